@@ -62,6 +62,10 @@ int agbdata3_used = 0;
 static const int AGBDATA_INITIAL_NUMBER = 1;
 /* the increment of agbnp structures slots for reallocation */
 static const int AGBDATA_INCREMENT = 1;
+/* internal ordering of the atoms of new structures */
+static int agbnp3_atom_order = AGBNP_ORDER_INPUT;
+/* SIMD kernel set of new structures */
+static int agbnp3_simd = AGBNP_SIMD_AUTO;
 
 /* Initializes libagbnp library.*/
 int agbnp3_initialize( void ){
@@ -117,6 +121,61 @@ void agbnp3_terminate( void ){
   agbdata3_used = 0;
 }
 
+/* sets the internal ordering of the atoms of the structures created 
+   afterwards. AGBNP_ORDER_MORTON and AGBNP_ORDER_HILBERT sort heavy 
+   atoms and hydrogens along a space-filling curve so that atoms close 
+   in space are close in memory. */
+int agbnp3_set_atom_order(int order){
+  if(order != AGBNP_ORDER_INPUT && order != AGBNP_ORDER_MORTON &&
+     order != AGBNP_ORDER_HILBERT){
+    agbnp3_errprint("agbnp3_set_atom_order(): unknown ordering %d.\n",order);
+    return AGBNP_ERR;
+  }
+  agbnp3_atom_order = order;
+  return AGBNP_OK;
+}
+
+static const char *agbnp3_simd_names[] = {"scalar", "SSE", "AVX2", 
+					  "AVX-512"};
+
+/* sets the SIMD kernel set of the structures created afterwards. Each
+   structure uses the best set built into the library and supported by 
+   the CPU, not above the one requested. */
+int agbnp3_set_simd(int simd){
+  if(simd != AGBNP_SIMD_AUTO && simd != AGBNP_SIMD_SSE && 
+     simd != AGBNP_SIMD_AVX2 && simd != AGBNP_SIMD_AVX512){
+    agbnp3_errprint("agbnp3_set_simd(): unknown kernel set %d.\n",simd);
+    return AGBNP_ERR;
+  }
+  agbnp3_simd = simd;
+  return AGBNP_OK;
+}
+
+int agbnp3_get_simd(int tag, int *simd){
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_get_simd(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  *simd = agbdata3_list[tag].simd;
+  return AGBNP_OK;
+}
+
+/* kernel set requested by agbnp3_set_simd() or else by the AGBNP3_SIMD
+   environment variable */
+static int agbnp3_simd_request(void){
+  char *env;
+
+  if(agbnp3_simd != AGBNP_SIMD_AUTO) return agbnp3_simd;
+  env = getenv("AGBNP3_SIMD");
+  if(!env || !*env) return AGBNP_SIMD_AUTO;
+  if(strcmp(env, "sse") == 0) return AGBNP_SIMD_SSE;
+  if(strcmp(env, "avx2") == 0) return AGBNP_SIMD_AVX2;
+  if(strcmp(env, "avx512") == 0) return AGBNP_SIMD_AVX512;
+  agbnp3_errprint("agbnp3_new(): warning: unknown AGBNP3_SIMD=%s, ignored.\n",
+		  env);
+  return AGBNP_SIMD_AUTO;
+}
+
 /* creates a new public instance of an agbnp structure */
 int agbnp3_new(int *tag, int natoms, 
 	      float_i *x, float_i *y, float_i *z, float_i *r, 
@@ -172,6 +231,11 @@ int agbnp3_new(int *tag, int natoms,
   /* reset new structure */
   agbnp3_reset(agbdata);
 
+  /* SIMD kernel set */
+  agbdata->simd = agbnp3_simd_detect(agbnp3_simd_request());
+  printf("\n agbnp3_new(): info: using %s kernels.\n", 
+	 agbnp3_simd_names[agbdata->simd]);
+
   /* set natoms */
   agbdata->natoms = natoms;
 
@@ -179,7 +243,11 @@ int agbnp3_new(int *tag, int natoms,
   /* atomic indexes mapping */
   agbnp3_vcalloc((void **)&(agbdata->int2ext), natoms*sizeof(int));
   agbnp3_vcalloc((void **)&(agbdata->ext2int), natoms*sizeof(int));
-  agbnp3_atom_reorder(agbdata, nhydrogen, ihydrogen); 
+  agbdata->atom_order = agbnp3_atom_order;
+  if(agbnp3_atom_reorder(agbdata, nhydrogen, ihydrogen, x, y, z) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_new(): error in agbnp3_atom_reorder()\n");
+    return AGBNP_ERR;
+  }
   int2ext = agbdata->int2ext;
   ext2int = agbdata->ext2int;
 
@@ -284,6 +352,9 @@ int agbnp3_new(int *tag, int natoms,
 
   agbnp3_vfree(iswhat);
 
+  /* decides whether i4() values are cached or recomputed */
+  agbnp3_q4cache_select(agbdata);
+
   /* set dielectric contstants */
   agbdata->dielectric_in = dielectric_in;
   agbdata->dielectric_out = dielectric_out;
@@ -436,6 +507,12 @@ int agbnp3_delete(int tag){
   if(agb->x){ agbnp3_vfree(agb->x); agb->x = NULL;}
   if(agb->y){ agbnp3_vfree(agb->y); agb->y = NULL;}
   if(agb->z){ agbnp3_vfree(agb->z); agb->z = NULL;}
+  if(agb->nblist_xref){ agbnp3_vfree(agb->nblist_xref); agb->nblist_xref = NULL;}
+  if(agb->nblist_yref){ agbnp3_vfree(agb->nblist_yref); agb->nblist_yref = NULL;}
+  if(agb->nblist_zref){ agbnp3_vfree(agb->nblist_zref); agb->nblist_zref = NULL;}
+  if(agb->isfrozen){ agbnp3_vfree(agb->isfrozen); agb->isfrozen = NULL;}
+  if(agb->bnd_isligand){ agbnp3_vfree(agb->bnd_isligand); agb->bnd_isligand = NULL;}
+  agbnp3_delta_free(agb);
   if(agb->r){ agbnp3_vfree(agb->r); agb->r = NULL;}
   if(agb->charge){ agbnp3_vfree(agb->charge); agb->charge = NULL;}
   if(agb->rtype){ agbnp3_vfree(agb->rtype); agb->rtype = NULL;}
@@ -453,6 +530,12 @@ int agbnp3_delete(int tag){
   if(agb->int2ext){ agbnp3_vfree(agb->int2ext) ; agb->int2ext = NULL;}
   if(agb->ext2int){ agbnp3_vfree(agb->ext2int) ; agb->ext2int = NULL;}
   if(agb->rot){ agbnp3_vfree(agb->rot) ; agb->rot = NULL; }
+  if(agb->trans){ agbnp3_vfree(agb->trans) ; agb->trans = NULL; }
+  if(agb->xs){ agbnp3_vfree(agb->xs) ; agb->xs = NULL; }
+  if(agb->ys){ agbnp3_vfree(agb->ys) ; agb->ys = NULL; }
+  if(agb->zs){ agbnp3_vfree(agb->zs) ; agb->zs = NULL; }
+  agbnp3_rgrid_free(agb);
+  agbnp3_rcache_free(agb);
   if(agb->vdiel_in){ agbnp3_vfree(agb->vdiel_in) ; agb->vdiel_in = NULL;}
 
   if(agb->agbw){
@@ -510,59 +593,2007 @@ int agbnp3_ener(int tag, int init,
     return AGBNP_ERR;
   }
 
-  /* pointer to agb data structure */
-  agb = &(agbdata3_list[tag]);
+  /* pointer to agb data structure */
+  agb = &(agbdata3_list[tag]);
+
+  int2ext = agb->int2ext;
+  ext2int = agb->ext2int;
+
+  /* copy to coordinates to local arrays */
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    agb->x[iat] = x[iatext];
+    agb->y[iat] = y[iatext];
+    agb->z[iat] = z[iatext];
+  }
+
+  if(agbnp3_total_energy(agb, init,
+			mol_volume,  
+			egb, 
+			evdw, ecorr_vdw,  
+			ecav, ecorr_cav, 
+			ehb) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ener(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  /* copy to output buffers */
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    br[iatext] = agb->br[iat];
+    sp[iatext] = agb->sp[iat];
+    surf_area[iatext] = agb->surf_area[iat];
+  }
+
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+
+    dgbdr[iatext][0] = agb->dgbdr[iat][0];
+    dgbdr[iatext][1] = agb->dgbdr[iat][1];
+    dgbdr[iatext][2] = agb->dgbdr[iat][2];
+
+    dvwdr[iatext][0] = agb->dvwdr[iat][0];
+    dvwdr[iatext][1] = agb->dvwdr[iat][1];
+    dvwdr[iatext][2] = agb->dvwdr[iat][2];
+
+    dehb[iatext][0] = agb->dehb[iat][0];
+    dehb[iatext][1] = agb->dehb[iat][1];
+    dehb[iatext][2] = agb->dehb[iat][2];
+
+    decav[iatext][0] = agb->decav[iat][0];
+    decav[iatext][1] = agb->decav[iat][1];
+    decav[iatext][2] = agb->decav[iat][2];
+  }
+
+  return AGBNP_OK;
+}
+
+/* returns the AGBNP energies without derivatives. The stages which 
+   only serve the gradient (derivatives at constant self volumes and 
+   Born radii, chain rule through self volumes and surface areas, the 
+   i4() cache) are skipped. */
+int agbnp3_ener_only(int tag, float_i *x, float_i *y, float_i *z,
+		     float_i *mol_volume, 
+		     float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+		     float_i *ecav, float_i *ecorr_cav, float_i *ehb){
+  AGBNPdata *agb;
+  int iat, iatext, res;
+  int *int2ext;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_only(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_only(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_only(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+
+  int2ext = agb->int2ext;
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    agb->x[iat] = x[iatext];
+    agb->y[iat] = y[iatext];
+    agb->z[iat] = z[iatext];
+  }
+
+  if(agb->rc_tag >= 0){
+    /* complex with a cached receptor */
+    if(agbnp3_rcache_energy(agb, mol_volume, egb, evdw, ecorr_vdw, 
+			    ecav, ecorr_cav, ehb) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_ener_only(): error in agbnp3_rcache_energy().\n");
+      return AGBNP_ERR;
+    }
+    return AGBNP_OK;
+  }
+
+  agb->ener_only = 1;
+  res = agbnp3_total_energy(agb, 0, mol_volume, egb, evdw, ecorr_vdw, 
+			    ecav, ecorr_cav, ehb);
+  agb->ener_only = 0;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ener_only(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  return AGBNP_OK;
+}
+
+/* returns the Born radii, for use with an external GB pair energy. Only
+   the stages which lead to the Born radii are evaluated (neighbor lists,
+   self volumes, scaling factors, inverse Born radii). The work data is 
+   kept for agbnp3_born_radii_ders(). */
+int agbnp3_born_radii_eval(int tag, float_i *x, float_i *y, float_i *z,
+			   float_i *br){
+  AGBNPdata *agb;
+  int iat, iatext, res;
+  int *int2ext;
+  float_i mol_volume, egb, evdw, ecorr_vdw, ecav, ecorr_cav, ehb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_born_radii_eval(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_born_radii_eval(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_born_radii_eval(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+  if(!(agb->terms & AGBNP_TERM_BR)){
+    agbnp3_errprint("agbnp3_born_radii_eval(): Born radii are not evaluated without the GB or van der Waals terms, see agbnp3_set_terms().\n");
+    return AGBNP_ERR;
+  }
+
+  int2ext = agb->int2ext;
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    agb->x[iat] = x[iatext];
+    agb->y[iat] = y[iatext];
+    agb->z[iat] = z[iatext];
+  }
+
+  agb->br_only = 1;
+  res = agbnp3_total_energy(agb, 0, &mol_volume, &egb, &evdw, &ecorr_vdw, 
+			    &ecav, &ecorr_cav, &ehb);
+  agb->br_only = 0;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_born_radii_eval(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  /* int2ext may have changed, see agbnp3_atom_resort() */
+  int2ext = agb->int2ext;
+  for(iat=0; iat < agb->natoms; iat++){
+    br[int2ext[iat]] = agb->br[iat];
+  }
+
+  return AGBNP_OK;
+}
+
+/* returns in dedr the gradient of an energy function E of the Born 
+   radii given dedb[i] = dE/dB_i, at the coordinates of the last 
+   agbnp3_born_radii_eval() call. No other evaluation or change of the
+   settings of the instance may intervene. */
+int agbnp3_born_radii_ders(int tag, float_i *dedb, float_i (*dedr)[3]){
+  AGBNPdata *agb;
+  int iat, iatext;
+  int *int2ext;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_born_radii_ders(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_born_radii_ders(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(!agb->br_ders_ok){
+    agbnp3_errprint("agbnp3_born_radii_ders(): no valid agbnp3_born_radii_eval() evaluation.\n");
+    return AGBNP_ERR;
+  }
+
+  if(agbnp3_born_radii_chain(agb, dedb) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_born_radii_ders(): error in agbnp3_born_radii_chain().\n");
+    return AGBNP_ERR;
+  }
+
+  int2ext = agb->int2ext;
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    if(agb->do_frozen && agb->isfrozen[iat]){
+      /* incomplete, see agbnp3_set_frozen() */
+      dedr[iatext][0] = dedr[iatext][1] = dedr[iatext][2] = 0.0;
+      continue;
+    }
+    dedr[iatext][0] = agb->agbw->dvwdr_h[iat][0];
+    dedr[iatext][1] = agb->agbw->dvwdr_h[iat][1];
+    dedr[iatext][2] = agb->agbw->dvwdr_h[iat][2];
+  }
+
+  return AGBNP_OK;
+}
+
+/* evaluates the energies of nframes sets of coordinates of the same
+   system, as in trajectory rescoring. The coordinates of frame f start
+   at x + f*stride (stride >= natoms, 0 means natoms); per-atom outputs
+   are stored the same way and energies at index f. Per-atom outputs 
+   set to NULL are not returned; if all gradients are NULL the frames
+   are evaluated as in agbnp3_ener_only(). Frames are evaluated in 
+   sequence, the threads work within each frame. */
+int agbnp3_ener_batch(int tag, int nframes, int stride,
+		      float_i *x, float_i *y, float_i *z,
+		      float_i *mol_volume, 
+		      float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+		      float_i *ecav, float_i *ecorr_cav, float_i *ehb,
+		      float_i *sp, float_i *br, float_i *surf_area, 
+		      float_i (*dgbdr)[3], float_i (*dvwdr)[3], 
+		      float_i (*decav)[3], float_i (*dehb)[3]){
+  AGBNPdata *agb;
+  int iat, iatext, k, f, offset, res;
+  int *int2ext;
+  float_i *xf, *yf, *zf;
+  int ener_only = !(dgbdr || dvwdr || decav || dehb);
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_batch(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_batch(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(stride <= 0) stride = agb->natoms;
+  if(nframes < 0 || stride < agb->natoms){
+    agbnp3_errprint("agbnp3_ener_batch(): invalid number of frames %d or stride %d.\n", nframes, stride);
+    return AGBNP_ERR;
+  }
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_batch(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+
+  for(f=0;f<nframes;f++){
+    offset = f*stride;
+    xf = x + offset;
+    yf = y + offset;
+    zf = z + offset;
+
+    /* int2ext may change during the evaluation, see agbnp3_atom_resort() */
+    int2ext = agb->int2ext;
+    for(iat=0; iat < agb->natoms; iat++){
+      iatext = int2ext[iat];
+      agb->x[iat] = xf[iatext];
+      agb->y[iat] = yf[iatext];
+      agb->z[iat] = zf[iatext];
+    }
+
+    agb->ener_only = ener_only;
+    res = agbnp3_total_energy(agb, 0, &(mol_volume[f]), &(egb[f]), 
+			      &(evdw[f]), &(ecorr_vdw[f]), 
+			      &(ecav[f]), &(ecorr_cav[f]), &(ehb[f]));
+    agb->ener_only = 0;
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_ener_batch(): error in agbnp3_total_energy() at frame %d.\n", f);
+      return AGBNP_ERR;
+    }
+
+    int2ext = agb->int2ext;
+    for(iat=0; iat < agb->natoms; iat++){
+      iatext = offset + int2ext[iat];
+      if(sp) sp[iatext] = agb->sp[iat];
+      if(br) br[iatext] = agb->br[iat];
+      if(surf_area) surf_area[iatext] = agb->surf_area[iat];
+      for(k=0;k<3;k++){
+	if(dgbdr) dgbdr[iatext][k] = agb->dgbdr[iat][k];
+	if(dvwdr) dvwdr[iatext][k] = agb->dvwdr[iat][k];
+	if(decav) decav[iatext][k] = agb->decav[iat][k];
+	if(dehb) dehb[iatext][k] = agb->dehb[iat][k];
+      }
+    }
+  }
+
+  return AGBNP_OK;
+}
+
+/* evaluates the change of the energies when the atoms in moved[] 
+   (external indexes) are displaced to the positions in x, y and z, 
+   relative to the reference state set by the last agbnp3_ener() or
+   agbnp3_ener_commit() call. Derivatives are not computed. The move 
+   must be accepted with agbnp3_ener_commit() or rejected with 
+   agbnp3_ener_rollback() before the next trial move. */
+int agbnp3_ener_delta(int tag, int nmoved, int *moved,
+		      float_i *x, float_i *y, float_i *z,
+		      float_i *degb, float_i *devdw, float_i *decorr_vdw,
+		      float_i *decav, float_i *decorr_cav, float_i *dehb){
+  AGBNPdata *agb;
+  int i, iat, iatext, res;
+  float_i mol_volume, egb, evdw, ecorr_vdw, ecav, ecorr_cav, ehb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_delta(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_delta(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_delta(): the previous trial move has not been committed or rolled back.\n");
+    return AGBNP_ERR;
+  }
+  if(agb->docryst){
+    agbnp3_errprint("agbnp3_ener_delta(): not available with crystal symmetry.\n");
+    return AGBNP_ERR;
+  }
+  if(agb->dogrid){
+    agbnp3_errprint("agbnp3_ener_delta(): not available with a receptor grid.\n");
+    return AGBNP_ERR;
+  }
+  if(nmoved < 0 || nmoved > agb->natoms){
+    agbnp3_errprint("agbnp3_ener_delta(): invalid number of moved atoms %d.\n", nmoved);
+    return AGBNP_ERR;
+  }
+  for(i=0;i<nmoved;i++){
+    if(moved[i] < 0 || moved[i] >= agb->natoms){
+      agbnp3_errprint("agbnp3_ener_delta(): invalid atom index %d.\n", moved[i]);
+      return AGBNP_ERR;
+    }
+  }
+
+  /* reference state at the current coordinates */
+  if(!agb->dlt_br1){
+    if(agbnp3_delta_allocate(agb) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_ener_delta(): error in agbnp3_delta_allocate().\n");
+      return AGBNP_ERR;
+    }
+  }
+  if(agb->dlt_state == AGBNP_DELTA_NONE){
+    agb->ener_only = 1;
+    res = agbnp3_total_energy(agb, 0, &mol_volume, &egb, &evdw, &ecorr_vdw,
+			      &ecav, &ecorr_cav, &ehb);
+    agb->ener_only = 0;
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_ener_delta(): error in agbnp3_total_energy().\n");
+      return AGBNP_ERR;
+    }
+  }
+
+  /* trial move */
+  agb->dlt_nmoved = 0;
+  for(i=0;i<nmoved;i++){
+    iatext = moved[i];
+    iat = agb->ext2int[iatext];
+    if(agb->dlt_ismoved[iat]) continue;
+    agb->dlt_ismoved[iat] = 1;
+    agb->dlt_moved[agb->dlt_nmoved++] = iat;
+    agb->x[iat] = x[iatext];
+    agb->y[iat] = y[iatext];
+    agb->z[iat] = z[iatext];
+  }
+
+  /* only the overlap trees and the water sites near the moved atoms
+     are evaluated, see agbnp3_self_volumes_rooti() */
+  agb->dlt_eval = 1;
+  agb->dlt_local = AGBNP_LOCAL_TRIAL;
+  if(agbnp3_total_energy(agb, 0, &mol_volume, &egb, &evdw, &ecorr_vdw,
+			 &ecav, &ecorr_cav, &ehb) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ener_delta(): error in agbnp3_total_energy().\n");
+    agb->dlt_eval = 0;
+    agb->dlt_local = AGBNP_LOCAL_NONE;
+    agb->dlt_state = AGBNP_DELTA_TRIAL;
+    agbnp3_ener_rollback(tag);
+    /* the overlap tree records may be incomplete */
+    agb->dlt_state = AGBNP_DELTA_NONE;
+    return AGBNP_ERR;
+  }
+  agb->dlt_eval = 0;
+  agb->dlt_local = AGBNP_LOCAL_NONE;
+
+  *degb = agb->dlt_ener[0] - agb->dlt_enerref[0];
+  *devdw = agb->dlt_ener[1] - agb->dlt_enerref[1];
+  *decorr_vdw = agb->dlt_ener[2] - agb->dlt_enerref[2];
+  *decav = agb->dlt_ener[3] - agb->dlt_enerref[3];
+  *decorr_cav = agb->dlt_ener[4] - agb->dlt_enerref[4];
+  *dehb = agb->dlt_ener[5] - agb->dlt_enerref[5];
+
+  return AGBNP_OK;
+}
+
+/* accepts the trial move of agbnp3_ener_delta(), which becomes the 
+   reference state */
+int agbnp3_ener_commit(int tag){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_commit(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_commit(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state != AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_commit(): no trial move to commit.\n");
+    return AGBNP_ERR;
+  }
+
+  agbnp3_delta_reference(agb, 0);
+
+  return AGBNP_OK;
+}
+
+/* rejects the trial move of agbnp3_ener_delta(), the moved atoms are
+   returned to their reference positions */
+int agbnp3_ener_rollback(int tag){
+  AGBNPdata *agb;
+  int i, iat;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_rollback(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_rollback(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state != AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_rollback(): no trial move to roll back.\n");
+    return AGBNP_ERR;
+  }
+
+  for(i=0;i<agb->dlt_nmoved;i++){
+    iat = agb->dlt_moved[i];
+    agb->x[iat] = agb->dlt_xref[iat];
+    agb->y[iat] = agb->dlt_yref[iat];
+    agb->z[iat] = agb->dlt_zref[iat];
+    agb->dlt_ismoved[iat] = 0;
+  }
+  agb->dlt_nmoved = 0;
+  agbnp3_delta_restore(agb);
+  agb->dlt_state = AGBNP_DELTA_REF;
+
+  return AGBNP_OK;
+}
+
+/* marks the ligand atoms for agbnp3_ener_binding(): isligand[i] != 0 
+   for ligand atom i (external index), the other atoms form the 
+   receptor. isligand = NULL turns the binding mode off. */
+int agbnp3_set_ligand(int tag, int *isligand){
+  AGBNPdata *agb;
+  int iat, nligand = 0;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_ligand(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_ligand(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  if(!isligand){
+    if(agb->bnd_isligand){ agbnp3_vfree(agb->bnd_isligand); agb->bnd_isligand = NULL;}
+    return AGBNP_OK;
+  }
+  for(iat=0;iat<agb->natoms;iat++){
+    if(isligand[iat]) nligand += 1;
+  }
+  if(nligand <= 0 || nligand >= agb->natoms){
+    agbnp3_errprint("agbnp3_set_ligand(): the receptor and the ligand must not be empty (%d ligand atoms).\n", nligand);
+    return AGBNP_ERR;
+  }
+
+  if(!agb->bnd_isligand){
+    agbnp3_vcalloc((void **)&(agb->bnd_isligand), agb->natoms*sizeof(int));
+    if(!agb->bnd_isligand){
+      agbnp3_errprint("agbnp3_set_ligand(): unable to allocate isligand array (%d ints)\n", agb->natoms);
+      return AGBNP_ERR;
+    }
+  }
+  for(iat=0;iat<agb->natoms;iat++){
+    agb->bnd_isligand[iat] = isligand[agb->int2ext[iat]] ? 1 : 0;
+  }
+  if(agb->verbose){
+    printf("agbnp3_set_ligand(): %d ligand atoms\n", nligand);
+  }
+
+  return AGBNP_OK;
+}
+
+/* returns the energies of the complex, of the receptor and of the 
+   ligand apart, and the binding energies (complex minus receptor minus
+   ligand) in one call. Energies are in arrays of AGBNP_NENER: egb, evdw,
+   ecorr_vdw, ecav, ecorr_cav and ehb. The complex is evaluated as in
+   agbnp3_ener_only() and becomes the reference state of 
+   agbnp3_ener_delta(). The receptor and the ligand apart are then 
+   evaluated as a trial move of the ligand atoms in which the 
+   receptor-ligand overlaps and descreening are turned off: the inverse
+   Born radii of the complex are corrected only for the pairs with the
+   ligand and with the atoms whose self volume changed. */
+int agbnp3_ener_binding(int tag, float_i *x, float_i *y, float_i *z,
+			float_i *ecomplex, float_i *ereceptor, 
+			float_i *eligand, float_i *ebind){
+  AGBNPdata *agb;
+  int k, iat, iatext, res;
+  int *int2ext;
+  float_i mol_volume, egb_cross;
+  float_i e[AGBNP_NENER];
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_ener_binding(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_ener_binding(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(!agb->bnd_isligand){
+    agbnp3_errprint("agbnp3_ener_binding(): the ligand is not set, see agbnp3_set_ligand().\n");
+    return AGBNP_ERR;
+  }
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_ener_binding(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+  if(agb->docryst){
+    agbnp3_errprint("agbnp3_ener_binding(): not available with crystal symmetry.\n");
+    return AGBNP_ERR;
+  }
+  if(agb->dogrid){
+    agbnp3_errprint("agbnp3_ener_binding(): not available with a receptor grid.\n");
+    return AGBNP_ERR;
+  }
+  if(!agb->dlt_br1){
+    if(agbnp3_delta_allocate(agb) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_ener_binding(): error in agbnp3_delta_allocate().\n");
+      return AGBNP_ERR;
+    }
+  }
+
+  /* complex */
+  int2ext = agb->int2ext;
+  for(iat=0; iat < agb->natoms; iat++){
+    iatext = int2ext[iat];
+    agb->x[iat] = x[iatext];
+    agb->y[iat] = y[iatext];
+    agb->z[iat] = z[iatext];
+  }
+  agb->ener_only = 1;
+  res = agbnp3_total_energy(agb, 0, &mol_volume, &e[0], &e[1], &e[2],
+			    &e[3], &e[4], &e[5]);
+  agb->ener_only = 0;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ener_binding(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+  for(k=0;k<AGBNP_NENER;k++){
+    ecomplex[k] = e[k];
+  }
+
+  /* receptor and ligand apart, the lists are rebuilt without the 
+     receptor-ligand pairs. As a trial move of the ligand from the
+     complex, only the overlap trees and the water sites which include
+     ligand atoms are evaluated again, the other receptor atoms keep
+     the contributions of the complex */
+  agb->dlt_nmoved = 0;
+  for(iat=0;iat<agb->natoms;iat++){
+    if(!agb->bnd_isligand[iat]) continue;
+    agb->dlt_ismoved[iat] = 1;
+    agb->dlt_moved[agb->dlt_nmoved++] = iat;
+  }
+  agb->nblist_invalid = 1;
+  agb->bnd_decouple = 1;
+  agb->dlt_eval = 1;
+  agb->dlt_local = AGBNP_LOCAL_TRIAL;
+  res = agbnp3_total_energy(agb, 0, &mol_volume, &e[0], &e[1], &e[2],
+			    &e[3], &e[4], &e[5]);
+  agb->dlt_eval = 0;
+  agb->dlt_local = AGBNP_LOCAL_NONE;
+  agb->bnd_decouple = 0;
+  agb->nblist_invalid = 1;
+  /* back to the complex as the reference state */
+  for(k=0;k<agb->dlt_nmoved;k++){
+    agb->dlt_ismoved[agb->dlt_moved[k]] = 0;
+  }
+  agb->dlt_nmoved = 0;
+  agbnp3_delta_restore(agb);
+  agb->dlt_state = res == AGBNP_OK ? AGBNP_DELTA_REF : AGBNP_DELTA_NONE;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ener_binding(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  /* split between receptor and ligand */
+  agbnp3_binding_ligand(agb, eligand, &egb_cross);
+  ereceptor[0] = e[0] - egb_cross - eligand[0];
+  for(k=1;k<AGBNP_NENER;k++){
+    ereceptor[k] = e[k] - eligand[k];
+  }
+  for(k=0;k<AGBNP_NENER;k++){
+    ebind[k] = ecomplex[k] - ereceptor[k] - eligand[k];
+  }
+
+  return AGBNP_OK;
+}
+
+/* energies of the ligand apart from the last evaluation with 
+   bnd_decouple set (agbnp3_ener_binding()), and GB pair energy between
+   the receptor and the ligand, which the GB kernels include. The same 
+   pair switching function as agbnp3_gb_energy_nblist_ps() is applied 
+   in cutoff mode. */
+void agbnp3_binding_ligand(AGBNPdata *agb, float_i *elig, float_i *egb_cross){
+  static const float_a tokcalmol = 332.0; /* conversion to kcal/mol */
+  static const float_a rw = 1.4;  /* water radius offset for np 
+				    energy function */
+  int iat, jat, k;
+  int natoms = agb->natoms;
+  int *isligand = agb->bnd_isligand;
+  float_a *x = agb->x;
+  float_a *y = agb->y;
+  float_a *z = agb->z;
+  float_a *q = agb->charge;
+  float_i *br = agb->br;
+  float_a dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float_a dx, dy, dz, d2, bb, fgb, sw, swp, a;
+  float_i egb;
+
+  for(k=0;k<AGBNP_NENER;k++){
+    elig[k] = 0.0;
+  }
+  *egb_cross = 0.0;
+
+  if(agb->terms & AGBNP_TERM_GB){
+    for(iat=0;iat<natoms;iat++){
+      if(isligand[iat]){
+	elig[0] += dielectric_factor*q[iat]*q[iat]/br[iat];
+      }
+      for(jat=iat+1;jat<natoms;jat++){
+	if(!isligand[iat] && !isligand[jat]) continue;
+	dx = x[jat] - x[iat];
+	dy = y[jat] - y[iat];
+	dz = z[jat] - z[iat];
+	d2 = dx*dx + dy*dy + dz*dz;
+	bb = br[iat]*br[jat];
+	fgb = 1./sqrt(d2 + bb*exp(-0.25*d2/bb));
+	egb = 2.0*dielectric_factor*q[iat]*q[jat]*fgb;
+	if(agb->gb_roff > 0.0){
+	  sw = 1.0 - agbnp3_pol_switchfunc(sqrt(d2), agb->gb_ron, agb->gb_roff,
+					   &swp, NULL);
+	  egb *= sw;
+	}
+	if(isligand[iat] && isligand[jat]){
+	  elig[0] += egb;
+	}else{
+	  *egb_cross += egb;
+	}
+      }
+    }
+    elig[0] *= tokcalmol;
+    *egb_cross *= tokcalmol;
+  }
+
+  if(agb->terms & AGBNP_TERM_VDW){
+    for(iat=0;iat<natoms;iat++){
+      if(!isligand[iat]) continue;
+      a = 1.0/(br[iat]+rw);
+      a = a*a*a;
+      elig[1] += agb->ialpha[iat]*a + agb->idelta[iat];
+      elig[2] += agb->salpha[iat]*a + agb->sdelta[iat];
+    }
+  }
+
+  if(agb->terms & AGBNP_TERM_CAV){
+    for(iat=0;iat<agb->nheavyat;iat++){
+      if(!isligand[iat]) continue;
+      elig[3] += agb->igamma[iat]*agb->surf_area[iat];
+      elig[4] += agb->sgamma[iat]*agb->surf_area[iat];
+    }
+  }
+
+  if(agb->terms & AGBNP_TERM_HB){
+    elig[5] = agb->bnd_ehb_lig;
+  }
+}
+
+/* Stores the state of the receptor instance rtag at its current 
+   coordinates in a cache (positions, volume scaling factors, self
+   volumes and surface areas and unfiltered inverse Born radii, in
+   external order). The cache is read,
+   and never written, by the energy evaluations of the complexes which
+   refer to it (see agbnp3_set_receptor_cache()), so it can be shared
+   by many complexes evaluated concurrently. */
+int agbnp3_receptor_cache(int rtag){
+  AGBNPdata *rec;
+  int iat, iatext, res, natoms;
+  float_i mol_volume, e[AGBNP_NENER];
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_receptor_cache(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(rtag)){
+    agbnp3_errprint("agbnp3_receptor_cache(): invalid tag %d.\n",rtag);
+    return AGBNP_ERR;
+  }
+  rec = &(agbdata3_list[rtag]);
+  if(rec->nblist_nevals <= 0){
+    agbnp3_errprint("agbnp3_receptor_cache(): the receptor has not been evaluated.\n");
+    return AGBNP_ERR;
+  }
+  if(rec->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_receptor_cache(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+  if(rec->docryst || rec->dogrid || rec->rc_tag >= 0){
+    agbnp3_errprint("agbnp3_receptor_cache(): not available with crystal symmetry, a receptor grid or a receptor cache.\n");
+    return AGBNP_ERR;
+  }
+  if(!(rec->terms & AGBNP_TERM_BR)){
+    agbnp3_errprint("agbnp3_receptor_cache(): the Born radii are not computed with the selected energy terms.\n");
+    return AGBNP_ERR;
+  }
+  if(!rec->dlt_br1){
+    if(agbnp3_delta_allocate(rec) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_receptor_cache(): error in agbnp3_delta_allocate().\n");
+      return AGBNP_ERR;
+    }
+  }
+
+  natoms = rec->natoms;
+  if(!rec->rc_x){
+    agbnp3_vcalloc((void **)&(rec->rc_x), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_y), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_z), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_r), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_sp), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_br1), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_vol), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(rec->rc_area), natoms*sizeof(float_a));
+    if(!(rec->rc_x && rec->rc_y && rec->rc_z && rec->rc_r && rec->rc_sp &&
+	 rec->rc_br1 && rec->rc_vol && rec->rc_area)){
+      agbnp3_errprint("agbnp3_receptor_cache(): unable to allocate memory for the cache (%d atoms).\n", natoms);
+      agbnp3_rcache_free(rec);
+      return AGBNP_ERR;
+    }
+  }
+  rec->rc_natoms = 0;
+
+  /* fills the reference state of agbnp3_ener_delta() */
+  rec->ener_only = 1;
+  res = agbnp3_total_energy(rec, 0, &mol_volume, &e[0], &e[1], &e[2],
+			    &e[3], &e[4], &e[5]);
+  rec->ener_only = 0;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_receptor_cache(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  for(iat=0;iat<natoms;iat++){
+    iatext = rec->int2ext[iat];
+    rec->rc_x[iatext] = rec->x[iat];
+    rec->rc_y[iatext] = rec->y[iat];
+    rec->rc_z[iatext] = rec->z[iat];
+    rec->rc_r[iatext] = rec->r[iat];
+    rec->rc_sp[iatext] = iat < rec->nheavyat ? rec->dlt_spref[iat] : 0.0;
+    rec->rc_br1[iatext] = rec->dlt_br1ref[iat];
+    rec->rc_vol[iatext] = iat < rec->nheavyat ? rec->dlt_volref[iat] : 0.0;
+    rec->rc_area[iatext] = iat < rec->nheavyat ? rec->dlt_arearef[iat] : 0.0;
+  }
+  memcpy(rec->rc_tail, rec->dlt_tailref, 5*sizeof(float_a));
+  rec->rc_br_ron = rec->br_ron;
+  rec->rc_br_roff = rec->br_roff;
+  rec->rc_natoms = natoms;
+  if(rec->verbose){
+    printf("agbnp3_receptor_cache(): %d receptor atoms\n", natoms);
+  }
+
+  return AGBNP_OK;
+}
+
+void agbnp3_rcache_free(AGBNPdata *agb){
+  if(agb->rc_x){ agbnp3_vfree(agb->rc_x); agb->rc_x = NULL;}
+  if(agb->rc_y){ agbnp3_vfree(agb->rc_y); agb->rc_y = NULL;}
+  if(agb->rc_z){ agbnp3_vfree(agb->rc_z); agb->rc_z = NULL;}
+  if(agb->rc_r){ agbnp3_vfree(agb->rc_r); agb->rc_r = NULL;}
+  if(agb->rc_sp){ agbnp3_vfree(agb->rc_sp); agb->rc_sp = NULL;}
+  if(agb->rc_br1){ agbnp3_vfree(agb->rc_br1); agb->rc_br1 = NULL;}
+  if(agb->rc_vol){ agbnp3_vfree(agb->rc_vol); agb->rc_vol = NULL;}
+  if(agb->rc_area){ agbnp3_vfree(agb->rc_area); agb->rc_area = NULL;}
+  agb->rc_natoms = 0;
+}
+
+/* The energies of agbnp3_ener_only() of the instance referenced by tag,
+   a complex of the receptor rtag and of the ligand set by 
+   agbnp3_set_ligand(), are obtained from the cache of the receptor 
+   (see agbnp3_receptor_cache()). rtag < 0 turns the cache off. */
+int agbnp3_set_receptor_cache(int tag, int rtag){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(rtag < 0){
+    agb->rc_tag = -1;
+    return AGBNP_OK;
+  }
+  if(rtag == tag || !agbnp3_tag_ok(rtag)){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): invalid receptor tag %d.\n",rtag);
+    return AGBNP_ERR;
+  }
+  if(agbdata3_list[rtag].rc_natoms <= 0){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): the receptor has no cache, see agbnp3_receptor_cache().\n");
+    return AGBNP_ERR;
+  }
+  if(!agb->bnd_isligand){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): the ligand is not set, see agbnp3_set_ligand().\n");
+    return AGBNP_ERR;
+  }
+  if(agb->docryst || agb->dogrid){
+    agbnp3_errprint("agbnp3_set_receptor_cache(): not available with crystal symmetry or a receptor grid.\n");
+    return AGBNP_ERR;
+  }
+  agb->rc_tag = rtag;
+
+  return AGBNP_OK;
+}
+
+/* Evaluates the complex from the receptor cache (see 
+   agbnp3_set_receptor_cache()) as a trial move of agbnp3_ener_delta()
+   from a reference state made of the receptor alone, as in the cache, 
+   and of the ligand away from it and not descreening: only the 
+   descreening terms of the ligand atoms and of the receptor atoms 
+   whose self volumes change are computed. Likewise only the overlap
+   trees which the ligand atoms enter are built, and only their overlaps
+   with ligand atoms are added to the self volumes of the cache
+   (AGBNP_LOCAL_INSERT, see agbnp3_self_volumes_rooti()). The receptor
+   atoms must be at their positions in the cache. The reference state
+   is not kept. */
+int agbnp3_rcache_energy(AGBNPdata *agb, float_i *mol_volume, 
+			 float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+			 float_i *ecav, float_i *ecorr_cav, float_i *ehb){
+  AGBNPdata *rec;
+  int iat, iatext, k, res;
+  int natoms = agb->natoms;
+  float_a cvdw = AGBNP_RADIUS_INCREMENT;
+
+  if(!agbnp3_tag_ok(agb->rc_tag)){
+    agbnp3_errprint("agbnp3_rcache_energy(): invalid receptor tag %d.\n", agb->rc_tag);
+    return AGBNP_ERR;
+  }
+  rec = &(agbdata3_list[agb->rc_tag]);
+  if(rec->rc_natoms <= 0 || !agb->bnd_isligand || agb->docryst || 
+     agb->dogrid){
+    agbnp3_errprint("agbnp3_rcache_energy(): the receptor cache is not set or not available.\n");
+    return AGBNP_ERR;
+  }
+  if(rec->rc_br_ron != agb->br_ron || rec->rc_br_roff != agb->br_roff){
+    agbnp3_errprint("agbnp3_rcache_energy(): the Born radii cutoffs of the receptor and of the complex differ.\n");
+    return AGBNP_ERR;
+  }
+  if(!agb->dlt_br1){
+    if(agbnp3_delta_allocate(agb) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_rcache_energy(): error in agbnp3_delta_allocate().\n");
+      return AGBNP_ERR;
+    }
+  }
+
+  /* reference state, the receptor atoms of the complex are those of the
+     cache in the same external order */
+  k = 0;
+  agb->dlt_nmoved = 0;
+  for(iatext=0;iatext<natoms;iatext++){
+    iat = agb->ext2int[iatext];
+    if(agb->bnd_isligand[iat]){
+      agb->dlt_xref[iat] = agb->x[iat] + AGBNP_RCACHE_AWAY;
+      agb->dlt_yref[iat] = agb->y[iat];
+      agb->dlt_zref[iat] = agb->z[iat];
+      if(iat < agb->nheavyat){
+	agb->dlt_spref[iat] = 0.0;
+	agb->dlt_volref[iat] = agb->agbw->vols[iat];
+	agb->dlt_arearef[iat] = 4.*pi*agb->r[iat]*agb->r[iat];
+      }
+      agb->dlt_br1ref[iat] = 1./(agb->r[iat] - cvdw);
+      agb->dlt_ismoved[iat] = 1;
+      agb->dlt_moved[agb->dlt_nmoved++] = iat;
+      continue;
+    }
+    if(k >= rec->rc_natoms || agb->r[iat] != rec->rc_r[k] || 
+       (iat < agb->nheavyat) != (rec->ext2int[k] < rec->nheavyat)){
+      agbnp3_errprint("agbnp3_rcache_energy(): the receptor atoms of the complex do not match those of the cache (atom %d).\n", iatext);
+      k = -1;
+      break;
+    }
+    if(agb->x[iat] != rec->rc_x[k] || agb->y[iat] != rec->rc_y[k] ||
+       agb->z[iat] != rec->rc_z[k]){
+      agbnp3_errprint("agbnp3_rcache_energy(): receptor atom %d of the complex is not at its position in the cache.\n", iatext);
+      k = -1;
+      break;
+    }
+    agb->dlt_xref[iat] = agb->x[iat];
+    agb->dlt_yref[iat] = agb->y[iat];
+    agb->dlt_zref[iat] = agb->z[iat];
+    if(iat < agb->nheavyat){
+      agb->dlt_spref[iat] = rec->rc_sp[k];
+      agb->dlt_volref[iat] = rec->rc_vol[k];
+      agb->dlt_arearef[iat] = rec->rc_area[k];
+    }
+    agb->dlt_br1ref[iat] = rec->rc_br1[k];
+    k += 1;
+  }
+  if(k != rec->rc_natoms){
+    if(k >= 0){
+      agbnp3_errprint("agbnp3_rcache_energy(): the complex has %d receptor atoms, the cache %d.\n", k, rec->rc_natoms);
+    }
+    for(k=0;k<agb->dlt_nmoved;k++){
+      agb->dlt_ismoved[agb->dlt_moved[k]] = 0;
+    }
+    agb->dlt_nmoved = 0;
+    agb->dlt_state = AGBNP_DELTA_NONE;
+    return AGBNP_ERR;
+  }
+  memcpy(agb->dlt_tailref, rec->rc_tail, 5*sizeof(float_a));
+
+  agb->dlt_eval = 1;
+  agb->dlt_local = AGBNP_LOCAL_INSERT;
+  res = agbnp3_total_energy(agb, 0, mol_volume, egb, evdw, ecorr_vdw,
+			    ecav, ecorr_cav, ehb);
+  agb->dlt_eval = 0;
+  agb->dlt_local = AGBNP_LOCAL_NONE;
+  for(k=0;k<agb->dlt_nmoved;k++){
+    agb->dlt_ismoved[agb->dlt_moved[k]] = 0;
+  }
+  agb->dlt_nmoved = 0;
+  agb->dlt_state = AGBNP_DELTA_NONE;
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_rcache_energy(): error in agbnp3_total_energy().\n");
+    return AGBNP_ERR;
+  }
+
+  return AGBNP_OK;
+}
+
+/* sets the neighbor list construction method */
+int agbnp3_set_nblist_method(int tag, int method){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_nblist_method(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_nblist_method(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(method != AGBNP_NBLIST_ALLPAIRS && method != AGBNP_NBLIST_CELLS){
+    agbnp3_errprint("agbnp3_set_nblist_method(): unknown method %d.\n",method);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->nblist_method = method;
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+
+  return AGBNP_OK;
+}
+
+/* turns on or off the GB pair energy cutoff */
+int agbnp3_set_gb_cutoff(int tag, float_i ron, float_i roff){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_gb_cutoff(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_gb_cutoff(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(roff > 0.0 && (ron < 0.0 || ron >= roff)){
+    agbnp3_errprint("agbnp3_set_gb_cutoff(): invalid switching distances (ron = %f, roff = %f).\n", ron, roff);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  if(roff > 0.0){
+    agb->gb_ron = ron;
+    agb->gb_roff = roff;
+  }else{
+    agb->gb_ron = agb->gb_roff = 0.0;
+  }
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+
+  return AGBNP_OK;
+}
+
+/* turns on or off the treecode approximation of the GB pair energy */
+int agbnp3_set_gb_treecode(int tag, float_i theta){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_gb_treecode(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_gb_treecode(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(theta >= 1.0){
+    agbnp3_errprint("agbnp3_set_gb_treecode(): invalid opening angle (theta = %f).\n", theta);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->gb_tree_theta = theta > 0.0 ? theta : 0.0;
+
+  return AGBNP_OK;
+}
+
+/* turns on or off the cutoff of the descreening integrals for Born radii */
+int agbnp3_set_born_radii_cutoff(int tag, float_i ron, float_i roff){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_born_radii_cutoff(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_born_radii_cutoff(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(roff > 0.0 && (ron < 0.0 || ron >= roff)){
+    agbnp3_errprint("agbnp3_set_born_radii_cutoff(): invalid switching distances (ron = %f, roff = %f).\n", ron, roff);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  if(roff > 0.0){
+    agb->br_ron = ron;
+    agb->br_roff = roff;
+    agb->br_rm = agbnp3_br_tail_radius(ron, roff);
+  }else{
+    agb->br_ron = agb->br_roff = 0.0;
+    agb->br_rm = 0.0;
+  }
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+  agb->frozen_init = 1;
+
+  return AGBNP_OK;
+}
+
+/* sets the neighbor list skin */
+int agbnp3_set_nblist_skin(int tag, float_i skin){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_nblist_skin(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_nblist_skin(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->nblist_skin = skin > 0.0 ? skin : 0.0;
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+  agb->nblist_nevals = agb->nblist_nbuilds = 0;
+  agb->nblist_maxdisp = 0.0;
+
+  return AGBNP_OK;
+}
+
+/* returns neighbor list statistics */
+int agbnp3_get_nblist_stats(int tag, int *nevals, int *nbuilds,
+			    float_i *maxdisp, float_i *trigger){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_get_nblist_stats(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_get_nblist_stats(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  if(nevals) *nevals = agb->nblist_nevals;
+  if(nbuilds) *nbuilds = agb->nblist_nbuilds;
+  if(maxdisp) *maxdisp = agb->nblist_maxdisp;
+  if(trigger) *trigger = 0.5*agb->nblist_skin;
+
+  return AGBNP_OK;
+}
+
+/* sets the memory budget (in MB) of the i4() cache */
+int agbnp3_set_q4cache_budget(int tag, float_i mbytes){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_q4cache_budget(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_q4cache_budget(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->q4cache_budget = mbytes > 0.0 ? mbytes : 0.0;
+  agbnp3_q4cache_select(agb);
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+  agb->frozen_init = 1;
+
+  return AGBNP_OK;
+}
+
+/* marks frozen atoms (isfrozen[i] != 0 for frozen atom i, external 
+   order). i4() descreening integrals between frozen atoms are computed 
+   once and reused and their contributions to the derivatives of frozen 
+   atoms are skipped, so the derivatives of frozen atoms are returned as
+   zero. isfrozen = NULL turns the optimization off. */
+int agbnp3_set_frozen(int tag, int *isfrozen){
+  AGBNPdata *agb;
+  int iat, nfrozen = 0;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_frozen(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_frozen(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->frozen_init = 1;
+  /* in cutoff mode the frozen-frozen pairs are in a separate list */
+  agb->nblist_invalid = 1;
+  if(!isfrozen){
+    agb->do_frozen = 0;
+    return AGBNP_OK;
+  }
+
+  if(!agb->isfrozen){
+    agbnp3_vcalloc((void **)&(agb->isfrozen), agb->natoms*sizeof(int));
+    if(!agb->isfrozen){
+      agbnp3_errprint("agbnp3_set_frozen(): unable to allocate isfrozen array (%d ints)\n", agb->natoms);
+      return AGBNP_ERR;
+    }
+  }
+  for(iat=0;iat<agb->natoms;iat++){
+    agb->isfrozen[iat] = isfrozen[agb->int2ext[iat]] ? 1 : 0;
+    nfrozen += agb->isfrozen[iat];
+  }
+  agb->do_frozen = (nfrozen > 0);
+  if(agb->verbose){
+    printf("agbnp3_set_frozen(): %d frozen atoms\n", nfrozen);
+  }
+
+  return AGBNP_OK;
+}
+
+/* turns on the re-sorting of the atoms along a space-filling curve 
+   during long simulations. The locality metric, the average index 
+   distance of the pairs of the near neighbor list, is measured at each
+   list build. When it exceeds factor times its value after the last 
+   sort the atoms are sorted again at the next build. Atoms in input 
+   order are sorted along a Hilbert curve at the next build. factor <= 0
+   turns the re-sorting off. */
+int agbnp3_set_atom_resort(int tag, float_i factor){
+  AGBNPdata *agb;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_atom_resort(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_atom_resort(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(factor > 0.0 && factor <= 1.0){
+    agbnp3_errprint("agbnp3_set_atom_resort(): invalid factor %f, must be larger than 1.\n",factor);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  agb->resort_factor = factor > 0.0 ? factor : 0.0;
+  agb->resort_ref = 0.0;
+  /* atoms in input order are sorted at the first build */
+  agb->resort_pending = (agb->resort_factor > 0.0 && 
+			 agb->atom_order == AGBNP_ORDER_INPUT);
+
+  return AGBNP_OK;
+}
+
+/* selects the energy terms to evaluate, an OR of AGBNP_TERM_* flags.
+   The stages needed only by the terms turned off are skipped: the Born
+   radii if neither the GB nor the van der Waals term is on, the water
+   sites if the HB correction is off, etc. The i4() cache and the water
+   site buffers are released when not needed. */
+int agbnp3_set_terms(int tag, int terms){
+  AGBNPdata *agb;
+  int iproc, res = AGBNP_OK;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_terms(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_terms(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+  if(terms <= 0 || (terms & ~AGBNP_TERM_ALL)){
+    agbnp3_errprint("agbnp3_set_terms(): invalid terms %d.\n",terms);
+    return AGBNP_ERR;
+  }
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_set_terms(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+  if(terms == agb->terms) return AGBNP_OK;
+
+  if(!(terms & AGBNP_TERM_HB)){
+    agbnp3_delete_wsbuffers(agb->agbw);
+  }else if(!(agb->terms & AGBNP_TERM_HB)){
+    res = agbnp3_allocate_wsbuffers(agb->natoms, agb->agbw);
+  }
+  if(!(terms & AGBNP_TERM_BR) && agb->agbw->q4cache){
+    free(agb->agbw->q4cache);
+    agb->agbw->q4cache = NULL;
+    agb->agbw->nq4cache = 0;
+  }
+#ifdef _OPENMP
+  for(iproc=0;iproc<agb->nprocs;iproc++){
+    AGBworkdata *agbw = agb->agbw_p[iproc];
+    if(!(terms & AGBNP_TERM_HB)){
+      agbnp3_delete_wsbuffers(agbw);
+    }else if(!(agb->terms & AGBNP_TERM_HB)){
+      if(agbnp3_allocate_wsbuffers(agb->natoms, agbw) != AGBNP_OK) res = AGBNP_ERR;
+    }
+    if(!(terms & AGBNP_TERM_BR) && agbw->q4cache){
+      free(agbw->q4cache);
+      agbw->q4cache = NULL;
+      agbw->nq4cache = 0;
+    }
+  }
+#endif
+  if(res != AGBNP_OK){
+    agbnp3_errprint("agbnp3_set_terms(): error in agbnp3_allocate_wsbuffers().\n");
+    return AGBNP_ERR;
+  }
+
+  agb->terms = terms;
+  /* the lists and the caches of the terms turned on are rebuilt */
+  agb->nblist_invalid = 1;
+  agb->br_ders_ok = 0;
+  agb->frozen_init = 1;
+  if(agb->dlt_state == AGBNP_DELTA_REF) agb->dlt_state = AGBNP_DELTA_NONE;
+
+  return AGBNP_OK;
+}
+
+/* turns on crystal symmetry. The nsym symmetry mates of the system 
+   (the asymmetric unit), obtained by applying the operations 
+   x' = rot[k] x + trans[k], k = 0, ..., nsym-1, to the coordinates of 
+   its atoms, descreen its atoms. The identity operation must not be 
+   included. Only the Born radii are affected: volumes, surface areas 
+   and hydrogen bonding are those of the asymmetric unit, and the GB 
+   pair energy is summed over its atoms. nsym <= 0 turns symmetry off. */
+int agbnp3_set_symmetry(int tag, int nsym, float_i (*rot)[3][3], 
+			float_i (*trans)[3]){
+  AGBNPdata *agb;
+  int k, i, j;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_symmetry(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_symmetry(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  /* the reference state of agbnp3_ener_delta() includes the mates */
+  if(agb->dlt_state == AGBNP_DELTA_REF) agb->dlt_state = AGBNP_DELTA_NONE;
+  agb->br_ders_ok = 0;
+  if(nsym <= 0 || !rot || !trans){
+    agb->docryst = 0;
+    agb->nsym = 1;
+    return AGBNP_OK;
+  }
+
+  if(nsym*agb->nheavyat > agb->ssize){
+    agb->ssize = nsym*agb->nheavyat;
+    if(agb->xs) agbnp3_vfree(agb->xs);
+    if(agb->ys) agbnp3_vfree(agb->ys);
+    if(agb->zs) agbnp3_vfree(agb->zs);
+    agbnp3_vcalloc((void **)&(agb->xs), agb->ssize*sizeof(float_i));
+    agbnp3_vcalloc((void **)&(agb->ys), agb->ssize*sizeof(float_i));
+    agbnp3_vcalloc((void **)&(agb->zs), agb->ssize*sizeof(float_i));
+  }
+  if(agb->rot) agbnp3_vfree(agb->rot);
+  if(agb->trans) agbnp3_vfree(agb->trans);
+  agbnp3_vcalloc((void **)&(agb->rot), nsym*sizeof(float_i [3][3]));
+  agbnp3_vcalloc((void **)&(agb->trans), nsym*sizeof(float_i [3]));
+  if(!(agb->xs && agb->ys && agb->zs && agb->rot && agb->trans)){
+    agbnp3_errprint("agbnp3_set_symmetry(): unable to allocate symmetry buffers (%d operations)\n", nsym);
+    agb->docryst = 0;
+    agb->nsym = 1;
+    agb->ssize = 0;
+    return AGBNP_ERR;
+  }
+  for(k=0;k<nsym;k++){
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	agb->rot[k][i][j] = rot[k][i][j];
+      }
+      agb->trans[k][i] = trans[k][i];
+    }
+  }
+  agb->nsym = nsym;
+  agb->docryst = 1;
+  if(agb->verbose){
+    printf("agbnp3_set_symmetry(): %d symmetry mates\n", nsym);
+  }
+
+  return AGBNP_OK;
+}
+
+/* places the heavy atoms of the symmetry mates, heavy atom iat of
+   operation k goes to position k*nheavyat + iat of xs, ys and zs */
+int agbnp3_sym_coordinates(AGBNPdata *agb){
+  int k, iat, is;
+  int nheavyat = agb->nheavyat;
+  float_i (*rot)[3][3] = agb->rot;
+  float_i (*trans)[3] = agb->trans;
+  float_a *x = agb->x;
+  float_a *y = agb->y;
+  float_a *z = agb->z;
+
+  for(k=0;k<agb->nsym;k++){
+    for(iat=0;iat<nheavyat;iat++){
+      is = k*nheavyat + iat;
+      agb->xs[is] = rot[k][0][0]*x[iat] + rot[k][0][1]*y[iat] + 
+	rot[k][0][2]*z[iat] + trans[k][0];
+      agb->ys[is] = rot[k][1][0]*x[iat] + rot[k][1][1]*y[iat] + 
+	rot[k][1][2]*z[iat] + trans[k][1];
+      agb->zs[is] = rot[k][2][0]*x[iat] + rot[k][2][1]*y[iat] + 
+	rot[k][2][2]*z[iat] + trans[k][2];
+    }
+  }
+  return AGBNP_OK;
+}
+
+/* Descreens the atoms of the instance referenced by tag by the heavy 
+   atoms of the receptor instance rtag, frozen at its last evaluation, 
+   through a grid precomputed over the box lo-hi with the given spacing.
+   Only the Born radii are affected. Atoms outside of the box are 
+   descreened by the receptor atoms directly. On return maxerr, if not
+   NULL, is the largest error of the interpolated inverse Born radii 
+   at sample points of the box outside of the receptor atoms. rtag < 0
+   removes the grid. */
+int agbnp3_set_receptor_grid(int tag, int rtag, float_i *lo, float_i *hi,
+			     float_i spacing, float_i *maxerr){
+  AGBNPdata *agb, *rec;
+  int i, iat, nheavyat, ntype;
+  float_a err;
+  size_t size;
+
+  if(!agbnp3_initialized){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): agbnp library is not initialized.\n");
+    return AGBNP_ERR;
+  }
+  if(!agbnp3_tag_ok(tag)){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): invalid tag %d.\n",tag);
+    return AGBNP_ERR;
+  }
+
+  agb = &(agbdata3_list[tag]);
+  if(agb->dlt_state == AGBNP_DELTA_TRIAL){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): a trial move of agbnp3_ener_delta() is pending.\n");
+    return AGBNP_ERR;
+  }
+  /* the reference state of agbnp3_ener_delta() excludes the grid */
+  if(agb->dlt_state == AGBNP_DELTA_REF) agb->dlt_state = AGBNP_DELTA_NONE;
+  agb->br_ders_ok = 0;
+  agbnp3_rgrid_free(agb);
+  if(maxerr) *maxerr = 0.0;
+  if(rtag < 0) return AGBNP_OK;
+
+  if(rtag == tag || !agbnp3_tag_ok(rtag)){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): invalid receptor tag %d.\n",rtag);
+    return AGBNP_ERR;
+  }
+  rec = &(agbdata3_list[rtag]);
+  if(rec->nblist_nevals <= 0){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): the receptor has not been evaluated.\n");
+    return AGBNP_ERR;
+  }
+  if(!lo || !hi || spacing <= 0.0){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): invalid box or spacing.\n");
+    return AGBNP_ERR;
+  }
+  for(i=0;i<3;i++){
+    if(hi[i] < lo[i]){
+      agbnp3_errprint("agbnp3_set_receptor_grid(): invalid box or spacing.\n");
+      return AGBNP_ERR;
+    }
+  }
+
+  /* receptor heavy atoms */
+  nheavyat = rec->nheavyat;
+  agbnp3_vcalloc((void **)&(agb->grd_xr), nheavyat*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->grd_yr), nheavyat*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->grd_zr), nheavyat*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->grd_rr), nheavyat*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->grd_spr), nheavyat*sizeof(float_a));
+  if(!(agb->grd_xr && agb->grd_yr && agb->grd_zr && agb->grd_rr && 
+       agb->grd_spr)){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): unable to allocate memory for %d receptor atoms.\n", nheavyat);
+    agbnp3_rgrid_free(agb);
+    return AGBNP_ERR;
+  }
+  for(iat=0;iat<nheavyat;iat++){
+    agb->grd_xr[iat] = rec->x[iat];
+    agb->grd_yr[iat] = rec->y[iat];
+    agb->grd_zr[iat] = rec->z[iat];
+    agb->grd_rr[iat] = rec->r[iat];
+    agb->grd_spr[iat] = rec->sp[iat];
+  }
+  agb->grd_nrec = nheavyat;
+
+  /* the tricubic interpolation in a cell reads one node below and two 
+     above */
+  agb->grd_h = spacing;
+  for(i=0;i<3;i++){
+    agb->grd_lo[i] = lo[i] - spacing;
+    agb->grd_n[i] = (int)ceil((hi[i] - lo[i])/spacing) + 4;
+  }
+  ntype = agb->nrtype;
+  size = (size_t)ntype*agb->grd_n[0]*agb->grd_n[1]*agb->grd_n[2];
+  agbnp3_vcalloc((void **)&(agb->grd_q), size*sizeof(float));
+  if(!agb->grd_q){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): unable to allocate memory for the grid (%d x %d x %d nodes, %d radius types).\n", agb->grd_n[0], agb->grd_n[1], agb->grd_n[2], ntype);
+    agbnp3_rgrid_free(agb);
+    return AGBNP_ERR;
+  }
+  if(agbnp3_rgrid_build(agb) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_set_receptor_grid(): error in agbnp3_rgrid_build().\n");
+    agbnp3_rgrid_free(agb);
+    return AGBNP_ERR;
+  }
+  agb->dogrid = 1;
+
+  err = agbnp3_rgrid_error(agb, lo, hi);
+  if(maxerr) *maxerr = err;
+  if(agb->verbose){
+    printf("agbnp3_set_receptor_grid(): %d receptor atoms, %d x %d x %d nodes, spacing %f, %d radius types, %.1f MB, max error of inverse Born radii %g\n", 
+	   nheavyat, agb->grd_n[0], agb->grd_n[1], agb->grd_n[2], 
+	   (float)spacing, ntype, size*sizeof(float)/(1024.*1024.), err);
+  }
+
+  return AGBNP_OK;
+}
+
+void agbnp3_rgrid_free(AGBNPdata *agb){
+  if(agb->grd_q){ agbnp3_vfree(agb->grd_q); agb->grd_q = NULL;}
+  if(agb->grd_xr){ agbnp3_vfree(agb->grd_xr); agb->grd_xr = NULL;}
+  if(agb->grd_yr){ agbnp3_vfree(agb->grd_yr); agb->grd_yr = NULL;}
+  if(agb->grd_zr){ agbnp3_vfree(agb->grd_zr); agb->grd_zr = NULL;}
+  if(agb->grd_rr){ agbnp3_vfree(agb->grd_rr); agb->grd_rr = NULL;}
+  if(agb->grd_spr){ agbnp3_vfree(agb->grd_spr); agb->grd_spr = NULL;}
+  agb->grd_nrec = 0;
+  agb->dogrid = 0;
+}
+
+/* radius (minus the radius increment) of each radius type */
+static int agbnp3_rgrid_type_radii(AGBNPdata *agb, float_a **typer){
+  int iat;
+  float_a cvdw = AGBNP_RADIUS_INCREMENT;
+
+  agbnp3_vcalloc((void **)typer, agb->nrtype*sizeof(float_a));
+  if(!(*typer)) return AGBNP_ERR;
+  for(iat=0;iat<agb->natoms;iat++){
+    (*typer)[agb->rtype[iat]] = agb->r[iat] - cvdw;
+  }
+  return AGBNP_OK;
+}
+
+/* fills the grid with the inverse Born radius decrement of an atom of 
+   each radius type placed at the nodes. Beyond the sum of the radii
+   i4() does not depend on the radius of the descreened atom, so the
+   far receptor atoms are summed once for all the types. */
+int agbnp3_rgrid_build(AGBNPdata *agb){
+  float_a fourpi1 = 1./(4.*pi);
+  double twopi = 2.0*pi;
+  int ntype = agb->nrtype;
+  int nrec = agb->grd_nrec;
+  int n0 = agb->grd_n[0], n1 = agb->grd_n[1], n2 = agb->grd_n[2];
+  float_a h = agb->grd_h;
+  float_a *typer = NULL;
+  float_a rmax = 0.0;
+  int t, node, nnodes = n0*n1*n2;
+  int error = 0;
+
+  if(agbnp3_rgrid_type_radii(agb, &typer) != AGBNP_OK){
+    return AGBNP_ERR;
+  }
+  for(t=0;t<ntype;t++){
+    if(typer[t] > rmax) rmax = typer[t];
+  }
+
+#pragma omp parallel private(t, node)
+  {
+    int i, j, k, jat, nnear;
+    int *near = NULL;
+    float_a xn, yn, zn, dx, dy, dz, d, dr4, rj;
+    double qfar, qt, a, a2;
+    float_a *dnear = NULL;
+
+    agbnp3_vcalloc((void **)&near, (nrec > 0 ? nrec : 1)*sizeof(int));
+    agbnp3_vcalloc((void **)&dnear, (nrec > 0 ? nrec : 1)*sizeof(float_a));
+    if(!(near && dnear)){
+#pragma omp atomic
+      error += 1;
+    }
+#pragma omp barrier
+    if(!error){
+#pragma omp for schedule(static)
+      for(node=0;node<nnodes;node++){
+	i = node/(n1*n2);
+	j = (node/n2) % n1;
+	k = node % n2;
+	xn = agb->grd_lo[0] + i*h;
+	yn = agb->grd_lo[1] + j*h;
+	zn = agb->grd_lo[2] + k*h;
+	qfar = 0.0;
+	nnear = 0;
+	for(jat=0;jat<nrec;jat++){
+	  dx = agb->grd_xr[jat] - xn;
+	  dy = agb->grd_yr[jat] - yn;
+	  dz = agb->grd_zr[jat] - zn;
+	  d = sqrt(dx*dx + dy*dy + dz*dz);
+	  rj = agb->grd_rr[jat];
+	  if(d > 4.0*rj && d > rmax + rj){
+	    /* series of i4() in a = Rj/d, a < 1/4: the terms left out 
+	       are below 2e-6 relative */
+	    a = rj/d;
+	    a2 = a*a;
+	    qfar += agb->grd_spr[jat]*twopi*(a2*a/d)*
+	      (2./3. + a2*(4./5. + a2*(6./7. + a2*(8./9. + a2*(10./11.)))));
+	  }else if(d > rmax + rj){
+	    qfar += agb->grd_spr[jat]*agbnp3_i4(d, rmax, rj, &dr4);
+	  }else{
+	    near[nnear] = jat;
+	    dnear[nnear++] = d;
+	  }
+	}
+	for(t=0;t<ntype;t++){
+	  qt = qfar;
+	  for(jat=0;jat<nnear;jat++){
+	    qt += agb->grd_spr[near[jat]]*
+	      agbnp3_i4(dnear[jat], typer[t], agb->grd_rr[near[jat]], &dr4);
+	  }
+	  agb->grd_q[(size_t)t*nnodes + node] = fourpi1*qt;
+	}
+      }
+    }
+    if(near) agbnp3_vfree(near);
+    if(dnear) agbnp3_vfree(dnear);
+  }
+
+  agbnp3_vfree(typer);
+  return error ? AGBNP_ERR : AGBNP_OK;
+}
+
+/* largest error of the interpolated inverse Born radius decrement over
+   the radius types at random points of the box lo-hi that are outside
+   of the van der Waals spheres of the receptor atoms */
+float_a agbnp3_rgrid_error(AGBNPdata *agb, float_i *lo, float_i *hi){
+  int ntype = agb->nrtype;
+  int nrec = agb->grd_nrec;
+  int nsample = 1000, ntrials = 100*nsample;
+  int is, it, t, jat, inside;
+  unsigned int seed = 12345;
+  float_a cvdw = AGBNP_RADIUS_INCREMENT;
+  float_a *typer = NULL;
+  float_a p[3], dx, dy, dz, rj, q, qx, err = 0.0;
+  int i;
+
+  if(agbnp3_rgrid_type_radii(agb, &typer) != AGBNP_OK){
+    return -1.0;
+  }
+  is = 0;
+  for(it=0; it<ntrials && is<nsample; it++){
+    for(i=0;i<3;i++){
+      seed = 1103515245u*seed + 12345u;
+      p[i] = lo[i] + (hi[i] - lo[i])*((seed >> 8) & 0xffff)/65535.0;
+    }
+    inside = 0;
+    for(jat=0;jat<nrec;jat++){
+      dx = agb->grd_xr[jat] - p[0];
+      dy = agb->grd_yr[jat] - p[1];
+      dz = agb->grd_zr[jat] - p[2];
+      rj = agb->grd_rr[jat] - cvdw;
+      if(dx*dx + dy*dy + dz*dz < rj*rj){
+	inside = 1;
+	break;
+      }
+    }
+    if(inside) continue;
+    is += 1;
+    for(t=0;t<ntype;t++){
+      agbnp3_rgrid_descreening(agb, t, typer[t], p[0], p[1], p[2], &q, NULL);
+      agbnp3_rgrid_descreening_exact(agb, typer[t], p[0], p[1], p[2], &qx, 
+				    NULL);
+      if(fabs(q - qx) > err) err = fabs(q - qx);
+    }
+  }
+  agbnp3_vfree(typer);
+  return err;
+}
+
+/* inverse Born radius decrement q, and its gradient dq if not NULL, of
+   an atom of radius type t and radius Ri (minus the radius increment) 
+   at (x,y,z) due to the receptor of the grid. Interpolated with 
+   tricubic (Catmull-Rom) splines inside the grid, summed over the 
+   receptor atoms outside. */
+void agbnp3_rgrid_descreening(AGBNPdata *agb, int t, float_a Ri,
+			     float_a x, float_a y, float_a z,
+			     float_a *q, float_a *dq){
+  float_a h = agb->grd_h;
+  int n0 = agb->grd_n[0], n1 = agb->grd_n[1], n2 = agb->grd_n[2];
+  float_a f[3], u, u2, u3, w[3][4], dw[3][4];
+  int c[3], i, j, k;
+  float_a qj;
+  double qs, g[3], wjk, dwjk[2];
+  float *gq;
+
+  f[0] = (x - agb->grd_lo[0])/h;
+  f[1] = (y - agb->grd_lo[1])/h;
+  f[2] = (z - agb->grd_lo[2])/h;
+  for(i=0;i<3;i++){
+    c[i] = (int)floor(f[i]);
+  }
+  if(c[0] < 1 || c[0] > n0 - 3 || c[1] < 1 || c[1] > n1 - 3 ||
+     c[2] < 1 || c[2] > n2 - 3){
+    agbnp3_rgrid_descreening_exact(agb, Ri, x, y, z, q, dq);
+    return;
+  }
+
+  /* Catmull-Rom weights of nodes c-1, c, c+1, c+2 and their derivatives */
+  for(i=0;i<3;i++){
+    u = f[i] - c[i];
+    u2 = u*u;
+    u3 = u2*u;
+    w[i][0] = 0.5*(-u3 + 2.*u2 - u);
+    w[i][1] = 0.5*(3.*u3 - 5.*u2 + 2.);
+    w[i][2] = 0.5*(-3.*u3 + 4.*u2 + u);
+    w[i][3] = 0.5*(u3 - u2);
+    dw[i][0] = 0.5*(-3.*u2 + 4.*u - 1.)/h;
+    dw[i][1] = 0.5*(9.*u2 - 10.*u)/h;
+    dw[i][2] = 0.5*(-9.*u2 + 8.*u + 1.)/h;
+    dw[i][3] = 0.5*(3.*u2 - 2.*u)/h;
+  }
+  gq = agb->grd_q + (size_t)t*n0*n1*n2;
+  qs = g[0] = g[1] = g[2] = 0.0;
+  for(j=0;j<4;j++){
+    for(k=0;k<4;k++){
+      wjk = w[1][j]*w[2][k];
+      dwjk[0] = dw[1][j]*w[2][k];
+      dwjk[1] = w[1][j]*dw[2][k];
+      for(i=0;i<4;i++){
+	qj = gq[((size_t)(c[0]+i-1)*n1 + c[1]+j-1)*n2 + c[2]+k-1];
+	qs += w[0][i]*wjk*qj;
+	g[0] += dw[0][i]*wjk*qj;
+	g[1] += w[0][i]*dwjk[0]*qj;
+	g[2] += w[0][i]*dwjk[1]*qj;
+      }
+    }
+  }
+  *q = qs;
+  if(dq){
+    for(i=0;i<3;i++) dq[i] = g[i];
+  }
+}
+
+/* same as agbnp3_rgrid_descreening() summed over the receptor atoms */
+void agbnp3_rgrid_descreening_exact(AGBNPdata *agb, float_a Ri,
+				   float_a x, float_a y, float_a z,
+				   float_a *q, float_a *dq){
+  float_a fourpi1 = 1./(4.*pi);
+  float_a dx, dy, dz, d, qj, dr4;
+  double qs, g[3];
+  int i, jat;
+
+  qs = g[0] = g[1] = g[2] = 0.0;
+  for(jat=0;jat<agb->grd_nrec;jat++){
+    dx = agb->grd_xr[jat] - x;
+    dy = agb->grd_yr[jat] - y;
+    dz = agb->grd_zr[jat] - z;
+    d = sqrt(dx*dx + dy*dy + dz*dz);
+    if(d <= 0.0) continue;
+    qj = agbnp3_i4(d, Ri, agb->grd_rr[jat], &dr4);
+    qs += agb->grd_spr[jat]*qj;
+    dr4 *= -agb->grd_spr[jat]/d;
+    g[0] += dr4*dx;
+    g[1] += dr4*dy;
+    g[2] += dr4*dz;
+  }
+  *q = fourpi1*qs;
+  if(dq){
+    for(i=0;i<3;i++) dq[i] = fourpi1*g[i];
+  }
+}
+
+/* Decides whether the neighbor lists are rebuilt in this energy 
+   evaluation. Without a skin they are always rebuilt. With a skin they
+   are rebuilt when an atom moved by more than half the skin since the
+   last build, or when the lists were invalidated by a change of 
+   settings. Sets agb->nblist_update. */
+int agbnp3_nblist_check(AGBNPdata *agb){
+  int iat;
+  int natoms = agb->natoms;
+  float_a *x = agb->x;
+  float_a *y = agb->y;
+  float_a *z = agb->z;
+  float_a dx, dy, dz, d2, d2max = 0.0;
+  float_a trigger = 0.5*agb->nblist_skin;
+
+  agb->nblist_nevals += 1;
+
+  if(agb->nblist_skin <= 0.0){
+    agb->nblist_update = 1;
+    agb->nblist_nbuilds += 1;
+    agb->nblist_maxdisp = 0.0;
+    return AGBNP_OK;
+  }
+
+  if(!agb->nblist_xref){
+    agbnp3_vcalloc((void **)&(agb->nblist_xref), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(agb->nblist_yref), natoms*sizeof(float_a));
+    agbnp3_vcalloc((void **)&(agb->nblist_zref), natoms*sizeof(float_a));
+    if(!(agb->nblist_xref && agb->nblist_yref && agb->nblist_zref)){
+      agbnp3_errprint("agbnp3_nblist_check(): unable to allocate memory for reference coordinates.\n");
+      return AGBNP_ERR;
+    }
+    agb->nblist_invalid = 1;
+  }
+
+  if(!agb->nblist_invalid){
+    for(iat=0;iat<natoms;iat++){
+      dx = x[iat] - agb->nblist_xref[iat];
+      dy = y[iat] - agb->nblist_yref[iat];
+      dz = z[iat] - agb->nblist_zref[iat];
+      d2 = dx*dx + dy*dy + dz*dz;
+      if(d2 > d2max) d2max = d2;
+    }
+    agb->nblist_maxdisp = sqrt(d2max);
+  }
+
+  if(agb->nblist_invalid || agb->nblist_maxdisp > trigger){
+    memcpy(agb->nblist_xref, x, natoms*sizeof(float_a));
+    memcpy(agb->nblist_yref, y, natoms*sizeof(float_a));
+    memcpy(agb->nblist_zref, z, natoms*sizeof(float_a));
+    agb->nblist_update = 1;
+    agb->nblist_invalid = 0;
+    agb->nblist_nbuilds += 1;
+  }else{
+    agb->nblist_update = 0;
+  }
 
-  int2ext = agb->int2ext;
-  ext2int = agb->ext2int;
+  return AGBNP_OK;
+}
 
-  /* copy to coordinates to local arrays */
-  for(iat=0; iat < agb->natoms; iat++){
-    iatext = int2ext[iat];
-    agb->x[iat] = x[iatext];
-    agb->y[iat] = y[iatext];
-    agb->z[iat] = z[iatext];
-  }
+/* allocates the reference state of agbnp3_ener_delta() */
+int agbnp3_delta_allocate(AGBNPdata *agb){
+  int natoms = agb->natoms;
 
-  if(agbnp3_total_energy(agb, init,
-			mol_volume,  
-			egb, 
-			evdw, ecorr_vdw,  
-			ecav, ecorr_cav, 
-			ehb) != AGBNP_OK){
-    agbnp3_errprint("agbnp3_ener(): error in agbnp3_total_energy().\n");
+  agbnp3_vcalloc((void **)&(agb->dlt_moved), natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&(agb->dlt_ismoved), natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&(agb->dlt_changed), natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&(agb->dlt_xref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_yref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_zref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_spref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_br1), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_br1ref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_vol), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_volref), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_area), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_arearef), natoms*sizeof(float_a));
+  agbnp3_vcalloc((void **)&(agb->dlt_speref), natoms*sizeof(float_a));
+  if(!(agb->dlt_moved && agb->dlt_ismoved && agb->dlt_changed &&
+       agb->dlt_xref && agb->dlt_yref && agb->dlt_zref && 
+       agb->dlt_spref && agb->dlt_br1 && agb->dlt_br1ref &&
+       agb->dlt_vol && agb->dlt_volref && agb->dlt_area &&
+       agb->dlt_arearef && agb->dlt_speref)){
+    agbnp3_errprint("agbnp3_delta_allocate(): unable to allocate memory for the reference state.\n");
+    agbnp3_delta_free(agb);
     return AGBNP_ERR;
   }
+  agb->dlt_state = AGBNP_DELTA_NONE;
+  agb->dlt_nmoved = agb->dlt_nchanged = 0;
+  return AGBNP_OK;
+}
 
-  /* copy to output buffers */
-  for(iat=0; iat < agb->natoms; iat++){
-    iatext = int2ext[iat];
-    br[iatext] = agb->br[iat];
-    sp[iatext] = agb->sp[iat];
-    surf_area[iatext] = agb->surf_area[iat];
-  }
+void agbnp3_delta_free(AGBNPdata *agb){
+  if(agb->dlt_moved){ agbnp3_vfree(agb->dlt_moved); agb->dlt_moved = NULL;}
+  if(agb->dlt_ismoved){ agbnp3_vfree(agb->dlt_ismoved); agb->dlt_ismoved = NULL;}
+  if(agb->dlt_changed){ agbnp3_vfree(agb->dlt_changed); agb->dlt_changed = NULL;}
+  if(agb->dlt_xref){ agbnp3_vfree(agb->dlt_xref); agb->dlt_xref = NULL;}
+  if(agb->dlt_yref){ agbnp3_vfree(agb->dlt_yref); agb->dlt_yref = NULL;}
+  if(agb->dlt_zref){ agbnp3_vfree(agb->dlt_zref); agb->dlt_zref = NULL;}
+  if(agb->dlt_spref){ agbnp3_vfree(agb->dlt_spref); agb->dlt_spref = NULL;}
+  if(agb->dlt_br1){ agbnp3_vfree(agb->dlt_br1); agb->dlt_br1 = NULL;}
+  if(agb->dlt_br1ref){ agbnp3_vfree(agb->dlt_br1ref); agb->dlt_br1ref = NULL;}
+  if(agb->dlt_vol){ agbnp3_vfree(agb->dlt_vol); agb->dlt_vol = NULL;}
+  if(agb->dlt_volref){ agbnp3_vfree(agb->dlt_volref); agb->dlt_volref = NULL;}
+  if(agb->dlt_area){ agbnp3_vfree(agb->dlt_area); agb->dlt_area = NULL;}
+  if(agb->dlt_arearef){ agbnp3_vfree(agb->dlt_arearef); agb->dlt_arearef = NULL;}
+  if(agb->dlt_speref){ agbnp3_vfree(agb->dlt_speref); agb->dlt_speref = NULL;}
+  agb->dlt_state = AGBNP_DELTA_NONE;
+}
 
-  for(iat=0; iat < agb->natoms; iat++){
-    iatext = int2ext[iat];
+/* releases the overlap tree records and the saved water sites of
+   agbnp3_ener_delta() */
+void agbnp3_delta_delete_agbworkdata(AGBworkdata *agbw){
+  if(agbw->svref){ agbnp3_svroot_delete(agbw->svref, agbw->natoms);
+    agbnp3_vfree(agbw->svref); agbw->svref = NULL;}
+  if(agbw->svnew){ agbnp3_svroot_delete(agbw->svnew, agbw->natoms);
+    agbnp3_vfree(agbw->svnew); agbw->svnew = NULL;}
+  if(agbw->svslot){ agbnp3_vfree(agbw->svslot); agbw->svslot = NULL;}
+  if(agbw->svroots){ agbnp3_vfree(agbw->svroots); agbw->svroots = NULL;}
+  agbw->nsvroots = 0;
+  if(agbw->wsdlt){ free(agbw->wsdlt); agbw->wsdlt = NULL;}
+  if(agbw->wsdlt_save){ free(agbw->wsdlt_save); agbw->wsdlt_save = NULL;}
+  agbw->nwsdlt = agbw->wsdlt_size = 0;
+}
 
-    dgbdr[iatext][0] = agb->dgbdr[iat][0];
-    dgbdr[iatext][1] = agb->dgbdr[iat][1];
-    dgbdr[iatext][2] = agb->dgbdr[iat][2];
+/* starts the record of the overlap tree of root atom iat with near_nl
+   row neighl[0..nne-1]: the atoms are listed, their contributions are
+   zeroed and slot[] is set to their positions in the record */
+int agbnp3_svroot_start(SVRoot *rec, int iat, int nne, int *neighl,
+			int *slot){
+  int j, n = nne + 1;
+
+  if(n > rec->size){
+    rec->size = n + n/2;
+    rec->atom = (int *)realloc(rec->atom, rec->size*sizeof(int));
+    rec->vol = (float_a *)realloc(rec->vol, rec->size*sizeof(float_a));
+    rec->area = (float_a *)realloc(rec->area, rec->size*sizeof(float_a));
+    if(!(rec->atom && rec->vol && rec->area)){
+      rec->n = rec->size = 0;
+      return AGBNP_ERR;
+    }
+  }
+  rec->n = n;
+  rec->atom[0] = iat;
+  slot[iat] = 0;
+  for(j=0;j<nne;j++){
+    rec->atom[j+1] = neighl[j];
+    slot[neighl[j]] = j+1;
+  }
+  memset(rec->vol, 0, n*sizeof(float_a));
+  memset(rec->area, 0, n*sizeof(float_a));
+  return AGBNP_OK;
+}
 
-    dvwdr[iatext][0] = agb->dvwdr[iat][0];
-    dvwdr[iatext][1] = agb->dvwdr[iat][1];
-    dvwdr[iatext][2] = agb->dvwdr[iat][2];
+/* releases the records of n roots */
+void agbnp3_svroot_delete(SVRoot *rec, int n){
+  int i;
+  for(i=0;i<n;i++){
+    if(rec[i].atom) free(rec[i].atom);
+    if(rec[i].vol) free(rec[i].vol);
+    if(rec[i].area) free(rec[i].area);
+    rec[i].atom = NULL;
+    rec[i].vol = rec[i].area = NULL;
+    rec[i].n = rec[i].size = 0;
+  }
+}
 
-    dehb[iatext][0] = agb->dehb[iat][0];
-    dehb[iatext][1] = agb->dehb[iat][1];
-    dehb[iatext][2] = agb->dehb[iat][2];
+/* makes the last evaluation the reference state of agbnp3_ener_delta().
+   If all is not set only the coordinates of the moved atoms and the 
+   scaling factors of the heavy atoms used by 
+   agbnp3_inverse_born_radii_delta_soa() are updated, so that the 
+   reference scaling factors stay consistent with the reference inverse
+   Born radii. */
+void agbnp3_delta_reference(AGBNPdata *agb, int all){
+  int i, iat, iproc, nprocs = 1;
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float_a *sp = agb->agbw->sp;
+  AGBworkdata *agbw;
+  SVRoot *svt, rect;
 
-    decav[iatext][0] = agb->decav[iat][0];
-    decav[iatext][1] = agb->decav[iat][1];
-    decav[iatext][2] = agb->decav[iat][2];
+  /* overlap tree records of the evaluation, all of them or those of the
+     roots rebuilt by the trial move, see agbnp3_self_volumes_rooti() */
+#ifdef _OPENMP
+  nprocs = agb->nprocs;
+#endif
+  for(iproc=0;iproc<nprocs;iproc++){
+#ifdef _OPENMP
+    agbw = agb->agbw_p[iproc];
+#else
+    agbw = agb->agbw;
+#endif
+    agbw->nwsdlt = 0;
+    if(!agbw->svref) continue;
+    if(all){
+      svt = agbw->svref;
+      agbw->svref = agbw->svnew;
+      agbw->svnew = svt;
+    }else{
+      for(i=0;i<agbw->nsvroots;i++){
+	iat = agbw->svroots[i];
+	rect = agbw->svref[iat];
+	agbw->svref[iat] = agbw->svnew[iat];
+	agbw->svnew[iat] = rect;
+      }
+    }
+    agbw->nsvroots = 0;
+  }
+  memcpy(agb->dlt_volref, agb->dlt_vol, nheavyat*sizeof(float_a));
+  memcpy(agb->dlt_arearef, agb->dlt_area, nheavyat*sizeof(float_a));
+  memcpy(agb->dlt_speref, agb->agbw->spe, nheavyat*sizeof(float_a));
+  agb->dlt_ehbligref = agb->dlt_ehblig;
+
+  if(all){
+    memcpy(agb->dlt_xref, agb->x, natoms*sizeof(float_a));
+    memcpy(agb->dlt_yref, agb->y, natoms*sizeof(float_a));
+    memcpy(agb->dlt_zref, agb->z, natoms*sizeof(float_a));
+    memcpy(agb->dlt_spref, sp, agb->nheavyat*sizeof(float_a));
+  }else{
+    for(i=0;i<agb->dlt_nmoved;i++){
+      iat = agb->dlt_moved[i];
+      agb->dlt_xref[iat] = agb->x[iat];
+      agb->dlt_yref[iat] = agb->y[iat];
+      agb->dlt_zref[iat] = agb->z[iat];
+    }
+    for(i=0;i<agb->dlt_nchanged;i++){
+      iat = agb->dlt_changed[i];
+      agb->dlt_spref[iat] = sp[iat];
+    }
   }
+  for(i=0;i<agb->dlt_nmoved;i++){
+    agb->dlt_ismoved[agb->dlt_moved[i]] = 0;
+  }
+  agb->dlt_nmoved = 0;
+  memcpy(agb->dlt_br1ref, agb->dlt_br1, natoms*sizeof(float_a));
+  memcpy(agb->dlt_tailref, agb->dlt_tail, 5*sizeof(float_a));
+  memcpy(agb->dlt_enerref, agb->dlt_ener, 6*sizeof(float_i));
+  agb->dlt_state = AGBNP_DELTA_REF;
+}
 
-  return AGBNP_OK;
+/* Chooses between caching i4() values for the derivative kernels and
+   recomputing them. The cache of the all-pairs descreening kernels 
+   grows as the square of the number of atoms, it is used only if it
+   fits within agb->q4cache_budget. Otherwise the derivative kernels
+   re-evaluate i4() one row at a time, doubling the i4() work. */
+void agbnp3_q4cache_select(AGBNPdata *agb){
+  double nh = agb->nheavyat;
+  double nhyd = agb->natoms - agb->nheavyat;
+  /* as allocated by agbnp3_neighbor_lists() */
+  double mbytes = 4.0*(0.5*nh*(nh-1.) + nh*(nhyd+1.))*sizeof(float)/(1024.*1024.);
+
+  agb->q4cache_recompute = (mbytes > agb->q4cache_budget);
+  if(agb->verbose){
+    printf("agbnp3_q4cache_select(): i4() cache size %.1f MB, budget %.1f MB: %s\n",
+	   mbytes, agb->q4cache_budget, 
+	   agb->q4cache_recompute ? "recomputing i4()" : "caching i4()");
+  }
 }
 
 /* check if it is a valid tag */
@@ -597,6 +2628,13 @@ int agbnp3_ener(int tag, int init,
   data->ndummy = 0;
   data->idummy = NULL;
   data->int2ext = NULL;
+  data->atom_order = AGBNP_ORDER_INPUT;
+  data->resort_factor = 0.0;
+  data->resort_ref = 0.0;
+  data->resort_dsum = 0.0;
+  data->resort_npairs = 0;
+  data->resort_pending = 0;
+  data->resort_nsorts = 0;
   data->ext2int = NULL;
   data->vdiel_in = NULL;
   data->dielectric_in = data->dielectric_out = -1.0;
@@ -606,13 +2644,66 @@ int agbnp3_ener(int tag, int init,
   data->ssize = 0;
   data->xs = data->ys = data->zs = NULL;
   data->rot = NULL;
+  data->trans = NULL;
+  data->dogrid = 0;
+  data->grd_n[0] = data->grd_n[1] = data->grd_n[2] = 0;
+  data->grd_lo[0] = data->grd_lo[1] = data->grd_lo[2] = 0.0;
+  data->grd_h = 0.0;
+  data->grd_q = NULL;
+  data->grd_nrec = 0;
+  data->grd_xr = data->grd_yr = data->grd_zr = NULL;
+  data->grd_rr = data->grd_spr = NULL;
+  data->rc_natoms = 0;
+  data->rc_x = data->rc_y = data->rc_z = NULL;
+  data->rc_r = data->rc_sp = data->rc_br1 = NULL;
+  data->rc_vol = data->rc_area = NULL;
+  data->rc_tail[0] = data->rc_tail[1] = data->rc_tail[2] = 0.0;
+  data->rc_tail[3] = data->rc_tail[4] = 0.0;
+  data->rc_br_ron = data->rc_br_roff = 0.0;
+  data->rc_tag = -1;
   data->conntbl = NULL;
+  data->nblist_method = AGBNP_NBLIST_CELLS;
+  data->nblist_skin = 0.0;
+  data->nblist_xref = data->nblist_yref = data->nblist_zref = NULL;
+  data->nblist_update = 1;
+  data->nblist_invalid = 1;
+  data->br_nl_stale = 0;
+  data->nblist_nevals = data->nblist_nbuilds = 0;
+  data->nblist_maxdisp = 0.0;
+  data->gb_ron = data->gb_roff = 0.0;
+  data->br_ron = data->br_roff = 0.0;
+  data->br_rm = 0.0;
+  data->gb_tree_theta = 0.0;
+  data->q4cache_budget = AGBNP_Q4CACHE_BUDGET;
+  data->q4cache_recompute = 0;
+  data->ener_only = 0;
+  data->terms = AGBNP_TERM_ALL;
+  data->br_only = 0;
+  data->br_ders_ok = 0;
+  data->do_frozen = 0;
+  data->isfrozen = NULL;
+  data->frozen_init = 1;
+  data->dlt_state = AGBNP_DELTA_NONE;
+  data->dlt_eval = 0;
+  data->dlt_nmoved = data->dlt_nchanged = 0;
+  data->dlt_moved = data->dlt_ismoved = data->dlt_changed = NULL;
+  data->dlt_xref = data->dlt_yref = data->dlt_zref = NULL;
+  data->dlt_spref = data->dlt_br1 = data->dlt_br1ref = NULL;
+  data->dlt_vol = data->dlt_volref = NULL;
+  data->dlt_area = data->dlt_arearef = NULL;
+  data->dlt_speref = NULL;
+  data->dlt_local = AGBNP_LOCAL_NONE;
+  data->dlt_ehblig = data->dlt_ehbligref = 0.0;
+  data->bnd_isligand = NULL;
+  data->bnd_decouple = 0;
+  data->bnd_ehb_lig = 0.0;
   data->do_w = 1;
   data->agbw = NULL;
   data->nprocs = data->maxprocs = 0;
   data->agbw_p = NULL;
   data->f4c1table2d = NULL;
   data->f4c1table2dh = NULL;
+  data->f4c1table2dl = NULL;
   return AGBNP_OK;
 }
 
@@ -637,6 +2728,16 @@ int agbnp3_ener(int tag, int init,
   agbw->q4cache = NULL;
   agbw->near_nl = NULL;
   agbw->far_nl = NULL;
+  agbnp3_grid_reset(&(agbw->nbgrid));
+  agbw->gb_nl = NULL;
+  agbnp3_grid_reset(&(agbw->gbgrid));
+  agbw->br_nl = NULL;
+  agbnp3_grid_reset(&(agbw->brgrid));
+  agbw->brfz_nl = NULL;
+  agbw->nq4fzcache = 0;
+  agbw->q4fzcache = NULL;
+  agbnp3_grid_reset(&(agbw->wsgrid));
+  agbnp3_tree_reset(&(agbw->gbtree));
 
   agbw->dgbdrx = NULL;
   agbw->dgbdry = NULL;
@@ -658,6 +2759,13 @@ int agbnp3_ener(int tag, int init,
   agbw->nwsat = 0;
   agbw->wsat_size = 0;
   agbw->wsat = NULL;
+  agbw->svref = agbw->svnew = NULL;
+  agbw->svslot = NULL;
+  agbw->nsvroots = 0;
+  agbw->svroots = NULL;
+  agbw->nwsdlt = agbw->wsdlt_size = 0;
+  agbw->wsdlt = NULL;
+  agbw->wsdlt_save = NULL;
 
   for(i=0;i<2;i++){
     agbw->overlap_lists[i] = NULL;
@@ -680,7 +2788,7 @@ int agbnp3_ener(int tag, int init,
   agbw->v3 = NULL;
   agbw->v3p = NULL;
   agbw->fp3 = NULL;
-  agbw->fp3 = NULL;
+  agbw->fpp3 = NULL;
 
   agbw->hbuffer_size = 0;
   agbw->hiat = NULL;
@@ -697,7 +2805,7 @@ int agbnp3_ener(int tag, int init,
   agbw->hv3 = NULL;
   agbw->hv3p = NULL;
   agbw->hfp3 = NULL;
-  agbw->hfp3 = NULL;
+  agbw->hfpp3 = NULL;
 
   agbw->qbuffer_size = 0;
   agbw->qdv = NULL;
@@ -718,6 +2826,12 @@ int agbnp3_ener(int tag, int init,
   agbw->qfp1= NULL;
   agbw->qfp2= NULL;
 
+  agbw->pbuffer_size = 0;
+  agbw->pbx = agbw->pby = agbw->pbz = NULL;
+  agbw->pbq = agbw->pbbr = NULL;
+  agbw->pbdera = NULL;
+  agbw->pbgx = agbw->pbgy = agbw->pbgz = NULL;
+
   agbw->wbuffer_size = 0;
   agbw->wb_iatom = NULL;
   agbw->wb_gvolv = NULL;
@@ -735,8 +2849,11 @@ int agbnp3_ener(int tag, int init,
   return AGBNP_OK;
 }
 
-/* reorder atoms so that hydrogens are at the end */
-int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
+/* reorder atoms so that hydrogens are at the end. Heavy atoms and 
+   hydrogens are then each sorted along a space-filling curve if 
+   requested by agb->atom_order */
+int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen,
+			float_i *x, float_i *y, float_i *z){
   int *int2ext = agb->int2ext;
   int *ext2int = agb->ext2int;
   int natoms = agb->natoms;
@@ -769,12 +2886,284 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
     } 
   }
 
+  free(ishydrogen);
+
+  if(agb->atom_order != AGBNP_ORDER_INPUT){
+    if(agbnp3_sfc_sort(agb->atom_order, nheavy, int2ext, x, y, z) != AGBNP_OK ||
+       agbnp3_sfc_sort(agb->atom_order, nhydrogen, &(int2ext[nheavy]), 
+		       x, y, z) != AGBNP_OK){
+      return AGBNP_ERR;
+    }
+    for(i = 0; i < natoms; i++){
+      ext2int[int2ext[i]] = i;
+    }
+  }
+
   //  for(i=0;i<natoms;i++){
   //  printf("%d %d %d %d\n", i, ishydrogen[i], int2ext[i], ext2int[i]);
   // }
   //exit(1);
 
-  free(ishydrogen);
+  return AGBNP_OK;
+}
+
+/* re-sorts the atoms along a space-filling curve at their current 
+   positions, see agbnp3_set_atom_resort(). Permutes the internal atomic
+   arrays in place and updates int2ext and ext2int so that external 
+   indexes are unchanged. Heavy atoms and hydrogens are sorted within 
+   their blocks. Neighbor lists and caches must be rebuilt afterwards. */
+int agbnp3_atom_resort(AGBNPdata *agb){
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  int order = agb->atom_order != AGBNP_ORDER_INPUT ? 
+    agb->atom_order : AGBNP_ORDER_HILBERT;
+  int *perm = NULL, *inv = NULL, *nne = NULL, *neighl = NULL;
+  float_i *xs = NULL, *ys = NULL, *zs = NULL;
+  void *buffer = NULL;
+  NeighList *conntbl = agb->conntbl;
+  int iat, i, j, indx, nnb, err = 0;
+#ifdef _OPENMP
+  int iproc;
+#endif
+
+  nnb = 0;
+  for(iat=0;iat<natoms;iat++) nnb += conntbl->nne[iat];
+
+  agbnp3_vcalloc((void **)&perm, natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&inv, natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&nne, natoms*sizeof(int));
+  agbnp3_vcalloc((void **)&neighl, (nnb+1)*sizeof(int));
+  agbnp3_vcalloc((void **)&xs, natoms*sizeof(float_i));
+  agbnp3_vcalloc((void **)&ys, natoms*sizeof(float_i));
+  agbnp3_vcalloc((void **)&zs, natoms*sizeof(float_i));
+  agbnp3_vcalloc((void **)&buffer, natoms*sizeof(float_i));
+  if(!(perm && inv && nne && neighl && xs && ys && zs && buffer)){
+    agbnp3_errprint("agbnp3_atom_resort(): unable to allocate work buffers (%d atoms).\n", natoms);
+    err = 1;
+    goto DONE;
+  }
+
+  /* perm[i] is the current index of the atom which goes to i */
+  for(iat=0;iat<natoms;iat++){
+    perm[iat] = iat;
+    xs[iat] = agb->x[iat];
+    ys[iat] = agb->y[iat];
+    zs[iat] = agb->z[iat];
+  }
+  if(agbnp3_sfc_sort(order, nheavyat, perm, xs, ys, zs) != AGBNP_OK ||
+     agbnp3_sfc_sort(order, natoms-nheavyat, &(perm[nheavyat]), 
+		     xs, ys, zs) != AGBNP_OK){
+    err = 1;
+    goto DONE;
+  }
+  for(iat=0;iat<natoms;iat++) inv[perm[iat]] = iat;
+
+  /* atomic arrays */
+  agbnp3_permute_atoms(agb->x, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->y, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->z, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->r, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->rtype, sizeof(int), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->charge, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->igamma, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->sgamma, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->ialpha, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->salpha, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->idelta, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->sdelta, sizeof(float_a), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->hbtype, sizeof(int), natoms, perm, buffer);
+  agbnp3_permute_atoms(agb->hbcorr, sizeof(float_a), natoms, perm, buffer);
+  if(agb->isfrozen){
+    agbnp3_permute_atoms(agb->isfrozen, sizeof(int), natoms, perm, buffer);
+  }
+  if(agb->bnd_isligand){
+    agbnp3_permute_atoms(agb->bnd_isligand, sizeof(int), natoms, perm, buffer);
+  }
+  if(agb->nblist_xref){
+    agbnp3_permute_atoms(agb->nblist_xref, sizeof(float_a), natoms, perm, buffer);
+    agbnp3_permute_atoms(agb->nblist_yref, sizeof(float_a), natoms, perm, buffer);
+    agbnp3_permute_atoms(agb->nblist_zref, sizeof(float_a), natoms, perm, buffer);
+  }
+
+  /* index mappings and lists, heavy atoms stay in 0..nheavyat-1 so 
+     iheavyat is unchanged */
+  agbnp3_permute_atoms(agb->int2ext, sizeof(int), natoms, perm, buffer);
+  for(iat=0;iat<natoms;iat++) agb->ext2int[agb->int2ext[iat]] = iat;
+  for(i=0;i<agb->nhydrogen;i++) agb->ihydrogen[i] = inv[agb->ihydrogen[i]];
+  for(i=0;i<agb->ndummy;i++) agb->idummy[i] = inv[agb->idummy[i]];
+
+  /* connection table */
+  indx = 0;
+  for(iat=0;iat<natoms;iat++){
+    nne[iat] = conntbl->nne[iat];
+    for(j=0;j<nne[iat];j++) neighl[indx++] = conntbl->neighl[iat][j];
+  }
+  indx = 0;
+  for(iat=0;iat<natoms;iat++){
+    conntbl->nne[iat] = nne[perm[iat]];
+    conntbl->neighl[iat] = &(conntbl->neighl1[indx]);
+    indx += conntbl->nne[iat];
+  }
+  indx = 0;
+  for(iat=0;iat<natoms;iat++){
+    for(j=0;j<nne[iat];j++){
+      conntbl->neighl[inv[iat]][j] = inv[neighl[indx++]];
+    }
+  }
+
+  /* per-atom constants of the work data */
+  agbnp3_init_agbworkdata(agb, agb->agbw);
+#ifdef _OPENMP
+  for(iproc=0;iproc<agb->nprocs;iproc++){
+    agbnp3_init_agbworkdata(agb, agb->agbw_p[iproc]);
+  }
+#endif
+
+  agb->atom_order = order;
+  agb->frozen_init = 1;
+  agb->resort_ref = 0.0;
+  agb->resort_pending = 0;
+  agb->resort_nsorts += 1;
+  if(agb->verbose){
+    printf("agbnp3_atom_resort(): atoms re-sorted (%d)\n", agb->resort_nsorts);
+  }
+
+ DONE:
+  if(perm) agbnp3_vfree(perm);
+  if(inv) agbnp3_vfree(inv);
+  if(nne) agbnp3_vfree(nne);
+  if(neighl) agbnp3_vfree(neighl);
+  if(xs) agbnp3_vfree(xs);
+  if(ys) agbnp3_vfree(ys);
+  if(zs) agbnp3_vfree(zs);
+  if(buffer) agbnp3_vfree(buffer);
+  return err ? AGBNP_ERR : AGBNP_OK;
+}
+
+/* a[i] = a[perm[i]] for the n elements of size 'size' of a, buffer
+   holds at least n elements */
+void agbnp3_permute_atoms(void *a, size_t size, int n, int *perm, 
+			  void *buffer){
+  char *ca = (char *)a;
+  char *cb = (char *)buffer;
+  int i;
+  for(i=0;i<n;i++){
+    memcpy(cb + i*size, ca + perm[i]*size, size);
+  }
+  memcpy(a, buffer, n*size);
+}
+
+/* key of the cell (ix,iy,iz) along the Morton curve: the bits of the 
+   cell indexes interleaved */
+unsigned int agbnp3_morton_key(unsigned int ix, unsigned int iy, 
+			       unsigned int iz, int nbits){
+  unsigned int key = 0;
+  int b;
+  for(b = nbits-1; b >= 0; b--){
+    key = (key << 3) | (((ix >> b) & 1) << 2) | (((iy >> b) & 1) << 1) | 
+      ((iz >> b) & 1);
+  }
+  return key;
+}
+
+/* key of the cell (ix,iy,iz) along the Hilbert curve. Uses J. Skilling's
+   transform of the cell indexes (AIP Conf. Proc. 707, 381 (2004)) 
+   followed by bit interleaving. */
+unsigned int agbnp3_hilbert_key(unsigned int ix, unsigned int iy, 
+				unsigned int iz, int nbits){
+  unsigned int X[3], M, P, Q, t;
+  int i;
+
+  X[0] = ix; X[1] = iy; X[2] = iz;
+  M = 1u << (nbits-1);
+  /* inverse undo excess work */
+  for(Q = M; Q > 1; Q >>= 1){
+    P = Q - 1;
+    for(i = 0; i < 3; i++){
+      if(X[i] & Q){
+	X[0] ^= P;
+      }else{
+	t = (X[0] ^ X[i]) & P;
+	X[0] ^= t;
+	X[i] ^= t;
+      }
+    }
+  }
+  /* Gray encode */
+  for(i = 1; i < 3; i++) X[i] ^= X[i-1];
+  t = 0;
+  for(Q = M; Q > 1; Q >>= 1){
+    if(X[2] & Q) t ^= Q - 1;
+  }
+  for(i = 0; i < 3; i++) X[i] ^= t;
+
+  return agbnp3_morton_key(X[0], X[1], X[2], nbits);
+}
+
+/* sorts the n atoms in indx[] (external indexes) along a space-filling
+   curve spanning their bounding box */
+int agbnp3_sfc_sort(int order, int n, int *indx, 
+		    float_i *x, float_i *y, float_i *z){
+  float_i xmin[3], xmax[3], scale;
+  unsigned int ic[3], ncells = 1u << AGBNP_SFC_BITS;
+  float_a *key = NULL;
+  int *is = NULL, *js = NULL;
+  int i, k, iat;
+
+  if(n <= 1) return AGBNP_OK;
+
+  agbnp3_vcalloc((void **)&key, n*sizeof(float_a));
+  agbnp3_vcalloc((void **)&is, n*sizeof(int));
+  agbnp3_vcalloc((void **)&js, n*sizeof(int));
+  if(!(key && is && js)){
+    agbnp3_errprint("agbnp3_sfc_sort(): unable to allocate sort buffers (%d atoms).\n", n);
+    if(key) agbnp3_vfree(key);
+    if(is) agbnp3_vfree(is);
+    if(js) agbnp3_vfree(js);
+    return AGBNP_ERR;
+  }
+
+  xmin[0] = xmax[0] = x[indx[0]];
+  xmin[1] = xmax[1] = y[indx[0]];
+  xmin[2] = xmax[2] = z[indx[0]];
+  for(i = 1; i < n; i++){
+    iat = indx[i];
+    if(x[iat] < xmin[0]) xmin[0] = x[iat];
+    if(x[iat] > xmax[0]) xmax[0] = x[iat];
+    if(y[iat] < xmin[1]) xmin[1] = y[iat];
+    if(y[iat] > xmax[1]) xmax[1] = y[iat];
+    if(z[iat] < xmin[2]) xmin[2] = z[iat];
+    if(z[iat] > xmax[2]) xmax[2] = z[iat];
+  }
+  /* same scale along all directions so that cells are cubes */
+  scale = 0.0;
+  for(k = 0; k < 3; k++){
+    if(xmax[k] - xmin[k] > scale) scale = xmax[k] - xmin[k];
+  }
+  scale = scale > 0.0 ? ncells/scale : 0.0;
+
+  for(i = 0; i < n; i++){
+    iat = indx[i];
+    ic[0] = (unsigned int)((x[iat] - xmin[0])*scale);
+    ic[1] = (unsigned int)((y[iat] - xmin[1])*scale);
+    ic[2] = (unsigned int)((z[iat] - xmin[2])*scale);
+    for(k = 0; k < 3; k++){
+      if(ic[k] >= ncells) ic[k] = ncells - 1;
+    }
+    if(order == AGBNP_ORDER_HILBERT){
+      key[i] = agbnp3_hilbert_key(ic[0], ic[1], ic[2], AGBNP_SFC_BITS);
+    }else{
+      key[i] = agbnp3_morton_key(ic[0], ic[1], ic[2], AGBNP_SFC_BITS);
+    }
+  }
+
+  agbnp3_fsortindx(n, key, is);
+  for(i = 0; i < n; i++) js[i] = indx[is[i]];
+  memcpy(indx, js, n*sizeof(int));
+
+  agbnp3_vfree(key);
+  agbnp3_vfree(is);
+  agbnp3_vfree(js);
   return AGBNP_OK;
 } 
 
@@ -895,20 +3284,13 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
       return AGBNP_ERR;
   }
 
-  n = natoms*natoms/4; //initial size of water site Gaussian overlap buffers
-  if(agbnp3_reallocate_hbuffers(agbw, n) != AGBNP_OK){
-      agbnp3_errprint( "agbnp3_allocate_agbworkdata(): unable to allocate memory for Gaussian overlap buffers.\n");
-      return AGBNP_ERR;
-  }
-
   n = 2*natoms + 4; //initial size of buffers for inverse born radii
   if(agbnp3_reallocate_qbuffers(agbw, n) != AGBNP_OK){
     agbnp3_errprint( "agbnp3_allocate_agbworkdata(): unable to allocate memory for inverse born radii buffers.\n");
       return AGBNP_ERR;
   }
 
-  n = natoms; //initial size of buffers for water sites
-  if(agbnp3_reallocate_wbuffers(agbw, n) != AGBNP_OK){
+  if(agbnp3_allocate_wsbuffers(natoms, agbw) != AGBNP_OK){
     agbnp3_errprint( "agbnp3_allocate_agbworkdata(): unable to allocate memory for water sites.\n");
       return AGBNP_ERR;
   }
@@ -916,8 +3298,80 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
   return AGBNP_OK;
 }
 
+/* allocates the buffers of the water sites of the HB correction */
+int agbnp3_allocate_wsbuffers(int natoms, AGBworkdata *agbw){
+  int n;
+
+  n = natoms*AGBNP_OVERLAPS/10; //initial size of water site Gaussian overlap buffers
+  if(agbnp3_reallocate_hbuffers(agbw, n) != AGBNP_OK){
+      agbnp3_errprint( "agbnp3_allocate_wsbuffers(): unable to allocate memory for Gaussian overlap buffers.\n");
+      return AGBNP_ERR;
+  }
+
+  n = natoms; //initial size of buffers for water sites
+  if(agbnp3_reallocate_wbuffers(agbw, n) != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_allocate_wsbuffers(): unable to allocate memory for water sites.\n");
+      return AGBNP_ERR;
+  }
+
+  return AGBNP_OK;
+}
+
+/* releases the buffers of the water sites, they are not used when the
+   HB correction is off */
+void agbnp3_delete_wsbuffers(AGBworkdata *agbw){
+
+  agbnp3_grid_delete(&(agbw->wsgrid));
+
+  if(agbw->wsat){ 
+    int iw;
+    WSat *wsat;
+    for(iw=0;iw<agbw->wsat_size;iw++){
+      wsat = &(agbw->wsat[iw]);
+      agbnp3_clr_wsat(wsat);
+    }
+    free(agbw->wsat); 
+    agbw->wsat = NULL;
+  }
+  agbw->nwsat = agbw->wsat_size = 0;
+
+  if(agbw->w_iov){agbnp3_vfree(agbw->w_iov); agbw->w_iov = NULL;}
+  if(agbw->w_nov){agbnp3_vfree(agbw->w_nov); agbw->w_nov = NULL;}
+  agbw->wsize = 0;
+
+  if(agbw->hiat){agbnp3_vfree(agbw->hiat); agbw->hiat = NULL;}
+  if(agbw->ha1){agbnp3_vfree(agbw->ha1); agbw->ha1 = NULL;}
+  if(agbw->hp1){agbnp3_vfree(agbw->hp1); agbw->hp1 = NULL;}
+  if(agbw->hc1x){agbnp3_vfree(agbw->hc1x); agbw->hc1x = NULL;}
+  if(agbw->hc1y){agbnp3_vfree(agbw->hc1y); agbw->hc1y = NULL;}
+  if(agbw->hc1z){agbnp3_vfree(agbw->hc1z); agbw->hc1z = NULL;}
+
+  if(agbw->ha2){agbnp3_vfree(agbw->ha2); agbw->ha2 = NULL;}
+  if(agbw->hp2){agbnp3_vfree(agbw->hp2); agbw->hp2 = NULL;}
+  if(agbw->hc2x){agbnp3_vfree(agbw->hc2x); agbw->hc2x = NULL;}
+  if(agbw->hc2y){agbnp3_vfree(agbw->hc2y); agbw->hc2y = NULL;}
+  if(agbw->hc2z){agbnp3_vfree(agbw->hc2z); agbw->hc2z = NULL;}
+
+  if(agbw->hv3){agbnp3_vfree(agbw->hv3); agbw->hv3 = NULL;}
+  if(agbw->hv3p){agbnp3_vfree(agbw->hv3p); agbw->hv3p = NULL;}
+  if(agbw->hfp3){agbnp3_vfree(agbw->hfp3); agbw->hfp3 = NULL;}
+  if(agbw->hfpp3){agbnp3_vfree(agbw->hfpp3); agbw->hfpp3 = NULL;}
+  agbw->hbuffer_size = 0;
+
+  if(agbw->wb_iatom){agbnp3_vfree(agbw->wb_iatom); agbw->wb_iatom = NULL;}
+  if(agbw->wb_gvolv){agbnp3_vfree(agbw->wb_gvolv); agbw->wb_gvolv = NULL;}
+  if(agbw->wb_gderwx){agbnp3_vfree(agbw->wb_gderwx); agbw->wb_gderwx = NULL;}
+  if(agbw->wb_gderwy){agbnp3_vfree(agbw->wb_gderwy); agbw->wb_gderwy = NULL;}
+  if(agbw->wb_gderwz){agbnp3_vfree(agbw->wb_gderwz); agbw->wb_gderwz = NULL;}
+  if(agbw->wb_gderix){agbnp3_vfree(agbw->wb_gderix); agbw->wb_gderix = NULL;}
+  if(agbw->wb_gderiy){agbnp3_vfree(agbw->wb_gderiy); agbw->wb_gderiy = NULL;}
+  if(agbw->wb_gderiz){agbnp3_vfree(agbw->wb_gderiz); agbw->wb_gderiz = NULL;}
+  agbw->wbuffer_size = 0;
+}
+
  int agbnp3_delete_agbworkdata(AGBworkdata *agbw){
   int i;
+  agbnp3_delta_delete_agbworkdata(agbw);
   if(agbw->vols){ agbnp3_vfree(agbw->vols); agbw->vols = NULL;}
   if(agbw->volumep){agbnp3_vfree(agbw->volumep); agbw->volumep = NULL;}
   if(agbw->dera){ agbnp3_vfree(agbw->dera); agbw->dera = NULL;}
@@ -972,21 +3426,34 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
     nblist_delete_neighbor_list(agbw->far_nl);
     agbw->far_nl = NULL;
   }  
+  agbnp3_grid_delete(&(agbw->nbgrid));
+  if(agbw->gb_nl){
+    nblist_delete_neighbor_list(agbw->gb_nl);
+    free(agbw->gb_nl);
+    agbw->gb_nl = NULL;
+  }
+  agbnp3_grid_delete(&(agbw->gbgrid));
+  if(agbw->br_nl){
+    nblist_delete_neighbor_list(agbw->br_nl);
+    free(agbw->br_nl);
+    agbw->br_nl = NULL;
+  }
+  if(agbw->brfz_nl){
+    nblist_delete_neighbor_list(agbw->brfz_nl);
+    free(agbw->brfz_nl);
+    agbw->brfz_nl = NULL;
+  }
+  if(agbw->q4fzcache){
+    free(agbw->q4fzcache);
+    agbw->q4fzcache = NULL;
+    agbw->nq4fzcache = 0;
+  }
+  agbnp3_grid_delete(&(agbw->brgrid));
+  agbnp3_tree_delete(&(agbw->gbtree));
 
   if(agbw->nl_r2v)  {agbnp3_vfree(agbw->nl_r2v); agbw->nl_r2v = NULL;}
   if(agbw->nl_indx) {agbnp3_vfree(agbw->nl_indx); agbw->nl_indx = NULL;}
 
-  if(agbw->wsat){ 
-    int iw;
-    WSat *wsat;
-    for(iw=0;iw<agbw->wsat_size;iw++){
-      wsat = &(agbw->wsat[iw]);
-      agbnp3_clr_wsat(wsat);
-    }
-    free(agbw->wsat); 
-    agbw->wsat = NULL;
-  }
-
   for(i=0;i<2;i++){
     if(agbw->overlap_lists[i]){agbnp3_vfree(agbw->overlap_lists[i]); agbw->overlap_lists[i] = NULL;}
     if(agbw->root_lists[i]){agbnp3_vfree(agbw->root_lists[i]); agbw->root_lists[i] = NULL;}
@@ -1004,28 +3471,10 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
   if(agbw->c2y){agbnp3_vfree(agbw->c2y); agbw->c2y = NULL;}
   if(agbw->c2z){agbnp3_vfree(agbw->c2z); agbw->c2z = NULL;}
 
-  if(agbw->v3){agbnp3_vfree(agbw->hv3); agbw->v3 = NULL;}
-  if(agbw->v3p){agbnp3_vfree(agbw->hv3p); agbw->v3p = NULL;}
-  if(agbw->fp3){agbnp3_vfree(agbw->hfp3); agbw->fp3 = NULL;}
-  if(agbw->fpp3){agbnp3_vfree(agbw->hfpp3); agbw->fpp3 = NULL;}
-
-  if(agbw->hiat){agbnp3_vfree(agbw->hiat); agbw->hiat = NULL;}
-  if(agbw->ha1){agbnp3_vfree(agbw->ha1); agbw->ha1 = NULL;}
-  if(agbw->hp1){agbnp3_vfree(agbw->hp1); agbw->hp1 = NULL;}
-  if(agbw->hc1x){agbnp3_vfree(agbw->hc1x); agbw->hc1x = NULL;}
-  if(agbw->hc1y){agbnp3_vfree(agbw->hc1y); agbw->hc1y = NULL;}
-  if(agbw->hc1z){agbnp3_vfree(agbw->hc1z); agbw->hc1z = NULL;}
-
-  if(agbw->ha2){agbnp3_vfree(agbw->ha2); agbw->ha2 = NULL;}
-  if(agbw->hp2){agbnp3_vfree(agbw->hp2); agbw->hp2 = NULL;}
-  if(agbw->hc2x){agbnp3_vfree(agbw->hc2x); agbw->hc2x = NULL;}
-  if(agbw->hc2y){agbnp3_vfree(agbw->hc2y); agbw->hc2y = NULL;}
-  if(agbw->hc2z){agbnp3_vfree(agbw->hc2z); agbw->hc2z = NULL;}
-
-  if(agbw->hv3){agbnp3_vfree(agbw->hv3); agbw->hv3 = NULL;}
-  if(agbw->hv3p){agbnp3_vfree(agbw->hv3p); agbw->hv3p = NULL;}
-  if(agbw->hfp3){agbnp3_vfree(agbw->hfp3); agbw->hfp3 = NULL;}
-  if(agbw->hfpp3){agbnp3_vfree(agbw->hfpp3); agbw->hfpp3 = NULL;}
+  if(agbw->v3){agbnp3_vfree(agbw->v3); agbw->v3 = NULL;}
+  if(agbw->v3p){agbnp3_vfree(agbw->v3p); agbw->v3p = NULL;}
+  if(agbw->fp3){agbnp3_vfree(agbw->fp3); agbw->fp3 = NULL;}
+  if(agbw->fpp3){agbnp3_vfree(agbw->fpp3); agbw->fpp3 = NULL;}
 
   if(agbw->qdv){agbnp3_vfree(agbw->qdv); agbw->qdv = NULL;}
   if(agbw->qR1v){agbnp3_vfree(agbw->qR1v); agbw->qR1v = NULL;}
@@ -1047,14 +3496,17 @@ int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen){
   if(agbw->qfp1){agbnp3_vfree(agbw->qfp1); agbw->qfp1 = NULL;}
   if(agbw->qfp2){agbnp3_vfree(agbw->qfp2); agbw->qfp2 = NULL;}
 
-  if(agbw->wb_iatom){agbnp3_vfree(agbw->wb_iatom); agbw->wb_iatom = NULL;}
-  if(agbw->wb_gvolv){agbnp3_vfree(agbw->wb_gvolv); agbw->wb_gvolv = NULL;}
-  if(agbw->wb_gderwx){agbnp3_vfree(agbw->wb_gderwx); agbw->wb_gderwx = NULL;}
-  if(agbw->wb_gderwy){agbnp3_vfree(agbw->wb_gderwy); agbw->wb_gderwy = NULL;}
-  if(agbw->wb_gderwz){agbnp3_vfree(agbw->wb_gderwz); agbw->wb_gderwz = NULL;}
-  if(agbw->wb_gderix){agbnp3_vfree(agbw->wb_gderix); agbw->wb_gderix = NULL;}
-  if(agbw->wb_gderiy){agbnp3_vfree(agbw->wb_gderiy); agbw->wb_gderiy = NULL;}
-  if(agbw->wb_gderiz){agbnp3_vfree(agbw->wb_gderiz); agbw->wb_gderiz = NULL;}
+  if(agbw->pbx){agbnp3_vfree(agbw->pbx); agbw->pbx = NULL;}
+  if(agbw->pby){agbnp3_vfree(agbw->pby); agbw->pby = NULL;}
+  if(agbw->pbz){agbnp3_vfree(agbw->pbz); agbw->pbz = NULL;}
+  if(agbw->pbq){agbnp3_vfree(agbw->pbq); agbw->pbq = NULL;}
+  if(agbw->pbbr){agbnp3_vfree(agbw->pbbr); agbw->pbbr = NULL;}
+  if(agbw->pbdera){agbnp3_vfree(agbw->pbdera); agbw->pbdera = NULL;}
+  if(agbw->pbgx){agbnp3_vfree(agbw->pbgx); agbw->pbgx = NULL;}
+  if(agbw->pbgy){agbnp3_vfree(agbw->pbgy); agbw->pbgy = NULL;}
+  if(agbw->pbgz){agbnp3_vfree(agbw->pbgz); agbw->pbgz = NULL;}
+
+  agbnp3_delete_wsbuffers(agbw);
 
   return AGBNP_OK;
 }
@@ -1233,7 +3685,7 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   int iat; /* atomic counter */
   static const float_a rw = 1.4;  /* water radius offset for np 
 				    energy function */
-  int no_init_frozen = 0;
+  int init_frozen;
   float_a dielectric_factor = 
     -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
 
@@ -1263,6 +3715,13 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   int iproc = 0;
   int res, error = 0, nop = 0;
 
+  /* energy terms, see agbnp3_set_terms() */
+  int do_gb = agb->terms & AGBNP_TERM_GB;
+  int do_vdw = agb->terms & AGBNP_TERM_VDW;
+  int do_br = agb->terms & AGBNP_TERM_BR;
+  int do_cav = agb->terms & AGBNP_TERM_CAV;
+  int do_hb = agb->terms & AGBNP_TERM_HB;
+
 #ifdef ATIMER
   static float timer_nblist  = 0.0f;
   static float timer_volumes = 0.0f;
@@ -1278,6 +3737,44 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   float startime, endtime, fproc;
 #endif
 
+  /* decides whether to rebuild the neighbor lists. Trial moves do not
+     rebuild the Born radii pair list, which is not used by
+     agbnp3_inverse_born_radii_delta_soa() */
+  if(agb->br_nl_stale && !agb->dlt_eval){
+    agb->nblist_invalid = 1;
+    agb->br_nl_stale = 0;
+  }
+  if(agbnp3_nblist_check(agb) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_nblist_check()\n");
+    return AGBNP_ERR;
+  }
+
+  /* re-sorts the atoms if their locality has degraded, the lists are 
+     rebuilt in the new order. Not while a trial move is pending. */
+  if(agb->resort_pending && agb->nblist_update && !agb->dlt_eval &&
+     agb->dlt_state != AGBNP_DELTA_TRIAL){
+    if(agbnp3_atom_resort(agb) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_atom_resort()\n");
+      return AGBNP_ERR;
+    }
+  }
+  agb->resort_dsum = 0.0;
+  agb->resort_npairs = 0;
+
+  /* the state of agbnp3_born_radii_eval() is overwritten */
+  agb->br_ders_ok = 0;
+
+  /* the i4() cache of frozen-frozen pairs is (re)filled when the frozen
+     atoms or the settings have changed. In cutoff mode the frozen-frozen
+     pairs are not in the Born radii pair list, see
+     agbnp3_br_neighbor_list() */
+  init_frozen = agb->frozen_init;
+
+  /* positions of the heavy atoms of the symmetry mates */
+  if(agb->docryst){
+    agbnp3_sym_coordinates(agb);
+  }
+
 #ifdef _OPENMP
 #pragma omp parallel private(agbw_h, iproc, res)
 #endif
@@ -1333,11 +3830,44 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 
   if(verbose) printf("agbnp3_neighbor_lists() ...\n");
 
-  res = agbnp3_neighbor_lists(agb, agbw_h, agb->x, agb->y, agb->z);
-  if(res != AGBNP_OK){
-    agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_neighbor_lists()\n");
+  /* with a skin the lists of the previous call are reused unless
+     agbnp3_nblist_check() decided otherwise */
+  if(agb->nblist_update){
+    res = agbnp3_neighbor_lists(agb, agbw_h, agb->x, agb->y, agb->z);
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_neighbor_lists()\n");
  #pragma omp atomic
-    error += 1; 
+      error += 1;
+    }
+  }else{
+    res = agbnp3_nblist_resort(agb, agbw_h, agb->x, agb->y, agb->z);
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_nblist_resort()\n");
+ #pragma omp atomic
+      error += 1; 
+    }
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+  if(agb->nblist_update && agb->gb_roff > 0.0 && do_gb){
+    res = agbnp3_gb_neighbor_list(agb, agbw_h, agb->x, agb->y, agb->z);
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_gb_neighbor_list()\n");
+#pragma omp atomic
+      error += 1; 
+    }
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+  if(agb->nblist_update && agb->br_roff > 0.0 && do_br && !agb->dlt_eval){
+    res = agbnp3_br_neighbor_list(agb, agbw_h, agb->x, agb->y, agb->z);
+    if(res != AGBNP_OK){
+      agbnp3_errprint("agbnp3_total_energy(): error in agbnp3_br_neighbor_list()\n");
+#pragma omp atomic
+      error += 1; 
+    }
   }
 #pragma omp flush(error)
   if(error) goto ERROR;
@@ -1394,9 +3924,11 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
     /* calculates cavity energy */
     *ecav = 0.0;
     *ecorr_cav = 0.0;
-    for(i=0;i<agb->nheavyat;i++){
-      *ecav += igamma[i]*agb->surf_area[i];
-      *ecorr_cav += sgamma[i]*agb->surf_area[i];
+    if(do_cav){
+      for(i=0;i<agb->nheavyat;i++){
+	*ecav += igamma[i]*agb->surf_area[i];
+	*ecorr_cav += sgamma[i]*agb->surf_area[i];
+      }
     }
   }
 #pragma omp single
@@ -1430,8 +3962,23 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier
 #endif
 
- res = agbnp3_inverse_born_radii_nolist_soa(agb, agbw_h, agb->x, agb->y, agb->z, 
-					      no_init_frozen);
+ if(!do_br){
+   res = AGBNP_OK;
+ }else if(agb->dlt_eval){
+   res = agbnp3_inverse_born_radii_delta_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+ }else if(agb->br_roff > 0.0){
+   res = agbnp3_inverse_born_radii_nblist_soa(agb, agbw_h, agb->x, agb->y, agb->z, 
+					      init_frozen);
+ }else{
+   res = agbnp3_inverse_born_radii_nolist_soa(agb, agbw_h, agb->x, agb->y, agb->z, 
+					      init_frozen);
+ }
+ if(res == AGBNP_OK && do_br && agb->docryst){
+   res = agbnp3_inverse_born_radii_sym_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+ }
+ if(res == AGBNP_OK && do_br && agb->dogrid){
+   res = agbnp3_inverse_born_radii_grid_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+ }
  if(res != AGBNP_OK){
    agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_inverse_born_radii()\n");
  #pragma omp atomic
@@ -1446,7 +3993,7 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   //printf("%d: agbnp3_born_radii()\n",iproc);
 
 
-  res = agbnp3_born_radii(agb, agbw_h);
+  res = do_br ? agbnp3_born_radii(agb, agbw_h) : AGBNP_OK;
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_born_radii()\n");
 #pragma omp atomic
@@ -1475,17 +4022,21 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #ifdef AGBNP_VDW_PRINT
       agbnp3_errprint("Id Bradius alpha*a 1/(B+Rw)^3 alpha*a/(B+Rw)^3\n");
 #endif
-    for(iat=0;iat<natoms;iat++){
-      a = 1.0/(agb->br[iat]+rw);
-      a = pow(a,3);
-      *evdw += (ialpha[iat]*a + idelta[iat]);
-      *ecorr_vdw += (salpha[iat]*a + sdelta[iat]);
+    if(do_vdw){
+      for(iat=0;iat<natoms;iat++){
+	a = 1.0/(agb->br[iat]+rw);
+	a = pow(a,3);
+	*evdw += (ialpha[iat]*a + idelta[iat]);
+	*ecorr_vdw += (salpha[iat]*a + sdelta[iat]);
 #ifdef AGBNP_VDW_PRINT
-      agbnp3_errprint("VDW: %d %f %f %f %f\n",iat+1,agb->br[iat],ialpha[iat],a,ialpha[iat]*a);
+	agbnp3_errprint("VDW: %d %f %f %f %f\n",iat+1,agb->br[iat],ialpha[iat],a,ialpha[iat]*a);
 #endif
+      }
     }
   }
 
+  /* Born radii only, see agbnp3_born_radii_eval() */
+  if(agb->br_only) goto DONE;
 
   /*                                                                 */
   /* Evaluates solvation energy, Ai's and derivatives of GB energy   */
@@ -1500,8 +4051,20 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier
 #endif
 
-  res = agbnp3_gb_energy_nolist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+  if(!do_gb){
+    /* only the auxiliary quantities of the van der Waals term */
+    res = agbnp3_gb_energy_reduce(agb, agbw_h, 0.0f, 0.0f, 
+				  &egb_self, &egb_pair);
+  }else if(agb->gb_roff > 0.0){
+    res = agbnp3_gb_energy_nblist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+				     &egb_self, &egb_pair);
+  }else if(agb->gb_tree_theta > 0.0){
+    res = agbnp3_gb_energy_tree_soa(agb, agbw_h, agb->x, agb->y, agb->z, 
+				    &egb_self, &egb_pair);
+  }else{
+    res = agbnp3_gb_energy_nolist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
 				     &egb_self, &egb_pair);
+  }
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_gb_energy()\n");
 #pragma omp atomic
@@ -1539,8 +4102,25 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier
 #endif
 
-  res = agbnp3_gb_ders_constvp_nolist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
-					   no_init_frozen);
+  /* trial moves (agbnp3_ener_delta()) and energy-only evaluations 
+     need no derivatives */
+  if(agb->dlt_eval || agb->ener_only || !do_br){
+    res = AGBNP_OK;
+  }else if(agb->br_roff > 0.0){
+    res = agbnp3_gb_ders_constvp_nblist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+					   init_frozen);
+  }else{
+    res = agbnp3_gb_ders_constvp_nolist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+					   init_frozen);
+  }
+  if(res == AGBNP_OK && !agb->dlt_eval && !agb->ener_only && do_br && 
+     agb->docryst){
+    res = agbnp3_gb_ders_sym_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+  }
+  if(res == AGBNP_OK && !agb->dlt_eval && !agb->ener_only && do_br && 
+     agb->dogrid){
+    res = agbnp3_gb_ders_grid_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+  }
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_gb_ders_constvp()\n");
  #pragma omp atomic
@@ -1569,7 +4149,13 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier 
 #endif
 
-  res = agbnp3_create_wsatoms(agb, agbw_h);
+  if(!do_hb){
+    res = AGBNP_OK;
+  }else if(agb->dlt_local == AGBNP_LOCAL_TRIAL){
+    res = agbnp3_delta_wsatoms(agb, agbw_h);
+  }else{
+    res = agbnp3_create_wsatoms(agb, agbw_h);
+  }
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_create_wsatoms()\n");
  #pragma omp atomic
@@ -1585,7 +4171,7 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   
   if(verbose) printf("agbnp3_ws_free_volumes_scalev_ps() ...\n");
 
-  res = agbnp3_ws_free_volumes_scalev_ps(agb, agbw_h);
+  res = do_hb ? agbnp3_ws_free_volumes_scalev_ps(agb, agbw_h) : AGBNP_OK;
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_ws_free_volumes_scalev(agb)\n");
  #pragma omp atomic
@@ -1595,7 +4181,7 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   if(error) goto ERROR;
 
 #pragma omp critical
-  if(agb->verbose)
+  if(agb->verbose && do_hb)
   {
     int iws;
     float xa = AGBNP_HB_SWA;
@@ -1621,6 +4207,8 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   }
 #endif
 
+  if(agb->dlt_eval || agb->ener_only) goto DONE;
+
   /*                                                   */
   /*             evaluation of Ui's and Vi's           */
   /*                                                   */
@@ -1630,7 +4218,13 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier 
 #endif
 
-  res = agbnp3_gb_deruv_nolist_ps(agb, agbw_h, no_init_frozen);
+  if(!do_br){
+    res = AGBNP_OK;
+  }else if(agb->br_roff > 0.0){
+    res = agbnp3_gb_deruv_nblist_ps(agb, agbw_h, init_frozen);
+  }else{
+    res = agbnp3_gb_deruv_nolist_ps(agb, agbw_h, init_frozen);
+  }
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_gb_deruv_nolist_ps()\n");
 #pragma omp atomic
@@ -1655,7 +4249,9 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier 
 #endif
 
-  res = agbnp3_der_vp_rooti(agb, agbw_h, agb->x, agb->y, agb->z);
+  /* through the Born radii and the water sites */
+  res = (do_br || do_hb) ? 
+    agbnp3_der_vp_rooti(agb, agbw_h, agb->x, agb->y, agb->z) : AGBNP_OK;
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_der_vp()\n");
 #pragma omp atomic
@@ -1681,7 +4277,8 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
 #pragma omp barrier 
 #endif
 
-  res = agbnp3_cavity_dersgb_rooti(agb, agbw_h, agb->x, agb->y, agb->z);
+  res = (do_br || do_cav) ? 
+    agbnp3_cavity_dersgb_rooti(agb, agbw_h, agb->x, agb->y, agb->z) : AGBNP_OK;
   if(res != AGBNP_OK){
     agbnp3_errprint( "agbnp3_total_energy(): error in agbnp3_cavity_dersgb()\n");
 #pragma omp atomic
@@ -1755,16 +4352,49 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   }/* #pragma omp parallel */
 
   if(error){
+    /* lists and caches may be incomplete */
+    agb->nblist_invalid = 1;
+    agb->frozen_init = 1;
     return AGBNP_ERR;
   }
 
+  if(agb->dlt_eval){
+    /* trial move, see agbnp3_ener_delta() */
+    agb->dlt_ener[0] = *egb;
+    agb->dlt_ener[1] = *evdw;
+    agb->dlt_ener[2] = *ecorr_vdw;
+    agb->dlt_ener[3] = *ecav;
+    agb->dlt_ener[4] = *ecorr_cav;
+    agb->dlt_ener[5] = *ehb = agb->ehb;
+    agb->dlt_ehblig = agb->bnd_ehb_lig;
+    if(agb->nblist_update && agb->br_roff > 0.0) agb->br_nl_stale = 1;
+    agb->dlt_state = AGBNP_DELTA_TRIAL;
+    if(init_frozen) agb->frozen_init = 1;
+    return AGBNP_OK;
+  }
+
   /* return derivatives */
-  for(iat=0;iat<natoms;iat++){
-    for(ki=0;ki<3;ki++){
-      agb->dgbdr[iat][ki] = tokcalmol*agbw->dgbdr_h[iat][ki];
-      agb->dvwdr[iat][ki] = agbw->dvwdr_h[iat][ki];
-      agb->decav[iat][ki] = agbw->decav_h[iat][ki];
-      agb->dehb[iat][ki]  = agbw->dehb[iat][ki];
+  if(!agb->ener_only && !agb->br_only){
+    for(iat=0;iat<natoms;iat++){
+      for(ki=0;ki<3;ki++){
+	agb->dgbdr[iat][ki] = tokcalmol*agbw->dgbdr_h[iat][ki];
+	agb->dvwdr[iat][ki] = agbw->dvwdr_h[iat][ki];
+	agb->decav[iat][ki] = agbw->decav_h[iat][ki];
+	agb->dehb[iat][ki]  = agbw->dehb[iat][ki];
+      }
+    }
+    /* the frozen-frozen terms of the derivatives of frozen atoms are
+       skipped (see agbnp3_set_frozen()), they are returned as zero */
+    if(agb->do_frozen){
+      for(iat=0;iat<natoms;iat++){
+	if(!agb->isfrozen[iat]) continue;
+	for(ki=0;ki<3;ki++){
+	  agb->dgbdr[iat][ki] = 0.0;
+	  agb->dvwdr[iat][ki] = 0.0;
+	  agb->decav[iat][ki] = 0.0;
+	  agb->dehb[iat][ki]  = 0.0;
+	}
+      }
     }
   }
 
@@ -1785,6 +4415,37 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   // HB energy
   *ehb = agb->ehb;
 
+  agb->frozen_init = 0;
+
+  if(agb->br_only){
+    /* derivatives are available from agbnp3_born_radii_ders(). The 
+       inverse Born radii of agbnp3_ener_delta() were overwritten */
+    agb->br_ders_ok = 1;
+    if(agb->dlt_state == AGBNP_DELTA_REF) agb->dlt_state = AGBNP_DELTA_NONE;
+  }
+
+  /* locality of the atom order, see agbnp3_set_atom_resort() */
+  if(agb->resort_factor > 0.0 && agb->nblist_update && agb->resort_npairs > 0){
+    float_a metric = agb->resort_dsum/agb->resort_npairs;
+    if(agb->resort_ref <= 0.0){
+      agb->resort_ref = metric;
+    }else if(metric > agb->resort_factor*agb->resort_ref){
+      agb->resort_pending = 1;
+    }
+  }
+
+  /* new reference state for agbnp3_ener_delta() */
+  if(agb->dlt_br1 && !agb->br_only){
+    agb->dlt_ener[0] = *egb;
+    agb->dlt_ener[1] = *evdw;
+    agb->dlt_ener[2] = *ecorr_vdw;
+    agb->dlt_ener[3] = *ecav;
+    agb->dlt_ener[4] = *ecorr_cav;
+    agb->dlt_ener[5] = *ehb;
+    agb->dlt_ehblig = agb->bnd_ehb_lig;
+    agbnp3_delta_reference(agb, 1);
+  }
+
 #ifdef ATIMER
   timecounter += 1;
   if(timecounter%100==0){
@@ -1815,6 +4476,137 @@ int agbnp3_total_energy(AGBNPdata *agb, int init,
   return AGBNP_OK;
 }
 
+/* chain rule of the Born radii evaluated by agbnp3_total_energy() in 
+   br_only mode: given dedb[] = dE/dB_i (external order) accumulates 
+   dE/dr in agbw->dvwdr_h. The van der Waals auxiliary quantities abrw[] 
+   are replaced by -B_i^2 dE/dB_i times the derivative of the inverse Born 
+   radius filter, so that the derivative kernels of the van der Waals 
+   energy return the gradient of E, and q2ab[] (GB) is set to zero. */
+int agbnp3_born_radii_chain(AGBNPdata *agb, float_i *dedb){
+  int natoms = agb->natoms;
+  int *int2ext = agb->int2ext;
+  AGBworkdata *agbw = agb->agbw; /* shared work space */
+  AGBworkdata *agbw_h;           /* work space for this thread */
+  int iproc = 0;
+  int res, error = 0, nop = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel private(agbw_h, iproc, res)
+#endif
+  {
+  int iat, i;
+
+#ifdef _OPENMP
+  iproc = omp_get_thread_num();
+  agbw_h = agb->agbw_p[iproc];
+#else
+  agbw_h = agbw;
+#endif
+
+  res = agbnp3_reset_derivatives(agb, agbw_h);
+  if(res != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_born_radii_chain(): error in agbnp3_reset_derivatives\n");
+#pragma omp atomic
+    error += 1; 
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+#pragma omp single
+  {
+    float_a *br = agbw->br;
+    float_a *br1_swf_der = agbw->br1_swf_der;
+    float_a *q2ab = agbw->q2ab;
+    float_a *abrw = agbw->abrw;
+    for(iat=0;iat<natoms;iat++){
+      q2ab[iat] = 0.0;
+      abrw[iat] = -br[iat]*br[iat]*dedb[int2ext[iat]]*br1_swf_der[iat];
+    }
+  }
+
+#ifdef _OPENMP
+  memcpy(agbw_h->q2ab, agbw->q2ab, natoms*sizeof(float));
+  memcpy(agbw_h->abrw, agbw->abrw, natoms*sizeof(float));
+#endif
+
+  /* the i4() cache was filled by the Born radii evaluation */
+  if(agb->br_roff > 0.0){
+    res = agbnp3_gb_ders_constvp_nblist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+					   0);
+  }else{
+    res = agbnp3_gb_ders_constvp_nolist_ps(agb, agbw_h, agb->x, agb->y, agb->z, 
+					   0);
+  }
+  if(res == AGBNP_OK && agb->docryst){
+    res = agbnp3_gb_ders_sym_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+  }
+  if(res == AGBNP_OK && agb->dogrid){
+    res = agbnp3_gb_ders_grid_soa(agb, agbw_h, agb->x, agb->y, agb->z);
+  }
+  if(res != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_born_radii_chain(): error in agbnp3_gb_ders_constvp()\n");
+#pragma omp atomic
+    error += 1; 
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+  if(agb->br_roff > 0.0){
+    res = agbnp3_gb_deruv_nblist_ps(agb, agbw_h, 0);
+  }else{
+    res = agbnp3_gb_deruv_nolist_ps(agb, agbw_h, 0);
+  }
+  if(res != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_born_radii_chain(): error in agbnp3_gb_deruv()\n");
+#pragma omp atomic
+    error += 1; 
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+  /* changes of the Born radii due to changes of the self volumes */
+  res = agbnp3_der_vp_rooti(agb, agbw_h, agb->x, agb->y, agb->z);
+  if(res != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_born_radii_chain(): error in agbnp3_der_vp()\n");
+#pragma omp atomic
+    error += 1; 
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+  res = agbnp3_cavity_dersgb_rooti(agb, agbw_h, agb->x, agb->y, agb->z);
+  if(res != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_born_radii_chain(): error in agbnp3_cavity_dersgb()\n");
+#pragma omp atomic
+    error += 1; 
+  }
+#pragma omp flush(error)
+  if(error) goto ERROR;
+
+#ifdef _OPENMP
+  /* reduction of derivatives */
+#pragma omp critical
+  for(iat=0;iat<natoms;iat++){
+    for(i=0;i<3;i++){
+      agbw->dvwdr_h[iat][i] += agbw_h->dvwdr_h[iat][i];
+    }
+  }
+#pragma omp barrier
+#endif
+
+  ERROR:
+  nop;
+
+  }/* #pragma omp parallel */
+
+  if(error){
+    agb->br_ders_ok = 0;
+    return AGBNP_ERR;
+  }
+
+  return AGBNP_OK;
+}
+
 /* clear contents of water site, frees associated neighbor list */
 int agbnp3_clr_wsat(WSat *wsat){
   if(wsat->nlist){
@@ -1899,6 +4691,13 @@ int agbnp3_create_wsatoms(AGBNPdata *agb, AGBworkdata *agbw){
     }
   }
 
+  /* place the ws atoms of this thread */
+  agbw->nwsdlt = 0;
+  if(!error && agbnp3_update_wsatoms(agb, agbw, agbw->nwsat, NULL) != AGBNP_OK){
+    agbnp3_errprint( "agbnp3_create_watoms(): error in agbnp3_update_wsatoms()\n");
+    error = 1;
+  }
+
   /* clean up temporary ws buffer */
   for(iws = 0; iws < 4; iws++){
     twsat = &(twsatb[iws]);
@@ -1914,6 +4713,315 @@ int agbnp3_create_wsatoms(AGBNPdata *agb, AGBworkdata *agbw){
 }
 
 
+/* water sites of this thread affected by a trial move of
+   agbnp3_ener_delta(): the ws atoms of the moved atoms, which are placed
+   again, followed by those overlapping moved atoms or atoms whose self
+   volume changed. They are listed in agbw->wsdlt and their reference
+   state is saved for agbnp3_delta_restore(). */
+int agbnp3_delta_wsatoms(AGBNPdata *agb, AGBworkdata *agbw){
+  int *ismoved = agb->dlt_ismoved;
+  int *cand = agbw->nlist;
+  int ncand = 0, nmv, ok, iws, iat, i, p;
+  float_a dx, dy, dz, d2, u;
+  WSat *wsat;
+
+  /* heavy atoms that moved or whose self volume changed */
+  for(iat=0;iat<agb->nheavyat;iat++){
+    if(ismoved[iat] ||
+       fabs(agbw->spe[iat] - agb->dlt_speref[iat]) > AGBNP_DELTA_SPTOL){
+      cand[ncand++] = iat;
+    }
+  }
+
+  if(agbw->wsdlt_size < agbw->wsat_size){
+    agbw->wsdlt_size = agbw->wsat_size;
+    agbw->wsdlt = (int *)realloc(agbw->wsdlt, agbw->wsdlt_size*sizeof(int));
+    agbw->wsdlt_save = (WSat *)realloc(agbw->wsdlt_save,
+				       agbw->wsdlt_size*sizeof(WSat));
+    if(!(agbw->wsdlt && agbw->wsdlt_save)){
+      agbnp3_errprint("agbnp3_delta_wsatoms(): unable to allocate list of ws atoms (%d)\n", agbw->wsdlt_size);
+      agbw->wsdlt_size = 0;
+      return AGBNP_ERR;
+    }
+  }
+
+  agbw->nwsdlt = 0;
+  for(iws=0;iws<agbw->nwsat;iws++){
+    wsat = &(agbw->wsat[iws]);
+    for(p=0;p<wsat->nparents;p++){
+      if(ismoved[wsat->parent[p]]) break;
+    }
+    if(p < wsat->nparents) agbw->wsdlt[agbw->nwsdlt++] = iws;
+  }
+  nmv = agbw->nwsdlt;
+  for(iws=0;iws<agbw->nwsat;iws++){
+    wsat = &(agbw->wsat[iws]);
+    for(p=0;p<wsat->nparents;p++){
+      if(ismoved[wsat->parent[p]]) break;
+    }
+    if(p < wsat->nparents) continue;
+    ok = 0;
+    for(i=0; !ok && i<ncand; i++){
+      iat = cand[i];
+      u = (agb->r[iat]+wsat->r)*AGBNP_NBOFFSET;
+      dx = agb->x[iat] - wsat->pos[0];
+      dy = agb->y[iat] - wsat->pos[1];
+      dz = agb->z[iat] - wsat->pos[2];
+      d2 = dx*dx + dy*dy + dz*dz;
+      ok = (d2 < u*u);
+      if(!ok && ismoved[iat]){
+	dx = agb->dlt_xref[iat] - wsat->pos[0];
+	dy = agb->dlt_yref[iat] - wsat->pos[1];
+	dz = agb->dlt_zref[iat] - wsat->pos[2];
+	d2 = dx*dx + dy*dy + dz*dz;
+	ok = (d2 < u*u);
+      }
+    }
+    if(ok) agbw->wsdlt[agbw->nwsdlt++] = iws;
+  }
+
+  for(i=0;i<agbw->nwsdlt;i++){
+    agbw->wsdlt_save[i] = agbw->wsat[agbw->wsdlt[i]];
+  }
+
+  return agbnp3_update_wsatoms(agb, agbw, nmv, agbw->wsdlt);
+}
+
+/* restores the water sites changed by the trial move of
+   agbnp3_ener_delta() */
+void agbnp3_delta_restore(AGBNPdata *agb){
+  int iproc, nprocs = 1, i;
+  AGBworkdata *agbw;
+
+#ifdef _OPENMP
+  nprocs = agb->nprocs;
+#endif
+  for(iproc=0;iproc<nprocs;iproc++){
+#ifdef _OPENMP
+    agbw = agb->agbw_p[iproc];
+#else
+    agbw = agb->agbw;
+#endif
+    for(i=0;i<agbw->nwsdlt;i++){
+      agbw->wsat[agbw->wsdlt[i]] = agbw->wsdlt_save[i];
+    }
+    agbw->nwsdlt = 0;
+    agbw->nsvroots = 0;
+  }
+}
+
+/* number of water sites and of parents of the placements of each kind 
+   (AGBNP_WSPLACE_*) */
+static const int agbnp3_wsplace_nsites[AGBNP_WSPLACE_NKINDS] = 
+  {1, 2, 2, 2, 1, 2, 1, 1};
+static const int agbnp3_wsplace_nparents[AGBNP_WSPLACE_NKINDS] = 
+  {2, 4, 4, 4, 3, 3, 4, 3};
+
+/* placement kind of a ws atom, -1 if it is placed together with 
+   the ws atom preceding it */
+static int agbnp3_wsplace_kind(WSat *wsat){
+  switch(wsat->type){
+  case AGBNP_HB_POLARH:
+    return AGBNP_WSPLACE_HYDROGEN;
+  case AGBNP_HB_TRIGONAL1:
+    return wsat->iseq == 0 ? AGBNP_WSPLACE_TRIGONAL1 : -1;
+  case AGBNP_HB_TRIGONAL_S:
+    if(wsat->iseq == 0) return AGBNP_WSPLACE_TRIGONAL1;
+    if(wsat->iseq == 2) return AGBNP_WSPLACE_TRIGONAL_S;
+    return -1;
+  case AGBNP_HB_TRIGONAL_OOP:
+    return wsat->iseq == 0 ? AGBNP_WSPLACE_TRIGONAL_OOP : -1;
+  case AGBNP_HB_TRIGONAL2:
+    return AGBNP_WSPLACE_TRIGONAL2;
+  case AGBNP_HB_TETRAHEDRAL2:
+    return wsat->iseq == 0 ? AGBNP_WSPLACE_TETRAHEDRAL2 : -1;
+  case AGBNP_HB_TETRAHEDRAL3:
+    return AGBNP_WSPLACE_TETRAHEDRAL3;
+  case AGBNP_HB_TETRAHEDRAL1:
+    return AGBNP_WSPLACE_TETRAHEDRAL1;
+  default:
+    return -1;
+  }
+}
+
+/* places the water sites of n placements of the same kind, wsat[k] is
+   the first ws atom of placement k, the others follow it in the list */
+static void agbnp3_place_wsat_batch(AGBNPdata *agb, int kind, int n, 
+				    WSat **wsat){
+  const int ld = AGBNP_WSPLACE_BATCH;
+  float px[4*AGBNP_WSPLACE_BATCH];
+  float py[4*AGBNP_WSPLACE_BATCH];
+  float pz[4*AGBNP_WSPLACE_BATCH];
+  float w[2*3*AGBNP_WSPLACE_BATCH];
+  float der[2*36*AGBNP_WSPLACE_BATCH];
+  int np = agbnp3_wsplace_nparents[kind];
+  int ns = agbnp3_wsplace_nsites[kind];
+  int m = (n + 3) & ~3;
+  int k, p, s, i, iat;
+  WSat *ws;
+  float_a *dpos;
+
+  /* gather the coordinates of the parents, the lanes past n repeat
+     the last placement */
+  for(k=0;k<m;k++){
+    ws = wsat[k < n ? k : n-1];
+    for(p=0;p<np;p++){
+      iat = ws->parent[p];
+      px[p*ld+k] = agb->x[iat];
+      py[p*ld+k] = agb->y[iat];
+      pz[p*ld+k] = agb->z[iat];
+    }
+  }
+
+#ifdef USE_SSE
+  agbnp3_place_wat_batch_ps(kind, m, (float)AGBNP_HB_LENGTH, 
+			    px, py, pz, w, der);
+#else
+  agbnp3_place_wat_batch_soa(kind, m, (float)AGBNP_HB_LENGTH, 
+			     px, py, pz, w, der);
+#endif
+
+  /* scatter positions and gradients to the ws atoms */
+  for(k=0;k<n;k++){
+    for(s=0;s<ns;s++){
+      ws = wsat[k] + s;
+      for(i=0;i<3;i++){
+	ws->pos[i] = w[(s*3+i)*ld+k];
+      }
+      dpos = &(ws->dpos[0][0][0]);
+      for(i=0;i<9*np;i++){
+	dpos[i] = der[(s*36+i)*ld+k];
+      }
+    }
+  }
+}
+
+/* places the ws atoms agbw->wsat[sites[k]], k < nsites, (all of them
+   if sites is NULL) at the current positions of their parents. The
+   placements of each geometry are collected in batches of
+   AGBNP_WSPLACE_BATCH evaluated by the SoA kernels */
+int agbnp3_update_wsatoms(AGBNPdata *agb, AGBworkdata *agbw,
+			  int nsites, int *sites){
+  WSat *batch[AGBNP_WSPLACE_NKINDS][AGBNP_WSPLACE_BATCH];
+  int nb[AGBNP_WSPLACE_NKINDS];
+  int k, iws, kind;
+
+  for(kind = 0; kind < AGBNP_WSPLACE_NKINDS; kind++){
+    nb[kind] = 0;
+  }
+  for(k = 0; k < nsites; k++){
+    iws = sites ? sites[k] : k;
+    kind = agbnp3_wsplace_kind(&(agbw->wsat[iws]));
+    if(kind < 0) continue;
+    batch[kind][nb[kind]++] = &(agbw->wsat[iws]);
+    if(nb[kind] == AGBNP_WSPLACE_BATCH){
+      agbnp3_place_wsat_batch(agb, kind, nb[kind], batch[kind]);
+      nb[kind] = 0;
+    }
+  }
+  for(kind = 0; kind < AGBNP_WSPLACE_NKINDS; kind++){
+    if(nb[kind] > 0){
+      agbnp3_place_wsat_batch(agb, kind, nb[kind], batch[kind]);
+    }
+  }
+
+  return AGBNP_OK;
+}
+
+/* scalar version of agbnp3_place_wat_batch_ps(), same array layout */
+void agbnp3_place_wat_batch_soa(int kind, int n, float d, 
+				float *px, float *py, float *pz,
+				float *w, float *der){
+  const int ld = AGBNP_WSPLACE_BATCH;
+  int np = agbnp3_wsplace_nparents[kind];
+  int ns = agbnp3_wsplace_nsites[kind];
+  float_a xp[4][3], xw[2][3], dw[2][4][3][3];
+  float_a *dpos;
+  int k, p, s, i;
+
+  for(k=0;k<n;k++){
+    for(p=0;p<np;p++){
+      xp[p][0] = px[p*ld+k];
+      xp[p][1] = py[p*ld+k];
+      xp[p][2] = pz[p*ld+k];
+    }
+    switch(kind){
+    case AGBNP_WSPLACE_HYDROGEN:
+      agbnp3_place_wat_hydrogen(xp[1][0], xp[1][1], xp[1][2],
+				xp[0][0], xp[0][1], xp[0][2], d,
+				&xw[0][0], &xw[0][1], &xw[0][2],
+				dw[0][0], dw[0][1]);
+      break;
+    case AGBNP_WSPLACE_TRIGONAL1:
+      agbnp3_place_wat_trigonal1(xp[0][0], xp[0][1], xp[0][2],
+				 xp[1][0], xp[1][1], xp[1][2],
+				 xp[2][0], xp[2][1], xp[2][2],
+				 xp[3][0], xp[3][1], xp[3][2], d,
+				 &xw[0][0], &xw[0][1], &xw[0][2],
+				 &xw[1][0], &xw[1][1], &xw[1][2],
+				 dw[0], dw[1]);
+      break;
+    case AGBNP_WSPLACE_TRIGONAL_S:
+      agbnp3_place_wat_trigonal_s(xp[0][0], xp[0][1], xp[0][2],
+				  xp[1][0], xp[1][1], xp[1][2],
+				  xp[2][0], xp[2][1], xp[2][2],
+				  xp[3][0], xp[3][1], xp[3][2], d,
+				  &xw[0][0], &xw[0][1], &xw[0][2],
+				  &xw[1][0], &xw[1][1], &xw[1][2],
+				  dw[0], dw[1]);
+      break;
+    case AGBNP_WSPLACE_TRIGONAL_OOP:
+      agbnp3_place_wat_trigonal_oop(xp[0][0], xp[0][1], xp[0][2],
+				    xp[1][0], xp[1][1], xp[1][2],
+				    xp[2][0], xp[2][1], xp[2][2],
+				    xp[3][0], xp[3][1], xp[3][2], d,
+				    &xw[0][0], &xw[0][1], &xw[0][2],
+				    &xw[1][0], &xw[1][1], &xw[1][2],
+				    dw[0], dw[1]);
+      break;
+    case AGBNP_WSPLACE_TRIGONAL2:
+      agbnp3_place_wat_trigonal2(xp[0][0], xp[0][1], xp[0][2],
+				 xp[1][0], xp[1][1], xp[1][2],
+				 xp[2][0], xp[2][1], xp[2][2], d,
+				 &xw[0][0], &xw[0][1], &xw[0][2],
+				 dw[0]);
+      break;
+    case AGBNP_WSPLACE_TETRAHEDRAL2:
+      agbnp3_place_wat_tetrahedral2(xp[0][0], xp[0][1], xp[0][2],
+				    xp[1][0], xp[1][1], xp[1][2],
+				    xp[2][0], xp[2][1], xp[2][2], d,
+				    &xw[0][0], &xw[0][1], &xw[0][2],
+				    &xw[1][0], &xw[1][1], &xw[1][2],
+				    dw[0], dw[1]);
+      break;
+    case AGBNP_WSPLACE_TETRAHEDRAL3:
+      agbnp3_place_wat_tetrahedral3(xp[0][0], xp[0][1], xp[0][2],
+				    xp[1][0], xp[1][1], xp[1][2],
+				    xp[2][0], xp[2][1], xp[2][2],
+				    xp[3][0], xp[3][1], xp[3][2], d,
+				    &xw[0][0], &xw[0][1], &xw[0][2],
+				    dw[0]);
+      break;
+    case AGBNP_WSPLACE_TETRAHEDRAL1:
+      agbnp3_place_wat_tetrahedral1_one(xp[0][0], xp[0][1], xp[0][2],
+					xp[1][0], xp[1][1], xp[1][2],
+					xp[2][0], xp[2][1], xp[2][2], d,
+					xw[0], dw[0]);
+      break;
+    }
+    for(s=0;s<ns;s++){
+      for(i=0;i<3;i++){
+	w[(s*3+i)*ld+k] = xw[s][i];
+      }
+      dpos = &(dw[s][0][0][0]);
+      for(i=0;i<9*np;i++){
+	der[(s*36+i)*ld+k] = dpos[i];
+      }
+    }
+  }
+}
+
+
 /* create water sites pseudo atoms for atom iat, stores ws atoms
    starting at location iws and returns the number of added ws atoms
    in nws */
@@ -2014,14 +5122,9 @@ int agbnp3_create_ws_ofatom(AGBNPdata *agb, int iat, int *nws, WSat *twsatb){
 int agbnp3_create_ws_atoms_ph(AGBNPdata *agb, int iat, 
 			      int *nws, WSat *twsatb){
   int jat = -1; /* heavy atom the hydrogen is attached to */
-  int i, j;
-  float_a xw, yw, zw;
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
+  int i;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
-  float_a der1[3][3], der2[3][3];
 
   if(conntbl->nne[iat] <= 0){
     /*
@@ -2044,29 +5147,15 @@ int agbnp3_create_ws_atoms_ph(AGBNPdata *agb, int iat,
     agbnp3_errprint( "agbnp3_create_ws_atoms_ph(): unable to find parent heavy atom of atom %d.\n", iat);
     return AGBNP_ERR;
   }
-  agbnp3_place_wat_hydrogen(x[jat],y[jat],z[jat],
-			   x[iat],y[iat],z[iat],
-			   (float_a)AGBNP_HB_LENGTH,
-			   &xw, &yw, &zw,
-			   der1, der2);
   /* stores water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw;
-  wsat->pos[1] = yw;
-  wsat->pos[2] = zw;  
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_POLARH;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
   wsat->nparents = 2;
   wsat->parent[0] = iat;
   wsat->parent[1] = jat;
-  wsat->iseq = 0; 
-  for(i=0;i<3;i++){
-    for(j=0;j<3;j++){
-      wsat->dpos[0][i][j] = der1[i][j];
-      wsat->dpos[1][i][j] = der2[i][j];
-    }
-  }
+  wsat->iseq = 0; 
   wsat->khb = agb->hbcorr[iat];
 
   *nws = 1;
@@ -2153,14 +5242,8 @@ int agbnp3_create_ws_atoms_trigonal1(AGBNPdata *agb, int iat,
 				     int *nws, WSat *twsatb){
   int i;
   int ir, ir1, ir2;
-  float_a xw1, yw1, zw1;
-  float_a xw2, yw2, zw2;
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
-  float_a der1[4][3][3], der2[4][3][3];
   /* assumed trigonal topology:
 
        R1
@@ -2211,19 +5294,8 @@ int agbnp3_create_ws_atoms_trigonal1(AGBNPdata *agb, int iat,
     }
     ir2 = conntbl->neighl[ir][i++];
   } 
-  agbnp3_place_wat_trigonal1(x[iat],y[iat],z[iat],
-			     x[ir],y[ir],z[ir],
-			     x[ir1],y[ir1],z[ir1],
-			     x[ir2],y[ir2],z[ir2],
-			     (float_a)AGBNP_HB_LENGTH,
-			     &xw1, &yw1, &zw1,
-			     &xw2, &yw2, &zw2,
-			     der1, der2);
   /* stores water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw1;
-  wsat->pos[1] = yw1;
-  wsat->pos[2] = zw1;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL1;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2233,13 +5305,9 @@ int agbnp3_create_ws_atoms_trigonal1(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;
   wsat->iseq = 0;
-  memcpy(wsat->dpos,der1,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   wsat = &(twsatb[1]);
-  wsat->pos[0] = xw2;
-  wsat->pos[1] = yw2;
-  wsat->pos[2] = zw2;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL1;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2249,7 +5317,6 @@ int agbnp3_create_ws_atoms_trigonal1(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;  
   wsat->iseq = 1;
-  memcpy(wsat->dpos,der2,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   *nws = 2;
@@ -2383,14 +5450,8 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
 				      int *nws, WSat *twsatb){
   int i;
   int ir, ir1, ir2;
-  float_a xw1, yw1, zw1;
-  float_a xw2, yw2, zw2;
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
-  float_a der1[4][3][3], der2[4][3][3];
   /* assumed trigonal topology:
 
        R1
@@ -2442,20 +5503,8 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
     ir2 = conntbl->neighl[ir][i++];
   } 
 
-  /* place first two water sites (in plane) */
-  agbnp3_place_wat_trigonal1(x[iat],y[iat],z[iat],
-			     x[ir],y[ir],z[ir],
-			     x[ir1],y[ir1],z[ir1],
-			     x[ir2],y[ir2],z[ir2],
-			     (float_a)AGBNP_HB_LENGTH,
-			     &xw1, &yw1, &zw1,
-			     &xw2, &yw2, &zw2,
-			     der1, der2);
   /* stores first two water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw1;
-  wsat->pos[1] = yw1;
-  wsat->pos[2] = zw1;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_S;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2465,13 +5514,9 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;
   wsat->iseq = 0;
-  memcpy(wsat->dpos,der1,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   wsat = &(twsatb[1]);
-  wsat->pos[0] = xw2;
-  wsat->pos[1] = yw2;
-  wsat->pos[2] = zw2;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_S;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2481,23 +5526,10 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;  
   wsat->iseq = 1;
-  memcpy(wsat->dpos,der2,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
-  /* places second set of water sites (out of plane) */
-  agbnp3_place_wat_trigonal_s(x[iat],y[iat],z[iat],
-			     x[ir],y[ir],z[ir],
-			     x[ir1],y[ir1],z[ir1],
-			     x[ir2],y[ir2],z[ir2],
-			     (float_a)AGBNP_HB_LENGTH,
-			     &xw1, &yw1, &zw1,
-			     &xw2, &yw2, &zw2,
-			     der1, der2);
   /* stores second set of water sites */
   wsat = &(twsatb[2]);
-  wsat->pos[0] = xw1;
-  wsat->pos[1] = yw1;
-  wsat->pos[2] = zw1;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_S;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2507,13 +5539,9 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;
   wsat->iseq = 2;
-  memcpy(wsat->dpos,der1,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   wsat = &(twsatb[3]);
-  wsat->pos[0] = xw2;
-  wsat->pos[1] = yw2;
-  wsat->pos[2] = zw2;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_S;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2523,7 +5551,6 @@ int agbnp3_create_ws_atoms_trigonal_s(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->parent[3] = ir2;  
   wsat->iseq = 3;
-  memcpy(wsat->dpos,der2,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   *nws = 4;
@@ -2702,14 +5729,8 @@ int agbnp3_create_ws_atoms_trigonal_oop(AGBNPdata *agb, int iat,
 					int *nws, WSat *twsatb){
   int i, p, ii, jj;
   int ia, ir1, ir2, ir3;
-  float_a xw1, yw1, zw1;
-  float_a xw2, yw2, zw2;
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
-  float_a der1[4][3][3], der2[4][3][3];
   /* assumed trigonal topology:
 
        R1
@@ -2728,19 +5749,8 @@ int agbnp3_create_ws_atoms_trigonal_oop(AGBNPdata *agb, int iat,
   ir1 = conntbl->neighl[iat][0];
   ir2 = conntbl->neighl[iat][1];
   ir3 = conntbl->neighl[iat][2];
-  agbnp3_place_wat_trigonal_oop(x[iat],y[iat],z[iat],
-				x[ir1],y[ir1],z[ir1],
-				x[ir2],y[ir2],z[ir2],
-				x[ir3],y[ir3],z[ir3],
-				(float_a)AGBNP_HB_LENGTH,
-				&xw1, &yw1, &zw1,
-				&xw2, &yw2, &zw2,
-				der1, der2);
   /* stores water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw1;
-  wsat->pos[1] = yw1;
-  wsat->pos[2] = zw1;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_OOP;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2750,13 +5760,9 @@ int agbnp3_create_ws_atoms_trigonal_oop(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->parent[3] = ir3;
   wsat->iseq = 0;
-  memcpy(wsat->dpos,der1,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   wsat = &(twsatb[1]);
-  wsat->pos[0] = xw2;
-  wsat->pos[1] = yw2;
-  wsat->pos[2] = zw2;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL_OOP;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2766,7 +5772,6 @@ int agbnp3_create_ws_atoms_trigonal_oop(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->parent[3] = ir3;  
   wsat->iseq = 1;
-  memcpy(wsat->dpos,der2,36*sizeof(float_a));
   wsat->khb = agb->hbcorr[iat];
 
   *nws = 2;
@@ -2947,11 +5952,6 @@ void agbnp3_place_wat_trigonal_oop(float_a xa, float_a ya, float_a za,
 int agbnp3_create_ws_atoms_trigonal2(AGBNPdata *agb, int iat, 
 				     int *nws, WSat *twsatb){
   int ir1, ir2;
-  float_a xw, yw, zw;
-  float_a der[3][3][3];
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
   /* assumed trigonal topology:
@@ -2973,17 +5973,8 @@ int agbnp3_create_ws_atoms_trigonal2(AGBNPdata *agb, int iat,
   /* parents */
   ir1 = conntbl->neighl[iat][0];
   ir2 = conntbl->neighl[iat][1];
-  agbnp3_place_wat_trigonal2(x[iat],y[iat],z[iat],
-			     x[ir1],y[ir1],z[ir1],
-			     x[ir2],y[ir2],z[ir2],
-			     (float_a)AGBNP_HB_LENGTH,
-			     &xw, &yw, &zw,
-			     der);
   /* stores water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw;
-  wsat->pos[1] = yw;
-  wsat->pos[2] = zw;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TRIGONAL2;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -2993,7 +5984,6 @@ int agbnp3_create_ws_atoms_trigonal2(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der,27*sizeof(float_a));
 
   *nws = 1;
   return AGBNP_OK;
@@ -3092,12 +6082,6 @@ void agbnp3_place_wat_trigonal2(float_a xa, float_a ya, float_a za,
 int agbnp3_create_ws_atoms_tetrahedral2(AGBNPdata *agb, int iat, 
 					int *nws,  WSat *twsatb){
   int ir1, ir2;
-  float_a xw1, yw1, zw1;
-  float_a xw2, yw2, zw2;
-  float_a der1[3][3][3], der2[3][3][3];
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
 
@@ -3120,18 +6104,8 @@ int agbnp3_create_ws_atoms_tetrahedral2(AGBNPdata *agb, int iat,
   /* R1 and R2 parents */
   ir1 = conntbl->neighl[iat][0];
   ir2 = conntbl->neighl[iat][1];
-  agbnp3_place_wat_tetrahedral2(x[iat],y[iat],z[iat],
-				x[ir1],y[ir1],z[ir1],
-				x[ir2],y[ir2],z[ir2],
-				(float_a)AGBNP_HB_LENGTH,
-				&xw1, &yw1, &zw1,
-				&xw2, &yw2, &zw2,
-				der1, der2);
   /* stores water sites */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw1;
-  wsat->pos[1] = yw1;
-  wsat->pos[2] = zw1;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL2;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3141,12 +6115,8 @@ int agbnp3_create_ws_atoms_tetrahedral2(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der1,27*sizeof(float_a));
 
   wsat = &(twsatb[1]);
-  wsat->pos[0] = xw2;
-  wsat->pos[1] = yw2;
-  wsat->pos[2] = zw2;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL2;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3156,7 +6126,6 @@ int agbnp3_create_ws_atoms_tetrahedral2(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->iseq = 1;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der2,27*sizeof(float_a));
 
   *nws = 2;
   return AGBNP_OK;
@@ -3393,11 +6362,6 @@ void agbnp3_place_wat_tetrahedral2(float_a xa, float_a ya, float_a za,
 int agbnp3_create_ws_atoms_tetrahedral3(AGBNPdata *agb, int iat, 
 					int *nws, WSat *twsatb){
   int ir1, ir2, ir3;
-  float_a xw, yw, zw;
-  float_a der[4][3][3];
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
 
@@ -3421,18 +6385,8 @@ int agbnp3_create_ws_atoms_tetrahedral3(AGBNPdata *agb, int iat,
   ir1 = conntbl->neighl[iat][0];
   ir2 = conntbl->neighl[iat][1];
   ir3 = conntbl->neighl[iat][2];
-  agbnp3_place_wat_tetrahedral3(x[iat],y[iat],z[iat],
-				x[ir1],y[ir1],z[ir1],
-				x[ir2],y[ir2],z[ir2],
-				x[ir3],y[ir3],z[ir3],
-				(float_a)AGBNP_HB_LENGTH,
-				&xw, &yw, &zw,
-				der);
   /* stores water site */
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw;
-  wsat->pos[1] = yw;
-  wsat->pos[2] = zw;
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL3;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3441,8 +6395,8 @@ int agbnp3_create_ws_atoms_tetrahedral3(AGBNPdata *agb, int iat,
   wsat->parent[1] = ir1;
   wsat->parent[2] = ir2;
   wsat->parent[3] = ir3;
+  wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der,36*sizeof(float_a));
 
   *nws = 1;
   return AGBNP_OK;
@@ -3558,11 +6512,6 @@ void agbnp3_place_wat_tetrahedral3(float_a xa, float_a ya, float_a za,
 int agbnp3_create_ws_atoms_tetrahedral1(AGBNPdata *agb, int iat, 
 					int *nws, WSat *twsatb){
   int i, nr, ir, irr[3], ir1, ir2, ir3;
-  float_a xw[3];
-  float_a der[4][3][3];
-  float_a *x = agb->x;
-  float_a *y = agb->y;
-  float_a *z = agb->z;
   NeighList *conntbl = agb->conntbl;
   WSat *wsat;
 
@@ -3607,15 +6556,7 @@ int agbnp3_create_ws_atoms_tetrahedral1(AGBNPdata *agb, int iat,
 
   /* water site 1 */
   ir1 = irr[0];
-  agbnp3_place_wat_tetrahedral1_one(x[iat],y[iat],z[iat],
-				    x[ir],y[ir],z[ir],
-				    x[ir1],y[ir1],z[ir1],
-				    (float_a)AGBNP_HB_LENGTH,
-				    xw, der);
   wsat = &(twsatb[0]);
-  wsat->pos[0] = xw[0];
-  wsat->pos[1] = xw[1];
-  wsat->pos[2] = xw[2];
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL1;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3625,20 +6566,11 @@ int agbnp3_create_ws_atoms_tetrahedral1(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir1;
   wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der,36*sizeof(float_a));
 
 
   /* water site 2 */
   ir2 = irr[1];
-  agbnp3_place_wat_tetrahedral1_one(x[iat],y[iat],z[iat],
-				    x[ir],y[ir],z[ir],
-				    x[ir2],y[ir2],z[ir2],
-				    (float_a)AGBNP_HB_LENGTH,
-				    xw, der);
   wsat = &(twsatb[1]);
-  wsat->pos[0] = xw[0];
-  wsat->pos[1] = xw[1];
-  wsat->pos[2] = xw[2];
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL1;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3648,19 +6580,10 @@ int agbnp3_create_ws_atoms_tetrahedral1(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir2;
   wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der,36*sizeof(float_a));
 
   /* water site 3 */
   ir3 = irr[2];
-  agbnp3_place_wat_tetrahedral1_one(x[iat],y[iat],z[iat],
-				    x[ir],y[ir],z[ir],
-				    x[ir3],y[ir3],z[ir3],
-				    (float_a)AGBNP_HB_LENGTH,
-				    xw, der);
   wsat = &(twsatb[2]);
-  wsat->pos[0] = xw[0];
-  wsat->pos[1] = xw[1];
-  wsat->pos[2] = xw[2];
   wsat->r = AGBNP_HB_RADIUS;
   wsat->type = AGBNP_HB_TETRAHEDRAL1;
   wsat->volume = (4./3.)*pi*pow(wsat->r,3);
@@ -3670,7 +6593,6 @@ int agbnp3_create_ws_atoms_tetrahedral1(AGBNPdata *agb, int iat,
   wsat->parent[2] = ir3;
   wsat->iseq = 0;
   wsat->khb = agb->hbcorr[iat];
-  memcpy(wsat->dpos,der,36*sizeof(float_a));
 
   *nws = 3;
   return AGBNP_OK;
@@ -3980,6 +6902,7 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
 
   int nnl; /* neighbor list counter for near heavy-heavy (d<r1+r2)*/
   int nnlrc; /* neighbor list counter for far heavy-heavy (r1+r2<d<rc) */
+  int nq4;   /* size of i4() cache */
   int iat,jat,j,nlsize=0,nbnum,hsize;
   float_a dx, dy, dz, d2, u;
   float_a nboffset = AGBNP_NBOFFSET; /* offset for neighbor list distance test */
@@ -4017,10 +6940,38 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
   AGBworkdata *agbwm = agb->agbw;
   int hk;
 
+  /* cell list search */
+  AGBGrid *grid = &(agbw->nbgrid);
+  int docells = (agb->nblist_method == AGBNP_NBLIST_CELLS);
+  float_a skin = agb->nblist_skin;
+  int ix, iy, iz, jx, jy, jz, jc, k, jb, je;
+  float_a rmax;
+
+  /* locality metric, see agbnp3_set_atom_resort() */
+  float_i dsum = 0.0;
+  int npairs = 0;
+
+  /* receptor and ligand apart, see agbnp3_ener_binding() */
+  int *part = agb->bnd_decouple ? agb->bnd_isligand : NULL;
+
   /* reset neighbor lists */
   memset(near_nl->nne, 0, natoms*sizeof(int));
   memset(far_nl->nne, 0, natoms*sizeof(int));
 
+  if(docells){
+    /* each thread bins the heavy atoms in its own grid. Cells are
+       large enough that near neighbors are found in adjacent cells. */
+    rmax = 0.0;
+    for(iat=0;iat<nheavyat;iat++){
+      if(r[iat] > rmax) rmax = r[iat];
+    }
+    if(agbnp3_grid_build(grid, nheavyat, x, y, z, 
+			 2.*rmax*nboffset + skin) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_neighbor_lists(): error in agbnp3_grid_build()\n");
+      return AGBNP_ERR;
+    }
+  }
+
   /* constructs  near and far neighbor lists */
   nnl = 0;
   nnlrc = 0;
@@ -4038,22 +6989,70 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
     near_nl->nne[iat] = 0;  /* reset number of near neighbors for atom iat */
     /*set pntr to beg.of near neigh.list of atm iat*/
     near_nl->neighl[iat] = &(near_nl->neighl1[nnl]); 
-    for(jat=iat+1;jat<nheavyat;jat++){
-      dx = x[jat] - x[iat];
-      dy = y[jat] - y[iat];
-      dz = z[jat] - z[iat];
-      d2 = dx*dx + dy*dy + dz*dz;
-      u = (r[iat]+r[jat])*nboffset;
-      /* Include only near neighbors based on sum of radii */
-      if(d2<u*u){
-	/* jat is a near neighbor */
-	near_nl->neighl1[nnl] = jat;    /* place jat in neighbor list */
-	nnl += 1;                       /* updates neighbor list counter */
-	nl_r2v[near_nl->nne[iat]] = d2; /* store distance for reordering */
-	near_nl->nne[iat] += 1;         /* updates counter for iat neighbors */
-      }else{
-	/* jat is a far neighbor */
-	nnlrc += 1;                     /* keeps also track of number of far neighbors to allocate q4cache */
+    if(docells){
+      agbnp3_grid_cell(grid, x[iat], y[iat], z[iat], &ix, &iy, &iz);
+      for(jz = iz-1; jz <= iz+1; jz++){
+	if(jz < 0 || jz >= grid->nz) continue;
+	for(jy = iy-1; jy <= iy+1; jy++){
+	  if(jy < 0 || jy >= grid->ny) continue;
+	  for(jx = ix-1; jx <= ix+1; jx++){
+	    if(jx < 0 || jx >= grid->nx) continue;
+	    jc = (jz*grid->ny + jy)*grid->nx + jx;
+	    jb = grid->cell_start[jc];
+	    je = grid->cell_start[jc+1];
+	    for(k=jb;k<je;k++){
+	      jat = grid->cell_atoms[k];
+	      if(jat <= iat) continue;
+	      if(part && part[jat] != part[iat]) continue;
+	      dx = x[jat] - x[iat];
+	      dy = y[jat] - y[iat];
+	      dz = z[jat] - z[iat];
+	      d2 = dx*dx + dy*dy + dz*dz;
+	      u = (r[iat]+r[jat])*nboffset + skin;
+	      if(d2<u*u){
+		near_nl->neighl1[nnl] = jat;
+		nnl += 1;
+		nl_r2v[near_nl->nne[iat]] = d2;
+		near_nl->nne[iat] += 1;
+	      }
+	    }
+	  }
+	}
+      }
+      /* the all-pairs search lists neighbors in ascending index
+	 order, do the same here so that ties in the distance sort
+	 below are broken the same way */
+      for(j=1;j<near_nl->nne[iat];j++){
+	jat = near_nl->neighl[iat][j];
+	d2 = nl_r2v[j];
+	for(k=j-1; k >= 0 && near_nl->neighl[iat][k] > jat; k--){
+	  near_nl->neighl[iat][k+1] = near_nl->neighl[iat][k];
+	  nl_r2v[k+1] = nl_r2v[k];
+	}
+	near_nl->neighl[iat][k+1] = jat;
+	nl_r2v[k+1] = d2;
+      }
+      /* all other heavy atoms with larger index are far neighbors */
+      nnlrc += nheavyat - iat - 1 - near_nl->nne[iat];
+    }else{
+      for(jat=iat+1;jat<nheavyat;jat++){
+	if(part && part[jat] != part[iat]) continue;
+	dx = x[jat] - x[iat];
+	dy = y[jat] - y[iat];
+	dz = z[jat] - z[iat];
+	d2 = dx*dx + dy*dy + dz*dz;
+	u = (r[iat]+r[jat])*nboffset + skin;
+	/* Include only near neighbors based on sum of radii */
+	if(d2<u*u){
+	  /* jat is a near neighbor */
+	  near_nl->neighl1[nnl] = jat;    /* place jat in neighbor list */
+	  nnl += 1;                       /* updates neighbor list counter */
+	  nl_r2v[near_nl->nne[iat]] = d2; /* store distance for reordering */
+	  near_nl->nne[iat] += 1;         /* updates counter for iat neighbors */
+	}else{
+	  /* jat is a far neighbor */
+	  nnlrc += 1;                     /* keeps also track of number of far neighbors to allocate q4cache */
+	}
       }
     }
     //add hydrogens to total for q4cache allocation
@@ -4065,6 +7064,21 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
       agbnp3_nblist_reorder(agbw, near_nl, iat, nl_indx);
     }
 
+    if(agb->resort_factor > 0.0){
+      for(j=0;j<near_nl->nne[iat];j++){
+	dsum += near_nl->neighl[iat][j] - iat;
+      }
+      npairs += near_nl->nne[iat];
+    }
+
+  }
+
+  if(agb->resort_factor > 0.0){
+#pragma omp critical
+    {
+      agb->resort_dsum += dsum;
+      agb->resort_npairs += npairs;
+    }
   }
 
   /* printf("nnl = %d nnl/nat = %f\n",nnl, nnl/(float)agb->nheavyat); */
@@ -4101,9 +7115,13 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
     return AGBNP_ERR;
   }
 
-  /* (re)allocation of i4() memory cache */
-  if(!agbw->q4cache || 4*(nnl+nnlrc) > agbw->nq4cache){
-    agbw->nq4cache = 4*(nnl+nnlrc);
+  /* (re)allocation of i4() memory cache, in cutoff mode it is sized by 
+     agbnp3_br_neighbor_list(). In recompute mode it holds one row. */
+  nq4 = agb->q4cache_recompute ? 4*natoms : 4*(nnl+nnlrc);
+  if(agb->br_roff <= 0.0 && (agb->terms & AGBNP_TERM_BR) &&
+     (!agbw->q4cache || nq4 > agbw->nq4cache || 
+			     (agb->q4cache_recompute && nq4 < agbw->nq4cache))){
+    agbw->nq4cache = nq4;
     agbw->q4cache = (float  *)realloc(agbw->q4cache, agbw->nq4cache*sizeof(float ));
     if(!agbw->q4cache){
       agbnp3_errprint( "agbnp3_neighbor_lists(): fatal error: can't allocate memory for q4cache (%d floats)!\n", agbw->nq4cache);
@@ -4114,3 +7132,341 @@ float_a agbnp3_i4ov(float_a rij, float_a Ri, float_a Rj, float_a *dr4){
   return AGBNP_OK;
  }
 
+/* re-sorts the rows of the near neighbor lists reused with a skin (see
+   agbnp3_nblist_check()) in ascending order of the current distances,
+   with ties broken by index as in agbnp3_neighbor_lists(). The order of
+   the neighbors sets the pruning of the overlap trees, so that reused
+   lists give the same energies as freshly built ones. Rows are assigned
+   to threads with the same schedule as in agbnp3_neighbor_lists(). */
+int agbnp3_nblist_resort(AGBNPdata *agb, AGBworkdata *agbw,
+			 float_a *x, float_a *y, float_a *z){
+  int iat, jat, j, k, nn;
+  float_a dx, dy, dz;
+  int nheavyat = agb->nheavyat;
+  NeighList *near_nl = agbw->near_nl;
+  float_a *nl_r2v = agbw->nl_r2v;
+  int *nl_indx = agbw->nl_indx;
+  int *row;
+
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<nheavyat;iat++){
+    nn = near_nl->nne[iat];
+    if(nn <= 1) continue;
+    row = near_nl->neighl[iat];
+    /* ascending index order first, as found by the all-pairs search */
+    for(j=1;j<nn;j++){
+      jat = row[j];
+      for(k=j-1; k >= 0 && row[k] > jat; k--){
+	row[k+1] = row[k];
+      }
+      row[k+1] = jat;
+    }
+    for(j=0;j<nn;j++){
+      jat = row[j];
+      dx = x[jat] - x[iat];
+      dy = y[jat] - y[iat];
+      dz = z[jat] - z[iat];
+      nl_r2v[j] = dx*dx + dy*dy + dz*dz;
+    }
+    agbnp3_fsortindx(nn, nl_r2v, nl_indx);
+    agbnp3_nblist_reorder(agbw, near_nl, iat, nl_indx);
+  }
+
+  return AGBNP_OK;
+}
+
+/* constructs the GB pair list: for each atom the atoms with larger
+   index within gb_roff (plus the neighbor list skin). Rows are assigned to threads with the same
+   schedule as the loop over atoms in agbnp3_gb_energy_nblist_ps(). */
+int agbnp3_gb_neighbor_list(AGBNPdata *agb, AGBworkdata *agbw,
+			    float_a *x, float_a *y, float_a *z){
+  int natoms = agb->natoms;
+  int nnl;
+
+  if(agbnp3_pair_neighbor_list(agb, &(agbw->gb_nl), &(agbw->gbgrid), natoms,
+			       agb->gb_roff + agb->nblist_skin,
+			       AGBNP_PAIRS_ALL, x, y, z, &nnl)
+     != AGBNP_OK){
+    agbnp3_errprint("agbnp3_gb_neighbor_list(): error in agbnp3_pair_neighbor_list()\n");
+    return AGBNP_ERR;
+  }
+  if(agbw->pbuffer_size < natoms + 4){
+    if(agbnp3_reallocate_pbuffers(agbw, natoms + 4) != AGBNP_OK){
+      agbnp3_errprint("agbnp3_gb_neighbor_list(): error in agbnp3_reallocate_pbuffers()\n");
+      return AGBNP_ERR;
+    }
+  }
+  return AGBNP_OK;
+}
+
+/* Mean-field tail correction for the descreening cutoff
+   (agbnp3_set_born_radii_cutoff()). 
+
+   The descreening from the pairs beyond the cutoff is replaced by that
+   of a sphere of radius R and uniform self volume density A. With an
+   ideal cutoff at distance rm the inverse Born radius of an atom at
+   distance s from the center of the sphere is lowered by
+
+   A*G(s,R),  G = 1/(4 pi) Int_{r > rm} f(r,s)/r^4 d^3r 
+                = Int_rm^inf f(r,s)/r^2 dr
+
+   where f(r,s) is the fraction of the spherical shell of radius r around
+   the atom which is inside the sphere. The sphere has the center and
+   radius of gyration of the heavy atoms (R^2 = 5/3 Rg^2) and A is the
+   sum of the self volumes of the heavy atoms divided by its
+   volume. rm is chosen so that for an infinite medium the tail matches
+   the descreening removed by the switching function:
+
+   1/rm = Int_0^inf [1 - S(r)]/r^2 dr
+
+   The integral over the switching region is evaluated by Simpson's
+   rule. */
+float_a agbnp3_br_tail_radius(float_a ron, float_a roff){
+  int i, n = 1000;
+  double h = (roff - ron)/n;
+  double r, w, s, ks = 0.0;
+
+  for(i=0;i<=n;i++){
+    r = ron + i*h;
+    w = (i == 0 || i == n) ? 1.0 : ( (i % 2) ? 4.0 : 2.0 );
+    s = 1.0 - agbnp3_pol_switchfunc(r, ron, roff, NULL, NULL);
+    if(r > 0.0) ks += w*(1.0 - s)/(r*r);
+  }
+  return 1.0/(ks*h/3.0 + 1.0/roff);
+}
+
+/* G(s,R) (see above) and its derivatives with respect to s and R. 
+   For R-s < r < R+s the fraction of the shell inside the sphere is 
+   f = [R^2 - (r-s)^2]/(4 r s). */
+void agbnp3_br_tail_function(float_a s, float_a R, float_a rm,
+			     float_a *g, float_a *gs, float_a *gR){
+  double a, b, s2, s1, R2 = R*R;
+  double ga = 0.0, gsa = 0.0, gRa = 0.0;
+
+  if(s < 1.e-3*R){
+    /* atom at the center of the sphere */
+    if(rm < R){
+      ga = 1./rm - 1./R;
+      gRa = 1./R2;
+    }
+    *g = ga; *gs = 0.0; *gR = gRa;
+    return;
+  }
+
+  s2 = s*s;
+  s1 = 1./s;
+  /* shell fully inside the sphere */
+  if(s < R && rm < R - s){
+    ga += 1./rm - 1./(R - s);
+  }
+  /* shell partially inside the sphere */
+  a = fabs(R - s);
+  if(a < rm) a = rm;
+  b = R + s;
+  if(a < b){
+    /* antiderivatives of f/r^2 and of its derivatives wrt s and R */
+#define AGBNP_BRTAIL_H(r)  (-(R2-s2)*0.125*s1/((r)*(r)) - 0.5/(r) - 0.25*s1*log(r))
+#define AGBNP_BRTAIL_HS(r) ((R2+s2)*0.125*s1*s1/((r)*(r)) + 0.25*s1*s1*log(r))
+#define AGBNP_BRTAIL_HR(r) (-0.25*R*s1/((r)*(r)))
+    ga  += AGBNP_BRTAIL_H(b)  - AGBNP_BRTAIL_H(a);
+    gsa += AGBNP_BRTAIL_HS(b) - AGBNP_BRTAIL_HS(a);
+    gRa += AGBNP_BRTAIL_HR(b) - AGBNP_BRTAIL_HR(a);
+#undef AGBNP_BRTAIL_H
+#undef AGBNP_BRTAIL_HS
+#undef AGBNP_BRTAIL_HR
+  }
+  *g = ga; *gs = gsa; *gR = gRa;
+}
+
+/* computes center, radius and self volume density of the sphere for the
+   mean-field tail correction of the descreening cutoff. Each thread
+   computes its own copy. */
+int agbnp3_br_tail_setup(AGBNPdata *agb, AGBworkdata *agbw_h,
+			 float_a *x, float_a *y, float_a *z){
+  int iat;
+  int nheavyat = agb->nheavyat;
+  float_a *sp = agbw_h->sp;
+  float_a *vols = agbw_h->vols;
+  double cx = 0.0, cy = 0.0, cz = 0.0, rg2 = 0.0, vsum = 0.0;
+  double dx, dy, dz, R;
+
+  if(nheavyat <= 0){
+    agbw_h->br_tailR = agbw_h->br_tailA = 0.0;
+    return AGBNP_OK;
+  }
+  for(iat=0;iat<nheavyat;iat++){
+    cx += x[iat];
+    cy += y[iat];
+    cz += z[iat];
+    vsum += sp[iat]*vols[iat];
+  }
+  cx /= nheavyat;
+  cy /= nheavyat;
+  cz /= nheavyat;
+  for(iat=0;iat<nheavyat;iat++){
+    dx = x[iat] - cx;
+    dy = y[iat] - cy;
+    dz = z[iat] - cz;
+    rg2 += dx*dx + dy*dy + dz*dz;
+  }
+  rg2 /= nheavyat;
+  R = sqrt(5.*rg2/3.);
+  if(R < AGBNP_RADIUS_INCREMENT) R = AGBNP_RADIUS_INCREMENT;
+
+  agbw_h->br_tailc[0] = cx;
+  agbw_h->br_tailc[1] = cy;
+  agbw_h->br_tailc[2] = cz;
+  agbw_h->br_tailR = R;
+  agbw_h->br_tailA = vsum/((4./3.)*pi*R*R*R);
+  return AGBNP_OK;
+}
+
+/* constructs the Born radii pair list (cutoff mode): for each heavy
+   atom the atoms (heavy and hydrogens) with larger index within
+   br_roff (plus the neighbor list skin). Rows are assigned to threads with the same schedule as the
+   loops over heavy atoms in agbnp3_inverse_born_radii_nblist_soa(),
+   agbnp3_gb_ders_constvp_nblist_ps() and agbnp3_gb_deruv_nblist_ps(),
+   which read the same list and the same i4() cache. With frozen atoms
+   the frozen-frozen pairs are left out and are kept in a separate
+   list, with its own i4() cache, which is built only when the frozen
+   atoms or the settings change (agb->frozen_init). */
+int agbnp3_br_neighbor_list(AGBNPdata *agb, AGBworkdata *agbw,
+			    float_a *x, float_a *y, float_a *z){
+  int nnl;
+  int frozen = agb->do_frozen;
+
+  if(agbnp3_pair_neighbor_list(agb, &(agbw->br_nl), &(agbw->brgrid), 
+			       agb->nheavyat, agb->br_roff + agb->nblist_skin,
+			       frozen ? AGBNP_PAIRS_MOBILE : AGBNP_PAIRS_ALL,
+			       x, y, z, &nnl)
+     != AGBNP_OK){
+    agbnp3_errprint("agbnp3_br_neighbor_list(): error in agbnp3_pair_neighbor_list()\n");
+    return AGBNP_ERR;
+  }
+
+  /* (re)allocation of i4() memory cache, 2 entries for each heavy-heavy 
+     pair and 1 for each heavy-hydrogen pair */
+  if(!agbw->q4cache || 4*nnl > agbw->nq4cache){
+    agbw->nq4cache = 4*nnl;
+    agbw->q4cache = (float  *)realloc(agbw->q4cache, agbw->nq4cache*sizeof(float ));
+    if(!agbw->q4cache){
+      agbnp3_errprint( "agbnp3_br_neighbor_list(): fatal error: can't allocate memory for q4cache (%d floats)!\n", agbw->nq4cache);
+      return AGBNP_ERR;
+    }
+  }
+
+  /* frozen atoms do not move, no skin is needed */
+  if(frozen && agb->frozen_init){
+    if(agbnp3_pair_neighbor_list(agb, &(agbw->brfz_nl), &(agbw->brgrid),
+				 agb->nheavyat, agb->br_roff,
+				 AGBNP_PAIRS_FROZEN, x, y, z, &nnl)
+       != AGBNP_OK){
+      agbnp3_errprint("agbnp3_br_neighbor_list(): error in agbnp3_pair_neighbor_list()\n");
+      return AGBNP_ERR;
+    }
+    if(!agbw->q4fzcache || 4*nnl > agbw->nq4fzcache){
+      agbw->nq4fzcache = 4*nnl;
+      agbw->q4fzcache = (float  *)realloc(agbw->q4fzcache, agbw->nq4fzcache*sizeof(float ));
+      if(!agbw->q4fzcache){
+	agbnp3_errprint( "agbnp3_br_neighbor_list(): fatal error: can't allocate memory for q4fzcache (%d floats)!\n", agbw->nq4fzcache);
+	return AGBNP_ERR;
+      }
+    }
+  }
+  return AGBNP_OK;
+}
+
+/* constructs a pair list using a cell list search: for each atom 
+   iat < nrows the atoms jat > iat within rc. The list and the grid 
+   are per-thread, rows are assigned to threads as in an 
+   "omp for schedule(static,1)" loop over atoms. The list is allocated 
+   on first use. pairs (AGBNP_PAIRS_*) selects all pairs, the pairs
+   with at least one mobile atom or the frozen-frozen pairs. nnlp
+   returns the number of pairs found by this thread. */
+int agbnp3_pair_neighbor_list(AGBNPdata *agb, NeighList **nlp, AGBGrid *grid,
+			      int nrows, float_a rc, int pairs,
+			      float_a *x, float_a *y, float_a *z, int *nnlp){
+  int natoms = agb->natoms;
+  NeighList *nl;
+  float_a rc2 = rc*rc;
+  float_a dx, dy, dz, d2;
+  int iat, jat, k, jb, je, jc, nnl, nlsize = 0;
+  int ix, iy, iz, jx, jy, jz;
+  float_a nlsize_increment = 1.2;
+  int error = 0;
+  int *isfrozen = agb->isfrozen;
+  int fiat;
+
+  if(!*nlp){
+    *nlp = (NeighList *)malloc(1*sizeof(NeighList));
+    if(!*nlp){
+      agbnp3_errprint( "agbnp3_pair_neighbor_list(): unable to allocate memory for neighbor list (%d NeighList).\n", 1);
+      return AGBNP_ERR;
+    }
+    nblist_reset_neighbor_list(*nlp);
+    if(nblist_reallocate_neighbor_list(*nlp, natoms,
+				       natoms*AGBNP_FARNEIGHBORS) != NBLIST_OK){
+      agbnp3_errprint("agbnp3_pair_neighbor_list(): unable to allocate neighbor list (natoms=%d, size=%d)\n", natoms, natoms*AGBNP_FARNEIGHBORS);
+      return AGBNP_ERR;
+    }
+  }
+  nl = *nlp;
+
+  if(agbnp3_grid_build(grid, natoms, x, y, z, rc) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_pair_neighbor_list(): error in agbnp3_grid_build()\n");
+    return AGBNP_ERR;
+  }
+
+  memset(nl->nne, 0, natoms*sizeof(int));
+  nnl = 0;
+#pragma omp for schedule(static,1) nowait
+  for(iat=0;iat<nrows;iat++){
+    if(error) continue;
+    while(nnl + natoms >= nl->neighl_size){
+      nlsize = agbnp3_mymax(nlsize_increment*nl->neighl_size, nnl + natoms);
+      if(nblist_reallocate_neighbor_list(nl,natoms,nlsize) != NBLIST_OK){
+	error = 1;
+      }
+      if (error) break;
+    }
+    if (error) continue;
+    nl->neighl[iat] = &(nl->neighl1[nnl]);
+    fiat = (pairs != AGBNP_PAIRS_ALL) && isfrozen[iat];
+    if(pairs == AGBNP_PAIRS_FROZEN && !fiat) continue;
+    agbnp3_grid_cell(grid, x[iat], y[iat], z[iat], &ix, &iy, &iz);
+    for(jz = iz-1; jz <= iz+1; jz++){
+      if(jz < 0 || jz >= grid->nz) continue;
+      for(jy = iy-1; jy <= iy+1; jy++){
+	if(jy < 0 || jy >= grid->ny) continue;
+	for(jx = ix-1; jx <= ix+1; jx++){
+	  if(jx < 0 || jx >= grid->nx) continue;
+	  jc = (jz*grid->ny + jy)*grid->nx + jx;
+	  jb = grid->cell_start[jc];
+	  je = grid->cell_start[jc+1];
+	  for(k=jb;k<je;k++){
+	    jat = grid->cell_atoms[k];
+	    if(jat <= iat) continue;
+	    if(pairs == AGBNP_PAIRS_MOBILE && fiat && isfrozen[jat]) continue;
+	    if(pairs == AGBNP_PAIRS_FROZEN && !isfrozen[jat]) continue;
+	    dx = x[jat] - x[iat];
+	    dy = y[jat] - y[iat];
+	    dz = z[jat] - z[iat];
+	    d2 = dx*dx + dy*dy + dz*dz;
+	    if(d2 < rc2){
+	      nl->neighl1[nnl++] = jat;
+	      nl->nne[iat] += 1;
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  if(error){
+    agbnp3_errprint("agbnp3_pair_neighbor_list(): unable to (re)allocate neighbor list (natoms=%d, size=%d)\n",natoms, nlsize);
+    return AGBNP_ERR;
+  }
+
+  *nnlp = nnl;
+  return AGBNP_OK;
+}
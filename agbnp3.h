@@ -73,12 +73,57 @@ typedef double float_i;
 #define AGBNP_HB_TETRAHEDRAL2 (22) /* like sp3 O */
 #define AGBNP_HB_TETRAHEDRAL3 (23) /* like sp3 N */
 
+/* neighbor list construction methods */
+#define AGBNP_NBLIST_ALLPAIRS (0) /* test all heavy atom pairs */
+#define AGBNP_NBLIST_CELLS    (1) /* cell list (uniform grid) search */
+
+/* internal ordering of the atoms */
+#define AGBNP_ORDER_INPUT   (0) /* input order, hydrogens last */
+#define AGBNP_ORDER_MORTON  (1) /* Morton (Z-order) curve */
+#define AGBNP_ORDER_HILBERT (2) /* Hilbert curve */
+
+/* SIMD kernel sets, see agbnp3_set_simd() */
+#define AGBNP_SIMD_AUTO   (-1) /* best one supported by the CPU */
+#define AGBNP_SIMD_NONE   (0)  /* scalar, library built without SSE */
+#define AGBNP_SIMD_SSE    (1)
+#define AGBNP_SIMD_AVX2   (2)  /* AVX2 and FMA */
+#define AGBNP_SIMD_AVX512 (3)  /* AVX-512F */
+
+/* energy terms, see agbnp3_set_terms() */
+#define AGBNP_TERM_GB  (1) /* generalized Born */
+#define AGBNP_TERM_VDW (2) /* solute-solvent van der Waals */
+#define AGBNP_TERM_CAV (4) /* cavity */
+#define AGBNP_TERM_HB  (8) /* hydrogen bonding correction */
+#define AGBNP_TERM_ALL (15)
+
+/* number of energy components returned by agbnp3_ener_binding(): 
+   egb, evdw, ecorr_vdw, ecav, ecorr_cav, ehb */
+#define AGBNP_NENER (6)
+
 /* Initializes libagbnp library.*/
 int agbnp3_initialize( void );
 
 /* Terminate libagbnp library. */
 void agbnp3_terminate( void );
 
+/* sets the internal ordering of the atoms (one of AGBNP_ORDER_*) of 
+   the instances created afterwards. The HB correction energy depends
+   on it */
+int agbnp3_set_atom_order(int order);
+
+/* sets the SIMD kernel set (one of AGBNP_SIMD_*) of the instances 
+   created afterwards, overriding the AGBNP3_SIMD environment variable
+   (sse, avx2 or avx512). The best set supported by the CPU not above 
+   the one requested is used */
+int agbnp3_set_simd(int simd);
+
+/* returns the SIMD kernel set (one of AGBNP_SIMD_*) used by an instance */
+int agbnp3_get_simd(int tag, int *simd);
+
+/* turns on (factor > 1) or off (factor <= 0) the re-sorting of the 
+   atoms at a neighbor list build when their locality degrades by factor */
+int agbnp3_set_atom_resort(int tag, float_i factor);
+
 /* creates a new public instance of an agbnp structure */
 int agbnp3_new(int *tag, int natoms, 
 	      float_i *x, float_i *y, float_i *z, float_i *r, 
@@ -103,7 +148,114 @@ int agbnp3_ener(int tag, int init,
 		float_i *ecav, float_i *ecorr_cav, float_i (*decav)[3],
 		float_i *ehb,  float_i (*dehb)[3]);
 
+/* returns the AGBNP energies without derivatives */
+int agbnp3_ener_only(int tag, float_i *x, float_i *y, float_i *z,
+		     float_i *mol_volume, 
+		     float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+		     float_i *ecav, float_i *ecorr_cav, float_i *ehb);
+
+/* returns the Born radii only, for use with an external GB pair energy */
+int agbnp3_born_radii_eval(int tag, float_i *x, float_i *y, float_i *z,
+			   float_i *br);
+
+/* returns the gradient dedr of a function E of the Born radii given 
+   dedb[i] = dE/dB_i, at the coordinates of agbnp3_born_radii_eval() */
+int agbnp3_born_radii_ders(int tag, float_i *dedb, float_i (*dedr)[3]);
+
+/* evaluates nframes frames of coordinates (frame f at x + f*stride) and
+   returns energies at index f and per-atom outputs (NULL to skip) at
+   offset f*stride. No derivatives are computed if all gradients are NULL */
+int agbnp3_ener_batch(int tag, int nframes, int stride,
+		      float_i *x, float_i *y, float_i *z,
+		      float_i *mol_volume, 
+		      float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+		      float_i *ecav, float_i *ecorr_cav, float_i *ehb,
+		      float_i *sp, float_i *br, float_i *surf_area, 
+		      float_i (*dgbdr)[3], float_i (*dvwdr)[3], 
+		      float_i (*decav)[3], float_i (*dehb)[3]);
+
+/* returns the change of the energies when the atoms in moved[] are 
+   displaced to the positions in x, y and z, relative to the last 
+   agbnp3_ener() or committed move. No derivatives */
+int agbnp3_ener_delta(int tag, int nmoved, int *moved,
+		      float_i *x, float_i *y, float_i *z,
+		      float_i *degb, float_i *devdw, float_i *decorr_vdw,
+		      float_i *decav, float_i *decorr_cav, float_i *dehb);
+
+/* marks the ligand atoms (isligand[i] != 0) for agbnp3_ener_binding(),
+   NULL for none */
+int agbnp3_set_ligand(int tag, int *isligand);
+
+/* returns the energies (arrays of AGBNP_NENER) of the complex, of the 
+   receptor and of the ligand apart and the binding energies */
+int agbnp3_ener_binding(int tag, float_i *x, float_i *y, float_i *z,
+			float_i *ecomplex, float_i *ereceptor, 
+			float_i *eligand, float_i *ebind);
+
+/* stores the state of instance rtag at its current coordinates in a 
+   cache shared by the complexes of agbnp3_set_receptor_cache() */
+int agbnp3_receptor_cache(int rtag);
+
+/* agbnp3_ener_only() of the complex tag (receptor + ligand set by 
+   agbnp3_set_ligand()) takes the self volumes and the descreening
+   among receptor atoms from the cache of receptor rtag. The receptor
+   atoms must be at their cached positions. rtag < 0 turns it off */
+int agbnp3_set_receptor_cache(int tag, int rtag);
+
+/* accepts the move of agbnp3_ener_delta() */
+int agbnp3_ener_commit(int tag);
+
+/* rejects the move of agbnp3_ener_delta() */
+int agbnp3_ener_rollback(int tag);
+
+/* sets the neighbor list construction method (one of AGBNP_NBLIST_*) */
+int agbnp3_set_nblist_method(int tag, int method);
+
+/* turns on (roff > 0) or off (roff <= 0) the GB pair energy cutoff. 
+   The pair energy is switched off smoothly between ron and roff */
+int agbnp3_set_gb_cutoff(int tag, float_i ron, float_i roff);
+
+/* turns on (0 < theta < 1) or off (theta <= 0) the treecode 
+   approximation of the GB pair energy. Smaller theta, better accuracy */
+int agbnp3_set_gb_treecode(int tag, float_i theta);
+
+/* turns on (roff > 0) or off (roff <= 0) the cutoff of the descreening 
+   integrals for Born radii, with a mean-field tail correction */
+int agbnp3_set_born_radii_cutoff(int tag, float_i ron, float_i roff);
+
+/* sets the neighbor list skin (skin <= 0 rebuilds lists at every call) */
+int agbnp3_set_nblist_skin(int tag, float_i skin);
+
+/* returns the number of energy evaluations and of neighbor list builds,
+   the max atomic displacement since the last build and the
+   displacement which triggers a rebuild */
+int agbnp3_get_nblist_stats(int tag, int *nevals, int *nbuilds,
+			    float_i *maxdisp, float_i *trigger);
+
+/* sets the memory budget (in MB) of the cache of descreening integrals.
+   If the cache would be larger they are recomputed when needed */
+int agbnp3_set_q4cache_budget(int tag, float_i mbytes);
+
+/* marks frozen atoms (isfrozen[i] != 0), NULL for none. Frozen atoms must
+   not move; the derivatives returned for frozen atoms are zero */
+int agbnp3_set_frozen(int tag, int *isfrozen);
+
+/* selects the energy terms to evaluate (an OR of AGBNP_TERM_*), the
+   terms turned off are returned as zero */
+int agbnp3_set_terms(int tag, int terms);
+
+/* turns on (nsym > 0) or off (nsym <= 0) crystal symmetry: the nsym 
+   mates rot[k] x + trans[k] of the system (identity excluded) descreen 
+   its atoms */
+int agbnp3_set_symmetry(int tag, int nsym, float_i (*rot)[3][3], 
+			float_i (*trans)[3]);
 
+/* descreens the atoms of instance tag by the heavy atoms of instance
+   rtag (at its last evaluation) through a grid of the given spacing 
+   over the box lo-hi, rtag < 0 removes it. maxerr is the largest 
+   interpolation error of the inverse Born radii */
+int agbnp3_set_receptor_grid(int tag, int rtag, float_i *lo, float_i *hi,
+			     float_i spacing, float_i *maxerr);
 
 #ifdef __cplusplus
 }
@@ -42,6 +42,9 @@
 #include <xmmintrin.h>
 #include "sse_mathfun.h"
 #endif
+#if defined(USE_AVX2) || defined(USE_AVX512)
+#include "avx_mathfun.h"
+#endif
 
 /* _PS_CONST(dielin4, dielin);
 _PS_CONST(dielout4,dielout);
@@ -54,6 +57,13 @@ _PS_CONST(pt25, 0.25f);
 #endif
 #define PI (3.14159265359f)
 
+#ifdef USE_AVX512
+/* mask of the first min(n,16) lanes */
+static inline __mmask16 agbnp3_mask16(int n){
+  return n >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << n) - 1);
+}
+#endif
+
 
 /* Serial GB pair inner loop. No neighbor list. No exclusions.
 
@@ -150,6 +160,54 @@ int agbnp3_gb_energy_inner_nolist_soa(
    return AGBNP_OK;
 }
 
+/* Same as agbnp3_gb_energy_inner_nolist_soa() without the Ai's and
+   the gradient, for energy-only evaluations. */
+int agbnp3_gb_energy_only_inner_nolist_soa(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, int je,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor){
+   
+  int k;
+  float xi, yi, zi, qi, bi;
+  float d2, dx, dy, dz, qq, bb, etij, fgb;
+  float valid_mask;
+  float *q = charge;
+
+  float en = 0.0f;
+
+  float pt25 = 0.25f;
+
+  float vdielf = 2.0f*dielectric_factor;
+
+  xi = x[iat];
+  yi = y[iat];
+  zi = z[iat];
+  qi = q[iat];
+  bi = br[iat];
+
+#pragma ivdep
+  for(k=jb; k<=je; k++){
+
+    dx = x[k] - xi;
+    dy = y[k] - yi;
+    dz = z[k] - zi;
+    d2 = dx*dx + dy*dy + dz*dz;
+    valid_mask = d2 > 0 ? 1.0f : 0.0f;
+    qq = valid_mask*qi*q[k];
+    bb = bi*br[k];
+    etij = expf(-pt25*d2/bb);
+    fgb = 1./sqrtf(d2 + bb*etij);
+    en += vdielf*qq*fgb;
+  }
+
+  *egb_pair += en;
+
+   return AGBNP_OK;
+}
+
 
 #ifdef USE_SSE
 /* utility function to print out a quad */
@@ -283,6 +341,69 @@ int agbnp3_gb_energy_inner_nolist_ps(
   return AGBNP_OK;
 }
 
+/* Same as agbnp3_gb_energy_inner_nolist_ps() without the Ai's and
+   the gradient, for energy-only evaluations. */
+int agbnp3_gb_energy_only_inner_nolist_ps(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor){
+   
+  int k4, k4start;
+  __m128 xi4, yi4, zi4, qi4, bi4;
+  __m128 d2, dx, dy, dz, qqf, bb, etij, fgb;
+
+  /* accumulator  */
+  __m128 en = _mm_setzero_ps();
+  float *ent = (float *)&en;
+
+  __m128 pt25 = *(__m128*)_ps_pt25;
+
+  __m128 *x4 = (__m128 *)x;
+  __m128 *y4 = (__m128 *)y;
+  __m128 *z4 = (__m128 *)z;
+  __m128 *q4 = (__m128 *)charge;
+  __m128 *b4 = (__m128 *)br;
+
+  float vdiel = 2.0f*dielectric_factor;
+  __m128 vdielf = _mm_set_ps1(vdiel);
+
+  __m128 valid_mask; // to set to zero energies corresponding to zero distance
+
+  xi4 = _mm_set_ps1(x[iat]);
+  yi4 = _mm_set_ps1(y[iat]);
+  zi4 = _mm_set_ps1(z[iat]);
+  qi4 = _mm_set_ps1(charge[iat]);
+  bi4 = _mm_set_ps1(br[iat]);
+
+  k4start = jb/4;
+  if(k4start*4 != jb){
+    agbnp3_errprint("agbnp3_gb_energy_only_inner_nolist_ps(): expecting jb to be divisible by 4. Got: %d.\n", jb);
+    return AGBNP_ERR;
+  }
+
+  for(k4=k4start; k4<natoms/4; k4++){
+
+    dx = x4[k4] - xi4;
+    dy = y4[k4] - yi4;
+    dz = z4[k4] - zi4;
+    d2 = dx*dx + dy*dy + dz*dz;
+    valid_mask = _mm_cmpgt_ps(d2, _mm_setzero_ps());
+    qqf = vdielf*(qi4*q4[k4]);
+    bb = bi4*b4[k4];
+    etij = exp_ps(-pt25*d2/bb);
+    fgb = rsqrt_ps(d2 + bb*etij);
+
+    en += _mm_and_ps(valid_mask, qqf*fgb);
+   }
+
+  /* update pair energy */
+  *egb_pair += ent[0] + ent[1] + ent[2] + ent[3];
+  return AGBNP_OK;
+}
+
 /* returns loop indexes to find leading, trailing, and quad sections */
 void agbnp3_qindex(int jat, int n, int *beglead, int *endlead, int* begquad, int* endquad, int* begtrail, int* endtrail){
   int lead1, lead2, s4, e4, trail1, trail2;
@@ -317,6 +438,147 @@ void agbnp3_qindex(int jat, int n, int *beglead, int *endlead, int* begquad, int
 } 
 #endif
 
+#ifdef USE_AVX512
+/* 16-wide version of agbnp3_gb_energy_inner_nolist_soa() for all 
+   jb <= j < natoms. The last partial group of j atoms is handled with
+   masked loads and stores, no alignment is assumed. */
+AVX512_TARGET int agbnp3_gb_energy_inner_nolist_avx512(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br, float *dera,
+		    float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor){
+  int j;
+  __mmask16 m, valid;
+  __m512 xi, yi, zi, qi, bi;
+  __m512 d2, dx, dy, dz, qq, qqf, bb, etij, fgb, fgb3, mw, atij;
+  __m512 gx, gy, gz;
+  __m512 zero = _mm512_setzero_ps();
+  __m512 pt25 = _mm512_set1_ps(0.25f);
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 vdielf = _mm512_set1_ps(2.0f*dielectric_factor);
+
+  /* accumulators */
+  __m512 en = _mm512_setzero_ps();
+  __m512 derai = _mm512_setzero_ps();
+  __m512 dgbdrix = _mm512_setzero_ps();
+  __m512 dgbdriy = _mm512_setzero_ps();
+  __m512 dgbdriz = _mm512_setzero_ps();
+
+  xi = _mm512_set1_ps(x[iat]);
+  yi = _mm512_set1_ps(y[iat]);
+  zi = _mm512_set1_ps(z[iat]);
+  qi = _mm512_set1_ps(charge[iat]);
+  bi = _mm512_set1_ps(br[iat]);
+
+  for(j=jb; j<natoms; j+=16){
+    m = agbnp3_mask16(natoms - j);
+
+    dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, x+j), xi);
+    dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, y+j), yi);
+    dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, z+j), zi);
+    d2 = _mm512_mul_ps(dx, dx);
+    d2 = _mm512_fmadd_ps(dy, dy, d2);
+    d2 = _mm512_fmadd_ps(dz, dz, d2);
+    /* zero distance pairs and lanes beyond natoms do not contribute */
+    valid = _mm512_mask_cmp_ps_mask(m, d2, zero, _CMP_GT_OQ);
+    qq = _mm512_maskz_mul_ps(valid, qi, _mm512_maskz_loadu_ps(m, charge+j));
+    qqf = _mm512_mul_ps(vdielf, qq);
+    bb = _mm512_mask_mul_ps(one, m, bi, _mm512_maskz_loadu_ps(m, br+j));
+    etij = exp512_ps(_mm512_div_ps(_mm512_mul_ps(_mm512_sub_ps(zero, pt25), 
+						 d2), bb));
+    fgb = rsqrt512_ps(_mm512_fmadd_ps(bb, etij, d2));
+    fgb3 = _mm512_mul_ps(_mm512_mul_ps(fgb, fgb), fgb);
+    en = _mm512_fmadd_ps(qqf, fgb, en);
+
+    mw = _mm512_mul_ps(_mm512_sub_ps(zero, qqf), 
+		       _mm512_mul_ps(_mm512_fnmadd_ps(pt25, etij, one), fgb3));
+    gx = _mm512_mul_ps(mw, dx);
+    gy = _mm512_mul_ps(mw, dy);
+    gz = _mm512_mul_ps(mw, dz);
+
+    /* Ai's */
+    atij = _mm512_mul_ps(_mm512_mul_ps(qq, _mm512_fmadd_ps(pt25, d2, bb)),
+			 _mm512_mul_ps(etij, fgb3));
+    derai = _mm512_add_ps(derai, atij);
+
+    _mm512_mask_storeu_ps(dera+j, m, 
+	     _mm512_add_ps(_mm512_maskz_loadu_ps(m, dera+j), atij));
+    _mm512_mask_storeu_ps(dgbdrx+j, m, 
+	     _mm512_add_ps(_mm512_maskz_loadu_ps(m, dgbdrx+j), gx));
+    _mm512_mask_storeu_ps(dgbdry+j, m, 
+	     _mm512_add_ps(_mm512_maskz_loadu_ps(m, dgbdry+j), gy));
+    _mm512_mask_storeu_ps(dgbdrz+j, m, 
+	     _mm512_add_ps(_mm512_maskz_loadu_ps(m, dgbdrz+j), gz));
+
+    dgbdrix = _mm512_sub_ps(dgbdrix, gx);
+    dgbdriy = _mm512_sub_ps(dgbdriy, gy);
+    dgbdriz = _mm512_sub_ps(dgbdriz, gz);
+  }
+
+  /* update accumulators for atom iat */
+  dera[iat] += _mm512_reduce_add_ps(derai);
+  dgbdrx[iat] += _mm512_reduce_add_ps(dgbdrix);
+  dgbdry[iat] += _mm512_reduce_add_ps(dgbdriy);
+  dgbdrz[iat] += _mm512_reduce_add_ps(dgbdriz);
+  /* update pair energy */
+  *egb_pair += _mm512_reduce_add_ps(en);
+  return AGBNP_OK;
+}
+
+/* Same as agbnp3_gb_energy_inner_nolist_avx512() without the Ai's and
+   the gradient, for energy-only evaluations. */
+AVX512_TARGET int agbnp3_gb_energy_only_inner_nolist_avx512(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor){
+  int j;
+  __mmask16 m, valid;
+  __m512 xi, yi, zi, qi, bi;
+  __m512 d2, dx, dy, dz, qqf, bb, etij, fgb;
+  __m512 zero = _mm512_setzero_ps();
+  __m512 mpt25 = _mm512_set1_ps(-0.25f);
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 vdielf = _mm512_set1_ps(2.0f*dielectric_factor);
+
+  /* accumulator */
+  __m512 en = _mm512_setzero_ps();
+
+  xi = _mm512_set1_ps(x[iat]);
+  yi = _mm512_set1_ps(y[iat]);
+  zi = _mm512_set1_ps(z[iat]);
+  qi = _mm512_set1_ps(charge[iat]);
+  bi = _mm512_set1_ps(br[iat]);
+
+  for(j=jb; j<natoms; j+=16){
+    m = agbnp3_mask16(natoms - j);
+
+    dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, x+j), xi);
+    dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, y+j), yi);
+    dz = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, z+j), zi);
+    d2 = _mm512_mul_ps(dx, dx);
+    d2 = _mm512_fmadd_ps(dy, dy, d2);
+    d2 = _mm512_fmadd_ps(dz, dz, d2);
+    valid = _mm512_mask_cmp_ps_mask(m, d2, zero, _CMP_GT_OQ);
+    qqf = _mm512_maskz_mul_ps(valid, _mm512_mul_ps(vdielf, qi), 
+			      _mm512_maskz_loadu_ps(m, charge+j));
+    bb = _mm512_mask_mul_ps(one, m, bi, _mm512_maskz_loadu_ps(m, br+j));
+    etij = exp512_ps(_mm512_div_ps(_mm512_mul_ps(mpt25, d2), bb));
+    fgb = rsqrt512_ps(_mm512_fmadd_ps(bb, etij, d2));
+    en = _mm512_fmadd_ps(qqf, fgb, en);
+  }
+
+  /* update pair energy */
+  *egb_pair += _mm512_reduce_add_ps(en);
+  return AGBNP_OK;
+}
+#endif
+
 
 /* 
 
@@ -345,12 +607,14 @@ All arrays are assumed to be 16-byte aligned.
   float egb_pair_h = 0.0;
 
   int beglead, endlead, begquad, endquad, begtrail, endtrail;
+  /* no Ai's and gradient for energy-only evaluations and trial moves */
+  int ders = !(agb->ener_only || agb->dlt_eval);
 
-  float *dera_m = agb->agbw->dera;
-
-  memset(dgbdrx,0,natoms*sizeof(float));
-  memset(dgbdry,0,natoms*sizeof(float));
-  memset(dgbdrz,0,natoms*sizeof(float));
+  if(ders){
+    memset(dgbdrx,0,natoms*sizeof(float));
+    memset(dgbdry,0,natoms*sizeof(float));
+    memset(dgbdrz,0,natoms*sizeof(float));
+  }
 
 #pragma omp for schedule(static,1)
   for(iat=0;iat<natoms;iat++){
@@ -358,56 +622,121 @@ All arrays are assumed to be 16-byte aligned.
     biat = br[iat];
     egb_self_h += vdielf*qiat*qiat/biat;
 
+#ifdef USE_AVX512
+    if(agb->simd >= AGBNP_SIMD_AVX512){
+      //AVX-512 inner loop, masked at the end
+      if(iat+1 < natoms && ders){
+        agbnp3_gb_energy_inner_nolist_avx512(agb, iat, natoms, iat+1,
+					     x, y, z, charge, br, dera,
+					     dgbdrx, dgbdry, dgbdrz, 
+					     &egb_pair_h, dielectric_factor);
+      }else if(iat+1 < natoms){
+        agbnp3_gb_energy_only_inner_nolist_avx512(agb, iat, natoms, iat+1,
+						  x, y, z, charge, br,
+						  &egb_pair_h, dielectric_factor);
+      }
+      continue;
+    }
+#endif
 #ifdef USE_SSE
-    //SSE inner loop
-    agbnp3_qindex(iat+1, natoms, &beglead, &endlead, &begquad, &endquad, &begtrail, &endtrail);
-    // leading j-particles before the start of the quads
-    if(beglead >= 0){// first j-particle not at quad boundary
-      agbnp3_gb_energy_inner_nolist_soa(agb, iat, natoms, 
+    if(agb->simd >= AGBNP_SIMD_SSE){
+      //SSE inner loop
+      agbnp3_qindex(iat+1, natoms, &beglead, &endlead, &begquad, &endquad, &begtrail, &endtrail);
+      // leading j-particles before the start of the quads
+      if(beglead >= 0 && ders){// first j-particle not at quad boundary
+        agbnp3_gb_energy_inner_nolist_soa(agb, iat, natoms, 
 					beglead, endlead,
 					x, y, z, charge, br, dera,
 					dgbdrx, dgbdry, dgbdrz, 
 					&egb_pair_h, dielectric_factor);
-    }
+      }else if(beglead >= 0){
+        agbnp3_gb_energy_only_inner_nolist_soa(agb, iat, natoms, 
+					     beglead, endlead,
+					     x, y, z, charge, br,
+					     &egb_pair_h, dielectric_factor);
+      }
 
-    /* compute the bulk in group of quads */
-    if(begquad >= 0){
-      agbnp3_gb_energy_inner_nolist_ps(
+      /* compute the bulk in group of quads */
+      if(begquad >= 0 && ders){
+        agbnp3_gb_energy_inner_nolist_ps(
 				       agb, iat, natoms, 
 				       begquad, 
 				       x, y, z,
 				       charge, br, dera,
 				       dgbdrx, dgbdry, dgbdrz, 
 				       &egb_pair_h, dielectric_factor);
-    }
+      }else if(begquad >= 0){
+        agbnp3_gb_energy_only_inner_nolist_ps(
+				       agb, iat, natoms, 
+				       begquad, 
+				       x, y, z, charge, br,
+				       &egb_pair_h, dielectric_factor);
+      }
 
-    // add the trailing left-overs
-    if(begtrail >= 0){
-      agbnp3_gb_energy_inner_nolist_soa(agb, iat, natoms, 
+      // add the trailing left-overs
+      if(begtrail >= 0 && ders){
+        agbnp3_gb_energy_inner_nolist_soa(agb, iat, natoms, 
 					begtrail, endtrail,
 					x, y, z, charge, br, dera,
 					dgbdrx, dgbdry, dgbdrz, 
 					&egb_pair_h, dielectric_factor);
+      }else if(begtrail >= 0){
+        agbnp3_gb_energy_only_inner_nolist_soa(agb, iat, natoms, 
+					     begtrail, endtrail,
+					     x, y, z, charge, br,
+					     &egb_pair_h, dielectric_factor);
+      }
+      continue;
     }
-#else // USE_SSE
-
+#endif
     //regular inner loop
     jstart = iat + 1;
     jend = natoms - 1;
-    if(jend>=jstart){
+    if(jend>=jstart && ders){
       agbnp3_gb_energy_inner_nolist_soa(agb, iat, natoms, 
 					jstart, jend,
 					x, y, z, charge, br, dera,
 					dgbdrx, dgbdry, dgbdrz, 
 					&egb_pair_h, dielectric_factor);
+    }else if(jend>=jstart){
+      agbnp3_gb_energy_only_inner_nolist_soa(agb, iat, natoms, 
+					     jstart, jend,
+					     x, y, z, charge, br,
+					     &egb_pair_h, dielectric_factor);
     }
-#endif
   }
 
 
+  return agbnp3_gb_energy_reduce(agb, agbw_h, egb_self_h, egb_pair_h, 
+				 egb_self, egb_pair);
+}
+
+/* Adds thread contributions to GB energies and to the derivatives
+   of the GB energy, and computes auxiliary quantities for the 
+   derivatives with respect to Born radii.  */
+int agbnp3_gb_energy_reduce(AGBNPdata *agb, AGBworkdata *agbw_h,
+			    float egb_self_h, float egb_pair_h,
+			    float *egb_self, float *egb_pair){
+  int iat;
+  int natoms = agb->natoms;
+  float *charge = (float *)agb->charge;
+  float *dera = (float *)agbw_h->dera;
+  float *dgbdrx = (float *)agbw_h->dgbdrx;
+  float *dgbdry = (float *)agbw_h->dgbdry;
+  float *dgbdrz = (float *)agbw_h->dgbdrz;
+  float *dera_m = agb->agbw->dera;
+
+  // add energies to total
+#pragma omp atomic
+  *egb_self += egb_self_h;
+#pragma omp atomic
+  *egb_pair += egb_pair_h;
+
+  /* nothing else is needed without derivatives */
+  if(agb->ener_only || agb->dlt_eval) return AGBNP_OK;
+
   //TBF copy the derivatives to old format
-  {
-    int iat;
+  if(agb->terms & AGBNP_TERM_GB){
     for(iat=0;iat<natoms;iat++){
       agbw_h->dgbdr_h[iat][0] += dgbdrx[iat];
       agbw_h->dgbdr_h[iat][1] += dgbdry[iat];
@@ -415,12 +744,6 @@ All arrays are assumed to be 16-byte aligned.
     }
   }
 
-  // add energies to total
-#pragma omp atomic
-  *egb_self += egb_self_h;
-#pragma omp atomic
-  *egb_pair += egb_pair_h;
-
 #ifdef _OPENMP
   //reduce dera
 #pragma omp critical
@@ -439,13 +762,16 @@ All arrays are assumed to be 16-byte aligned.
     float_a *brw = agb->agbw->brw;
     float_a *abrw = agb->agbw->abrw;
     float_a *br_m = agb->agbw->br;
+    /* zero for the terms turned off, see agbnp3_set_terms() */
+    float_a fgb = (agb->terms & AGBNP_TERM_GB) ? 1.0 : 0.0;
+    float_a fvdw = (agb->terms & AGBNP_TERM_VDW) ? 1.0 : 0.0;
     /* q2ab[], brw[], abrw[], br1_swf_der[], and dera_m[] 
        are master copies */
     for(iat=0;iat<natoms;iat++){
       q2ab[iat] = charge[iat]*charge[iat]+dera_m[iat]*br_m[iat];
-      q2ab[iat] *= br1_swf_der[iat];
+      q2ab[iat] *= fgb*br1_swf_der[iat];
       abrw[iat] = alpha[iat]*brw[iat];
-      abrw[iat] *= br1_swf_der[iat];
+      abrw[iat] *= fvdw*br1_swf_der[iat];
     }
   }
 
@@ -459,70 +785,1341 @@ All arrays are assumed to be 16-byte aligned.
   return AGBNP_OK;
 }
 
-#ifdef USE_SSE
-int agbnp3_gb_energy_nolist_ps_testders(AGBNPdata *agb, AGBworkdata *agbw_h,
-			       float *x, float *y, float *z,
-			       float *egb_self, float *egb_pair){
+/* Serial GB pair inner loop over the neighbors of atom iat in the GB
+pair list (cutoff mode). The pair energy is multiplied by a switching
+function which goes smoothly from 1 at gb_ron to 0 at gb_roff.
 
-  float en, en_old, dx = 0.01, de;;
-  float eself, epair;
-  int iat = 34;
-  int iter, niter = 100;
-  float *dgbdrx = agbw_h->dgbdrx;
-  float *dgbdry = agbw_h->dgbdry;
-  float *dgbdrz = agbw_h->dgbdrz;
+iat: pivot i atom
+n: number of neighbors
+jx, jy, jz, jq, jbr: positions, charges and Born radii of the neighbors, 
+                     gathered from the GB pair list
+jdera, jgx, jgy, jgz: output, contributions to dera and to the gradient 
+                      of the neighbors, to be scattered by the caller
 
-  agbnp3_gb_energy_nolist_ps(agb, agbw_h,
-			     x, y, z,
-			     &eself, &epair);
-  en_old = eself + epair;
+Contributions to atom iat are added to dera, dgbdrx, etc.
+*/
+int agbnp3_gb_energy_inner_nblist_soa(
+		    AGBNPdata *agb, int iat, int n,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *jx, float *jy, float *jz, float *jq, float *jbr,
+		    float *jdera, float *jgx, float *jgy, float *jgz,
+		    float *dera, float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor){
+  int k;
+  float xi, yi, zi, qi, bi;
+  float d2, d, dx, dy, dz, qq, qqf, bb, etij, fgb, fgb3, mw, atij, egb;
+  float sw, swp;
+  float valid_mask;
+  float ron = agb->gb_ron;
+  float roff = agb->gb_roff;
 
-  x[iat] += dx;
-  for(iter = 0; iter<niter; iter++){
-    agbnp3_gb_energy_nolist_ps(agb, agbw_h,
-			       x, y, z,
-			       &eself, &epair);
-    en = eself + epair;
-    de = dgbdrx[iat]*dx;
-    printf("en: %f %f %f\n", en, en-en_old, de);
-    en_old = en;
-    x[iat] += dx;
-  }
+  float en = 0.0f;
+  float pt25 = 0.25f;
+  float one =  1.0f;
+  float vdielf = 2.0f*dielectric_factor;
 
-  return AGBNP_OK;
+  float dgbdrix = 0.0f;
+  float dgbdriy = 0.0f;
+  float dgbdriz = 0.0f;
+  float derai = 0.0f;
 
-}
-#endif
+  xi = x[iat];
+  yi = y[iat];
+  zi = z[iat];
+  qi = charge[iat];
+  bi = br[iat];
 
- 
+  for(k=0; k<n; k++){
+    dx = jx[k] - xi;
+    dy = jy[k] - yi;
+    dz = jz[k] - zi;
+    d2 = dx*dx + dy*dy + dz*dz;
+    valid_mask = d2 > 0 ? 1.0f : 0.0f;
+    qq = valid_mask*qi*jq[k];
+    qqf = vdielf*qq;
+    bb = bi*jbr[k];
+    etij = expf(-pt25*d2/bb);
+    fgb = 1./sqrtf(d2 + bb*etij);
+    egb = qqf*fgb;
+    fgb3 = fgb*fgb*fgb;
 
-/* calculates inverse Born radii */
-int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
-					 float *x, float *y, float *z,
-					 int init_frozen){
-  float fourpi1 = 1./(4.*pi);
-  int iq4cache=0; /* cache counters */
-  int i, iat, j, jat;
-  float spiat, spjat, dx, dy, dz, d, q, dr4;
-  float riat, rjat;
+    /* switching function s(d) = 1 - p(d), p goes from 0 at ron to 1 at roff */
+    d = sqrtf(d2);
+    sw = one - agbnp3_pol_switchfunc(d, ron, roff, &swp, NULL);
+    swp = -swp;
 
-  int natoms = agb->natoms;
-  int nheavyat = agb->nheavyat;
-  float *r = agb->r;
-  float *sp = agbw_h->sp;
-  float *vols = agbw_h->vols;
-  float *br1 = agbw_h->br1;
-  float *q4cache = agbw_h->q4cache;
-  float vol2i;
+    /* (1/d) d(s*egb)/dd */
+    mw = -qqf*(one-pt25*etij)*fgb3*sw;
+    if(d2 > 0) mw += egb*swp/d;
 
-  float cvdw = AGBNP_RADIUS_INCREMENT;
+    jgx[k] = mw*dx;
+    jgy[k] = mw*dy;
+    jgz[k] = mw*dz;
 
-  float *dv = agbw_h->qdv;
-  float *R1v = agbw_h->qR1v;
-  float *R2v = agbw_h->qR2v;
-  int *btype = agbw_h->qbtype;
-  float *qv = agbw_h->qqv;
-  float *dqv = agbw_h->qdqv;
+    /* Ai's */
+    atij = sw*qq*(bb+pt25*d2)*etij*fgb3;
+
+    en += sw*egb;
+
+    jdera[k] = atij;
+    derai += atij;
+
+    dgbdrix -= jgx[k];
+    dgbdriy -= jgy[k];
+    dgbdriz -= jgz[k];
+  }
+
+  dera[iat] += derai;
+  dgbdrx[iat] += dgbdrix;
+  dgbdry[iat] += dgbdriy;
+  dgbdrz[iat] += dgbdriz;
+  *egb_pair += en;
+
+  return AGBNP_OK;
+}
+
+/* Vectorized version of agbnp3_gb_energy_inner_nblist_soa().
+
+The gathered buffers are assumed 16-byte aligned and padded to a
+multiple of 4. The lanes of the last quad beyond n are masked out.
+*/
+#ifdef USE_SSE
+int agbnp3_gb_energy_inner_nblist_ps(
+		    AGBNPdata *agb, int iat, int n,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *jx, float *jy, float *jz, float *jq, float *jbr,
+		    float *jdera, float *jgx, float *jgy, float *jgz,
+		    float *dera, float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor){
+   
+  int k4, n4 = (n+3)/4;
+  __m128 xi4, yi4, zi4, qi4, bi4;
+  __m128 d2, d1, d, dx, dy, dz, qq, qqf, bb, etij, fgb, fgb3, mw, atij, egb;
+  __m128 sw, swp, swpp;
+  __m128 gx, gy, gz;
+  __m128 valid_mask, lane, nleft;
+
+  /* accumulators  */
+  __m128 en = _mm_setzero_ps();
+  float *ent = (float *)&en;
+
+  __m128 derai = _mm_setzero_ps();
+  float *derait = (float *)&derai;
+
+  __m128 dgbdrix = _mm_setzero_ps();
+  __m128 dgbdriy = _mm_setzero_ps();
+  __m128 dgbdriz = _mm_setzero_ps();
+
+  float *dgbdrixt = (float *)&dgbdrix;
+  float *dgbdriyt = (float *)&dgbdriy;
+  float *dgbdrizt = (float *)&dgbdriz;
+  /*               */
+
+  __m128 pt25 = *(__m128*)_ps_pt25;
+  __m128 one = *(__m128*)_ps_1;
+  __m128 four = _mm_set_ps1(4.0f);
+  __m128 tiny = _mm_set_ps1(FLT_MIN);
+  __m128 ron = _mm_set_ps1(agb->gb_ron);
+  __m128 roff = _mm_set_ps1(agb->gb_roff);
+
+  __m128 *x4 = (__m128 *)jx;
+  __m128 *y4 = (__m128 *)jy;
+  __m128 *z4 = (__m128 *)jz;
+  __m128 *q4 = (__m128 *)jq;
+  __m128 *b4 = (__m128 *)jbr;
+  __m128 *dera4 = (__m128 *)jdera;
+  __m128 *gx4 = (__m128 *)jgx;
+  __m128 *gy4 = (__m128 *)jgy;
+  __m128 *gz4 = (__m128 *)jgz;
+
+  float vdiel = 2.0f*dielectric_factor;
+  __m128 vdielf = _mm_set_ps1(vdiel);
+
+  xi4 = _mm_set_ps1(x[iat]);
+  yi4 = _mm_set_ps1(y[iat]);
+  zi4 = _mm_set_ps1(z[iat]);
+  qi4 = _mm_set_ps1(charge[iat]);
+  bi4 = _mm_set_ps1(br[iat]);
+
+  /* lane indexes, compared to the number of remaining neighbors to 
+     mask out the padding of the last quad */
+  lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+  nleft = _mm_set_ps1((float)n);
+
+  for(k4=0; k4<n4; k4++){
+
+    dx = x4[k4] - xi4;
+    dy = y4[k4] - yi4;
+    dz = z4[k4] - zi4;
+    d2 = dx*dx + dy*dy + dz*dz;
+    valid_mask = _mm_and_ps(_mm_cmpgt_ps(d2, _mm_setzero_ps()),
+			    _mm_cmplt_ps(lane, nleft));
+    qq = _mm_and_ps(valid_mask, qi4*q4[k4]);
+    qqf = vdielf*qq;
+    bb = bi4*b4[k4];
+    etij = exp_ps(-pt25*d2/bb);
+    fgb = rsqrt_ps(d2 + bb*etij);
+    egb = qqf*fgb;
+    fgb3 = fgb*fgb*fgb;
+
+    /* switching function */
+    d1 = rsqrt_ps(_mm_max_ps(d2, tiny));
+    d = d2*d1;
+    sw = one - agbnp3_pol_switchfunc_ps(d, ron, roff, &swp, &swpp);
+
+    mw = -qqf*(one-pt25*etij)*fgb3*sw - egb*swp*d1;
+
+    gx = mw*dx;
+    gy = mw*dy;
+    gz = mw*dz;
+
+    /* Ai's */
+    atij = sw*qq*(bb+pt25*d2)*etij*fgb3;
+
+    en += sw*egb;
+
+    dera4[k4] = atij;
+    derai += atij;
+
+    gx4[k4] = gx;
+    gy4[k4] = gy;
+    gz4[k4] = gz;
+
+    dgbdrix -= gx;
+    dgbdriy -= gy;
+    dgbdriz -= gz;
+
+    nleft -= four;
+  }
+
+  /* update accumulators for atom iat */
+  dera[iat] += derait[0] + derait[1] + derait[2] + derait[3];
+  dgbdrx[iat] += dgbdrixt[0] + dgbdrixt[1] + dgbdrixt[2] + dgbdrixt[3];
+  dgbdry[iat] += dgbdriyt[0] + dgbdriyt[1] + dgbdriyt[2] + dgbdriyt[3];
+  dgbdrz[iat] += dgbdrizt[0] + dgbdrizt[1] + dgbdrizt[2] + dgbdrizt[3];
+  /* update pair energy */
+  *egb_pair += ent[0] + ent[1] + ent[2] + ent[3];
+  return AGBNP_OK;
+}
+#endif
+
+/* 
+
+GB pair and self-energy 
+          + derivatives (at constant Born radii).
+Pair energy with cutoff over the GB pair list built by 
+agbnp3_gb_neighbor_list().
+
+*/
+int agbnp3_gb_energy_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
+			       float *x, float *y, float *z,
+			       float *egb_self, float *egb_pair){
+  int iat, jat, j, n, n4;
+  float qiat,biat;
+  float dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float vdielf = dielectric_factor;
+  int natoms = agb->natoms;
+  float *charge = (float *)agb->charge;
+  float *br = (float *)agbw_h->br;
+  float *dera = (float *)agbw_h->dera;
+  float *dgbdrx = (float *)agbw_h->dgbdrx;
+  float *dgbdry = (float *)agbw_h->dgbdry;
+  float *dgbdrz = (float *)agbw_h->dgbdrz;
+  float egb_self_h = 0.0;
+  float egb_pair_h = 0.0;
+  NeighList *gb_nl = agbw_h->gb_nl;
+  int *nl;
+  float *jx = agbw_h->pbx;
+  float *jy = agbw_h->pby;
+  float *jz = agbw_h->pbz;
+  float *jq = agbw_h->pbq;
+  float *jbr = agbw_h->pbbr;
+  float *jdera = agbw_h->pbdera;
+  float *jgx = agbw_h->pbgx;
+  float *jgy = agbw_h->pbgy;
+  float *jgz = agbw_h->pbgz;
+
+  memset(dgbdrx,0,natoms*sizeof(float));
+  memset(dgbdry,0,natoms*sizeof(float));
+  memset(dgbdrz,0,natoms*sizeof(float));
+
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    qiat = charge[iat];
+    biat = br[iat];
+    egb_self_h += vdielf*qiat*qiat/biat;
+
+    n = gb_nl->nne[iat];
+    if(n <= 0) continue;
+    nl = gb_nl->neighl[iat];
+
+    /* gather neighbors, pad to a multiple of 4 with copies of atom iat */
+    for(j=0;j<n;j++){
+      jat = nl[j];
+      jx[j] = x[jat];
+      jy[j] = y[jat];
+      jz[j] = z[jat];
+      jq[j] = charge[jat];
+      jbr[j] = br[jat];
+    }
+    n4 = 4*((n+3)/4);
+    for(j=n;j<n4;j++){
+      jx[j] = x[iat];
+      jy[j] = y[iat];
+      jz[j] = z[iat];
+      jq[j] = 0.0f;
+      jbr[j] = biat;
+    }
+
+#ifdef USE_SSE
+    agbnp3_gb_energy_inner_nblist_ps(agb, iat, n, x, y, z, charge, br,
+				     jx, jy, jz, jq, jbr, 
+				     jdera, jgx, jgy, jgz,
+				     dera, dgbdrx, dgbdry, dgbdrz, 
+				     &egb_pair_h, dielectric_factor);
+#else
+    agbnp3_gb_energy_inner_nblist_soa(agb, iat, n, x, y, z, charge, br,
+				      jx, jy, jz, jq, jbr, 
+				      jdera, jgx, jgy, jgz,
+				      dera, dgbdrx, dgbdry, dgbdrz, 
+				      &egb_pair_h, dielectric_factor);
+#endif
+
+    /* scatter contributions to neighbors */
+    for(j=0;j<n;j++){
+      jat = nl[j];
+      dera[jat] += jdera[j];
+      dgbdrx[jat] += jgx[j];
+      dgbdry[jat] += jgy[j];
+      dgbdrz[jat] += jgz[j];
+    }
+  }
+
+  return agbnp3_gb_energy_reduce(agb, agbw_h, egb_self_h, egb_pair_h, 
+				 egb_self, egb_pair);
+}
+
+/* 
+
+GB pair and self-energy 
+          + derivatives (at constant Born radii).
+Treecode approximation of the pair sum.
+
+For each atom i the octree (agb->agbw->gbtree) is descended from the
+root. A node of radius r at distance d from atom i is accepted if 
+r < theta*d and d^2 > AGBNP_TREE_BFACTOR*b_i*bmax, and its interaction with i is evaluated from the node
+moments: with g(u,beta) = 1/sqrt(u + beta exp(-u/(4 beta))),
+u = |x_i - c|^2 and beta = b_i B, the potential of the node at i is
+
+  phi = Q g - 2 g_u (D.s) + g_u Tr(M) + 2 g_uu (s.M.s) + P b_i g_beta
+
+where s = x_i - c, Q, D and M are the charge, dipole and second 
+moments of the node and P = sum q_j (b_j - B). This is exact to second
+order in the distances of the atoms from the node center and to first
+order in the deviations of their Born radii from the node mean B. Leaves which are not accepted are evaluated directly.
+
+Every atom collects all of its interactions, so each thread only 
+updates its own atoms. The accuracy is controlled by theta 
+(agb->gb_tree_theta), the cost is O(N log N).
+*/
+int agbnp3_gb_energy_tree_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			      float *x, float *y, float *z,
+			      float *egb_self, float *egb_pair){
+  int iat, k, n, sp;
+  int stack[AGBNP_TREE_STACKSIZE];
+  int error = 0, res;
+  float dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float theta2 = agb->gb_tree_theta*agb->gb_tree_theta;
+  int natoms = agb->natoms;
+  float *charge = (float *)agb->charge;
+  float *br = (float *)agbw_h->br;
+  float *dera = (float *)agbw_h->dera;
+  float *dgbdrx = (float *)agbw_h->dgbdrx;
+  float *dgbdry = (float *)agbw_h->dgbdry;
+  float *dgbdrz = (float *)agbw_h->dgbdrz;
+  double egb_self_h = 0.0; /* many terms of similar size */
+  double egb_pair_h = 0.0;
+
+  AGBTree *tree = &(agb->agbw->gbtree);
+  AGBTreeNode *nd;
+  int *atoms;
+  float *tx, *ty, *tz, *tq, *tb;
+
+  float xi, yi, zi, qi, bi;
+  float dx, dy, dz, d2, bb, etij, fgb, fgb3, u1;
+  float phi, gx, gy, gz, ai, phib;
+  float sx, sy, sz, u, beta, w, ds;
+  float f, f_u, f_b, f_uu, f_ub, f_bb, f_uuu, f_uub;
+  float p, p3, p5, p7;
+  float g, g_u, g_b, g_uu, g_ub, g_bb, g_uuu, g_uub, h;
+  float *m, msx, msy, msz, sms, trm, r2;
+
+  memset(dgbdrx,0,natoms*sizeof(float));
+  memset(dgbdry,0,natoms*sizeof(float));
+  memset(dgbdrz,0,natoms*sizeof(float));
+
+#pragma omp single
+  {
+    agbnp3_tree_build(tree, natoms, x, y, z, charge, br);
+  }
+  if(tree->error){
+    agbnp3_errprint("agbnp3_gb_energy_tree_soa(): error in agbnp3_tree_build()\n");
+    return AGBNP_ERR;
+  }
+  atoms = tree->atoms;
+  tx = tree->x;
+  ty = tree->y;
+  tz = tree->z;
+  tq = tree->q;
+  tb = tree->b;
+
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    if(error) continue;
+    xi = x[iat];
+    yi = y[iat];
+    zi = z[iat];
+    qi = charge[iat];
+    bi = br[iat];
+    egb_self_h += dielectric_factor*qi*qi/bi;
+
+    /* potential at i, its gradient and its derivative with respect
+       to the Born radius of i, and the direct contribution to Ai */
+    phi = gx = gy = gz = phib = ai = 0.0f;
+
+    sp = 0;
+    stack[sp++] = 0;
+    while(sp > 0){
+      nd = &(tree->node[stack[--sp]]);
+      sx = xi - nd->c[0];
+      sy = yi - nd->c[1];
+      sz = zi - nd->c[2];
+      u = sx*sx + sy*sy + sz*sz;
+
+      /* effective size of the node */
+      r2 = nd->radius*nd->radius;
+      if(AGBNP_TREE_BFACTOR*bi*nd->bmax > r2) r2 = AGBNP_TREE_BFACTOR*bi*nd->bmax;
+      if(r2 < theta2*u){
+
+	/* far field from the node moments */
+	beta = bi*nd->b;
+	w = expf(-0.25f*u/beta);
+	f = u + beta*w;
+	f_u = 1.0f - 0.25f*w;
+	f_b = w*(1.0f + 0.25f*u/beta);
+	f_uu = 0.0625f*w/beta;
+	f_ub = -0.0625f*w*u/(beta*beta);
+	f_bb = 0.0625f*w*u*u/(beta*beta*beta);
+	f_uuu = -0.015625f*w/(beta*beta);
+	f_uub = 0.015625f*w*u/(beta*beta*beta) - 0.0625f*w/(beta*beta);
+	p = 1.0f/sqrtf(f);
+	p3 = p*p*p;
+	p5 = p3*p*p;
+	p7 = p5*p*p;
+	g = p;
+	g_u = -0.5f*p3*f_u;
+	g_b = -0.5f*p3*f_b;
+	g_uu = 0.75f*p5*f_u*f_u - 0.5f*p3*f_uu;
+	g_ub = 0.75f*p5*f_u*f_b - 0.5f*p3*f_ub;
+	g_bb = 0.75f*p5*f_b*f_b - 0.5f*p3*f_bb;
+	g_uuu = -1.875f*p7*f_u*f_u*f_u + 2.25f*p5*f_u*f_uu - 0.5f*p3*f_uuu;
+	g_uub = -1.875f*p7*f_u*f_u*f_b + 
+	  0.75f*p5*(f_uu*f_b + 2.0f*f_ub*f_u) - 0.5f*p3*f_uub;
+	m = nd->m;
+	ds = nd->d[0]*sx + nd->d[1]*sy + nd->d[2]*sz;
+	msx = m[0]*sx + m[1]*sy + m[2]*sz;
+	msy = m[1]*sx + m[3]*sy + m[4]*sz;
+	msz = m[2]*sx + m[4]*sy + m[5]*sz;
+	sms = sx*msx + sy*msy + sz*msz;
+	trm = m[0] + m[3] + m[5];
+
+	phi += nd->q*g - 2.0f*g_u*ds + g_u*trm + 2.0f*g_uu*sms + 
+	  nd->p*bi*g_b;
+	h = 2.0f*(nd->q*g_u - 2.0f*g_uu*ds + g_uu*trm + 2.0f*g_uuu*sms + 
+		  nd->p*bi*g_ub);
+	gx += h*sx - 2.0f*g_u*nd->d[0] + 4.0f*g_uu*msx;
+	gy += h*sy - 2.0f*g_u*nd->d[1] + 4.0f*g_uu*msy;
+	gz += h*sz - 2.0f*g_u*nd->d[2] + 4.0f*g_uu*msz;
+	phib += nd->b*(nd->q*g_b - 2.0f*g_ub*ds + g_ub*trm + 2.0f*g_uub*sms) + 
+	  nd->p*(g_b + beta*g_bb);
+
+      }else if(nd->nchild == 0){
+
+	/* near field, direct sum */
+	for(k=nd->first;k<nd->last;k++){
+	  if(atoms[k] == iat) continue;
+	  dx = tx[k] - xi;
+	  dy = ty[k] - yi;
+	  dz = tz[k] - zi;
+	  d2 = dx*dx + dy*dy + dz*dz;
+	  bb = bi*tb[k];
+	  etij = expf(-0.25f*d2/bb);
+	  fgb = 1.0f/sqrtf(d2 + bb*etij);
+	  fgb3 = fgb*fgb*fgb;
+	  phi += tq[k]*fgb;
+	  /* gradient with respect to x_i */
+	  u1 = tq[k]*(1.0f-0.25f*etij)*fgb3;
+	  gx += u1*dx;
+	  gy += u1*dy;
+	  gz += u1*dz;
+	  ai += tq[k]*(bb+0.25f*d2)*etij*fgb3;
+	}
+
+      }else{
+
+	if(sp + nd->nchild > AGBNP_TREE_STACKSIZE){
+	  error = 1;
+	  break;
+	}
+	for(n=nd->child;n<nd->child+nd->nchild;n++){
+	  stack[sp++] = n;
+	}
+
+      }
+    }
+
+    /* each pair is visited from both atoms */
+    egb_pair_h += dielectric_factor*qi*phi;
+    dgbdrx[iat] += 2.0f*dielectric_factor*qi*gx;
+    dgbdry[iat] += 2.0f*dielectric_factor*qi*gy;
+    dgbdrz[iat] += 2.0f*dielectric_factor*qi*gz;
+    dera[iat] += qi*ai - 2.0f*bi*qi*phib;
+  }
+
+  /* the reduction has barriers, it is done also if this thread failed */
+  res = agbnp3_gb_energy_reduce(agb, agbw_h, egb_self_h, egb_pair_h, 
+				egb_self, egb_pair);
+  if(error){
+    agbnp3_errprint("agbnp3_gb_energy_tree_soa(): tree traversal stack overflow.\n");
+    return AGBNP_ERR;
+  }
+  return res;
+}
+
+#ifdef USE_SSE
+int agbnp3_gb_energy_nolist_ps_testders(AGBNPdata *agb, AGBworkdata *agbw_h,
+			       float *x, float *y, float *z,
+			       float *egb_self, float *egb_pair){
+
+  float en, en_old, dx = 0.01, de;;
+  float eself, epair;
+  int iat = 34;
+  int iter, niter = 100;
+  float *dgbdrx = agbw_h->dgbdrx;
+  float *dgbdry = agbw_h->dgbdry;
+  float *dgbdrz = agbw_h->dgbdrz;
+
+  agbnp3_gb_energy_nolist_ps(agb, agbw_h,
+			     x, y, z,
+			     &eself, &epair);
+  en_old = eself + epair;
+
+  x[iat] += dx;
+  for(iter = 0; iter<niter; iter++){
+    agbnp3_gb_energy_nolist_ps(agb, agbw_h,
+			       x, y, z,
+			       &eself, &epair);
+    en = eself + epair;
+    de = dgbdrx[iat]*dx;
+    printf("en: %f %f %f\n", en, en-en_old, de);
+    en_old = en;
+    x[iat] += dx;
+  }
+
+  return AGBNP_OK;
+
+}
+#endif
+
+ 
+
+/* calculates inverse Born radii */
+int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+					 float *x, float *y, float *z,
+					 int init_frozen){
+  float fourpi1 = 1./(4.*pi);
+  int iq4cache=0; /* cache counters */
+  int i, iat, j, jat;
+  float spiat, spjat, dx, dy, dz, d, q, dr4;
+  float riat, rjat;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float *r = agb->r;
+  float *sp = agbw_h->sp;
+  float *vols = agbw_h->vols;
+  float *br1 = agbw_h->br1;
+  float *q4cache = agbw_h->q4cache;
+  float vol2i;
+
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
+
+  float *av = agbw_h->qav;
+  float *bv = agbw_h->qbv;
+  
+  float *qkv = agbw_h->qkv;
+  float *qxh= agbw_h->qxh;
+  float *qyp= agbw_h->qyp;
+  float *qy= agbw_h->qy;
+  float *qy2p= agbw_h->qy2p;
+  float *qy2= agbw_h->qy2;
+  float *qf1= agbw_h->qf1;
+  float *qf2= agbw_h->qf2;
+  float *qfp1= agbw_h->qfp1;
+  float *qfp2= agbw_h->qfp2;
+
+  int nrtype = agb->nrtype;
+  int *rtype = agb->rtype;
+
+  float xiat, yiat, ziat;
+
+  int iv;
+
+  /* with frozen atoms the i4() values of frozen-frozen pairs are
+     taken from the cache filled at the last initialization */
+  int *isfrozen = agb->isfrozen;
+  int frozen = agb->do_frozen && !init_frozen && !agb->q4cache_recompute;
+  /* energy-only evaluations need the cache only to initialize the
+     frozen-frozen pairs */
+  int fill = !agb->ener_only || 
+    (agb->do_frozen && init_frozen && !agb->q4cache_recompute);
+  int fiat;
+
+  iq4cache = 0;
+  /* Loop over heavy atom pairs, these need scaled volume correction */
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<nheavyat;iat++){
+
+    iv = 0;
+    if(agb->q4cache_recompute) iq4cache = 0;
+
+    xiat = x[iat];
+    yiat = y[iat];
+    ziat = z[iat];
+    riat = r[iat];
+    fiat = frozen && isfrozen[iat];
+
+    for(jat=iat+1; jat < nheavyat; jat++){
+      if(fiat && isfrozen[jat]) continue;
+      rjat = r[jat];
+      dx = x[jat] - xiat;
+      dy = y[jat] - yiat;
+      dz = z[jat] - ziat;
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      dv[iv] = d;
+      R1v[iv] = rjat - cvdw;
+      R2v[iv] = riat;
+      btype[iv] = rtype[jat]*nrtype + rtype[iat];
+
+      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
+
+      iv += 1;
+      dv[iv] = d;
+      R1v[iv] = riat - cvdw;
+      R2v[iv] = rjat;
+      btype[iv] = rtype[iat]*nrtype + rtype[jat];
+
+      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
+
+      iv += 1;
+    }
+
+    agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
+		    qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
+    
+    iv = 0;
+    for(jat=iat+1; jat < nheavyat; jat++){
+
+      spiat = sp[iat];
+      spjat = sp[jat];
+
+      if(fiat && isfrozen[jat]){
+	br1[jat] -= fourpi1*q4cache[iq4cache]*spiat;
+	br1[iat] -= fourpi1*q4cache[iq4cache+2]*spjat;
+	iq4cache += 4;
+	continue;
+      }
+
+      q = qv[iv];
+      
+      //printf("qq: %f %f\n",dv[iv],q*spiat);
+      //printf("qq: %f %f\n",q, agbnp3_i4(dv[iv],R1v[iv],R2v[iv],&dr4));
+
+      dr4 = dqv[iv];
+      iv += 1;
+      br1[jat] -= fourpi1*q*spiat;
+      if(fill){
+	q4cache[iq4cache] = q;
+	q4cache[iq4cache+1] = dr4;
+      }
+      iq4cache += 2;
+
+
+      q = qv[iv];
+      //printf("qq: %f %f\n",dv[iv],q*spjat);
+      //printf("qq: %f %f\n",q, agbnp3_i4(dv[iv],R1v[iv],R2v[iv],&dr4));
+
+      dr4 = dqv[iv];
+      iv += 1;
+      br1[iat] -= fourpi1*q*spjat;
+      if(fill){
+	q4cache[iq4cache] = q;
+	q4cache[iq4cache+1] = dr4;
+      }
+      iq4cache += 2;
+
+
+    }
+
+
+  }
+
+  /* born radii of hydrogens.
+     Assumes that hydrogens are listed after heavy atoms. */
+#pragma omp for schedule(static,1)
+  for(iat = 0; iat < nheavyat ; iat++){ //heavy atoms
+
+    iv = 0;
+    if(agb->q4cache_recompute) iq4cache = 0;
+
+    xiat = x[iat];
+    yiat = y[iat];
+    ziat = z[iat];
+    riat = r[iat];
+    fiat = frozen && isfrozen[iat];
+
+    for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
+      if(fiat && isfrozen[jat]) continue;
+      dx = x[jat] - xiat;
+      dy = y[jat] - yiat;
+      dz = z[jat] - ziat;
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      dv[iv] = d;
+      R1v[iv] = r[jat]-cvdw;
+      R2v[iv] = riat;
+      btype[iv] = rtype[jat]*nrtype + rtype[iat];
+
+      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
+
+      iv += 1;
+    }
+
+    agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
+		    qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
+    
+    iv = 0;
+
+    spiat = sp[iat];
+
+    for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
+      if(fiat && isfrozen[jat]){
+	br1[jat] -= fourpi1*q4cache[iq4cache]*spiat;
+	iq4cache += 2;
+	continue;
+      }
+      q = qv[iv];
+      dr4 = dqv[iv];
+      iv += 1;
+      br1[jat] -= fourpi1*q*spiat;
+      if(fill){
+	q4cache[iq4cache] = q;
+	q4cache[iq4cache+1] = dr4;
+      }
+      iq4cache += 2;
+
+    }
+
+  }
+
+  return AGBNP_OK;
+}
+
+/* Evaluates i4() and its derivative for row iat of the all-pairs
+   descreening loops and stores the (q, dq/dd) pairs in q4cache in the 
+   order written by agbnp3_inverse_born_radii_nolist_soa(): jat->iat and
+   iat->jat for heavy atoms jat > iat or, if hydrogens is set, iat->jat 
+   for all hydrogens. Used by the derivative kernels when 
+   agb->q4cache_recompute is set. Returns the number of floats stored. */
+int agbnp3_i4_nolist_row(AGBNPdata *agb, AGBworkdata *agbw_h,
+			 float_a *x, float_a *y, float_a *z,
+			 int iat, int hydrogens, float *q4cache){
+  int i, jat, iv;
+  float dx, dy, dz, d;
+  float riat, xiat, yiat, ziat;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float *r = agb->r;
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+  int nrtype = agb->nrtype;
+  int *rtype = agb->rtype;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
+
+  xiat = x[iat];
+  yiat = y[iat];
+  ziat = z[iat];
+  riat = r[iat];
+
+  iv = 0;
+  if(!hydrogens){
+    for(jat=iat+1; jat < nheavyat; jat++){
+      dx = x[jat] - xiat;
+      dy = y[jat] - yiat;
+      dz = z[jat] - ziat;
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      dv[iv] = d;
+      R1v[iv] = r[jat] - cvdw;
+      R2v[iv] = riat;
+      btype[iv] = rtype[jat]*nrtype + rtype[iat];
+      iv += 1;
+      dv[iv] = d;
+      R1v[iv] = riat - cvdw;
+      R2v[iv] = r[jat];
+      btype[iv] = rtype[iat]*nrtype + rtype[jat];
+      iv += 1;
+    }
+  }else{
+    for(jat = nheavyat; jat < natoms; jat++){
+      dx = x[jat] - xiat;
+      dy = y[jat] - yiat;
+      dz = z[jat] - ziat;
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      dv[iv] = d;
+      R1v[iv] = r[jat]-cvdw;
+      R2v[iv] = riat;
+      btype[iv] = rtype[jat]*nrtype + rtype[iat];
+      iv += 1;
+    }
+  }
+
+  agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, iv, qv, dqv, 
+		  agbw_h->qav, agbw_h->qbv, agbw_h->qkv, agbw_h->qxh, 
+		  agbw_h->qyp, agbw_h->qy, agbw_h->qy2p, agbw_h->qy2, 
+		  agbw_h->qf1, agbw_h->qf2, agbw_h->qfp1, agbw_h->qfp2);
+
+  for(i=0;i<iv;i++){
+    q4cache[2*i] = qv[i];
+    q4cache[2*i+1] = dqv[i];
+  }
+
+  return 2*iv;
+}
+
+#ifdef USE_SSE
+/* transposes 4 x,y,z triplets in SoA form into the 12 floats of their
+   AoS layout (x0 y0 z0 x1) (y1 z1 x2 y2) (z2 x3 y3 z3) */
+static inline void agbnp3_soa2aos_ps(__m128 vx, __m128 vy, __m128 vz,
+				     __m128 *o0, __m128 *o1, __m128 *o2){
+  __m128 xylo = _mm_unpacklo_ps(vx, vy); /* x0 y0 x1 y1 */
+  __m128 xyhi = _mm_unpackhi_ps(vx, vy); /* x2 y2 x3 y3 */
+  __m128 t;
+
+  t = _mm_shuffle_ps(vz, xylo, _MM_SHUFFLE(2,2,0,0));   /* z0 z0 x1 x1 */
+  *o0 = _mm_shuffle_ps(xylo, t, _MM_SHUFFLE(2,0,1,0));
+  t = _mm_shuffle_ps(xylo, vz, _MM_SHUFFLE(1,1,3,3));   /* y1 y1 z1 z1 */
+  *o1 = _mm_shuffle_ps(t, xyhi, _MM_SHUFFLE(1,0,2,0));
+  t = _mm_shuffle_ps(xyhi, vz, _MM_SHUFFLE(3,3,3,2));   /* x3 y3 z3 z3 */
+  *o2 = _mm_shuffle_ps(_mm_shuffle_ps(vz, xyhi, _MM_SHUFFLE(2,2,2,2)), t,
+		       _MM_SHUFFLE(2,1,2,0));
+}
+
+/* subtracts the 4 force vectors (fx,fy,fz) from the AoS gradients
+   g[0..3][3] */
+static inline void agbnp3_aos_sub_ps(float (*g)[3], 
+				     __m128 fx, __m128 fy, __m128 fz){
+  __m128 o0, o1, o2;
+  float *p = &(g[0][0]);
+
+  agbnp3_soa2aos_ps(fx, fy, fz, &o0, &o1, &o2);
+  _mm_storeu_ps(p,   _mm_sub_ps(_mm_loadu_ps(p),   o0));
+  _mm_storeu_ps(p+4, _mm_sub_ps(_mm_loadu_ps(p+4), o1));
+  _mm_storeu_ps(p+8, _mm_sub_ps(_mm_loadu_ps(p+8), o2));
+}
+
+/* horizontal sum of the elements of a */
+static inline float agbnp3_hsum_ps(__m128 a){
+  __m128 t = _mm_add_ps(a, _mm_movehl_ps(a, a));
+  t = _mm_add_ss(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1,1,1,1)));
+  return _mm_cvtss_f32(t);
+}
+
+/* GB and vdW derivatives at constant self volumes between heavy atom iat
+   and the heavy atoms jb to jb+4*n4-1, with the q4cache entries of the
+   pairs (4 per pair) starting at q4c. The i-side is accumulated in 
+   registers, the j-side is applied to the AoS gradients in blocks of 4 
+   atoms. Returns the number of pairs processed (4*n4). */
+int agbnp3_gb_ders_constvp_inner_ps(int iat, int jb, int n4,
+				    float *x, float *y, float *z,
+				    float *sp, float *q2ab, float *abrw,
+				    float *q4c, float gbfactor, float vdwfactor,
+				    float (*dgbdr)[3], float (*dvwdr)[3]){
+  int k, jat;
+  __m128 c0, c1, c2, c3, dqij, dqji, spj, rd, dx, dy, dz, ht, ut, gx, gy, gz;
+  __m128 xi4 = _mm_set_ps1(x[iat]);
+  __m128 yi4 = _mm_set_ps1(y[iat]);
+  __m128 zi4 = _mm_set_ps1(z[iat]);
+  __m128 spi4 = _mm_set_ps1(sp[iat]);
+  __m128 q2abi4 = _mm_set_ps1(q2ab[iat]);
+  __m128 abrwi4 = _mm_set_ps1(abrw[iat]);
+  __m128 gbf = _mm_set_ps1(gbfactor);
+  __m128 vwf = _mm_set_ps1(vdwfactor);
+  __m128 dgbix = _mm_setzero_ps();
+  __m128 dgbiy = _mm_setzero_ps();
+  __m128 dgbiz = _mm_setzero_ps();
+  __m128 dvwix = _mm_setzero_ps();
+  __m128 dvwiy = _mm_setzero_ps();
+  __m128 dvwiz = _mm_setzero_ps();
+
+  for(k=0;k<n4;k++){
+    jat = jb + 4*k;
+    /* q4cache entries are (q_ij, dq_ij, q_ji, dq_ji) for each pair */
+    c0 = _mm_loadu_ps(q4c);
+    c1 = _mm_loadu_ps(q4c+4);
+    c2 = _mm_loadu_ps(q4c+8);
+    c3 = _mm_loadu_ps(q4c+12);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    dqij = c1;
+    dqji = c3;
+    q4c += 16;
+
+    dx = _mm_loadu_ps(x+jat) - xi4;
+    dy = _mm_loadu_ps(y+jat) - yi4;
+    dz = _mm_loadu_ps(z+jat) - zi4;
+    rd = rsqrt_ps(dx*dx + dy*dy + dz*dz);
+    spj = _mm_loadu_ps(sp+jat);
+
+    ht = gbf*rd*(_mm_loadu_ps(q2ab+jat)*dqij*spi4 + q2abi4*dqji*spj);
+    ut = vwf*rd*(_mm_loadu_ps(abrw+jat)*dqij*spi4 + abrwi4*dqji*spj);
+
+    gx = ht*dx; gy = ht*dy; gz = ht*dz;
+    dgbix += gx; dgbiy += gy; dgbiz += gz;
+    agbnp3_aos_sub_ps(&(dgbdr[jat]), gx, gy, gz);
+
+    gx = ut*dx; gy = ut*dy; gz = ut*dz;
+    dvwix += gx; dvwiy += gy; dvwiz += gz;
+    agbnp3_aos_sub_ps(&(dvwdr[jat]), gx, gy, gz);
+  }
+
+  dgbdr[iat][0] += agbnp3_hsum_ps(dgbix);
+  dgbdr[iat][1] += agbnp3_hsum_ps(dgbiy);
+  dgbdr[iat][2] += agbnp3_hsum_ps(dgbiz);
+  dvwdr[iat][0] += agbnp3_hsum_ps(dvwix);
+  dvwdr[iat][1] += agbnp3_hsum_ps(dvwiy);
+  dvwdr[iat][2] += agbnp3_hsum_ps(dvwiz);
+
+  return 4*n4;
+}
+
+/* same as agbnp3_gb_ders_constvp_inner_ps() between heavy atom iat and 
+   the hydrogens jb to jb+4*n4-1, which carry 2 q4cache entries per pair 
+   (q_ij, dq_ij) and do not descreen */
+int agbnp3_gb_ders_constvp_h_inner_ps(int iat, int jb, int n4,
+				      float *x, float *y, float *z,
+				      float *sp, float *q2ab, float *abrw,
+				      float *q4c, float gbfactor, float vdwfactor,
+				      float (*dgbdr)[3], float (*dvwdr)[3]){
+  int k, jat;
+  __m128 dq, rd, dx, dy, dz, ht, ut, gx, gy, gz;
+  __m128 xi4 = _mm_set_ps1(x[iat]);
+  __m128 yi4 = _mm_set_ps1(y[iat]);
+  __m128 zi4 = _mm_set_ps1(z[iat]);
+  __m128 gbf = _mm_set_ps1(gbfactor*sp[iat]);
+  __m128 vwf = _mm_set_ps1(vdwfactor*sp[iat]);
+  __m128 dgbix = _mm_setzero_ps();
+  __m128 dgbiy = _mm_setzero_ps();
+  __m128 dgbiz = _mm_setzero_ps();
+  __m128 dvwix = _mm_setzero_ps();
+  __m128 dvwiy = _mm_setzero_ps();
+  __m128 dvwiz = _mm_setzero_ps();
+
+  for(k=0;k<n4;k++){
+    jat = jb + 4*k;
+    dq = _mm_shuffle_ps(_mm_loadu_ps(q4c), _mm_loadu_ps(q4c+4), 
+			_MM_SHUFFLE(3,1,3,1));
+    q4c += 8;
+
+    dx = _mm_loadu_ps(x+jat) - xi4;
+    dy = _mm_loadu_ps(y+jat) - yi4;
+    dz = _mm_loadu_ps(z+jat) - zi4;
+    rd = dq*rsqrt_ps(dx*dx + dy*dy + dz*dz);
+
+    ht = gbf*rd*_mm_loadu_ps(q2ab+jat);
+    ut = vwf*rd*_mm_loadu_ps(abrw+jat);
+
+    gx = ht*dx; gy = ht*dy; gz = ht*dz;
+    dgbix += gx; dgbiy += gy; dgbiz += gz;
+    agbnp3_aos_sub_ps(&(dgbdr[jat]), gx, gy, gz);
+
+    gx = ut*dx; gy = ut*dy; gz = ut*dz;
+    dvwix += gx; dvwiy += gy; dvwiz += gz;
+    agbnp3_aos_sub_ps(&(dvwdr[jat]), gx, gy, gz);
+  }
+
+  dgbdr[iat][0] += agbnp3_hsum_ps(dgbix);
+  dgbdr[iat][1] += agbnp3_hsum_ps(dgbiy);
+  dgbdr[iat][2] += agbnp3_hsum_ps(dgbiz);
+  dvwdr[iat][0] += agbnp3_hsum_ps(dvwix);
+  dvwdr[iat][1] += agbnp3_hsum_ps(dvwiy);
+  dvwdr[iat][2] += agbnp3_hsum_ps(dvwiz);
+
+  return 4*n4;
+}
+#endif
+
+/* GB and vdw derivatives contribution at constant self volumes */
+ int agbnp3_gb_ders_constvp_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
+				      float_a *x, float_a *y, float_a *z,
+				      int init_frozen){
+
+  int natoms = agb->natoms;
+  float_a dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float_a vdielf = 1.0;
+  int iq4cache=0; /* cache counters */
+  int i, iat, j, jat, hk;
+  float_a dx, dy, dz, d2, d, volume2, q, dr4, spiat, htij, utij, spjat;
+  float_a fourpi1 = 1./(4.*pi);
+  float_a gbfactor = fourpi1*vdielf*dielectric_factor;
+  int n;
+  
+  int nheavyat = agb->nheavyat;
+  int *iheavyat = agb->iheavyat;
+  int *isheavy = agbw_h->isheavy;
+  int nhydrogen = agb->nhydrogen;
+  int *ihydrogen = agb->ihydrogen;
+  NeighList *near_nl = agbw_h->near_nl;
+  NeighList *far_nl = agbw_h->far_nl;
+  float_a *sp = agbw_h->sp;
+  float_a *vols = agbw_h->vols;
+  float_a *q2ab = agbw_h->q2ab;
+  float_a *abrw = agbw_h->abrw;
+  float_a (*dgbdr)[3] = agbw_h->dgbdr_h;
+  float_a (*dvwdr)[3] = agbw_h->dvwdr_h;
+  float *q4cache = agbw_h->q4cache;
+  float_a u[3], ur[3];
+  float_a w[3], wr[3];
+
+  float *dgbdrx = agbw_h->dgbdrx;
+  float *dgbdry = agbw_h->dgbdry;
+  float *dgbdrz = agbw_h->dgbdrz;
+
+  /* frozen-frozen pairs only contribute to the derivatives of frozen 
+     atoms, which are not needed */
+  int *isfrozen = agb->isfrozen;
+  int fiat;
+
+  /* loop over near heavy-heavy interactions */
+  iq4cache = 0;
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<nheavyat;iat++){
+    if(agb->q4cache_recompute){
+      agbnp3_i4_nolist_row(agb, agbw_h, x, y, z, iat, 0, q4cache);
+      iq4cache = 0;
+    }
+    fiat = agb->do_frozen && isfrozen[iat];
+    jat = iat+1;
+#ifdef USE_SSE
+    if(!fiat){
+      n = agbnp3_gb_ders_constvp_inner_ps(iat, jat, (nheavyat-jat)/4, 
+			     x, y, z, sp, q2ab, abrw, &(q4cache[iq4cache]), 
+			     gbfactor, fourpi1, dgbdr, dvwdr);
+      jat += n;
+      iq4cache += 4*n;
+    }
+#endif
+    for(;jat<nheavyat;jat++){
+      if(fiat && isfrozen[jat]){
+	iq4cache += 4;
+	continue;
+      }
+      dx = x[jat] - x[iat];
+      dy = y[jat] - y[iat];
+      dz = z[jat] - z[iat];
+      d2 = dx*dx + dy*dy + dz*dz;
+      d = mysqrt(d2);
+      q = q4cache[iq4cache++];
+      dr4 = q4cache[iq4cache++];
+      spiat = sp[iat];
+      htij = q2ab[jat]*dr4*spiat;
+      utij = abrw[jat]*dr4*spiat;
+      q = q4cache[iq4cache++];
+      dr4 = q4cache[iq4cache++];
+      spjat = sp[jat];
+      htij += q2ab[iat]*dr4*spjat;
+      utij += abrw[iat]*dr4*spjat;
+      htij = fourpi1*vdielf*dielectric_factor*htij/d;	
+      u[0] = htij*dx;
+      u[1] = htij*dy;
+      u[2] = htij*dz;
+
+      dgbdr[iat][0] +=  u[0]; 
+      dgbdr[iat][1] +=  u[1]; 
+      dgbdr[iat][2] +=  u[2]; 
+      dgbdr[jat][0] -=  u[0];
+      dgbdr[jat][1] -=  u[1];
+      dgbdr[jat][2] -=  u[2];
+      
+      utij = fourpi1*utij/d;
+      w[0] = utij*dx;
+      w[1] = utij*dy;
+      w[2] = utij*dz;
+
+      dvwdr[iat][0] +=  w[0]; 
+      dvwdr[iat][1] +=  w[1]; 
+      dvwdr[iat][2] +=  w[2]; 
+      dvwdr[jat][0] -=  w[0];
+      dvwdr[jat][1] -=  w[1];
+      dvwdr[jat][2] -=  w[2];
+
+    }
+  }
+
+  /* loop for hydrogen-heavy interactions */
+#pragma omp for schedule(static,1)
+   for(iat = 0; iat < nheavyat ; iat++){//heavy atoms
+     if(agb->q4cache_recompute){
+       agbnp3_i4_nolist_row(agb, agbw_h, x, y, z, iat, 1, q4cache);
+       iq4cache = 0;
+     }
+     fiat = agb->do_frozen && isfrozen[iat];
+     jat = nheavyat;
+#ifdef USE_SSE
+     if(!fiat){
+       n = agbnp3_gb_ders_constvp_h_inner_ps(iat, jat, (natoms-jat)/4, 
+			     x, y, z, sp, q2ab, abrw, &(q4cache[iq4cache]), 
+			     gbfactor, fourpi1, dgbdr, dvwdr);
+       jat += n;
+       iq4cache += 2*n;
+     }
+#endif
+     for(; jat < natoms; jat++){ //hydrogens
+      if(fiat && isfrozen[jat]){
+	iq4cache += 2;
+	continue;
+      }
+
+      dx = x[jat] - x[iat];
+      dy = y[jat] - y[iat];
+      dz = z[jat] - z[iat];
+      d2 = dx*dx + dy*dy + dz*dz;
+      d = mysqrt(d2);
+      iq4cache += 1;
+      dr4 = q4cache[iq4cache++];
+      htij = q2ab[jat]*dr4*sp[iat];
+      utij = abrw[jat]*dr4*sp[iat];
+      
+      htij = fourpi1*vdielf*dielectric_factor*htij/d;	
+      u[0] = htij*dx;
+      u[1] = htij*dy;
+      u[2] = htij*dz;
+      
+      dgbdr[iat][0] +=  u[0]; 
+      dgbdr[iat][1] +=  u[1]; 
+      dgbdr[iat][2] +=  u[2]; 
+      dgbdr[jat][0] -=  u[0];
+      dgbdr[jat][1] -=  u[1];
+      dgbdr[jat][2] -=  u[2];
+      
+      utij = fourpi1*utij/d;
+      w[0] = utij*dx;
+      w[1] = utij*dy;
+      w[2] = utij*dz;
+      
+      dvwdr[iat][0] +=  w[0]; 
+      dvwdr[iat][1] +=  w[1]; 
+      dvwdr[iat][2] +=  w[2]; 
+      dvwdr[jat][0] -=  w[0];
+      dvwdr[jat][1] -=  w[1];
+      dvwdr[jat][2] -=  w[2];
+      
+    }
+  }
+
+  return AGBNP_OK;
+}
+
+
+/* Evaluates Ui's and Vi's */
+int agbnp3_gb_deruv_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h, 
+			  int init_frozen){
+  int iq4cache=0;
+  int i, iat, j, jat;
+  float_a q;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float *q2ab = agbw_h->q2ab;
+  float *abrw = agbw_h->abrw;
+  float *deru = agbw_h->deru;
+  float *derv = agbw_h->derv;
+  float *q4cache = agbw_h->q4cache;
+
+  /* heavy atoms loop */
+  iq4cache = 0;
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<nheavyat;iat++){
+    if(agb->q4cache_recompute){
+      agbnp3_i4_nolist_row(agb, agbw_h, agb->x, agb->y, agb->z, 
+			   iat, 0, q4cache);
+      iq4cache = 0;
+    }
+    for(jat=iat+1;jat<nheavyat;jat++){
+      /* get from cache */
+      q = q4cache[iq4cache++];
+      iq4cache += 1;
+      deru[iat] += q2ab[jat]*q;
+      derv[iat] += abrw[jat]*q;
+      q = q4cache[iq4cache++];
+      iq4cache += 1;
+      deru[jat] += q2ab[iat]*q;
+      derv[jat] += abrw[iat]*q;
+    }
+  }
+
+#pragma omp for schedule(static,1)
+  for(iat = 0; iat < nheavyat ; iat++){ //heavy atoms
+   if(agb->q4cache_recompute){
+     agbnp3_i4_nolist_row(agb, agbw_h, agb->x, agb->y, agb->z, 
+			  iat, 1, q4cache);
+     iq4cache = 0;
+   }
+   for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
+	q = q4cache[iq4cache++];
+	iq4cache += 1;
+	deru[iat] += q2ab[jat]*q;
+	derv[iat] += abrw[jat]*q;
+    }
+  }
+
+  return agbnp3_gb_deruv_reduce(agb, agbw_h);
+}
+
+/* Normalizes Ui's and Vi's, computes the effective gammas and adds 
+   thread contributions to the master copies */
+int agbnp3_gb_deruv_reduce(AGBNPdata *agb, AGBworkdata *agbw_h){
+  int iat;
+  float_a q;
+  int nheavyat = agb->nheavyat;
+  float *deru = agbw_h->deru;
+  float *derv = agbw_h->derv;
+  float *derus = agbw_h->derus;
+  float *dervs = agbw_h->dervs;
+  float *psvol = agbw_h->psvol;
+  float *deru_m = agb->agbw->deru;
+  float *derv_m = agb->agbw->derv;
+  float *derus_m = agb->agbw->derus;
+  float *dervs_m = agb->agbw->dervs;
+  float dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float *vols = agbw_h->vols;
+
+  for(iat=0;iat<nheavyat;iat++){
+    deru[iat] /= vols[iat];
+    derv[iat] /= vols[iat];
+  }
+  /* compute effective gammas for GB and vdW derivatives due to surface
+     area corrections */
+  q = 1./(4.*pi);
+  for(iat=0;iat<nheavyat;iat++){
+    dervs[iat] = q*psvol[iat]*derv[iat];
+  }
+  q = dielectric_factor/(4.*pi);
+  for(iat=0;iat<nheavyat;iat++){
+    derus[iat] = q*psvol[iat]*deru[iat];
+  }
+
+
+#ifdef _OPENMP
+  //reduce deru/derv
+#pragma omp critical
+  for(iat = 0; iat < nheavyat ; iat++){
+    deru_m[iat] += deru[iat];
+  }
+#pragma omp critical
+  for(iat = 0; iat < nheavyat ; iat++){
+    derv_m[iat] += derv[iat];
+  }
+#pragma omp critical
+  for(iat = 0; iat < nheavyat ; iat++){
+    derus_m[iat] += derus[iat];
+  }
+#pragma omp critical
+  for(iat = 0; iat < nheavyat ; iat++){
+    dervs_m[iat] += dervs[iat];
+  }
+#pragma omp barrier
+#endif
+  // copy to threads
+  memcpy(derv, derv_m, nheavyat*sizeof(float));
+  memcpy(deru, deru_m, nheavyat*sizeof(float));
+  memcpy(dervs, dervs_m, nheavyat*sizeof(float));
+  memcpy(derus, derus_m, nheavyat*sizeof(float));
+
+  return AGBNP_OK;
+}
+
+/* calculates inverse Born radii (cutoff mode) 
+
+Same as agbnp3_inverse_born_radii_nolist_soa() but only the pairs in
+the Born radii pair list (d < br_roff) are considered. The i4() 
+descreening integral of each pair is multiplied by a switching function 
+which goes from 1 at br_ron to 0 at br_roff. The switched values and 
+their derivatives are stored in the i4() cache for
+agbnp3_gb_ders_constvp_nblist_ps() and agbnp3_gb_deruv_nblist_ps().
+The descreening from beyond the cutoff is replaced by a mean-field
+term, see agbnp3_br_tail_function(). With frozen atoms the frozen-frozen
+pairs are in a separate list, their i4() values are computed when
+init_frozen is set and are taken from their cache otherwise.
+*/
+int agbnp3_inverse_born_radii_nblist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+					 float *x, float *y, float *z,
+					 int init_frozen){
+  float fourpi1 = 1./(4.*pi);
+  int iq4cache=0; /* cache counters */
+  int j, iat, jat, n, pass;
+  float spiat, dx, dy, dz, d, q, dr4, sw, swp;
+  float riat, rjat;
+  float_a g, gs, gR;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float *r = agb->r;
+  float *sp = agbw_h->sp;
+  float *br1 = agbw_h->br1;
+  float *q4cache = agbw_h->q4cache;
+  NeighList *br_nl = agbw_h->br_nl;
+  int *nl;
+  float ron = agb->br_ron;
+  float roff = agb->br_roff;
+  float *tailc = agbw_h->br_tailc;
+
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
 
   float *av = agbw_h->qav;
   float *bv = agbw_h->qbv;
@@ -545,11 +2142,45 @@ int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
 
   int iv;
 
+  /* the second pass goes over the frozen-frozen pairs, see
+     agbnp3_br_neighbor_list() */
+  int npass = agb->do_frozen ? 2 : 1;
+  NeighList *pnl;
+  float *cache;
+  /* energy-only evaluations need the cache only to initialize the
+     frozen-frozen pairs */
+  int fill;
+  int cached;
+
+  for(pass=0;pass<npass;pass++){
+  pnl = pass ? agbw_h->brfz_nl : br_nl;
+  cache = pass ? agbw_h->q4fzcache : q4cache;
+  fill = pass || !agb->ener_only;
+  cached = pass && !init_frozen;
   iq4cache = 0;
-  /* Loop over heavy atom pairs, these need scaled volume correction */
+  /* heavy-heavy pairs have two entries (descreening of j by i and of i 
+     by j), heavy-hydrogen pairs one (descreening of the hydrogen) */
 #pragma omp for schedule(static,1)
   for(iat=0;iat<nheavyat;iat++){
 
+    n = pnl->nne[iat];
+    if(n <= 0) continue;
+    nl = pnl->neighl[iat];
+
+    if(cached){
+      spiat = sp[iat];
+      for(j=0;j<n;j++){
+	jat = nl[j];
+	br1[jat] -= fourpi1*cache[iq4cache]*spiat;
+	iq4cache += 2;
+	if(jat < nheavyat){
+	  br1[iat] -= fourpi1*cache[iq4cache]*sp[jat];
+	  iq4cache += 2;
+	}
+      }
+      continue;
+    }
+
     iv = 0;
 
     xiat = x[iat];
@@ -557,7 +2188,8 @@ int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
     ziat = z[iat];
     riat = r[iat];
 
-    for(jat=iat+1; jat < nheavyat; jat++){
+    for(j=0;j<n;j++){
+      jat = nl[j];
       rjat = r[jat];
       dx = x[jat] - xiat;
       dy = y[jat] - yiat;
@@ -567,171 +2199,488 @@ int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
       R1v[iv] = rjat - cvdw;
       R2v[iv] = riat;
       btype[iv] = rtype[jat]*nrtype + rtype[iat];
-
-      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
-
       iv += 1;
-      dv[iv] = d;
-      R1v[iv] = riat - cvdw;
-      R2v[iv] = rjat;
-      btype[iv] = rtype[iat]*nrtype + rtype[jat];
+      if(jat < nheavyat){
+	dv[iv] = d;
+	R1v[iv] = riat - cvdw;
+	R2v[iv] = rjat;
+	btype[iv] = rtype[iat]*nrtype + rtype[jat];
+	iv += 1;
+      }
+    }
 
-      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
+    agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
+		    qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
 
-      iv += 1;
+    /* switching function */
+    for(j=0;j<iv;j++){
+      sw = 1.0f - agbnp3_pol_switchfunc(dv[j], ron, roff, &swp, NULL);
+      dqv[j] = sw*dqv[j] - swp*qv[j];
+      qv[j] = sw*qv[j];
     }
 
-#ifdef USE_SSE
-    agbnp3_i4p_ps(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
-		  qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
-#else
-    agbnp3_i4p_soa(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
-		  qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
-#endif
-    
+    spiat = sp[iat];
     iv = 0;
-    for(jat=iat+1; jat < nheavyat; jat++){
-
-      spiat = sp[iat];
-      spjat = sp[jat];
+    for(j=0;j<n;j++){
+      jat = nl[j];
 
       q = qv[iv];
-      
-      //printf("qq: %f %f\n",dv[iv],q*spiat);
-      //printf("qq: %f %f\n",q, agbnp3_i4(dv[iv],R1v[iv],R2v[iv],&dr4));
-
       dr4 = dqv[iv];
       iv += 1;
       br1[jat] -= fourpi1*q*spiat;
-      q4cache[iq4cache++] = q;
-      q4cache[iq4cache++] = dr4;
+      if(fill){
+	cache[iq4cache] = q;
+	cache[iq4cache+1] = dr4;
+      }
+      iq4cache += 2;
+
+      if(jat < nheavyat){
+	q = qv[iv];
+	dr4 = dqv[iv];
+	iv += 1;
+	br1[iat] -= fourpi1*q*sp[jat];
+	if(fill){
+	  cache[iq4cache] = q;
+	  cache[iq4cache+1] = dr4;
+	}
+	iq4cache += 2;
+      }
+    }
 
+  }
+  }
 
-      q = qv[iv];
-      //printf("qq: %f %f\n",dv[iv],q*spjat);
-      //printf("qq: %f %f\n",q, agbnp3_i4(dv[iv],R1v[iv],R2v[iv],&dr4));
+  /* mean-field tail correction */
+  agbnp3_br_tail_setup(agb, agbw_h, x, y, z);
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    dx = x[iat] - tailc[0];
+    dy = y[iat] - tailc[1];
+    dz = z[iat] - tailc[2];
+    d = mysqrt(dx*dx + dy*dy + dz*dz);
+    agbnp3_br_tail_function(d, agbw_h->br_tailR, agb->br_rm, &g, &gs, &gR);
+    br1[iat] -= agbw_h->br_tailA*g;
+  }
 
-      dr4 = dqv[iv];
+  return AGBNP_OK;
+}
+
+/* Inverse Born radii of a trial move from those of the reference state
+   (agbnp3_ener_delta()). Only the descreening pairs which changed are
+   evaluated: all pairs of moved atoms and the pairs with heavy atoms 
+   whose volume scaling factor changed. For each pair the new term, at 
+   the current coordinates and scaling factors, replaces the reference 
+   term, at the reference coordinates and scaling factors. In cutoff mode
+   the tail correction is also replaced. When the receptor and the ligand
+   are evaluated apart (agbnp3_ener_binding()) the ligand atoms are the
+   moved atoms and the new receptor-ligand terms are zero. */
+int agbnp3_inverse_born_radii_delta_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+					float_a *x, float_a *y, float_a *z){
+  float fourpi1 = 1./(4.*pi);
+  int i, iat, jat, n, iv;
+  float d, dq, sw, swp;
+  float_a g, gs, gR, dx, dy, dz;
+  float riat;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  float *r = agb->r;
+  float *sp = agbw_h->sp;
+  float *br1 = agbw_h->br1;
+  float *xref = agb->dlt_xref;
+  float *yref = agb->dlt_yref;
+  float *zref = agb->dlt_zref;
+  float *spref = agb->dlt_spref;
+  int *ismoved = agb->dlt_ismoved;
+  int *changed = agb->dlt_changed;
+  float ron = agb->br_ron;
+  float roff = agb->br_roff;
+  float *tailref = agb->dlt_tailref;
+  /* receptor and ligand apart, see agbnp3_ener_binding() */
+  int *part = agb->bnd_decouple ? agb->bnd_isligand : NULL;
+  float spj;
+
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+  int nrtype = agb->nrtype;
+  int *rtype = agb->rtype;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
+
+  /* heavy atoms whose descreening changed */
+#pragma omp single
+  {
+    float *sp_m = agb->agbw->sp;
+    agb->dlt_nchanged = 0;
+    for(iat=0;iat<nheavyat;iat++){
+      if(ismoved[iat] || fabs(sp_m[iat] - spref[iat]) > AGBNP_DELTA_SPTOL){
+	changed[agb->dlt_nchanged++] = iat;
+      }
+    }
+    /* start from the reference inverse Born radii */
+    memcpy(agb->agbw->br1, agb->dlt_br1ref, natoms*sizeof(float));
+  }
+
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    riat = r[iat] - cvdw;
+    n = ismoved[iat] ? nheavyat : agb->dlt_nchanged;
+    iv = 0;
+    for(i=0;i<n;i++){
+      jat = ismoved[iat] ? i : changed[i];
+      if(jat == iat) continue;
+      dx = x[jat] - x[iat];
+      dy = y[jat] - y[iat];
+      dz = z[jat] - z[iat];
+      dv[iv] = mysqrt(dx*dx + dy*dy + dz*dz);
+      R1v[iv] = riat;
+      R2v[iv] = r[jat];
+      btype[iv] = rtype[iat]*nrtype + rtype[jat];
       iv += 1;
-      br1[iat] -= fourpi1*q*spjat;
-      q4cache[iq4cache++] = q;
-      q4cache[iq4cache++] = dr4;
+      dx = xref[jat] - xref[iat];
+      dy = yref[jat] - yref[iat];
+      dz = zref[jat] - zref[iat];
+      dv[iv] = mysqrt(dx*dx + dy*dy + dz*dz);
+      R1v[iv] = riat;
+      R2v[iv] = r[jat];
+      btype[iv] = rtype[iat]*nrtype + rtype[jat];
+      iv += 1;
+    }
+    if(iv <= 0) continue;
 
+    agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, iv, qv, dqv, 
+		    agbw_h->qav, agbw_h->qbv, agbw_h->qkv, agbw_h->qxh, 
+		    agbw_h->qyp, agbw_h->qy, agbw_h->qy2p, agbw_h->qy2, 
+		    agbw_h->qf1, agbw_h->qf2, agbw_h->qfp1, agbw_h->qfp2);
 
+    if(roff > 0.0){
+      for(i=0;i<iv;i++){
+	sw = 1.0f - agbnp3_pol_switchfunc(dv[i], ron, roff, &swp, NULL);
+	qv[i] = sw*qv[i];
+      }
     }
 
+    dq = 0.0;
+    iv = 0;
+    for(i=0;i<n;i++){
+      jat = ismoved[iat] ? i : changed[i];
+      if(jat == iat) continue;
+      /* no descreening between receptor and ligand apart */
+      spj = (part && part[jat] != part[iat]) ? 0.0f : sp[jat];
+      dq += qv[iv]*spj - qv[iv+1]*spref[jat];
+      iv += 2;
+    }
+    br1[iat] -= fourpi1*dq;
+  }
 
+  /* tail correction */
+  if(roff > 0.0){
+    agbnp3_br_tail_setup(agb, agbw_h, x, y, z);
+#pragma omp for schedule(static,1)
+    for(iat=0;iat<natoms;iat++){
+      dx = x[iat] - agbw_h->br_tailc[0];
+      dy = y[iat] - agbw_h->br_tailc[1];
+      dz = z[iat] - agbw_h->br_tailc[2];
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      agbnp3_br_tail_function(d, agbw_h->br_tailR, agb->br_rm, &g, &gs, &gR);
+      br1[iat] -= agbw_h->br_tailA*g;
+      dx = xref[iat] - tailref[0];
+      dy = yref[iat] - tailref[1];
+      dz = zref[iat] - tailref[2];
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      agbnp3_br_tail_function(d, tailref[3], agb->br_rm, &g, &gs, &gR);
+      br1[iat] += tailref[4]*g;
+    }
   }
 
-  /* born radii of hydrogens.
-     Assumes that hydrogens are listed after heavy atoms. */
+  return AGBNP_OK;
+}
+
+/* Adds the descreening of the atoms of the asymmetric unit by the heavy 
+   atoms of its symmetry mates (crystal symmetry, see 
+   agbnp3_set_symmetry()). The coordinates of the mates are in agb->xs,
+   ys, zs: heavy atom jat of symmetry operation k is at k*nheavyat+jat. 
+   The mate has the self volume and scaling factor of jat. In cutoff 
+   mode the same switching function as in 
+   agbnp3_inverse_born_radii_nblist_soa() is applied. */
+int agbnp3_inverse_born_radii_sym_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+				      float_a *x, float_a *y, float_a *z){
+  float fourpi1 = 1./(4.*pi);
+  int iat, jat, k;
+  float dq, sw, swp;
+  float_a dx, dy, dz;
+  float riat;
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  int nsym = agb->nsym;
+  float_i *xs = agb->xs;
+  float_i *ys = agb->ys;
+  float_i *zs = agb->zs;
+  float *r = agb->r;
+  float *sp = agbw_h->sp;
+  float *br1 = agbw_h->br1;
+  float ron = agb->br_ron;
+  float roff = agb->br_roff;
+
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+  int nrtype = agb->nrtype;
+  int *rtype = agb->rtype;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
+
 #pragma omp for schedule(static,1)
-  for(iat = 0; iat < nheavyat ; iat++){ //heavy atoms
+  for(iat=0;iat<natoms;iat++){
+    riat = r[iat] - cvdw;
+    dq = 0.0;
+    for(k=0;k<nsym;k++){
+      for(jat=0;jat<nheavyat;jat++){
+	dx = xs[k*nheavyat+jat] - x[iat];
+	dy = ys[k*nheavyat+jat] - y[iat];
+	dz = zs[k*nheavyat+jat] - z[iat];
+	dv[jat] = mysqrt(dx*dx + dy*dy + dz*dz);
+	R1v[jat] = riat;
+	R2v[jat] = r[jat];
+	btype[jat] = rtype[iat]*nrtype + rtype[jat];
+      }
+      agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, nheavyat, qv, dqv, 
+		      agbw_h->qav, agbw_h->qbv, agbw_h->qkv, agbw_h->qxh, 
+		      agbw_h->qyp, agbw_h->qy, agbw_h->qy2p, agbw_h->qy2, 
+		      agbw_h->qf1, agbw_h->qf2, agbw_h->qfp1, agbw_h->qfp2);
+      for(jat=0;jat<nheavyat;jat++){
+	if(roff > 0.0){
+	  sw = 1.0f - agbnp3_pol_switchfunc(dv[jat], ron, roff, &swp, NULL);
+	  qv[jat] = sw*qv[jat];
+	}
+	if(dv[jat] <= 0.0f) continue; /* atom on a special position */
+	dq += qv[jat]*sp[jat];
+      }
+    }
+    br1[iat] -= fourpi1*dq;
+  }
 
-    iv = 0;
+  return AGBNP_OK;
+}
+
+/* GB and vdw derivatives due to the descreening by the symmetry mates
+   (see agbnp3_inverse_born_radii_sym_soa()). The gradient with respect
+   to the position of a mate atom is rotated back and added to its 
+   original in the asymmetric unit. Also adds the contributions of the
+   mates to Ui's and Vi's, which are finished by agbnp3_gb_deruv_*(). */
+int agbnp3_gb_ders_sym_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			   float_a *x, float_a *y, float_a *z){
+  float_a dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  float_a fourpi1 = 1./(4.*pi);
+  int i, iat, jat, k;
+  float sw, swp;
+  float_a dx, dy, dz, htij, utij;
+  float riat;
+  float_a u[3], w[3];
+
+  int natoms = agb->natoms;
+  int nheavyat = agb->nheavyat;
+  int nsym = agb->nsym;
+  float_i *xs = agb->xs;
+  float_i *ys = agb->ys;
+  float_i *zs = agb->zs;
+  float_i (*rot)[3][3] = agb->rot;
+  float *r = agb->r;
+  float *sp = agbw_h->sp;
+  float_a *q2ab = agbw_h->q2ab;
+  float_a *abrw = agbw_h->abrw;
+  float_a *deru = agbw_h->deru;
+  float_a *derv = agbw_h->derv;
+  float_a (*dgbdr)[3] = agbw_h->dgbdr_h;
+  float_a (*dvwdr)[3] = agbw_h->dvwdr_h;
+  float ron = agb->br_ron;
+  float roff = agb->br_roff;
+
+  float cvdw = AGBNP_RADIUS_INCREMENT;
+  int nrtype = agb->nrtype;
+  int *rtype = agb->rtype;
+
+  float *dv = agbw_h->qdv;
+  float *R1v = agbw_h->qR1v;
+  float *R2v = agbw_h->qR2v;
+  int *btype = agbw_h->qbtype;
+  float *qv = agbw_h->qqv;
+  float *dqv = agbw_h->qdqv;
+
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    riat = r[iat] - cvdw;
+    for(k=0;k<nsym;k++){
+      for(jat=0;jat<nheavyat;jat++){
+	dx = xs[k*nheavyat+jat] - x[iat];
+	dy = ys[k*nheavyat+jat] - y[iat];
+	dz = zs[k*nheavyat+jat] - z[iat];
+	dv[jat] = mysqrt(dx*dx + dy*dy + dz*dz);
+	R1v[jat] = riat;
+	R2v[jat] = r[jat];
+	btype[jat] = rtype[iat]*nrtype + rtype[jat];
+      }
+      agbnp3_i4p_simd(agb, dv, R1v, R2v, btype, nheavyat, qv, dqv, 
+		      agbw_h->qav, agbw_h->qbv, agbw_h->qkv, agbw_h->qxh, 
+		      agbw_h->qyp, agbw_h->qy, agbw_h->qy2p, agbw_h->qy2, 
+		      agbw_h->qf1, agbw_h->qf2, agbw_h->qfp1, agbw_h->qfp2);
+      for(jat=0;jat<nheavyat;jat++){
+	if(roff > 0.0){
+	  sw = 1.0f - agbnp3_pol_switchfunc(dv[jat], ron, roff, &swp, NULL);
+	  dqv[jat] = sw*dqv[jat] - swp*qv[jat];
+	  qv[jat] = sw*qv[jat];
+	}
+	if(dv[jat] <= 0.0f) continue;
+	/* Ui's and Vi's of the original of the mate atom */
+	deru[jat] += q2ab[iat]*qv[jat];
+	derv[jat] += abrw[iat]*qv[jat];
+
+	dx = xs[k*nheavyat+jat] - x[iat];
+	dy = ys[k*nheavyat+jat] - y[iat];
+	dz = zs[k*nheavyat+jat] - z[iat];
+	htij = fourpi1*dielectric_factor*q2ab[iat]*dqv[jat]*sp[jat]/dv[jat];
+	utij = fourpi1*abrw[iat]*dqv[jat]*sp[jat]/dv[jat];
+	u[0] = htij*dx;
+	u[1] = htij*dy;
+	u[2] = htij*dz;
+	w[0] = utij*dx;
+	w[1] = utij*dy;
+	w[2] = utij*dz;
+	for(i=0;i<3;i++){
+	  dgbdr[iat][i] += u[i];
+	  dvwdr[iat][i] += w[i];
+	  /* x' = R x + t, the gradient wrt x is R^T times that wrt x' */
+	  dgbdr[jat][i] -= rot[k][0][i]*u[0] + rot[k][1][i]*u[1] + 
+	    rot[k][2][i]*u[2];
+	  dvwdr[jat][i] -= rot[k][0][i]*w[0] + rot[k][1][i]*w[1] + 
+	    rot[k][2][i]*w[2];
+	}
+      }
+    }
+  }
 
-    xiat = x[iat];
-    yiat = y[iat];
-    ziat = z[iat];
-    riat = r[iat];
+  return AGBNP_OK;
+}
 
-    for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
-      dx = x[jat] - xiat;
-      dy = y[jat] - yiat;
-      dz = z[jat] - ziat;
-      d = mysqrt(dx*dx + dy*dy + dz*dz);
-      dv[iv] = d;
-      R1v[iv] = r[jat]-cvdw;
-      R2v[iv] = riat;
-      btype[iv] = rtype[jat]*nrtype + rtype[iat];
+/* Adds the descreening by the receptor of the grid (see 
+   agbnp3_set_receptor_grid()) to the inverse Born radii */
+int agbnp3_inverse_born_radii_grid_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+				       float_a *x, float_a *y, float_a *z){
+  int iat;
+  float_a q;
 
-      //fprintf(stderr,"rc: %d %d %d\n", iat, jat, btype[iv]);
+  int natoms = agb->natoms;
+  float *r = agb->r;
+  int *rtype = agb->rtype;
+  float *br1 = agbw_h->br1;
+  float cvdw = AGBNP_RADIUS_INCREMENT;
 
-      iv += 1;
-    }
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    agbnp3_rgrid_descreening(agb, rtype[iat], r[iat] - cvdw, 
+			    x[iat], y[iat], z[iat], &q, NULL);
+    br1[iat] -= q;
+  }
 
-#ifdef USE_SSE
-    agbnp3_i4p_ps(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
-		  qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
-#else
-    agbnp3_i4p_soa(agb, dv, R1v, R2v, btype, iv, qv, dqv, av, bv,
-		  qkv, qxh, qyp, qy, qy2p, qy2, qf1, qf2, qfp1, qfp2);
-#endif
-    
-    iv = 0;
+  return AGBNP_OK;
+}
 
-    spiat = sp[iat];
+/* GB and vdw derivatives due to the descreening by the receptor of the
+   grid (see agbnp3_inverse_born_radii_grid_soa()). The receptor is 
+   frozen, only the descreened atoms get a gradient. */
+int agbnp3_gb_ders_grid_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			    float_a *x, float_a *y, float_a *z){
+  float_a dielectric_factor = 
+    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
+  int i, iat;
+  float_a q, dq[3];
 
-    for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
-      q = qv[iv];
-      dr4 = dqv[iv];
-      iv += 1;
-      br1[jat] -= fourpi1*q*spiat;
-      q4cache[iq4cache++] = q;
-      q4cache[iq4cache++] = dr4;
+  int natoms = agb->natoms;
+  float *r = agb->r;
+  int *rtype = agb->rtype;
+  float_a *q2ab = agbw_h->q2ab;
+  float_a *abrw = agbw_h->abrw;
+  float_a (*dgbdr)[3] = agbw_h->dgbdr_h;
+  float_a (*dvwdr)[3] = agbw_h->dvwdr_h;
+  float cvdw = AGBNP_RADIUS_INCREMENT;
 
+#pragma omp for schedule(static,1)
+  for(iat=0;iat<natoms;iat++){
+    agbnp3_rgrid_descreening(agb, rtype[iat], r[iat] - cvdw, 
+			    x[iat], y[iat], z[iat], &q, dq);
+    for(i=0;i<3;i++){
+      dgbdr[iat][i] -= dielectric_factor*q2ab[iat]*dq[i];
+      dvwdr[iat][i] -= abrw[iat]*dq[i];
     }
-
   }
 
   return AGBNP_OK;
 }
 
-/* GB and vdw derivatives contribution at constant self volumes */
- int agbnp3_gb_ders_constvp_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
-				      float_a *x, float_a *y, float_a *z,
-				      int init_frozen){
+/* GB and vdw derivatives contribution at constant self volumes
+   (cutoff mode), reads the Born radii pair list and the i4() cache 
+   filled by agbnp3_inverse_born_radii_nblist_soa() */
+int agbnp3_gb_ders_constvp_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
+				     float_a *x, float_a *y, float_a *z,
+				     int init_frozen){
 
-  int natoms = agb->natoms;
   float_a dielectric_factor = 
     -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
   float_a vdielf = 1.0;
   int iq4cache=0; /* cache counters */
-  int i, iat, j, jat, hk;
-  float_a dx, dy, dz, d2, d, volume2, q, dr4, spiat, htij, utij, spjat;
+  int iat, j, jat, n;
+  float_a dx, dy, dz, d2, d, dr4, spiat, htij, utij, spjat;
   float_a fourpi1 = 1./(4.*pi);
   
+  int natoms = agb->natoms;
   int nheavyat = agb->nheavyat;
-  int *iheavyat = agb->iheavyat;
-  int *isheavy = agbw_h->isheavy;
-  int nhydrogen = agb->nhydrogen;
-  int *ihydrogen = agb->ihydrogen;
-  NeighList *near_nl = agbw_h->near_nl;
-  NeighList *far_nl = agbw_h->far_nl;
+  NeighList *br_nl = agbw_h->br_nl;
+  int *nl;
   float_a *sp = agbw_h->sp;
-  float_a *vols = agbw_h->vols;
   float_a *q2ab = agbw_h->q2ab;
   float_a *abrw = agbw_h->abrw;
   float_a (*dgbdr)[3] = agbw_h->dgbdr_h;
   float_a (*dvwdr)[3] = agbw_h->dvwdr_h;
   float *q4cache = agbw_h->q4cache;
-  float_a u[3], ur[3];
-  float_a w[3], wr[3];
-
-  float *dgbdrx = agbw_h->dgbdrx;
-  float *dgbdry = agbw_h->dgbdry;
-  float *dgbdrz = agbw_h->dgbdrz;
+  float_a u[3];
+  float_a w[3];
 
-  /* loop over near heavy-heavy interactions */
+  /* frozen-frozen pairs, which are not in the list, only contribute to
+     the derivatives of frozen atoms, which are not needed */
   iq4cache = 0;
 #pragma omp for schedule(static,1)
   for(iat=0;iat<nheavyat;iat++){
-    for(jat=iat+1;jat<nheavyat;jat++){
+    n = br_nl->nne[iat];
+    if(n <= 0) continue;
+    nl = br_nl->neighl[iat];
+    spiat = sp[iat];
+    for(j=0;j<n;j++){
+      jat = nl[j];
       dx = x[jat] - x[iat];
       dy = y[jat] - y[iat];
       dz = z[jat] - z[iat];
       d2 = dx*dx + dy*dy + dz*dz;
       d = mysqrt(d2);
-      q = q4cache[iq4cache++];
+      iq4cache += 1;
       dr4 = q4cache[iq4cache++];
-      spiat = sp[iat];
       htij = q2ab[jat]*dr4*spiat;
       utij = abrw[jat]*dr4*spiat;
-      q = q4cache[iq4cache++];
-      dr4 = q4cache[iq4cache++];
-      spjat = sp[jat];
-      htij += q2ab[iat]*dr4*spjat;
-      utij += abrw[iat]*dr4*spjat;
+      if(jat < nheavyat){
+	iq4cache += 1;
+	dr4 = q4cache[iq4cache++];
+	spjat = sp[jat];
+	htij += q2ab[iat]*dr4*spjat;
+	utij += abrw[iat]*dr4*spjat;
+      }
       htij = fourpi1*vdielf*dielectric_factor*htij/d;	
       u[0] = htij*dx;
       u[1] = htij*dy;
@@ -755,152 +2704,138 @@ int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
       dvwdr[jat][0] -=  w[0];
       dvwdr[jat][1] -=  w[1];
       dvwdr[jat][2] -=  w[2];
-
     }
   }
 
-  /* loop for hydrogen-heavy interactions */
-#pragma omp for schedule(static,1)
-   for(iat = 0; iat < nheavyat ; iat++){//heavy atoms
-     for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
+  /* mean-field tail correction. The inverse Born radius of atom i is
+     lowered by A*G(s_i,R) where s_i is the distance from the center of
+     the sphere, R its radius and A its self volume density. The center
+     and R depend on the positions of the heavy atoms. The partial sums 
+     over the atoms of this thread are applied to all heavy atoms. */
+  {
+    float_a *tailc = agbw_h->br_tailc;
+    float_a R = agbw_h->br_tailR;
+    float_a A = agbw_h->br_tailA;
+    float_a g, gs, gR, ph, pw, ds[3];
+    float_a qh = 0.0, qw = 0.0, vh[3] = {0.0, 0.0, 0.0}, vw[3] = {0.0, 0.0, 0.0};
+    float_a rf = (5./3.)/(nheavyat*R);
+    float_a nh1 = 1./nheavyat;
+    int k;
 
-      dx = x[jat] - x[iat];
-      dy = y[jat] - y[iat];
-      dz = z[jat] - z[iat];
-      d2 = dx*dx + dy*dy + dz*dz;
-      d = mysqrt(d2);
-      iq4cache += 1;
-      dr4 = q4cache[iq4cache++];
-      htij = q2ab[jat]*dr4*sp[iat];
-      utij = abrw[jat]*dr4*sp[iat];
-      
-      htij = fourpi1*vdielf*dielectric_factor*htij/d;	
-      u[0] = htij*dx;
-      u[1] = htij*dy;
-      u[2] = htij*dz;
-      
-      dgbdr[iat][0] +=  u[0]; 
-      dgbdr[iat][1] +=  u[1]; 
-      dgbdr[iat][2] +=  u[2]; 
-      dgbdr[jat][0] -=  u[0];
-      dgbdr[jat][1] -=  u[1];
-      dgbdr[jat][2] -=  u[2];
-      
-      utij = fourpi1*utij/d;
-      w[0] = utij*dx;
-      w[1] = utij*dy;
-      w[2] = utij*dz;
-      
-      dvwdr[iat][0] +=  w[0]; 
-      dvwdr[iat][1] +=  w[1]; 
-      dvwdr[iat][2] +=  w[2]; 
-      dvwdr[jat][0] -=  w[0];
-      dvwdr[jat][1] -=  w[1];
-      dvwdr[jat][2] -=  w[2];
-      
+#pragma omp for schedule(static,1)
+    for(iat=0;iat<natoms;iat++){
+      ds[0] = x[iat] - tailc[0];
+      ds[1] = y[iat] - tailc[1];
+      ds[2] = z[iat] - tailc[2];
+      d = mysqrt(ds[0]*ds[0] + ds[1]*ds[1] + ds[2]*ds[2]);
+      agbnp3_br_tail_function(d, R, agb->br_rm, &g, &gs, &gR);
+      ph = dielectric_factor*q2ab[iat];
+      pw = abrw[iat];
+      /* dependence on R through A and G */
+      qh += ph*A*(gR - 3.*g/R);
+      qw += pw*A*(gR - 3.*g/R);
+      /* dependence on s_i */
+      if(d > 0.0){
+	for(k=0;k<3;k++){
+	  u[k] = ph*A*gs*ds[k]/d;
+	  w[k] = pw*A*gs*ds[k]/d;
+	  dgbdr[iat][k] -= u[k];
+	  dvwdr[iat][k] -= w[k];
+	  vh[k] += u[k];
+	  vw[k] += w[k];
+	}
+      }
+    }
+    for(iat=0;iat<nheavyat;iat++){
+      ds[0] = x[iat] - tailc[0];
+      ds[1] = y[iat] - tailc[1];
+      ds[2] = z[iat] - tailc[2];
+      for(k=0;k<3;k++){
+	dgbdr[iat][k] += nh1*vh[k] - qh*rf*ds[k];
+	dvwdr[iat][k] += nh1*vw[k] - qw*rf*ds[k];
+      }
     }
   }
 
   return AGBNP_OK;
 }
 
-
-/* Evaluates Ui's and Vi's */
-int agbnp3_gb_deruv_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h, 
-			  int init_frozen){
+/* Evaluates Ui's and Vi's (cutoff mode), reads the Born radii pair list 
+   and the i4() cache filled by agbnp3_inverse_born_radii_nblist_soa(),
+   then the frozen-frozen pairs and their cache */
+int agbnp3_gb_deruv_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h, 
+			      int init_frozen){
   int iq4cache=0;
-  int i, iat, j, jat;
+  int iat, j, jat, n, pass;
+  int npass = agb->do_frozen ? 2 : 1;
+  NeighList *pnl;
   float_a q;
 
   int natoms = agb->natoms;
   int nheavyat = agb->nheavyat;
+  float_a *x = agb->x;
+  float_a *y = agb->y;
+  float_a *z = agb->z;
+  NeighList *br_nl = agbw_h->br_nl;
+  int *nl;
   float *q2ab = agbw_h->q2ab;
   float *abrw = agbw_h->abrw;
   float *deru = agbw_h->deru;
   float *derv = agbw_h->derv;
-  float *derus = agbw_h->derus;
-  float *dervs = agbw_h->dervs;
-  float *psvol = agbw_h->psvol;
-  float *q4cache = agbw_h->q4cache;
-  float *deru_m = agb->agbw->deru;
-  float *derv_m = agb->agbw->derv;
-  float *derus_m = agb->agbw->derus;
-  float *dervs_m = agb->agbw->dervs;
-
-  float dielectric_factor = 
-    -0.5*(1./agb->dielectric_in - 1./agb->dielectric_out);
-  float *vols = agbw_h->vols;
+  float *q4cache;
 
-  /* heavy atoms loop */
+  for(pass=0;pass<npass;pass++){
+  pnl = pass ? agbw_h->brfz_nl : br_nl;
+  q4cache = pass ? agbw_h->q4fzcache : agbw_h->q4cache;
   iq4cache = 0;
 #pragma omp for schedule(static,1)
   for(iat=0;iat<nheavyat;iat++){
-    for(jat=iat+1;jat<nheavyat;jat++){
-      /* get from cache */
+    n = pnl->nne[iat];
+    if(n <= 0) continue;
+    nl = pnl->neighl[iat];
+    for(j=0;j<n;j++){
+      jat = nl[j];
       q = q4cache[iq4cache++];
       iq4cache += 1;
       deru[iat] += q2ab[jat]*q;
       derv[iat] += abrw[jat]*q;
-      q = q4cache[iq4cache++];
-      iq4cache += 1;
-      deru[jat] += q2ab[iat]*q;
-      derv[jat] += abrw[iat]*q;
-    }
-  }
-
-#pragma omp for schedule(static,1)
-  for(iat = 0; iat < nheavyat ; iat++){ //heavy atoms
-   for(jat = nheavyat; jat < natoms; jat++){ //hydrogens
+      if(jat < nheavyat){
 	q = q4cache[iq4cache++];
 	iq4cache += 1;
-	deru[iat] += q2ab[jat]*q;
-	derv[iat] += abrw[jat]*q;
+	deru[jat] += q2ab[iat]*q;
+	derv[jat] += abrw[iat]*q;
+      }
     }
   }
-
-  for(iat=0;iat<nheavyat;iat++){
-    deru[iat] /= vols[iat];
-    derv[iat] /= vols[iat];
-  }
-  /* compute effective gammas for GB and vdW derivatives due to surface
-     area corrections */
-  q = 1./(4.*pi);
-  for(iat=0;iat<nheavyat;iat++){
-    dervs[iat] = q*psvol[iat]*derv[iat];
-  }
-  q = dielectric_factor/(4.*pi);
-  for(iat=0;iat<nheavyat;iat++){
-    derus[iat] = q*psvol[iat]*deru[iat];
   }
 
+  /* mean-field tail correction, A*G(s_i,R) is linear in the self 
+     volumes of the heavy atoms */
+  {
+    float_a *tailc = agbw_h->br_tailc;
+    float_a R = agbw_h->br_tailR;
+    float_a g, gs, gR, dx, dy, dz, d;
+    float_a su = 0.0, sv = 0.0, f;
+    float *vols = agbw_h->vols;
 
-#ifdef _OPENMP
-  //reduce deru/derv
-#pragma omp critical
-  for(iat = 0; iat < nheavyat ; iat++){
-    deru_m[iat] += deru[iat];
-  }
-#pragma omp critical
-  for(iat = 0; iat < nheavyat ; iat++){
-    derv_m[iat] += derv[iat];
-  }
-#pragma omp critical
-  for(iat = 0; iat < nheavyat ; iat++){
-    derus_m[iat] += derus[iat];
-  }
-#pragma omp critical
-  for(iat = 0; iat < nheavyat ; iat++){
-    dervs_m[iat] += dervs[iat];
+#pragma omp for schedule(static,1)
+    for(iat=0;iat<natoms;iat++){
+      dx = x[iat] - tailc[0];
+      dy = y[iat] - tailc[1];
+      dz = z[iat] - tailc[2];
+      d = mysqrt(dx*dx + dy*dy + dz*dz);
+      agbnp3_br_tail_function(d, R, agb->br_rm, &g, &gs, &gR);
+      su += q2ab[iat]*g;
+      sv += abrw[iat]*g;
+    }
+    f = 3./(R*R*R);
+    for(jat=0;jat<nheavyat;jat++){
+      deru[jat] += f*vols[jat]*su;
+      derv[jat] += f*vols[jat]*sv;
+    }
   }
-#pragma omp barrier
-#endif
-  // copy to threads
-  memcpy(derv, derv_m, nheavyat*sizeof(float));
-  memcpy(deru, deru_m, nheavyat*sizeof(float));
-  memcpy(dervs, dervs_m, nheavyat*sizeof(float));
-  memcpy(derus, derus_m, nheavyat*sizeof(float));
 
-  return AGBNP_OK;
+  return agbnp3_gb_deruv_reduce(agb, agbw_h);
 }
 
 /* applies cspline interpolation to a series of data:
@@ -1015,6 +2950,167 @@ int agbnp3_i4p_ps(AGBNPdata *agb, float* rijf, float *Rif, float *Rjf, int *btyp
   return AGBNP_OK;
 }
 #endif
+#ifdef USE_AVX2
+/* 8-wide version of agbnp3_i4p_ps(). The a = rij/Rj preparation, the 
+   lookup of the spline nodes with gathers from the packed tables of 
+   C1Table2DL, the interpolation and the 1/Rj scaling are done in one 
+   pass, without the staging buffers of agbnp3_i4p_ps(). The last 
+   partial group of points uses masked loads and stores */
+AVX2_TARGET int agbnp3_i4p_avx2(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+      int *btype, int m, float *f, float *fp){
+  C1Table2DL *tbl = agb->f4c1table2dl;
+  int i;
+  __m256i msk, inb, k, idx;
+  __m256 mskf, inbf, Rjinv, xh, kf, a, a2, b, b2, yk, ypk, y2k, y2pk, fv, fpv;
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i n = _mm256_set1_epi32(tbl->n);
+  __m256i nlast = _mm256_set1_epi32(tbl->n - 1);
+  __m256i mone = _mm256_set1_epi32(-1);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 three = _mm256_set1_ps(3.0f);
+  float dp1 = tbl->dx/6.0f;
+  __m256 dp1v = _mm256_set1_ps(dp1);
+  __m256 dp2v = _mm256_set1_ps(tbl->dx*dp1);
+  __m256 dxinv = _mm256_set1_ps(tbl->dxinv);
+
+  for(i=0;i<m;i+=8){
+    msk = _mm256_cmpgt_epi32(_mm256_set1_epi32(m - i), lane);
+    mskf = _mm256_castsi256_ps(msk);
+    Rjinv = _mm256_div_ps(one, 
+	     _mm256_blendv_ps(one, _mm256_maskload_ps(Rj+i, msk), mskf));
+    xh = _mm256_mul_ps(_mm256_mul_ps(_mm256_maskload_ps(rij+i, msk), Rjinv),
+		       dxinv);
+    k = _mm256_cvttps_epi32(xh);
+    kf = _mm256_cvtepi32_ps(k);
+
+    /* nodes beyond the end of the table (0 <= k <= n-2) are zero */
+    inb = _mm256_and_si256(msk, _mm256_and_si256(_mm256_cmpgt_epi32(k, mone),
+				       _mm256_cmpgt_epi32(nlast, k)));
+    inbf = _mm256_castsi256_ps(inb);
+    idx = _mm256_add_epi32(_mm256_mullo_epi32(
+	     _mm256_maskload_epi32(btype+i, msk), n), k);
+    yk = _mm256_mask_i32gather_ps(zero, tbl->y, idx, inbf, 4);
+    y2k = _mm256_mask_i32gather_ps(zero, tbl->y2, idx, inbf, 4);
+    idx = _mm256_sub_epi32(idx, mone);
+    ypk = _mm256_mask_i32gather_ps(zero, tbl->y, idx, inbf, 4);
+    y2pk = _mm256_mask_i32gather_ps(zero, tbl->y2, idx, inbf, 4);
+
+    a = _mm256_sub_ps(_mm256_add_ps(kf, one), xh);
+    a2 = _mm256_mul_ps(a, a);
+    b = _mm256_sub_ps(xh, kf);
+    b2 = _mm256_mul_ps(b, b);
+
+    fv = _mm256_fmadd_ps(a, yk, 
+	 _mm256_fmadd_ps(b, ypk,
+	 _mm256_mul_ps(dp2v, 
+	 _mm256_fmadd_ps(_mm256_fmsub_ps(a2, a, a), y2k, 
+			 _mm256_mul_ps(_mm256_fmsub_ps(b2, b, b), y2pk)))));
+    fpv = _mm256_fnmadd_ps(dp1v,
+	  _mm256_fmadd_ps(_mm256_fmsub_ps(three, a2, one), y2k,
+			  _mm256_mul_ps(_mm256_fmsub_ps(three, b2, one), y2pk)),
+	  _mm256_mul_ps(_mm256_sub_ps(ypk, yk), dxinv));
+
+    _mm256_maskstore_ps(f+i, msk, _mm256_mul_ps(fv, Rjinv));
+    _mm256_maskstore_ps(fp+i, msk, 
+			_mm256_mul_ps(fpv, _mm256_mul_ps(Rjinv, Rjinv)));
+  }
+
+  return AGBNP_OK;
+}
+#endif
+#ifdef USE_AVX512
+/* 16-wide version of agbnp3_i4p_avx2(), no padding of the arrays 
+   beyond m is assumed */
+AVX512_TARGET int agbnp3_i4p_avx512(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+      int *btype, int m, float *f, float *fp){
+  C1Table2DL *tbl = agb->f4c1table2dl;
+  int i;
+  __mmask16 msk, inb;
+  __m512i k, idx;
+  __m512 Rjinv, xh, kf, a, a2, b, b2, yk, ypk, y2k, y2pk, fv, fpv;
+  __m512i n = _mm512_set1_epi32(tbl->n);
+  __m512i nmax = _mm512_set1_epi32(tbl->n - 2);
+  __m512i ione = _mm512_set1_epi32(1);
+  __m512 zero = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 three = _mm512_set1_ps(3.0f);
+  float dp1 = tbl->dx/6.0f;
+  __m512 dp1v = _mm512_set1_ps(dp1);
+  __m512 dp2v = _mm512_set1_ps(tbl->dx*dp1);
+  __m512 dxinv = _mm512_set1_ps(tbl->dxinv);
+
+  for(i=0;i<m;i+=16){
+    msk = agbnp3_mask16(m - i);
+    Rjinv = _mm512_div_ps(one, _mm512_mask_loadu_ps(one, msk, Rj+i));
+    xh = _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(msk, rij+i), Rjinv),
+		       dxinv);
+    k = _mm512_cvttps_epi32(xh);
+    kf = _mm512_cvtepi32_ps(k);
+
+    /* nodes beyond the end of the table are zero, the unsigned 
+       comparison also excludes k < 0 */
+    inb = _mm512_mask_cmple_epu32_mask(msk, k, nmax);
+    idx = _mm512_add_epi32(_mm512_mullo_epi32(
+	     _mm512_maskz_loadu_epi32(msk, btype+i), n), k);
+    yk = _mm512_mask_i32gather_ps(zero, inb, idx, tbl->y, 4);
+    y2k = _mm512_mask_i32gather_ps(zero, inb, idx, tbl->y2, 4);
+    idx = _mm512_add_epi32(idx, ione);
+    ypk = _mm512_mask_i32gather_ps(zero, inb, idx, tbl->y, 4);
+    y2pk = _mm512_mask_i32gather_ps(zero, inb, idx, tbl->y2, 4);
+
+    a = _mm512_sub_ps(_mm512_add_ps(kf, one), xh);
+    a2 = _mm512_mul_ps(a, a);
+    b = _mm512_sub_ps(xh, kf);
+    b2 = _mm512_mul_ps(b, b);
+
+    /* a y + b yp + ((a^3 - a) y2 + (b^3 - b) y2p) dx^2/6 */
+    fv = _mm512_fmadd_ps(a, yk, 
+	 _mm512_fmadd_ps(b, ypk,
+	 _mm512_mul_ps(dp2v, 
+	 _mm512_fmadd_ps(_mm512_fmsub_ps(a2, a, a), y2k, 
+			 _mm512_mul_ps(_mm512_fmsub_ps(b2, b, b), y2pk)))));
+    /* (yp - y)/dx - ((3 a^2 - 1) y2 + (3 b^2 - 1) y2p) dx/6 */
+    fpv = _mm512_fnmadd_ps(dp1v,
+	  _mm512_fmadd_ps(_mm512_fmsub_ps(three, a2, one), y2k,
+			  _mm512_mul_ps(_mm512_fmsub_ps(three, b2, one), y2pk)),
+	  _mm512_mul_ps(_mm512_sub_ps(ypk, yk), dxinv));
+
+    _mm512_mask_storeu_ps(f+i, msk, _mm512_mul_ps(fv, Rjinv));
+    _mm512_mask_storeu_ps(fp+i, msk, 
+			  _mm512_mul_ps(fpv, _mm512_mul_ps(Rjinv, Rjinv)));
+  }
+
+  return AGBNP_OK;
+}
+#endif
+/* i4 lookups with the SIMD kernel set of the instance (agb->simd) */
+int agbnp3_i4p_simd(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+		    int *btype, int m, float *f, float *fp,
+		    float *mbuffera, float *mbufferb,
+		    float *qkv, float *qxh, float *qyp, float *qy, 
+		    float *qy2p, float *qy2,
+		    float *qf1, float *qf2, float *qfp1, float *qfp2){
+#ifdef USE_AVX512
+  if(agb->simd >= AGBNP_SIMD_AVX512){
+    return agbnp3_i4p_avx512(agb, rij, Ri, Rj, btype, m, f, fp);
+  }
+#endif
+#ifdef USE_AVX2
+  if(agb->simd >= AGBNP_SIMD_AVX2){
+    return agbnp3_i4p_avx2(agb, rij, Ri, Rj, btype, m, f, fp);
+  }
+#endif
+#ifdef USE_SSE
+  return agbnp3_i4p_ps(agb, rij, Ri, Rj, btype, m, f, fp, 
+		       mbuffera, mbufferb, qkv, qxh, qyp, qy, qy2p, qy2,
+		       qf1, qf2, qfp1, qfp2);
+#else
+  return agbnp3_i4p_soa(agb, rij, Ri, Rj, btype, m, f, fp, 
+			mbuffera, mbufferb, qkv, qxh, qyp, qy, qy2p, qy2,
+			qf1, qf2, qfp1, qfp2);
+#endif
+}
 
 /* print overlaps for debugging */
 int agbnp3_print_overlap_buffer(int order, int noverlaps, GOverlap *overlap, 
@@ -1060,7 +3156,16 @@ int agbnp3_print_overlap_buffer(int order, int noverlaps, GOverlap *overlap,
 
 
 /* Computes self-volumes, corrected self-volumes for pair
-    descreening, and surface areas */ 
+    descreening, and surface areas.
+
+   The contributions of the overlap tree of each root atom are recorded
+   for agbnp3_ener_delta() (agbw->svnew). A trial move
+   (AGBNP_LOCAL_TRIAL) rebuilds only the trees of the roots which are
+   moved or have a moved atom in their reference or current near_nl
+   row. Their reference contributions are subtracted, the other trees
+   are unchanged, see agbnp3_reset_buffers(). With AGBNP_LOCAL_INSERT
+   the reference lacks the moved atoms: only the trees which they enter
+   are built and only the overlaps which include them are added. */
 int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 			       float_a *x, float_a *y, float_a *z){
   /* coordinate buffer for Gaussian overlap calculation */
@@ -1145,8 +3250,55 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 
   float *xx;
 
+  /* overlap tree records, see agbnp3_ener_delta() */
+  int local = agb->dlt_local;
+  int record = (agb->dlt_br1 != NULL && local != AGBNP_LOCAL_INSERT);
+  int *ismoved = agb->dlt_ismoved;
+  int add = 1;
+  int *slot = NULL;
+  SVRoot *rec = NULL;
+  int nroots, ir;
+
   /* verbose = 1; */
 
+  if(agb->dlt_br1 && !agbw->svref){
+    agbnp3_vcalloc((void **)&(agbw->svref), agbw->natoms*sizeof(SVRoot));
+    agbnp3_vcalloc((void **)&(agbw->svnew), agbw->natoms*sizeof(SVRoot));
+    agbnp3_vcalloc((void **)&(agbw->svslot), agbw->natoms*sizeof(int));
+    agbnp3_vcalloc((void **)&(agbw->svroots), agbw->natoms*sizeof(int));
+    if(!(agbw->svref && agbw->svnew && agbw->svslot && agbw->svroots)){
+      agbnp3_errprint("agbnp3_self_volumes_rooti(): unable to allocate overlap tree records.\n");
+      return AGBNP_ERR;
+    }
+  }
+  slot = agbw->svslot;
+
+  if(local){
+    /* roots of this thread whose tree changes, with the same schedule
+       as the rows of near_nl */
+    agbw->nsvroots = 0;
+#pragma omp for schedule(static,1)
+    for(iat=0;iat<nheavyat;iat++){
+      int changed = ismoved[iat];
+      for(j=0; !changed && j < near_nl->nne[iat]; j++){
+	changed = ismoved[near_nl->neighl[iat][j]];
+      }
+      for(j=1; !changed && record && j < agbw->svref[iat].n; j++){
+	changed = ismoved[agbw->svref[iat].atom[j]];
+      }
+      if(changed) agbw->svroots[agbw->nsvroots++] = iat;
+    }
+    /* remove their reference contributions */
+    for(ir=0; record && ir<agbw->nsvroots; ir++){
+      rec = &(agbw->svref[agbw->svroots[ir]]);
+      for(j=0;j<rec->n;j++){
+	volumep[rec->atom[j]] -= rec->vol[j];
+	surf_area[rec->atom[j]] -= rec->area[j];
+      }
+    }
+    rec = NULL;
+  }
+  nroots = local ? agbw->nsvroots : nheavyat;
 
   for(iat=0;iat<nheavyat;iat++){
     agbw->atm_gs[iat].a = agbw->galpha[iat];
@@ -1178,7 +3330,8 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
   nov_beg = 0;
 
   nov = nov_beg;
-  for(iat=0;iat<nheavyat;iat++){ //assume heavy atoms are on top
+  for(ir=0;ir<nroots;ir++){ //assume heavy atoms are on top
+    iat = local ? agbw->svroots[ir] : ir;
 
     gsi = &(atm_gs[iat]);
 
@@ -1240,22 +3393,24 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
   }
   nov_end = nov;
 
-#ifdef USE_SSE
-  agbnp3_ogauss_ps(nov_beg, nov_end,
-		    c1x, c1y, c1z, a1, p1,
-		    c2x, c2y, c2z, a2, p2,
-		    volmina, volminb,
-		    v3, v3p, fp3, fpp3);
-#else
-  agbnp3_ogauss_soa(nov_beg, nov_end,
-		    c1x, c1y, c1z, a1, p1,
-		    c2x, c2y, c2z, a2, p2,
-		    volmina, volminb,
-		    v3, v3p, fp3, fpp3);
-#endif
+  agbnp3_ogauss_simd(agb, nov_beg, nov_end,
+		     c1x, c1y, c1z, a1, p1,
+		     c2x, c2y, c2z, a2, p2,
+		     volmina, volminb,
+		     v3, v3p, fp3, fpp3);
   
   nov = nov_beg;
-  for(iat=0;iat<nheavyat;iat++){ //assume heavy atoms are on top
+  for(ir=0;ir<nroots;ir++){ //assume heavy atoms are on top
+    iat = local ? agbw->svroots[ir] : ir;
+
+    if(record){
+      rec = &(agbw->svnew[iat]);
+      if(agbnp3_svroot_start(rec, iat, near_nl->nne[iat],
+			     near_nl->neighl[iat], slot) != AGBNP_OK){
+	agbnp3_errprint("agbnp3_self_volumes_rooti(): unable to expand overlap tree record.\n");
+	return AGBNP_ERR;
+      }
+    }
 
     gsi = &(atm_gs[iat]);
     gx[0][0] = gsi->c[0];
@@ -1319,6 +3474,15 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	ov->gs = gsij;
 	nov_next += 1;
 
+	/* only the overlaps of the moved atoms, see AGBNP_LOCAL_INSERT */
+	if(local == AGBNP_LOCAL_INSERT){
+	  add = 0;
+	  for(ii=0;ii<order;ii++){
+	    add |= ismoved[gatlist[ii]];
+	  }
+	  if(!add) continue;
+	}
+
 	/* collect scaled volumes */
 	u = volpcoeff[order-1];
 	v = order*volpcoeff[order-1];
@@ -1326,6 +3490,7 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	for(ii=0;ii<order;ii++){
 	  kat = gatlist[ii];
 	  volumep[kat] += w;
+	  if(record) rec->vol[slot[kat]] += w;
 	}
 	deltai = 0.0;
 	for(ii=0;ii<order;ii++){
@@ -1341,7 +3506,9 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	  v1 = u2*(gx[ii][1]-gsij.c[1]);
 	  v2 = u2*(gx[ii][2]-gsij.c[2]);
 	  d2 = v0*v0 + v1*v1 + v2*v2;
-	  surf_area[kat] += (h3*u1 + h4*d2/u1)/gr[ii];
+	  sr = (h3*u1 + h4*d2/u1)/gr[ii];
+	  surf_area[kat] += sr;
+	  if(record) rec->area[slot[kat]] += sr;
 	}
 	
       }
@@ -1450,19 +3617,11 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
     }
     nov_end =  nov;
 
-#ifdef USE_SSE
-    agbnp3_ogauss_ps(nov_beg, nov_end,
-		      c1x, c1y, c1z, a1, p1,
-		      c2x, c2y, c2z, a2, p2,
-		      volmina, volminb,
-		      v3, v3p, fp3, fpp3);
-#else
-    agbnp3_ogauss_soa(nov_beg, nov_end,
-		      c1x, c1y, c1z, a1, p1,
-		      c2x, c2y, c2z, a2, p2,
-		      volmina, volminb,
-		      v3, v3p, fp3, fpp3);
-#endif
+    agbnp3_ogauss_simd(agb, nov_beg, nov_end,
+		       c1x, c1y, c1z, a1, p1,
+		       c2x, c2y, c2z, a2, p2,
+		       volmina, volminb,
+		       v3, v3p, fp3, fpp3);
 
     /* second time through, assemble next overlap list and scatter to atoms */
     nov = nov_beg;
@@ -1487,6 +3646,14 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	  gp[ip] = atm_gs[iat].p;
 	  gr[ip] = agb->r[iat];
 	}
+
+	/* the first parent is the root atom of the tree */
+	if(record && rec->atom[0] != gatlist[0]){
+	  rec = &(agbw->svnew[gatlist[0]]);
+	  for(j=0;j<rec->n;j++){
+	    slot[rec->atom[j]] = j;
+	  }
+	}
 	
 	root_next[nroot_next] = nov_next; //starts a new root, maybe empty 
 	
@@ -1543,6 +3710,15 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	    ov->gs = gsij;
 	    nov_next += 1;
 	    
+	    /* only the overlaps of the moved atoms, see AGBNP_LOCAL_INSERT */
+	    if(local == AGBNP_LOCAL_INSERT){
+	      add = 0;
+	      for(ii=0;ii<order;ii++){
+		add |= ismoved[gatlist[ii]];
+	      }
+	      if(!add) continue;
+	    }
+
 	    /* collect scaled volumes */
 	    u = volpcoeff[order-1];
 	    v = order*volpcoeff[order-1];
@@ -1550,6 +3726,7 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	    for(ii=0;ii<order;ii++){
 	      kat = gatlist[ii];
 	      volumep[kat] += w;
+	      if(record) rec->vol[slot[kat]] += w;
 	    }
 	    deltai = 0.0;
 	    for(ii=0;ii<order;ii++){
@@ -1565,7 +3742,9 @@ int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 	      v1 = u2*(gx[ii][1]-gsij.c[1]);
 	      v2 = u2*(gx[ii][2]-gsij.c[2]);
 	      d2 = v0*v0 + v1*v1 + v2*v2;
-	      surf_area[kat] += (h3*u1 + h4*d2/u1)/gr[ii];
+	      sr = (h3*u1 + h4*d2/u1)/gr[ii];
+	      surf_area[kat] += sr;
+	      if(record) rec->area[slot[kat]] += sr;
 	    }
 
 	  }
@@ -2633,6 +4812,313 @@ int agbnp3_ogauss_ps(int n1, int n2,
 }
 #endif
 
+#ifdef USE_AVX2
+_PS256_CONST(2, 2.0f);
+_PS256_CONST(6, 6.0f);
+_PS256_CONST(10, 10.0f);
+_PS256_CONST(15, 15.0f);
+_PS256_CONST(30, 30.0f);
+_PS256_CONST(60, 60.0f);
+/* 8-wide version of agbnp3_pol_switchfunc_ps() */
+static inline AVX2_TARGET __m256 agbnp3_pol_switchfunc_avx(
+				 __m256 x, __m256 xa, __m256 xb,
+				 __m256 *fp, __m256 *fpp){
+  __m256 u,d,u2,f;
+  __m256 maskb, maskab;
+  __m256 one = *(__m256 *)_ps256_1;
+  __m256 two = *(__m256 *)_ps256_2;
+  __m256 three = *(__m256 *)_ps256_3;
+  __m256 six = *(__m256 *)_ps256_6;
+  __m256 ten = *(__m256 *)_ps256_10;
+  __m256 fifteen = *(__m256 *)_ps256_15;
+  __m256 thirty = *(__m256 *)_ps256_30;
+  __m256 sixty = *(__m256 *)_ps256_60;
+
+  maskb = _mm256_cmp_ps(x, xb, _CMP_LE_OQ);
+  maskab = _mm256_and_ps(_mm256_cmp_ps(x, xa, _CMP_GT_OQ), maskb);
+
+  d = _mm256_div_ps(one, _mm256_sub_ps(xb, xa));
+  u = _mm256_mul_ps(_mm256_sub_ps(x, xa), d);
+  u2 = _mm256_mul_ps(u, u);
+
+  /* u^3 (10 - 15 u + 6 u^2) */
+  f = _mm256_fmadd_ps(six, u2, _mm256_fnmadd_ps(fifteen, u, ten));
+  f = _mm256_mul_ps(_mm256_mul_ps(u, u2), f);
+  f = _mm256_and_ps(maskab, f);
+  f = _mm256_add_ps(f, _mm256_andnot_ps(maskb, one));
+  /* 30 d u^2 (1 - 2 u + u^2) */
+  *fp = _mm256_add_ps(_mm256_fnmadd_ps(two, u, one), u2);
+  *fp = _mm256_and_ps(maskab, 
+		      _mm256_mul_ps(_mm256_mul_ps(thirty, d),
+				    _mm256_mul_ps(u2, *fp)));
+  /* 60 d^2 u (1 - 3 u + 2 u^2) */
+  *fpp = _mm256_fmadd_ps(two, u2, _mm256_fnmadd_ps(three, u, one));
+  *fpp = _mm256_and_ps(maskab, 
+		       _mm256_mul_ps(_mm256_mul_ps(sixty, _mm256_mul_ps(d, d)),
+				     _mm256_mul_ps(u, *fpp)));
+  return f;
+}
+
+/* 8-wide AVX2/FMA version of agbnp3_ogauss_ps(), the arrays are assumed 
+   to be 32-byte aligned */
+AVX2_TARGET int agbnp3_ogauss_avx(int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp){
+  int n2p, n1p, kl1, kt2, k0, k8;
+
+  __m256 d2_8, dx_8, dy_8, dz_8, a12t_8, p12t_8;
+  __m256 deltai_8, u_8, gvol_8;
+  __m256 one = *(__m256 *)_ps256_1;
+  __m256 two = *(__m256 *)_ps256_2;
+  __m256 PI_8 = *(__m256 *)_ps256_PI;
+
+  __m256 *c1x_8 =(__m256 *)c1x;
+  __m256 *c1y_8 =(__m256 *)c1y;
+  __m256 *c1z_8 =(__m256 *)c1z;
+  __m256 *a1_8 =(__m256 *)a1;
+  __m256 *p1_8 =(__m256 *)p1;
+
+  __m256 *c2x_8 =(__m256 *)c2x;
+  __m256 *c2y_8 =(__m256 *)c2y;
+  __m256 *c2z_8 =(__m256 *)c2z;
+  __m256 *a2_8 =(__m256 *)a2;
+  __m256 *p2_8 =(__m256 *)p2;
+
+  __m256 volmina_8 = _mm256_set1_ps(volmina);
+  __m256 volminb_8 = _mm256_set1_ps(volminb);
+
+  __m256 *gvol_8p  =(__m256 *)gvol;
+  __m256 *gvolp_8  =(__m256 *)gvolp;
+  __m256 *fp_8     =(__m256 *)fp;
+  __m256 *fpp_8    =(__m256 *)fpp;
+
+  __m256 s, sp, spp;
+
+  kl1 = n1/8; /* starting octet */
+  kt2 = n2/8; /* ending octet */
+
+  if( kl1 == kt2 ){
+    /* if n1 and n2 are in the same octet do only SOA loop */
+    agbnp3_ogauss_soa(n1, n2, 
+		      c1x, c1y, c1z, a1, p1,
+		      c2x, c2y, c2z, a2, p2,
+		      volmina, volminb,
+		      gvol, gvolp, fp, fpp);
+    return n2-n1;
+  }
+
+  n1p = (n1%8 == 0) ? n1 : (kl1+1)*8; // position at next leading octet
+  /* leading terms in first octet */
+  agbnp3_ogauss_soa(n1, n1p, 
+		    c1x, c1y, c1z, a1, p1,
+		    c2x, c2y, c2z, a2, p2,
+		    volmina, volminb,
+		    gvol, gvolp, fp, fpp);
+
+  k0 = n1p/8; // first full octet
+  /* octets */
+  for(k8=k0; k8 < kt2; k8++){
+
+    dx_8 = _mm256_sub_ps(c2x_8[k8], c1x_8[k8]);
+    dy_8 = _mm256_sub_ps(c2y_8[k8], c1y_8[k8]);
+    dz_8 = _mm256_sub_ps(c2z_8[k8], c1z_8[k8]);
+    d2_8 = _mm256_mul_ps(dx_8, dx_8);
+    d2_8 = _mm256_fmadd_ps(dy_8, dy_8, d2_8);
+    d2_8 = _mm256_fmadd_ps(dz_8, dz_8, d2_8);
+
+    a12t_8 = _mm256_add_ps(a1_8[k8], a2_8[k8]);
+    deltai_8 = _mm256_div_ps(one, a12t_8);
+
+    u_8 = _mm256_mul_ps(_mm256_mul_ps(a1_8[k8], a2_8[k8]), 
+			_mm256_mul_ps(d2_8, deltai_8));
+    p12t_8 = _mm256_mul_ps(_mm256_mul_ps(p1_8[k8], p2_8[k8]),
+			   exp256_ps(_mm256_sub_ps(_mm256_setzero_ps(), u_8)));
+    /* (pi/a12)^(3/2) */
+    u_8 = _mm256_mul_ps(PI_8, deltai_8);
+    gvol_8 = _mm256_mul_ps(_mm256_mul_ps(p12t_8, u_8), 
+			   _mm256_mul_ps(u_8, rsqrt256_ps(u_8)));
+    gvol_8p[k8] = gvol_8;
+
+    c2x_8[k8] = _mm256_mul_ps(deltai_8, 
+	        _mm256_fmadd_ps(a1_8[k8], c1x_8[k8], 
+				_mm256_mul_ps(a2_8[k8], c2x_8[k8])));
+    c2y_8[k8] = _mm256_mul_ps(deltai_8, 
+	        _mm256_fmadd_ps(a1_8[k8], c1y_8[k8], 
+				_mm256_mul_ps(a2_8[k8], c2y_8[k8])));
+    c2z_8[k8] = _mm256_mul_ps(deltai_8, 
+	        _mm256_fmadd_ps(a1_8[k8], c1z_8[k8], 
+				_mm256_mul_ps(a2_8[k8], c2z_8[k8])));
+
+    a2_8[k8] = a12t_8;
+    p2_8[k8] = p12t_8;
+
+    s = agbnp3_pol_switchfunc_avx(gvol_8, volmina_8, volminb_8, &sp, &spp);
+    gvolp_8[k8] = _mm256_mul_ps(s, gvol_8);
+    fp_8[k8] = _mm256_fmadd_ps(gvol_8, sp, s);
+    fpp_8[k8] = _mm256_fmadd_ps(gvol_8, spp, _mm256_mul_ps(two, sp));
+
+  }
+
+  n2p = (n2%8 == 0) ? n2 : kt2*8; // position at beg. of last octet
+  /* trailing terms in last octet */
+  agbnp3_ogauss_soa(n2p, n2, 
+		    c1x, c1y, c1z, a1, p1,
+		    c2x, c2y, c2z, a2, p2,
+		    volmina, volminb,
+		    gvol, gvolp, fp, fpp);
+
+  return n2-n1;
+}
+#endif
+
+#ifdef USE_AVX512
+/* 16-wide version of agbnp3_pol_switchfunc_ps() */
+static inline AVX512_TARGET __m512 agbnp3_pol_switchfunc_avx512(
+				    __m512 x, __m512 xa, __m512 xb,
+				    __m512 *fp, __m512 *fpp){
+  __m512 u,d,u2,f;
+  __mmask16 maskab, maskgtb;
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 two = _mm512_set1_ps(2.0f);
+  __m512 three = _mm512_set1_ps(3.0f);
+
+  maskgtb = _mm512_cmp_ps_mask(x, xb, _CMP_GT_OQ);
+  maskab = _mm512_mask_cmp_ps_mask(_mm512_cmp_ps_mask(x, xb, _CMP_LE_OQ), 
+				   x, xa, _CMP_GT_OQ);
+
+  d = _mm512_div_ps(one, _mm512_sub_ps(xb, xa));
+  u = _mm512_mul_ps(_mm512_sub_ps(x, xa), d);
+  u2 = _mm512_mul_ps(u, u);
+
+  /* u^3 (10 - 15 u + 6 u^2), 1 beyond xb */
+  f = _mm512_fmadd_ps(_mm512_set1_ps(6.0f), u2, 
+		      _mm512_fnmadd_ps(_mm512_set1_ps(15.0f), u, 
+				       _mm512_set1_ps(10.0f)));
+  f = _mm512_maskz_mul_ps(maskab, _mm512_mul_ps(u, u2), f);
+  f = _mm512_mask_mov_ps(f, maskgtb, one);
+  /* 30 d u^2 (1 - 2 u + u^2) */
+  *fp = _mm512_add_ps(_mm512_fnmadd_ps(two, u, one), u2);
+  *fp = _mm512_maskz_mul_ps(maskab, 
+			    _mm512_mul_ps(_mm512_set1_ps(30.0f), d),
+			    _mm512_mul_ps(u2, *fp));
+  /* 60 d^2 u (1 - 3 u + 2 u^2) */
+  *fpp = _mm512_fmadd_ps(two, u2, _mm512_fnmadd_ps(three, u, one));
+  *fpp = _mm512_maskz_mul_ps(maskab, 
+			     _mm512_mul_ps(_mm512_set1_ps(60.0f), 
+					   _mm512_mul_ps(d, d)),
+			     _mm512_mul_ps(u, *fpp));
+  return f;
+}
+
+/* 16-wide version of agbnp3_ogauss_ps(). The overlaps before the first 
+   and after the last full group of 16 are handled with masked loads and
+   stores, no alignment is assumed. */
+AVX512_TARGET int agbnp3_ogauss_avx512(int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp){
+  int i;
+  __mmask16 m;
+  __m512 c1x_16, c1y_16, c1z_16, a1_16, c2x_16, c2y_16, c2z_16, a2_16;
+  __m512 d2_16, dx_16, dy_16, dz_16, a12t_16, p12t_16;
+  __m512 deltai_16, u_16, gvol_16;
+  __m512 s, sp, spp;
+  __m512 one = _mm512_set1_ps(1.0f);
+  __m512 two = _mm512_set1_ps(2.0f);
+  __m512 PI_16 = _mm512_set1_ps(3.141592654f);
+  __m512 volmina_16 = _mm512_set1_ps(volmina);
+  __m512 volminb_16 = _mm512_set1_ps(volminb);
+
+  for(i=n1; i<n2; i+=16){
+    m = agbnp3_mask16(n2 - i);
+
+    c1x_16 = _mm512_maskz_loadu_ps(m, c1x+i);
+    c1y_16 = _mm512_maskz_loadu_ps(m, c1y+i);
+    c1z_16 = _mm512_maskz_loadu_ps(m, c1z+i);
+    c2x_16 = _mm512_maskz_loadu_ps(m, c2x+i);
+    c2y_16 = _mm512_maskz_loadu_ps(m, c2y+i);
+    c2z_16 = _mm512_maskz_loadu_ps(m, c2z+i);
+    /* exponents of the unused lanes are set to one */
+    a1_16 = _mm512_mask_loadu_ps(one, m, a1+i);
+    a2_16 = _mm512_mask_loadu_ps(one, m, a2+i);
+
+    dx_16 = _mm512_sub_ps(c2x_16, c1x_16);
+    dy_16 = _mm512_sub_ps(c2y_16, c1y_16);
+    dz_16 = _mm512_sub_ps(c2z_16, c1z_16);
+    d2_16 = _mm512_mul_ps(dx_16, dx_16);
+    d2_16 = _mm512_fmadd_ps(dy_16, dy_16, d2_16);
+    d2_16 = _mm512_fmadd_ps(dz_16, dz_16, d2_16);
+
+    a12t_16 = _mm512_add_ps(a1_16, a2_16);
+    deltai_16 = _mm512_div_ps(one, a12t_16);
+
+    u_16 = _mm512_mul_ps(_mm512_mul_ps(a1_16, a2_16), 
+			 _mm512_mul_ps(d2_16, deltai_16));
+    p12t_16 = _mm512_mul_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(m, p1+i), 
+					  _mm512_maskz_loadu_ps(m, p2+i)),
+		       exp512_ps(_mm512_sub_ps(_mm512_setzero_ps(), u_16)));
+    /* (pi/a12)^(3/2) */
+    u_16 = _mm512_mul_ps(PI_16, deltai_16);
+    gvol_16 = _mm512_mul_ps(_mm512_mul_ps(p12t_16, u_16), 
+			    _mm512_mul_ps(u_16, rsqrt512_ps(u_16)));
+    _mm512_mask_storeu_ps(gvol+i, m, gvol_16);
+
+    _mm512_mask_storeu_ps(c2x+i, m, _mm512_mul_ps(deltai_16, 
+	 _mm512_fmadd_ps(a1_16, c1x_16, _mm512_mul_ps(a2_16, c2x_16))));
+    _mm512_mask_storeu_ps(c2y+i, m, _mm512_mul_ps(deltai_16, 
+	 _mm512_fmadd_ps(a1_16, c1y_16, _mm512_mul_ps(a2_16, c2y_16))));
+    _mm512_mask_storeu_ps(c2z+i, m, _mm512_mul_ps(deltai_16, 
+	 _mm512_fmadd_ps(a1_16, c1z_16, _mm512_mul_ps(a2_16, c2z_16))));
+
+    _mm512_mask_storeu_ps(a2+i, m, a12t_16);
+    _mm512_mask_storeu_ps(p2+i, m, p12t_16);
+
+    s = agbnp3_pol_switchfunc_avx512(gvol_16, volmina_16, volminb_16, 
+				     &sp, &spp);
+    _mm512_mask_storeu_ps(gvolp+i, m, _mm512_mul_ps(s, gvol_16));
+    _mm512_mask_storeu_ps(fp+i, m, _mm512_fmadd_ps(gvol_16, sp, s));
+    _mm512_mask_storeu_ps(fpp+i, m, 
+		   _mm512_fmadd_ps(gvol_16, spp, _mm512_mul_ps(two, sp)));
+  }
+
+  return n2-n1;
+}
+#endif
+
+/* Gaussian overlaps with the SIMD kernel set of the instance (agb->simd) */
+int agbnp3_ogauss_simd(AGBNPdata *agb, int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp){
+#ifdef USE_AVX512
+  if(agb->simd >= AGBNP_SIMD_AVX512){
+    return agbnp3_ogauss_avx512(n1, n2, c1x, c1y, c1z, a1, p1,
+				c2x, c2y, c2z, a2, p2, volmina, volminb,
+				gvol, gvolp, fp, fpp);
+  }
+#endif
+#ifdef USE_AVX2
+  if(agb->simd >= AGBNP_SIMD_AVX2){
+    return agbnp3_ogauss_avx(n1, n2, c1x, c1y, c1z, a1, p1,
+			     c2x, c2y, c2z, a2, p2, volmina, volminb,
+			     gvol, gvolp, fp, fpp);
+  }
+#endif
+#ifdef USE_SSE
+  return agbnp3_ogauss_ps(n1, n2, c1x, c1y, c1z, a1, p1,
+			  c2x, c2y, c2z, a2, p2, volmina, volminb,
+			  gvol, gvolp, fp, fpp);
+#else
+  return agbnp3_ogauss_soa(n1, n2, c1x, c1y, c1z, a1, p1,
+			   c2x, c2y, c2z, a2, p2, volmina, volminb,
+			   gvol, gvolp, fp, fpp);
+#endif
+}
+
 
 int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
 
@@ -2685,6 +5171,10 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
   float xb = AGBNP_HB_SWB;
   float fp, s;
   float ehb = 0.0; 
+  float ehb_lig = 0.0; /* of the ligand water sites, see agbnp3_ener_binding() */
+  int *isligand = agb->bnd_isligand;
+  /* receptor and ligand apart, see agbnp3_ener_binding() */
+  int *part = agb->bnd_decouple ? agb->bnd_isligand : NULL;
 
   float (*dehb)[3] = agbw->dehb; // derivatives of WS energy
 
@@ -2733,6 +5223,16 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
   float cutoff;
   float nboffset = AGBNP_NBOFFSET; 
 
+  AGBGrid *grid = &(agbw->wsgrid);
+  int ix, iy, iz, jx, jy, jz, jc, jb, je, k, jat;
+  float rmax, rwmax;
+
+  /* a trial move of agbnp3_ener_delta() evaluates only the ws atoms of
+     agbnp3_delta_wsatoms(), agb->ehb starts from the reference energy */
+  int local = (agb->dlt_local == AGBNP_LOCAL_TRIAL);
+  int nsites = local ? agbw->nwsdlt : agbw->nwsat;
+  int *sites = agbw->wsdlt;
+  int kws;
 
   if(agbw->nwsat > agbw->wsize){
     agbw->wsize += agbw->nwsat;
@@ -2744,35 +5244,26 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
     w_nov = agbw->w_nov;
   }
 
-  nadd = agbw->nwsat*nheavyat;
-  if(nadd > agbw->hbuffer_size){
-      // reallocate overlap lists
-    int new_size = nadd;
-    if(agbnp3_reallocate_hbuffers(agbw, new_size) != AGBNP_OK){
-      agbnp3_errprint("agbnp3_ws_free_volumes_scalev_ps(): Unable to expand Gaussian overlap buffers. Requested size = %d\n", new_size);
-      return AGBNP_ERR;
-    }else{
-      hiat = agbw->hiat;
-      ha1 = agbw->ha1;
-      hp1 = agbw->hp1;
-      hc1x = agbw->hc1x;
-      hc1y = agbw->hc1y;
-      hc1z = agbw->hc1z;
-      ha2 = agbw->ha2;
-      hp2 = agbw->hp2;
-      hc2x = agbw->hc2x;
-      hc2y = agbw->hc2y;
-      hc2z = agbw->hc2z;
-      hv3 = agbw->hv3;
-      hv3p = agbw->hv3p;
-      hfp3 = agbw->hfp3;
-      hfpp3 = agbw->hfpp3;
-    }
+  /* bin heavy atoms into cells at least as wide as the largest
+     water site/heavy atom overlap distance */
+  rwmax = 0.0f;
+  for(iws = 0 ; iws<agbw->nwsat;iws++){
+    if(agbw->wsat[iws].r > rwmax) rwmax = agbw->wsat[iws].r;
+  }
+  rmax = 0.0f;
+  for(iat=0;iat<nheavyat;iat++){
+    if(r[iat] > rmax) rmax = r[iat];
+  }
+  if(agbnp3_grid_build(grid, nheavyat, x, y, z, 
+		       (rmax+rwmax)*nboffset) != AGBNP_OK){
+    agbnp3_errprint("agbnp3_ws_free_volumes_scalev_ps(): error in agbnp3_grid_build()\n");
+    return AGBNP_ERR;
   }
 
   //phase1 collect interactions, place them in buffers 1 and 2
   nov = 0;
-  for(iws = 0 ; iws<agbw->nwsat;iws++){ 
+  for(kws = 0 ; kws<nsites;kws++){
+     iws = local ? sites[kws] : kws;
 
      wsat = &(agbw->wsat[iws]);
      xw = wsat->pos[0];
@@ -2783,54 +5274,115 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
 
      w_iov[iws] = nov;
      w_nov[iws] = 0;
-     for(iat=0;iat<nheavyat;iat++){
-       
-       dx = x[iat] - xw;
-       dy = y[iat] - yw;
-       dz = z[iat] - zw;
-       d2 = dx*dx + dy*dy + dz*dz;
-       u = (r[iat]+rw)*nboffset;
-       if(d2 < u*u){
-
-	 hiat[nov] = iat;
-	 /* buffer 1 */
-	 ha1[nov] = aw;
-	 hp1[nov] = pf_ws;
-	 hc1x[nov] = xw;
-	 hc1y[nov] = yw;
-	 hc1z[nov] = zw;
-	 /* buffer 2 */
-	 ha2[nov] = galpha[iat];
-	 hp2[nov] = gprefac[iat];
-	 hc2x[nov] = x[iat];
-	 hc2y[nov] = y[iat];
-	 hc2z[nov] = z[iat];
-	 
-	 w_nov[iws] += 1;
-	 nov += 1;
+
+     /* number of candidate heavy atoms in the neighboring cells */
+     agbnp3_grid_cell(grid, xw, yw, zw, &ix, &iy, &iz);
+     nadd = 0;
+     for(jz = iz-1; jz <= iz+1; jz++){
+       if(jz < 0 || jz >= grid->nz) continue;
+       for(jy = iy-1; jy <= iy+1; jy++){
+	 if(jy < 0 || jy >= grid->ny) continue;
+	 jb = (jz*grid->ny + jy)*grid->nx;
+	 nadd += grid->cell_start[jb + agbnp3_mymin(ix+1, grid->nx-1) + 1] - 
+	   grid->cell_start[jb + agbnp3_mymax(ix-1, 0)];
+       }
+     }
+
+     if(nov + nadd > agbw->hbuffer_size){
+       // reallocate overlap lists
+       int new_size = agbw->hbuffer_size + natoms*AGBNP_OVERLAPS_INCREMENT;
+       if (new_size - agbw->hbuffer_size < nadd){
+	 new_size = agbw->hbuffer_size + nadd;
+       }
+       if(agbnp3_reallocate_hbuffers(agbw, new_size) != AGBNP_OK){
+	 agbnp3_errprint("agbnp3_ws_free_volumes_scalev_ps(): Unable to expand Gaussian overlap buffers. Requested size = %d\n", new_size);
+	 return AGBNP_ERR;
+       }else{
+	 hiat = agbw->hiat;
+	 ha1 = agbw->ha1;
+	 hp1 = agbw->hp1;
+	 hc1x = agbw->hc1x;
+	 hc1y = agbw->hc1y;
+	 hc1z = agbw->hc1z;
+	 ha2 = agbw->ha2;
+	 hp2 = agbw->hp2;
+	 hc2x = agbw->hc2x;
+	 hc2y = agbw->hc2y;
+	 hc2z = agbw->hc2z;
+	 hv3 = agbw->hv3;
+	 hv3p = agbw->hv3p;
+	 hfp3 = agbw->hfp3;
+	 hfpp3 = agbw->hfpp3;
+       }
+     }
+
+     for(jz = iz-1; jz <= iz+1; jz++){
+       if(jz < 0 || jz >= grid->nz) continue;
+       for(jy = iy-1; jy <= iy+1; jy++){
+	 if(jy < 0 || jy >= grid->ny) continue;
+	 for(jx = ix-1; jx <= ix+1; jx++){
+	   if(jx < 0 || jx >= grid->nx) continue;
+	   jc = (jz*grid->ny + jy)*grid->nx + jx;
+	   jb = grid->cell_start[jc];
+	   je = grid->cell_start[jc+1];
+	   for(k=jb;k<je;k++){
+	     jat = grid->cell_atoms[k];
+	     if(part && part[jat] != part[wsat->parent[0]]) continue;
+	     dx = x[jat] - xw;
+	     dy = y[jat] - yw;
+	     dz = z[jat] - zw;
+	     d2 = dx*dx + dy*dy + dz*dz;
+	     u = (r[jat]+rw)*nboffset;
+	     if(d2 < u*u){
+	       /* insertion in ascending atom order, the free volume
+		  calculation below depends on the order of the overlaps */
+	       for(m = nov; m > w_iov[iws] && hiat[m-1] > jat; m--){
+		 hiat[m] = hiat[m-1];
+	       }
+	       hiat[m] = jat;
+	       w_nov[iws] += 1;
+	       nov += 1;
+	     }
+	   }
+	 }
        }
      }
+
+     for(i = w_iov[iws]; i < nov; i++){
+       jat = hiat[i];
+       /* buffer 1 */
+       ha1[i] = aw;
+       hp1[i] = pf_ws;
+       hc1x[i] = xw;
+       hc1y[i] = yw;
+       hc1z[i] = zw;
+       /* buffer 2 */
+       ha2[i] = galpha[jat];
+       hp2[i] = gprefac[jat];
+       hc2x[i] = x[jat];
+       hc2y[i] = y[jat];
+       hc2z[i] = z[jat];
+     }
   }
   
   /* evaluate gaussian overlaps and derivatives */
-#ifdef USE_SSE
-  agbnp3_ogauss_ps(0, nov,
-		   hc1x, hc1y, hc1z, ha1, hp1,
-		   hc2x, hc2y, hc2z, ha2, hp2,
-		   volmina, volminb,
-		   hv3, hv3p, hfp3, hfpp3);
-#else
-  agbnp3_ogauss_soa(0, nov,
-		    hc1x, hc1y, hc1z, ha1, hp1,
-		    hc2x, hc2y, hc2z, ha2, hp2,
-		    volmina, volminb,
-		    hv3, hv3p, hfp3, hfpp3);
-#endif
+  agbnp3_ogauss_simd(agb, 0, nov,
+		     hc1x, hc1y, hc1z, ha1, hp1,
+		     hc2x, hc2y, hc2z, ha2, hp2,
+		     volmina, volminb,
+		     hv3, hv3p, hfp3, hfpp3);
 
   //first pass, free volumes
-  for(iws = 0 ; iws<agbw->nwsat;iws++){ 
+  for(kws = 0 ; kws<nsites;kws++){
+    iws = local ? sites[kws] : kws;
 
     wsat = &(agbw->wsat[iws]);
+    if(local){
+      /* reference energy of the ws atom */
+      s = agbnp3_pol_switchfunc(wsat->sp, xa, xb, &fp, NULL);
+      ehb -= wsat->khb*s;
+      if(isligand && isligand[wsat->parent[0]]) ehb_lig -= wsat->khb*s;
+    }
     gx[0][0] = wsat->pos[0];
     gx[0][1] = wsat->pos[1];
     gx[0][2] = wsat->pos[2];
@@ -2851,12 +5403,12 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
 	
 	if(gvolp > 0.0f){
 	  
+	  iat = hiat[nov];
+
 	  wsat->free_volume -= spe[iat]*gvolp;
 	  
 	  gvol = hv3[nov]; //raw volume
 	  fp = hfp3[nov];
-
-	  iat = hiat[nov];
 	  
 	  gx[1][0] = x[iat];
 	  gx[1][1] = y[iat];
@@ -2898,6 +5450,7 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
     s = agbnp3_pol_switchfunc(wsat->sp, xa, xb, &fp, NULL);
     wsat->dhw = wsat->khb*fp/wsat->volume;
     ehb += wsat->khb*s;
+    if(isligand && isligand[wsat->parent[0]]) ehb_lig += wsat->khb*s;
 
     //printf("ws(%d): %f %f %f\n", iws, wsat->khb*s, s, wsat->sp);
 
@@ -2937,6 +5490,7 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
 #pragma omp critical
   {
     agb->ehb += ehb;
+    agb->bnd_ehb_lig += ehb_lig;
   }
 #pragma omp critical
   for(iat=0;iat<nheavyat;iat++){
@@ -2952,3 +5506,689 @@ int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw){
 
   return AGBNP_OK;
 }
+
+#ifdef USE_SSE
+/* 
+   Batched water site placement kernels, see agbnp3_update_wsatoms().
+
+   Each call of agbnp3_place_wat_*_ps() places the water sites of n 
+   acceptors/donors of the same geometry, 4 per SSE vector. n is rounded up
+   to a multiple of 4, the arrays have AGBNP_WSPLACE_BATCH (ld) lanes:
+
+   px[p*ld+k]: x coordinate of parent p of placement k (same for py, pz)
+   w[(s*3+c)*ld+k]: coordinate c of water site s of placement k
+   der[(s*36+(p*3+i)*3+j)*ld+k]: derivative of coordinate i of water site s
+                                 with respect to coordinate j of parent p
+                                 (WSat.dpos layout)
+
+   They follow the scalar agbnp3_place_wat_*() line by line.
+*/
+
+static inline void agbnp3_ws_load_ps(float *px, float *py, float *pz, 
+				     int p, int k, __m128 x[3]){
+  const int ld = AGBNP_WSPLACE_BATCH;
+  x[0] = _mm_loadu_ps(px+p*ld+k);
+  x[1] = _mm_loadu_ps(py+p*ld+k);
+  x[2] = _mm_loadu_ps(pz+p*ld+k);
+}
+
+static inline void agbnp3_ws_store_pos_ps(float *w, int s, int k, 
+					  __m128 x, __m128 y, __m128 z){
+  const int ld = AGBNP_WSPLACE_BATCH;
+  _mm_storeu_ps(w+(s*3+0)*ld+k, x);
+  _mm_storeu_ps(w+(s*3+1)*ld+k, y);
+  _mm_storeu_ps(w+(s*3+2)*ld+k, z);
+}
+
+static inline void agbnp3_ws_store_der_ps(float *der, int s, int k, int np,
+					  __m128 d[][3][3]){
+  const int ld = AGBNP_WSPLACE_BATCH;
+  int p, i, j;
+  for(p=0;p<np;p++){
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	_mm_storeu_ps(der+(s*36+(p*3+i)*3+j)*ld+k, d[p][i][j]);
+      }
+    }
+  }
+}
+
+/* 4-wide agbnp3_cross_product() without derivatives */
+static inline void agbnp3_cross_product_ps(__m128 a[3], __m128 b[3], 
+					   __m128 c[3]){
+  c[0] = a[1]*b[2] - a[2]*b[1];
+  c[1] = a[2]*b[0] - a[0]*b[2];
+  c[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+/* 4-wide agbnp3_der_unitvector() */
+static inline void agbnp3_der_unitvector_ps(__m128 u[3], __m128 invr,
+					    __m128 der[3][3]){
+  int i, j;
+  __m128 s = -invr;
+  for(i=0;i<3;i++){
+    for(j=0;j<3;j++){
+      der[i][j] = s*u[i]*u[j];
+    }
+  }
+  for(i=0;i<3;i++){
+    der[i][i] += invr;
+  }
+}
+
+/* 4-wide agbnp3_matmul() */
+static inline void agbnp3_matmul_ps(__m128 a[3][3], __m128 b[3][3], 
+				    __m128 c[3][3]){
+  int i, j, k;
+  for(i=0;i<3;i++){
+    for(j=0;j<3;j++){
+      c[i][j] = a[i][0]*b[0][j];
+      for(k=1;k<3;k++){
+	c[i][j] += a[i][k]*b[k][j];
+      }
+    }
+  }
+}
+
+/* polar hydrogen: parents H, heavy atom */
+void agbnp3_place_wat_hydrogen_ps(int n, float d, 
+				  float *px, float *py, float *pz,
+				  float *w, float *der){
+  int k, i, j;
+  __m128 xh[3], xd[3], dx[3], d2inv, dinv, wk, w1, w2, w3;
+  __m128 der1[2][3][3], der2[1][3][3];
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xh);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, xd);
+    for(i=0;i<3;i++){
+      dx[i] = xh[i] - xd[i];
+    }
+    d2inv = one/(dx[0]*dx[0]+dx[1]*dx[1]+dx[2]*dx[2]);
+    dinv = _mm_sqrt_ps(d2inv);
+    wk = dv*dinv;
+    agbnp3_ws_store_pos_ps(w, 0, k, xd[0] + wk*dx[0], xd[1] + wk*dx[1], 
+			   xd[2] + wk*dx[2]);
+
+    w2 = wk*d2inv;
+    for(i=0;i<3;i++){
+      w3 = w2*dx[i];
+      for(j=0;j<3;j++){
+	w1 = w3*dx[j];
+	der1[0][i][j] = -w1;
+	der2[0][i][j] =  w1;
+      }
+    }
+    w1 = one - wk;
+    for(i=0;i<3;i++){
+      der1[0][i][i] += wk;
+      der2[0][i][i] += w1;
+    }
+    /* derivatives with respect to the hydrogen and the heavy atom */
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	der1[1][i][j] = der2[0][i][j];
+      }
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 2, der1);
+  }
+}
+
+/* sp2 acceptor with one connection (A, R, R1, R2), 2 sites */
+void agbnp3_place_wat_trigonal1_ps(int n, float d, 
+				   float *px, float *py, float *pz,
+				   float *w, float *der){
+  int k, i, j;
+  __m128 xa[3], xr[3], xr1[3], xr2[3], dx1[3], dx2[3], d1i, d2i, w1, w2;
+  __m128 der1[4][3][3], der2[4][3][3];
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xa);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, xr);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, xr1);
+    agbnp3_ws_load_ps(px, py, pz, 3, k, xr2);
+
+    for(i=0;i<3;i++){
+      dx1[i] = xr1[i] - xr[i];
+      dx2[i] = xr2[i] - xr[i];
+    }
+    d1i = one/_mm_sqrt_ps(dx1[0]*dx1[0]+dx1[1]*dx1[1]+dx1[2]*dx1[2]);
+    w1 = -dv*d1i;
+    agbnp3_ws_store_pos_ps(w, 0, k, xa[0] + w1*dx1[0], xa[1] + w1*dx1[1], 
+			   xa[2] + w1*dx1[2]);
+    d2i = one/_mm_sqrt_ps(dx2[0]*dx2[0]+dx2[1]*dx2[1]+dx2[2]*dx2[2]);
+    w2 = -dv*d2i;
+    agbnp3_ws_store_pos_ps(w, 1, k, xa[0] + w2*dx2[0], xa[1] + w2*dx2[1], 
+			   xa[2] + w2*dx2[2]);
+
+    /* unit vectors */
+    for(i=0;i<3;i++){
+      dx1[i] *= d1i;
+      dx2[i] *= d2i;
+    }
+
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	/* acceptor */
+	der1[0][i][j] = der2[0][i][j] = (i == j) ? one : zero;
+	/* R */
+	der1[1][i][j] = w1*dx1[i]*dx1[j];
+	der2[1][i][j] = w2*dx2[i]*dx2[j];
+	if(i == j){
+	  der1[1][i][j] -= w1;
+	  der2[1][i][j] -= w2;
+	}
+	/* R1/R2 */
+	der1[2][i][j] = -der1[1][i][j];
+	der2[3][i][j] = -der2[1][i][j];
+	der1[3][i][j] = der2[2][i][j] = zero;
+      }
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 4, der1);
+    agbnp3_ws_store_der_ps(der, 1, k, 4, der2);
+  }
+}
+
+/* out of plane sites of sp2 acceptors with one connection (A, R, R1, R2), 
+   2 sites */
+void agbnp3_place_wat_trigonal_s_ps(int n, float d, 
+				    float *px, float *py, float *pz,
+				    float *w, float *der){
+  int k, i, j;
+  __m128 xa[3], xr[3], xr1[3], dx1[3], dx0[3], d2i, d0i, wc, ws, w1, w2;
+  __m128 uin[3], uout[3], drprp[3][3], drt1[3][3], drt2[3][3];
+  __m128 der1[3][3][3], der2[3][3][3];
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+  __m128 costh = _mm_set1_ps(0.5f);      /* cos(60) */
+  __m128 sinth = _mm_set1_ps(0.866025f); /* sin(60) */
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xa);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, xr);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, xr1);
+
+    for(i=0;i<3;i++){
+      dx0[i] = xa[i] - xr[i];
+      dx1[i] = xr1[i] - xr[i];
+    }
+
+    /* in plane direction given by ar */
+    d0i = one/_mm_sqrt_ps(dx0[0]*dx0[0]+dx0[1]*dx0[1]+dx0[2]*dx0[2]);
+    for(i=0;i<3;i++){
+      uin[i] = dx0[i]*d0i;
+    }
+
+    /* out of plane given by (r1r x ar ) */
+    agbnp3_cross_product_ps(dx1, dx0, uout);
+    d2i = one/_mm_sqrt_ps(uout[0]*uout[0]+uout[1]*uout[1]+uout[2]*uout[2]);
+    for(i=0;i<3;i++){
+      uout[i] *= d2i;
+    }
+
+    agbnp3_ws_store_pos_ps(w, 0, k, 
+			   xa[0] + dv*(costh*uin[0]+sinth*uout[0]),
+			   xa[1] + dv*(costh*uin[1]+sinth*uout[1]),
+			   xa[2] + dv*(costh*uin[2]+sinth*uout[2]));
+    agbnp3_ws_store_pos_ps(w, 1, k, 
+			   xa[0] + dv*(costh*uin[0]-sinth*uout[0]),
+			   xa[1] + dv*(costh*uin[1]-sinth*uout[1]),
+			   xa[2] + dv*(costh*uin[2]-sinth*uout[2]));
+
+    /* gradient from uin */
+    agbnp3_der_unitvector_ps(uin, d0i, drprp);
+    wc = dv*costh;
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = wc*drprp[i][j];
+	der1[0][i][j] = der2[0][i][j] =  w1; 
+	der1[1][i][j] = der2[1][i][j] = -w1;
+	der1[2][i][j] = der2[2][i][j] = zero;
+      }
+    }
+
+    /* gradient from uout */
+    agbnp3_der_unitvector_ps(uout, d2i, drprp);
+    for(i=0;i<3;i++){
+      agbnp3_cross_product_ps(dx1, drprp[i], drt1[i]);
+      agbnp3_cross_product_ps(dx0, drprp[i], drt2[i]);
+    }
+
+    ws = dv*sinth;
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = -ws*drt1[i][j];
+	w2 =  ws*drt2[i][j];
+
+	der1[0][i][j] += w1;
+	der1[1][i][j] -= (w1+w2);
+	der1[2][i][j] += w2;
+
+	der2[0][i][j] -= w1;
+	der2[1][i][j] += (w1+w2);
+	der2[2][i][j] -= w2;
+      }
+    }
+
+    for(i=0;i<3;i++){
+      der1[0][i][i] += one;
+      der2[0][i][i] += one;
+    }
+    /* no dependence on R2 */
+    agbnp3_ws_store_der_ps(der, 0, k, 3, der1);
+    agbnp3_ws_store_der_ps(der, 1, k, 3, der2);
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	der1[0][i][j] = zero;
+      }
+    }
+    agbnp3_ws_store_der_ps(der+27*AGBNP_WSPLACE_BATCH, 0, k, 1, der1);
+    agbnp3_ws_store_der_ps(der+27*AGBNP_WSPLACE_BATCH, 1, k, 1, der1);
+  }
+}
+
+/* sites above and below a trigonal center bound to R1, R2, R3 
+   (A, R1, R2, R3), 2 sites */
+void agbnp3_place_wat_trigonal_oop_ps(int n, float d1, 
+				      float *px, float *py, float *pz,
+				      float *w, float *der){
+  int k, i, j;
+  float d = d1 + 0.2;
+  __m128 x0[3], x1[3], x2[3], x3[3], v1[3], v2[3], nu[3], nun, dn;
+  __m128 nu_outer[3][3], dernu1[3][3], dernu2[3][3];
+  __m128 derxv1[3][3], derxv2[3][3];
+  __m128 der1[4][3][3], der2[4][3][3];
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, x0);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, x1);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, x2);
+    agbnp3_ws_load_ps(px, py, pz, 3, k, x3);
+
+    /* displacements relative to x1 */
+    for(i=0;i<3;i++){
+      v1[i] = x2[i] - x1[i];
+      v2[i] = x3[i] - x1[i];
+    }
+
+    /* unit vector normal to 1,2,3 plane, nu = v2 x v1 */
+    agbnp3_cross_product_ps(v2, v1, nu);
+    dernu2[0][0] = zero;   dernu2[0][1] =  v1[2]; dernu2[0][2] = -v1[1];
+    dernu2[1][0] = -v1[2]; dernu2[1][1] = zero;   dernu2[1][2] =  v1[0];
+    dernu2[2][0] =  v1[1]; dernu2[2][1] = -v1[0]; dernu2[2][2] = zero;
+    dernu1[0][0] = zero;   dernu1[0][1] = -v2[2]; dernu1[0][2] =  v2[1];
+    dernu1[1][0] =  v2[2]; dernu1[1][1] = zero;   dernu1[1][2] = -v2[0];
+    dernu1[2][0] = -v2[1]; dernu1[2][1] =  v2[0]; dernu1[2][2] = zero;
+    nun = _mm_sqrt_ps(nu[0]*nu[0]+nu[1]*nu[1]+nu[2]*nu[2]);
+    for(i=0;i<3;i++){
+      nu[i] /= nun;
+    }
+
+    /* water site positions */
+    agbnp3_ws_store_pos_ps(w, 0, k, x0[0] + dv*nu[0], x0[1] + dv*nu[1],
+			   x0[2] + dv*nu[2]);
+    agbnp3_ws_store_pos_ps(w, 1, k, x0[0] - dv*nu[0], x0[1] - dv*nu[1],
+			   x0[2] - dv*nu[2]);
+
+    /* I - nu x nu ; x=outer product */
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	nu_outer[i][j] = ((i == j) ? one : zero) - nu[i]*nu[j];
+      }
+    }
+
+    dn = dv/nun;
+
+    agbnp3_matmul_ps(nu_outer, dernu1, derxv1);
+    agbnp3_matmul_ps(nu_outer, dernu2, derxv2);
+
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	/* derivatives w.r.t x0 */
+	der1[0][i][j] = der2[0][i][j] = (i == j) ? one : zero;
+	/* derivatives w.r.t x2 */
+	der1[2][i][j] =  dn*derxv1[i][j];
+	der2[2][i][j] = -dn*derxv1[i][j];
+	/* derivatives w.r.t x3 */
+	der1[3][i][j] =  dn*derxv2[i][j];
+	der2[3][i][j] = -dn*derxv2[i][j];
+	/* derivatives w.r.t x1 */
+	der1[1][i][j] = -(der1[2][i][j]+der1[3][i][j]);
+	der2[1][i][j] = -(der2[2][i][j]+der2[3][i][j]);
+      }
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 4, der1);
+    agbnp3_ws_store_der_ps(der, 1, k, 4, der2);
+  }
+}
+
+/* sp2 acceptor with two connections (A, R1, R2), 1 site */
+void agbnp3_place_wat_trigonal2_ps(int n, float d, 
+				   float *px, float *py, float *pz,
+				   float *w, float *der){
+  int k, i, j;
+  __m128 xa[3], xr1[3], xr2[3], d1[3], d2[3], dw[3];
+  __m128 idist1, idist2, idistw, w1, w2;
+  __m128 drprp[3][3], dr1r1[3][3], dr2r2[3][3], drp1[3][3], drp2[3][3];
+  __m128 der1[3][3][3];
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xa);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, xr1);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, xr2);
+
+    /* unit vectors of bonds */
+    for(i=0;i<3;i++){
+      d1[i] = xr1[i] - xa[i];
+      d2[i] = xr2[i] - xa[i];
+    }
+    idist1 = one/_mm_sqrt_ps(d1[0]*d1[0]+d1[1]*d1[1]+d1[2]*d1[2]);
+    idist2 = one/_mm_sqrt_ps(d2[0]*d2[0]+d2[1]*d2[1]+d2[2]*d2[2]);
+    for(i=0;i<3;i++){
+      d1[i] *= idist1;
+      d2[i] *= idist2;
+    }
+
+    /* water site along the negative of the sum of the bond vectors */
+    for(i=0;i<3;i++){
+      dw[i] = d1[i] + d2[i];
+    }
+    idistw = one/_mm_sqrt_ps(dw[0]*dw[0]+dw[1]*dw[1]+dw[2]*dw[2]);
+    for(i=0;i<3;i++){
+      dw[i] *= idistw;
+    }
+    agbnp3_ws_store_pos_ps(w, 0, k, xa[0] - dv*dw[0], xa[1] - dv*dw[1],
+			   xa[2] - dv*dw[2]);
+
+    agbnp3_der_unitvector_ps(dw, idistw, drprp);
+    agbnp3_der_unitvector_ps(d1, idist1, dr1r1);
+    agbnp3_der_unitvector_ps(d2, idist2, dr2r2);
+    agbnp3_matmul_ps(drprp, dr1r1, drp1);
+    agbnp3_matmul_ps(drprp, dr2r2, drp2);
+
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = -dv*drp1[i][j];
+	w2 = -dv*drp2[i][j];
+	der1[1][i][j] = w1; 
+	der1[2][i][j] = w2;
+	der1[0][i][j] = -(w1+w2);
+      }
+    }
+    for(i=0;i<3;i++){
+      der1[0][i][i] += one;
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 3, der1);
+  }
+}
+
+/* sp3 acceptor with two connections (A, R1, R2), 2 sites */
+void agbnp3_place_wat_tetrahedral2_ps(int n, float d, 
+				      float *px, float *py, float *pz,
+				      float *w, float *der){
+  int k, i, j;
+  __m128 costh = _mm_set1_ps(-0.577350269f); /* -1/sqrt(3) */
+  __m128 sinth = _mm_set1_ps( 0.816496581f); /* sqrt(2/3) */
+  __m128 xa[3], r1[3], r2[3], d1[3], d2[3], dpin[3], dout[3], u[3];
+  __m128 dist1, dist2, distin, distout, wc, ws, w1, w2;
+  __m128 drprp[3][3], dr1r1[3][3], dr2r2[3][3];
+  __m128 drtrt[3][3], drp1[3][3], drp2[3][3];
+  __m128 drt1[3][3], drt2[3][3];
+  __m128 der1[3][3][3], der2[3][3][3];
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xa);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, r1);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, r2);
+
+    /* unit vectors of bonds */
+    for(i=0;i<3;i++){
+      r1[i] -= xa[i];
+      r2[i] -= xa[i];
+    }
+    dist1 = one/_mm_sqrt_ps(r1[0]*r1[0]+r1[1]*r1[1]+r1[2]*r1[2]);
+    dist2 = one/_mm_sqrt_ps(r2[0]*r2[0]+r2[1]*r2[1]+r2[2]*r2[2]);
+    for(i=0;i<3;i++){
+      d1[i] = dist1*r1[i];
+      d2[i] = dist2*r2[i];
+    }
+
+    /* in plane direction (sum of bond unit vectors) */
+    for(i=0;i<3;i++){
+      dpin[i] = d1[i] + d2[i];
+    }
+    distin = one/_mm_sqrt_ps(dpin[0]*dpin[0]+dpin[1]*dpin[1]+dpin[2]*dpin[2]);
+    for(i=0;i<3;i++){
+      dpin[i] *= distin;
+    }
+
+    /* out of plane projection (cross product between bond vectors) */
+    agbnp3_cross_product_ps(r2, r1, dout);
+    distout = one/_mm_sqrt_ps(dout[0]*dout[0]+dout[1]*dout[1]+dout[2]*dout[2]);
+    for(i=0;i<3;i++){
+      dout[i] *= distout;
+    }
+
+    /* LP positions */
+    for(i=0;i<3;i++){
+      u[i] = costh*dpin[i] + sinth*dout[i];
+    }
+    agbnp3_ws_store_pos_ps(w, 0, k, xa[0] + dv*u[0], xa[1] + dv*u[1], 
+			   xa[2] + dv*u[2]);
+    for(i=0;i<3;i++){
+      u[i] = costh*dpin[i] - sinth*dout[i];
+    }
+    agbnp3_ws_store_pos_ps(w, 1, k, xa[0] + dv*u[0], xa[1] + dv*u[1], 
+			   xa[2] + dv*u[2]);
+
+    agbnp3_der_unitvector_ps(dpin, distin, drprp);
+    agbnp3_der_unitvector_ps(d1, dist1, dr1r1);
+    agbnp3_der_unitvector_ps(d2, dist2, dr2r2);
+    agbnp3_matmul_ps(drprp, dr1r1, drp1);
+    agbnp3_matmul_ps(drprp, dr2r2, drp2);
+
+    wc = dv*costh;
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = wc*drp1[i][j];
+	w2 = wc*drp2[i][j];
+	der1[1][i][j] = der2[1][i][j] = w1; 
+	der1[2][i][j] = der2[2][i][j] = w2;
+	der1[0][i][j] = der2[0][i][j] = -(w1+w2);
+      }
+    }
+
+    agbnp3_der_unitvector_ps(dout, distout, drtrt);
+    for(i=0;i<3;i++){
+      agbnp3_cross_product_ps(drtrt[i], r2, drt1[i]);
+      agbnp3_cross_product_ps(r1, drtrt[i], drt2[i]);
+    }
+
+    ws = dv*sinth;
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = ws*drt1[i][j];
+	w2 = ws*drt2[i][j];
+	der1[1][i][j] += w1;
+	der1[2][i][j] += w2;
+	der2[1][i][j] -= w1;
+	der2[2][i][j] -= w2;
+
+	der1[0][i][j] -= (w1+w2);
+	der2[0][i][j] += (w1+w2);
+      }
+    }
+
+    for(i=0;i<3;i++){
+      der1[0][i][i] += one;
+      der2[0][i][i] += one;
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 3, der1);
+    agbnp3_ws_store_der_ps(der, 1, k, 3, der2);
+  }
+}
+
+/* sp3 acceptor with three connections (A, R1, R2, R3), 1 site */
+void agbnp3_place_wat_tetrahedral3_ps(int n, float d, 
+				      float *px, float *py, float *pz,
+				      float *w, float *der){
+  int k, i, j;
+  __m128 xa[3], xr[3], dw[3], d1[3], d2[3], d3[3];
+  __m128 idist1, idist2, idist3, idistw, w1, w2, w3;
+  __m128 drprp[3][3], dr1r1[3][3], dr2r2[3][3], dr3r3[3][3];
+  __m128 drp1[3][3], drp2[3][3], drp3[3][3];
+  __m128 der1[4][3][3];
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, xa);
+
+    /* unit vectors of bonds */
+    agbnp3_ws_load_ps(px, py, pz, 1, k, xr);
+    for(i=0;i<3;i++){
+      d1[i] = xr[i] - xa[i];
+    }
+    agbnp3_ws_load_ps(px, py, pz, 2, k, xr);
+    for(i=0;i<3;i++){
+      d2[i] = xr[i] - xa[i];
+    }
+    agbnp3_ws_load_ps(px, py, pz, 3, k, xr);
+    for(i=0;i<3;i++){
+      d3[i] = xr[i] - xa[i];
+    }
+    idist1 = one/_mm_sqrt_ps(d1[0]*d1[0]+d1[1]*d1[1]+d1[2]*d1[2]);
+    idist2 = one/_mm_sqrt_ps(d2[0]*d2[0]+d2[1]*d2[1]+d2[2]*d2[2]);
+    idist3 = one/_mm_sqrt_ps(d3[0]*d3[0]+d3[1]*d3[1]+d3[2]*d3[2]);
+    for(i=0;i<3;i++){
+      d1[i] *= idist1;
+      d2[i] *= idist2;
+      d3[i] *= idist3;
+    }
+
+    /* water site along the negative of the sum of the bond vectors */
+    for(i=0;i<3;i++){
+      dw[i] = d1[i] + d2[i] + d3[i];
+    }
+    idistw = one/_mm_sqrt_ps(dw[0]*dw[0]+dw[1]*dw[1]+dw[2]*dw[2]);
+    for(i=0;i<3;i++){
+      dw[i] *= idistw;
+    }
+    agbnp3_ws_store_pos_ps(w, 0, k, xa[0] - dv*dw[0], xa[1] - dv*dw[1],
+			   xa[2] - dv*dw[2]);
+
+    agbnp3_der_unitvector_ps(dw, idistw, drprp);
+    agbnp3_der_unitvector_ps(d1, idist1, dr1r1);
+    agbnp3_der_unitvector_ps(d2, idist2, dr2r2);
+    agbnp3_der_unitvector_ps(d3, idist3, dr3r3);
+    agbnp3_matmul_ps(drprp, dr1r1, drp1);
+    agbnp3_matmul_ps(drprp, dr2r2, drp2);
+    agbnp3_matmul_ps(drprp, dr3r3, drp3);
+
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	w1 = -dv*drp1[i][j];
+	w2 = -dv*drp2[i][j];
+	w3 = -dv*drp3[i][j];
+	der1[0][i][j] = -(w1+w2+w3);
+	der1[1][i][j] = w1; 
+	der1[2][i][j] = w2;
+	der1[3][i][j] = w3;
+      }
+    }
+    for(i=0;i<3;i++){
+      der1[0][i][i] += one;
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 4, der1);
+  }
+}
+
+/* one site of an sp3 acceptor bound to a tetrahedral center R, 
+   opposite to substituent R1 of R (A, R, R1) */
+void agbnp3_place_wat_tetrahedral1_ps(int n, float d, 
+				      float *px, float *py, float *pz,
+				      float *w, float *der){
+  int k, i, j;
+  __m128 x0[3], x1[3], x2[3], rsu1[3], rsn1, u;
+  __m128 der1[3][3][3];
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 dv = _mm_set1_ps(d);
+
+  for(k=0;k<n;k+=4){
+    agbnp3_ws_load_ps(px, py, pz, 0, k, x0);
+    agbnp3_ws_load_ps(px, py, pz, 1, k, x1);
+    agbnp3_ws_load_ps(px, py, pz, 2, k, x2);
+
+    /* R-sulfur vectors and unit vectors */
+    for(i=0;i<3;i++){
+      rsu1[i] = x2[i] - x1[i];
+    }
+    rsn1 = _mm_sqrt_ps(rsu1[0]*rsu1[0]+rsu1[1]*rsu1[1]+rsu1[2]*rsu1[2]);
+    for(i=0;i<3;i++){
+      rsu1[i] /= rsn1;
+    }
+    /* center on oxygen */
+    agbnp3_ws_store_pos_ps(w, 0, k, x0[0] - dv*rsu1[0], x0[1] - dv*rsu1[1],
+			   x0[2] - dv*rsu1[2]);
+
+    u = -dv/rsn1;
+    for(i=0;i<3;i++){
+      for(j=0;j<3;j++){
+	der1[0][i][j] = (i == j) ? one : zero;
+	der1[1][i][j] = u*rsu1[i]*rsu1[j];
+	if(i == j){
+	  der1[1][i][j] -= u;
+	}
+	der1[2][i][j] = -der1[1][i][j];
+      }
+    }
+    agbnp3_ws_store_der_ps(der, 0, k, 3, der1);
+  }
+}
+
+/* batched placement of kind AGBNP_WSPLACE_* */
+void agbnp3_place_wat_batch_ps(int kind, int n, float d, 
+			       float *px, float *py, float *pz,
+			       float *w, float *der){
+  switch(kind){
+  case AGBNP_WSPLACE_HYDROGEN:
+    agbnp3_place_wat_hydrogen_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TRIGONAL1:
+    agbnp3_place_wat_trigonal1_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TRIGONAL_S:
+    agbnp3_place_wat_trigonal_s_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TRIGONAL_OOP:
+    agbnp3_place_wat_trigonal_oop_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TRIGONAL2:
+    agbnp3_place_wat_trigonal2_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TETRAHEDRAL2:
+    agbnp3_place_wat_tetrahedral2_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TETRAHEDRAL3:
+    agbnp3_place_wat_tetrahedral3_ps(n, d, px, py, pz, w, der);
+    break;
+  case AGBNP_WSPLACE_TETRAHEDRAL1:
+    agbnp3_place_wat_tetrahedral1_ps(n, d, px, py, pz, w, der);
+    break;
+  }
+}
+#endif
@@ -32,6 +32,14 @@
 #ifdef USE_SSE
 #include <xmmintrin.h>
 #endif
+#if defined(USE_AVX2) || defined(USE_AVX512)
+#include <immintrin.h>
+/* AVX2 and AVX-512 kernels are compiled for their instruction set 
+   through target attributes and selected at run time, see 
+   agbnp3_simd_detect() */
+#define AVX2_TARGET   __attribute__((target("avx2,fma")))
+#define AVX512_TARGET __attribute__((target("avx512f")))
+#endif
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -121,6 +129,66 @@ typedef double float_a;
 /* a multiplicative offset to search for neighbors */
 #define AGBNP_NBOFFSET (1.6)
 
+/* max number of cells of a cell-list grid per gridded atom */
+#ifndef AGBNP_GRID_MAXCELLS
+#define AGBNP_GRID_MAXCELLS (8)
+#endif
+
+/* bits per coordinate of the space-filling curve keys of atom ordering, 
+   3*AGBNP_SFC_BITS must fit the mantissa of a float */
+#ifndef AGBNP_SFC_BITS
+#define AGBNP_SFC_BITS (8)
+#endif
+
+/* pair selections of agbnp3_pair_neighbor_list() */
+#define AGBNP_PAIRS_ALL    (0) /* all pairs */
+#define AGBNP_PAIRS_MOBILE (1) /* pairs with at least one mobile atom */
+#define AGBNP_PAIRS_FROZEN (2) /* frozen-frozen pairs */
+
+/* energy terms which need the Born radii */
+#define AGBNP_TERM_BR (AGBNP_TERM_GB|AGBNP_TERM_VDW)
+
+/* max number of atoms in a leaf of the GB treecode octree */
+#ifndef AGBNP_TREE_LEAFSIZE
+#define AGBNP_TREE_LEAFSIZE (16)
+#endif
+/* the effective size of a treecode node seen from atom i is at least
+   sqrt(AGBNP_TREE_BFACTOR*b_i*bmax), the length scale over which the
+   GB interaction depends on the Born radii */
+#ifndef AGBNP_TREE_BFACTOR
+#define AGBNP_TREE_BFACTOR (6.0)
+#endif
+/* size of the stack to traverse the octree */
+#ifndef AGBNP_TREE_STACKSIZE
+#define AGBNP_TREE_STACKSIZE (1024)
+#endif
+
+/* default memory budget (MB) of the i4() cache of all threads. If the
+   cache would be larger i4() is recomputed by the derivative kernels */
+#ifndef AGBNP_Q4CACHE_BUDGET
+#define AGBNP_Q4CACHE_BUDGET (1024.0)
+#endif
+
+/* states of the incremental evaluation of trial moves */
+#define AGBNP_DELTA_NONE  (0) /* no reference state */
+#define AGBNP_DELTA_REF   (1) /* reference state available */
+#define AGBNP_DELTA_TRIAL (2) /* trial move waiting for commit/rollback */
+/* local evaluations of the self volumes (dlt_local) */
+#define AGBNP_LOCAL_NONE   (0)
+#define AGBNP_LOCAL_TRIAL  (1) /* the overlap trees and water sites near the
+				  moved atoms are rebuilt,
+				  agbnp3_ener_delta() */
+#define AGBNP_LOCAL_INSERT (2) /* the overlaps of the moved atoms are added
+				  to a reference without them,
+				  agbnp3_rcache_energy() */
+/* displacement along x of the ligand in the reference state of the 
+   evaluations from a receptor cache, its descreening is negligible */
+#define AGBNP_RCACHE_AWAY (1.e4)
+/* changes of volume scaling factors below this are taken as round-off */
+#ifndef AGBNP_DELTA_SPTOL
+#define AGBNP_DELTA_SPTOL (1.e-5)
+#endif
+
 /* cutoff for searching neighbors of a water site */
 #define AGBNP_WS_CUTOFF (5.0)
 
@@ -157,6 +225,15 @@ typedef struct goverlap_ {
   GParm gs;
 } GOverlap;
 
+/* self volume and surface area contributions of the overlap tree of a
+   root atom, see agbnp3_self_volumes_rooti() */
+typedef struct svroot_ {
+  int n, size;    /* number of atoms and allocated size */
+  int *atom;      /* the root atom followed by its near_nl neighbors */
+  float_a *vol;   /* contribution to the self volume of each atom */
+  float_a *area;  /* contribution to the surface area of each atom */
+} SVRoot;
+
 /* a pseudo atom for water sites */
 typedef struct wat_ {
   float_a pos[3]; /* position */
@@ -230,11 +307,59 @@ typedef struct c1table2dh_ {
 typedef struct c1table2dl_ {
   unsigned int size;   /* number of look-up tables */
   C1Table **table;     /* list of look-up tables */
+  int n;               /* number of nodes of each table */
+  float_a dx, dxinv;   /* spacing and its inverse, same for all tables */
+  float_a *y, *y2;     /* node values of all tables, table i at i*n, 
+			  for hardware gathers */
 } C1Table2DL;
 
 
 
 
+/* a uniform grid (cell list) for spatial searches */
+typedef struct agbgrid_ {
+  int nx, ny, nz;   /* number of cells along x, y and z */
+  int ncells;       /* nx*ny*nz */
+  float_a xmin, ymin, zmin; /* grid origin */
+  float_a spacing;  /* cell side */
+  float_a spacing1; /* inverse of cell side */
+  int cells_size;   /* allocated size of cell_start */
+  int *cell_start;  /* atoms in cell ic are 
+		       cell_atoms[cell_start[ic]] ... cell_atoms[cell_start[ic+1]-1] */
+  int atoms_size;   /* allocated size of cell_atoms and atom_cell */
+  int *cell_atoms;  /* atom indexes sorted by cell, ascending within a cell */
+  int *atom_cell;   /* cell index of each atom */
+} AGBGrid;
+
+/* a node of the octree used by the GB treecode. The moments describe
+   the charges of the node as seen from far away, to second order in
+   the atomic positions and to first order in the Born radii */
+typedef struct agbtreenode_ {
+  float_a c[3];     /* center (centroid of the atoms) */
+  float_a radius;   /* upper bound of the distance of the atoms from c */
+  float_a q;        /* total charge */
+  float_a d[3];     /* dipole with respect to c */
+  float_a m[6];     /* second moments (xx, xy, xz, yy, yz, zz) of the 
+		       charges with respect to c */
+  float_a b;        /* mean Born radius */
+  float_a bmax;     /* largest Born radius */
+  float_a p;        /* sum of charge*(Born radius - b) */
+  int first, last;  /* atoms are atoms[first] ... atoms[last-1] */
+  int child, nchild;/* children are node[child] ... node[child+nchild-1] */
+} AGBTreeNode;
+
+/* octree of atoms for the GB treecode */
+typedef struct agbtree_ {
+  int nnodes;          /* number of nodes, node[0] is the root */
+  int nodes_size;      /* allocated size of node */
+  AGBTreeNode *node;
+  int atoms_size;      /* allocated size of the atom arrays */
+  int *atoms;          /* atom indexes in tree order */
+  float_a *x, *y, *z;  /* positions, charges and Born radii */
+  float_a *q, *b;      /* in tree order */
+  int error;           /* set if the last build failed */
+} AGBTree;
+
 typedef struct AGBworkdata_ {
   
   int natoms;
@@ -278,6 +403,20 @@ typedef struct AGBworkdata_ {
   int nnl, nnlrc;    /* size of near_nl and far_nl neighbor lists */
   NeighList *near_nl; /* near (d<Ri+Rj) neighbor list for heavy atoms */
   NeighList *far_nl;  /* far Ri+Rj<d<cutoff neigh.list */
+  AGBGrid nbgrid;     /* cell list of heavy atoms for neighbor list search */
+  NeighList *gb_nl;   /* GB pair list (cutoff mode) */
+  AGBGrid gbgrid;     /* cell list of all atoms for GB pair list search */
+  NeighList *br_nl;   /* Born radii pair list (cutoff mode) */
+  AGBGrid brgrid;     /* cell list of all atoms for Born radii pair list */
+  NeighList *brfz_nl; /* frozen-frozen pairs of the Born radii pair list */
+  int nq4fzcache;     /* and their i4() cache, see */
+  float *q4fzcache;   /* agbnp3_br_neighbor_list() */
+  AGBGrid wsgrid;     /* cell list of heavy atoms for water site overlaps */
+  AGBTree gbtree;     /* octree of all atoms for the GB treecode, only the
+			 master copy is used */
+  float_a br_tailc[3]; /* center, radius and self volume density of the */
+  float_a br_tailR;    /* sphere used for the mean-field tail correction */
+  float_a br_tailA;    /* of the descreening cutoff */
 
   float_a *dgbdrx;
   float_a *dgbdry;
@@ -316,6 +455,17 @@ typedef struct AGBworkdata_ {
   int n_root_lists[2]; // number of roots
   int *root_lists[2]; //roots, point to entries in overlap_lists
 
+  /* overlap trees of the roots of this thread for agbnp3_ener_delta(),
+     see agbnp3_self_volumes_rooti() */
+  SVRoot *svref;      /* of the reference state */
+  SVRoot *svnew;      /* of the last evaluation */
+  int *svslot;        /* position of an atom in the tree of a root */
+  int nsvroots, *svroots; /* roots rebuilt by the last trial move */
+  /* water sites of this thread evaluated by the last trial move, see
+     agbnp3_delta_wsatoms() */
+  int nwsdlt, wsdlt_size, *wsdlt;
+  WSat *wsdlt_save;   /* and their reference state */
+
   /* buffers for vectorized Gaussian overlaps */
   int gbuffer_size;
   /* buffer 1 contains the overlap Gaussians (R,i) */
@@ -365,6 +515,15 @@ typedef struct AGBworkdata_ {
 
 
 
+  /* buffers for the GB pair energy over the GB pair list, 
+     j atoms gathered from the list */
+  int pbuffer_size;
+  float *pbx, *pby, *pbz; // positions
+  float *pbq;   // charges
+  float *pbbr;  // Born radii
+  float *pbdera; // output: contributions to dera 
+  float *pbgx, *pbgy, *pbgz; //output: contributions to the gradient
+
   int wbuffer_size;
   int   *wb_iatom;
   float *wb_gvolv;
@@ -412,6 +571,8 @@ typedef struct AGBNPdata_ {
   int do_frozen; /* 1 if it should turn on optimizations relating to
 		    frozen atoms */
   int *isfrozen; /* 1 if a frozen atom, 0 otherwise */
+  int frozen_init; /* 1 if the frozen-frozen terms in the i4() cache 
+		      need to be (re)computed at the next evaluation */
 
   float_a dielectric_in, dielectric_out; /* default dielectric constants */
   
@@ -428,11 +589,111 @@ typedef struct AGBNPdata_ {
   float_i *xs, *ys, *zs; /* coordinates of symmetric images (for crystal
 			   PBC's) */
   float_i (*rot)[3][3];  /* cell rotation matrices */
+  float_i (*trans)[3];   /* cell translations */
+
+  /* receptor descreening grid, see agbnp3_set_receptor_grid() */
+  int dogrid;           /* > 0 if the atoms are descreened by the grid */
+  int grd_n[3];         /* number of grid nodes along x, y and z */
+  float_a grd_lo[3];    /* position of node (0,0,0) */
+  float_a grd_h;        /* grid spacing */
+  float *grd_q;         /* inverse Born radius decrement of an atom of 
+			   radius type t at node (i,j,k), at
+			   ((t*n[0] + i)*n[1] + j)*n[2] + k */
+  int grd_nrec;         /* number of receptor heavy atoms */
+  float_a *grd_xr, *grd_yr, *grd_zr; /* their positions */
+  float_a *grd_rr, *grd_spr; /* their radii and volume scaling factors */
 
   NeighList *conntbl; /* atomic connection table */
 
+  int nblist_method; /* neighbor list construction method, 
+			one of AGBNP_NBLIST_* */
+
+  float_a nblist_skin; /* neighbor list skin, lists are reused until an
+			  atom moves by more than half the skin */
+  float_a *nblist_xref, *nblist_yref, *nblist_zref; /* coordinates at the
+						       last list build */
+  int nblist_update;   /* whether lists are rebuilt in this evaluation */
+  int nblist_invalid;  /* lists must be rebuilt at the next evaluation */
+  int br_nl_stale;     /* the Born radii pair list was left out of the
+			  last build, see agbnp3_ener_delta() */
+  int nblist_nevals, nblist_nbuilds; /* number of energy evaluations and of
+					neighbor list builds */
+  float_a nblist_maxdisp; /* max displacement since the last build */
+
+  float_a gb_ron, gb_roff; /* GB pair energy is switched off between
+			      gb_ron and gb_roff. No cutoff if gb_roff <= 0 */
+  float_a br_ron, br_roff; /* descreening pairs are switched off between
+			      br_ron and br_roff. No cutoff if br_roff <= 0 */
+  float_a br_rm;    /* inner radius of the mean-field tail region for 
+		       the descreening cutoff, see agbnp3_br_tail_radius() */
+  float_a gb_tree_theta; /* opening angle of the GB treecode. The 
+			    treecode is off if gb_tree_theta <= 0 */
+
+  float_a q4cache_budget; /* memory budget (MB) of the i4() cache */
+  int q4cache_recompute;  /* if set the i4() cache holds only one row and
+			     i4() is recomputed by the derivative kernels */
+  int ener_only;          /* set while the energies are evaluated without
+			     derivatives, see agbnp3_ener_only() */
+  int terms;              /* energy terms evaluated (AGBNP_TERM_*) */
+  int br_only;            /* set while only the Born radii are evaluated,
+			     see agbnp3_born_radii_eval() */
+  int br_ders_ok;         /* the work data of agbnp3_born_radii_eval()
+			     is available to agbnp3_born_radii_ders() */
+
+  /* incremental evaluation of trial moves, see agbnp3_ener_delta() */
+  int dlt_state;    /* one of AGBNP_DELTA_* */
+  int dlt_eval;     /* set while a trial move is evaluated */
+  int dlt_nmoved, *dlt_moved; /* atoms moved by the trial move */
+  int *dlt_ismoved; /* 1 if the atom is moved by the trial move */
+  int dlt_nchanged, *dlt_changed; /* heavy atoms moved or with changed 
+				     volume scaling factor */
+  float_a *dlt_xref, *dlt_yref, *dlt_zref; /* reference coordinates */
+  float_a *dlt_spref; /* reference volume scaling factors */
+  float_a *dlt_br1, *dlt_br1ref; /* unfiltered inverse Born radii of the 
+				    last evaluation and of the reference */
+  float_a dlt_tail[5], dlt_tailref[5]; /* same for the tail correction 
+					  sphere (center, radius, density) */
+  float_i dlt_ener[6], dlt_enerref[6]; /* same for egb, evdw, ecorr_vdw,
+					  ecav, ecorr_cav and ehb */
+  float_i dlt_ehblig, dlt_ehbligref; /* same for bnd_ehb_lig */
+  int dlt_local;    /* one of AGBNP_LOCAL_* */
+  float_a *dlt_vol, *dlt_volref; /* self volumes and surface areas before */
+  float_a *dlt_area, *dlt_arearef; /* the surface corrections, of the last
+				      evaluation and of the reference */
+  float_a *dlt_speref; /* reference scaling factors w/o surface
+			  corrections */
+
+  /* binding mode, see agbnp3_ener_binding() */
+  int *bnd_isligand;   /* 1 for the atoms of the ligand, NULL if not set */
+  int bnd_decouple;    /* set while the receptor and the ligand are 
+			  evaluated apart: their overlaps, descreening 
+			  and water site overlaps are excluded */
+  float_a bnd_ehb_lig; /* HB correction energy of the ligand water sites */
+
+  /* receptor cache, see agbnp3_receptor_cache() */
+  int rc_natoms;        /* number of atoms in the cache, 0 if none */
+  float_a *rc_x, *rc_y, *rc_z; /* positions, external order */
+  float_a *rc_r;        /* radii */
+  float_a *rc_sp;       /* volume scaling factors (0 for hydrogens) */
+  float_a *rc_br1;      /* unfiltered inverse Born radii */
+  float_a *rc_vol, *rc_area; /* self volumes and surface areas before the
+				surface corrections (0 for hydrogens) */
+  float_a rc_tail[5];   /* Born radii tail correction, as dlt_tail */
+  float_a rc_br_ron, rc_br_roff; /* Born radii cutoff of the cache */
+  int rc_tag;           /* tag of the receptor whose cache is used by
+			   this complex, -1 if none */
+
   int *int2ext; /* mapping from internal to external indexes */
   int *ext2int; /* mapping from external to internal indexes */
+  int atom_order; /* internal ordering of the atoms, AGBNP_ORDER_* */
+  int simd;       /* SIMD kernel set, AGBNP_SIMD_* */
+  float_a resort_factor; /* atoms are re-sorted when the locality metric
+			    grows by this factor, off if <= 0 */
+  float_a resort_ref;    /* locality metric after the last sort */
+  float_i resort_dsum;   /* sum of index distances of near_nl pairs */
+  int resort_npairs;     /* number of near_nl pairs */
+  int resort_pending;    /* re-sort at the next neighbor list build */
+  int resort_nsorts;     /* number of re-sorts */
 
   float_i *br; /* Born radii */
   float_i *sp; /* volume scaling factors */
@@ -493,6 +754,8 @@ int agbnp3_reset(AGBNPdata *data);
 int agbnp3_reset_agbworkdata(AGBworkdata *agbw);
 int agbnp3_allocate_agbworkdata(int natoms, AGBNPdata *agb, AGBworkdata *agbw);
 int agbnp3_delete_agbworkdata(AGBworkdata *agbw);
+int agbnp3_allocate_wsbuffers(int natoms, AGBworkdata *agbw);
+void agbnp3_delete_wsbuffers(AGBworkdata *agbw);
 int agbnp3_init_agbworkdata(AGBNPdata *agbdata, AGBworkdata *agbw);
 int agbnp3_tag_ok(int tag);
 
@@ -512,18 +775,87 @@ int agbnp3_ogauss_ps(int n1, int n2,
 		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
 		      float volmina, float volminb,
 		     float *gvol, float *gvolp, float *fp, float *fpp);
+#ifdef USE_AVX2
+int agbnp3_ogauss_avx(int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp);
+int agbnp3_i4p_avx2(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+		    int *btype, int m, float *f, float *fp);
+#endif
+int agbnp3_ogauss_simd(AGBNPdata *agb, int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp);
+int agbnp3_simd_detect(int request);
 
 
 float_a agbnp3_swf_invbr(float_a beta, float_a *fp);
 
 int agbnp3_neighbor_lists(AGBNPdata *agb, AGBworkdata *agbw,
 			 float_a *x, float_a *y, float_a *z);
+int agbnp3_nblist_resort(AGBNPdata *agb, AGBworkdata *agbw,
+			 float_a *x, float_a *y, float_a *z);
+int agbnp3_nblist_check(AGBNPdata *agb);
+void agbnp3_q4cache_select(AGBNPdata *agb);
 int agbnp3_self_volumes_rooti(AGBNPdata *agb, AGBworkdata *agbw,
 			      float_a *x, float_a *y, float_a *z);
 int agbnp3_scaling_factors(AGBNPdata *agb, AGBworkdata *agbw_h);
 int agbnp3_inverse_born_radii_nolist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
 					float_a *x, float_a *y, float_a *z,
 					int init_frozen);
+int agbnp3_inverse_born_radii_nblist_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+					float_a *x, float_a *y, float_a *z,
+					int init_frozen);
+int agbnp3_i4_nolist_row(AGBNPdata *agb, AGBworkdata *agbw_h,
+			 float_a *x, float_a *y, float_a *z,
+			 int iat, int hydrogens, float *q4cache);
+int agbnp3_inverse_born_radii_delta_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+					float_a *x, float_a *y, float_a *z);
+int agbnp3_delta_allocate(AGBNPdata *agb);
+void agbnp3_delta_free(AGBNPdata *agb);
+void agbnp3_delta_reference(AGBNPdata *agb, int all);
+void agbnp3_delta_restore(AGBNPdata *agb);
+int agbnp3_svroot_start(SVRoot *rec, int iat, int nne, int *neighl,
+			int *slot);
+void agbnp3_svroot_delete(SVRoot *rec, int n);
+void agbnp3_delta_delete_agbworkdata(AGBworkdata *agbw);
+int agbnp3_delta_wsatoms(AGBNPdata *agb, AGBworkdata *agbw);
+void agbnp3_binding_ligand(AGBNPdata *agb, float_i *elig, float_i *egb_cross);
+void agbnp3_rcache_free(AGBNPdata *agb);
+int agbnp3_rcache_energy(AGBNPdata *agb, float_i *mol_volume, 
+			 float_i *egb, float_i *evdw, float_i *ecorr_vdw, 
+			 float_i *ecav, float_i *ecorr_cav, float_i *ehb);
+int agbnp3_sym_coordinates(AGBNPdata *agb);
+int agbnp3_inverse_born_radii_sym_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+				      float_a *x, float_a *y, float_a *z);
+int agbnp3_gb_ders_sym_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			   float_a *x, float_a *y, float_a *z);
+void agbnp3_rgrid_free(AGBNPdata *agb);
+int agbnp3_rgrid_build(AGBNPdata *agb);
+float_a agbnp3_rgrid_error(AGBNPdata *agb, float_i *lo, float_i *hi);
+void agbnp3_rgrid_descreening(AGBNPdata *agb, int t, float_a Ri,
+			     float_a x, float_a y, float_a z,
+			     float_a *q, float_a *dq);
+void agbnp3_rgrid_descreening_exact(AGBNPdata *agb, float_a Ri,
+				   float_a x, float_a y, float_a z,
+				   float_a *q, float_a *dq);
+int agbnp3_inverse_born_radii_grid_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+				       float_a *x, float_a *y, float_a *z);
+int agbnp3_gb_ders_grid_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			    float_a *x, float_a *y, float_a *z);
+int agbnp3_br_neighbor_list(AGBNPdata *agb, AGBworkdata *agbw,
+			    float_a *x, float_a *y, float_a *z);
+float_a agbnp3_br_tail_radius(float_a ron, float_a roff);
+void agbnp3_br_tail_function(float_a s, float_a R, float_a rm,
+			     float_a *g, float_a *gs, float_a *gR);
+int agbnp3_br_tail_setup(AGBNPdata *agb, AGBworkdata *agbw_h,
+			 float_a *x, float_a *y, float_a *z);
+int agbnp3_pair_neighbor_list(AGBNPdata *agb, NeighList **nlp, AGBGrid *grid,
+			      int nrows, float_a rc, int pairs,
+			      float_a *x, float_a *y, float_a *z, int *nnlp);
  int agbnp3_born_radii(AGBNPdata *agb, AGBworkdata *agbw_h);
  int agbnp3_reset_derivatives(AGBNPdata *agb, AGBworkdata *agbw_h);
 
@@ -546,24 +878,92 @@ int agbnp3_gb_energy_inner_nolist_soa(
 		    float *egb_pair, 
 		    float dielectric_factor);
 
+#ifdef USE_SSE
+int agbnp3_gb_energy_only_inner_nolist_ps(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor);
+#endif
+int agbnp3_gb_energy_only_inner_nolist_soa(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, int je,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor);
 int agbnp3_gb_energy_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
 			       float *x, float *y, float *z,
 			       float *egb_self, float *egb_pair);
+int agbnp3_gb_energy_reduce(AGBNPdata *agb, AGBworkdata *agbw_h,
+			    float egb_self_h, float egb_pair_h,
+			    float *egb_self, float *egb_pair);
+int agbnp3_gb_neighbor_list(AGBNPdata *agb, AGBworkdata *agbw,
+			    float_a *x, float_a *y, float_a *z);
+int agbnp3_gb_energy_inner_nblist_soa(
+		    AGBNPdata *agb, int iat, int n,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *jx, float *jy, float *jz, float *jq, float *jbr,
+		    float *jdera, float *jgx, float *jgy, float *jgz,
+		    float *dera, float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor);
+#ifdef USE_SSE
+int agbnp3_gb_energy_inner_nblist_ps(
+		    AGBNPdata *agb, int iat, int n,
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *jx, float *jy, float *jz, float *jq, float *jbr,
+		    float *jdera, float *jgx, float *jgy, float *jgz,
+		    float *dera, float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor);
+__m128 agbnp3_pol_switchfunc_ps(__m128 x, __m128 xa, __m128 xb,
+				__m128 *fp, __m128 *fpp);
+#endif
+int agbnp3_gb_energy_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
+			       float *x, float *y, float *z,
+			       float *egb_self, float *egb_pair);
+int agbnp3_gb_energy_tree_soa(AGBNPdata *agb, AGBworkdata *agbw_h,
+			      float *x, float *y, float *z,
+			      float *egb_self, float *egb_pair);
  int agbnp3_gb_ders_constvp_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
 				 float_a *x, float_a *y, float_a *z,
 				 int init_frozen);
+#ifdef USE_SSE
+int agbnp3_gb_ders_constvp_inner_ps(int iat, int jb, int n4,
+				    float *x, float *y, float *z,
+				    float *sp, float *q2ab, float *abrw,
+				    float *q4c, float gbfactor, float vdwfactor,
+				    float (*dgbdr)[3], float (*dvwdr)[3]);
+int agbnp3_gb_ders_constvp_h_inner_ps(int iat, int jb, int n4,
+				      float *x, float *y, float *z,
+				      float *sp, float *q2ab, float *abrw,
+				      float *q4c, float gbfactor, float vdwfactor,
+				      float (*dgbdr)[3], float (*dvwdr)[3]);
+#endif
+ int agbnp3_gb_ders_constvp_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h,
+				 float_a *x, float_a *y, float_a *z,
+				 int init_frozen);
  int agbnp3_der_vp_rooti(AGBNPdata *agb, AGBworkdata *agbw_h,
 			 float_a *x, float_a *y, float_a *z);
  int agbnp3_gb_deruv(AGBNPdata *agb, AGBworkdata *agbw_h, 
 			  int init_frozen);
  int agbnp3_gb_deruv_nolist_ps(AGBNPdata *agb, AGBworkdata *agbw_h, 
 			       int init_frozen);
+ int agbnp3_gb_deruv_nblist_ps(AGBNPdata *agb, AGBworkdata *agbw_h, 
+			       int init_frozen);
+ int agbnp3_gb_deruv_reduce(AGBNPdata *agb, AGBworkdata *agbw_h);
 int agbnp3_total_energy(AGBNPdata *agb, int init,
 		    float_i *mol_volume,
 		    float_i *egb, 
 		    float_i *evdw, float_i *ecorr_vdw, 
 		    float_i *ecav, float_i *ecorr_cav, 
 			float_i *ehb);
+int agbnp3_born_radii_chain(AGBNPdata *agb, float_i *dedb);
 
 int agbnp3_surface_areas(AGBNPdata *agb, AGBworkdata *agbw,
 			float_a *x, float_a *y, float_a *z);
@@ -576,7 +976,8 @@ void agbnp3_rtvec(float_a y[3], float_a rot[3][3], float_a x[3]);
 int agbnp3_cpy_wsat(WSat *wsat1, WSat *wsat2);
 int agbnp3_clr_wsat(WSat *wsat);
 int agbnp3_create_wsatoms(AGBNPdata *agb, AGBworkdata *agbw);
-int agbnp3_update_wsatoms(AGBNPdata *agb, AGBworkdata *agbw);
+int agbnp3_update_wsatoms(AGBNPdata *agb, AGBworkdata *agbw, int nsites,
+			  int *sites);
 int agbnp3_create_ws_ofatom(AGBNPdata *agb, int iat, int *nws, WSat *twsatb);
 int agbnp3_create_ws_atoms_ph(AGBNPdata *agb, int iat, 
 			      int *nws, WSat *twsatb);
@@ -675,6 +1076,51 @@ void agbnp3_place_wat_tetrahedral1_one(float_a xa, float_a ya, float_a za,
 				       float_a der[4][3][3]
 				       );
 
+/* batched placement of the water sites, see agbnp3_update_wsatoms() */
+#define AGBNP_WSPLACE_HYDROGEN     (0) /* POLARH */
+#define AGBNP_WSPLACE_TRIGONAL1    (1) /* TRIGONAL1, TRIGONAL_S iseq 0,1 */
+#define AGBNP_WSPLACE_TRIGONAL_S   (2) /* TRIGONAL_S iseq 2,3 */
+#define AGBNP_WSPLACE_TRIGONAL_OOP (3)
+#define AGBNP_WSPLACE_TRIGONAL2    (4)
+#define AGBNP_WSPLACE_TETRAHEDRAL2 (5)
+#define AGBNP_WSPLACE_TETRAHEDRAL3 (6)
+#define AGBNP_WSPLACE_TETRAHEDRAL1 (7)
+#define AGBNP_WSPLACE_NKINDS       (8)
+/* placements per batch (a multiple of 4) */
+#define AGBNP_WSPLACE_BATCH       (64)
+void agbnp3_place_wat_batch_soa(int kind, int n, float d,
+				float *px, float *py, float *pz,
+				float *w, float *der);
+#ifdef USE_SSE
+void agbnp3_place_wat_hydrogen_ps(int n, float d,
+				  float *px, float *py, float *pz,
+				  float *w, float *der);
+void agbnp3_place_wat_trigonal1_ps(int n, float d,
+				   float *px, float *py, float *pz,
+				   float *w, float *der);
+void agbnp3_place_wat_trigonal_s_ps(int n, float d,
+				    float *px, float *py, float *pz,
+				    float *w, float *der);
+void agbnp3_place_wat_trigonal_oop_ps(int n, float d1,
+				      float *px, float *py, float *pz,
+				      float *w, float *der);
+void agbnp3_place_wat_trigonal2_ps(int n, float d,
+				   float *px, float *py, float *pz,
+				   float *w, float *der);
+void agbnp3_place_wat_tetrahedral2_ps(int n, float d,
+				      float *px, float *py, float *pz,
+				      float *w, float *der);
+void agbnp3_place_wat_tetrahedral3_ps(int n, float d,
+				      float *px, float *py, float *pz,
+				      float *w, float *der);
+void agbnp3_place_wat_tetrahedral1_ps(int n, float d,
+				      float *px, float *py, float *pz,
+				      float *w, float *der);
+void agbnp3_place_wat_batch_ps(int kind, int n, float d,
+			       float *px, float *py, float *pz,
+			       float *w, float *der);
+#endif
+
 
 /* functions to create and evaluate lookup tables for i4() */
 #define F4LOOKUP_MAXA (20.0)
@@ -711,6 +1157,17 @@ int agbnp3_fcompare( const void *val1, const void *val2 );
 void agbnp3_fsortindx( int pnval, float_a *val, int *indx );
 int agbnp3_nblist_reorder(AGBworkdata *agbw, NeighList *nl, int iat, int *indx);
 int agbnp3_int_reorder(AGBworkdata *agbw, int n, int *nl, int *indx);
+int agbnp3_atom_reorder(AGBNPdata *agb, int nhydrogen, int *ihydrogen,
+			float_i *x, float_i *y, float_i *z);
+unsigned int agbnp3_morton_key(unsigned int ix, unsigned int iy, 
+			       unsigned int iz, int nbits);
+unsigned int agbnp3_hilbert_key(unsigned int ix, unsigned int iy, 
+				unsigned int iz, int nbits);
+int agbnp3_sfc_sort(int order, int n, int *indx, 
+		    float_i *x, float_i *y, float_i *z);
+int agbnp3_atom_resort(AGBNPdata *agb);
+void agbnp3_permute_atoms(void *a, size_t size, int n, int *perm, 
+			  void *buffer);
 void agbnp3_errprint(const char *fmt, ...);
 
 #define agbnp3_mymin(a,b) ((a) < (b) ? (a) : (b))
@@ -762,6 +1219,37 @@ int agbnp3_i4p_ps(AGBNPdata *agb, float* rij, float *Ri, float *Rj, int *btype,
 		  float *qf1, float *qf2, float *qfp1, float *qfp2);
 #endif
 
+#ifdef USE_AVX512
+int agbnp3_gb_energy_inner_nolist_avx512(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br, float *dera,
+		    float *dgbdrx, float *dgbdry, float *dgbdrz, 
+		    float *egb_pair, 
+		    float dielectric_factor);
+int agbnp3_gb_energy_only_inner_nolist_avx512(
+		    AGBNPdata *agb, int iat, int natoms, 
+		    int jb, 
+		    float *x, float *y, float *z,
+		    float *charge, float *br,
+		    float *egb_pair, 
+		    float dielectric_factor);
+int agbnp3_ogauss_avx512(int n1, int n2,
+		      float *c1x, float *c1y, float *c1z, float *a1, float *p1,
+		      float *c2x, float *c2y, float *c2z, float *a2, float *p2,
+		      float volmina, float volminb,
+		      float *gvol, float *gvolp, float *fp, float *fpp);
+int agbnp3_i4p_avx512(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+		      int *btype, int m, float *f, float *fp);
+#endif
+int agbnp3_i4p_simd(AGBNPdata *agb, float* rij, float *Ri, float *Rj, 
+		    int *btype, int m, float *f, float *fp,
+		    float *a, float *b,
+		    float *qkv, float *qxh, float *qyp, float *qy, 
+		    float *qy2p, float *qy2,
+		    float *qf1, float *qf2, float *qfp1, float *qfp2);
+
 void agbnp3_test_cspline(void);
 
 int agbnp3_ws_free_volumes_scalev_ps(AGBNPdata *agb, AGBworkdata *agbw);
@@ -781,6 +1269,21 @@ int agbnp3_reallocate_gbuffers(AGBworkdata *agbw, int size);
 int agbnp3_reallocate_hbuffers(AGBworkdata *agbw, int size);
 int agbnp3_reallocate_qbuffers(AGBworkdata *agbw, int size);
 int agbnp3_reallocate_wbuffers(AGBworkdata *agbw, int size);
+int agbnp3_reallocate_pbuffers(AGBworkdata *agbw, int size);
 int agbnp3_reallocate_overlap_lists(AGBworkdata *agbw, int size);
 
+void agbnp3_grid_reset(AGBGrid *grid);
+void agbnp3_grid_delete(AGBGrid *grid);
+int agbnp3_grid_build(AGBGrid *grid, int n, 
+		      float_a *x, float_a *y, float_a *z, float_a spacing);
+void agbnp3_grid_cell(AGBGrid *grid, float_a x, float_a y, float_a z,
+		      int *ix, int *iy, int *iz);
+void agbnp3_tree_reset(AGBTree *tree);
+void agbnp3_tree_delete(AGBTree *tree);
+int agbnp3_tree_partition(int *atoms, int first, int last,
+			  float_a *u, float_a mid);
+int agbnp3_tree_build(AGBTree *tree, int n, 
+		      float_a *x, float_a *y, float_a *z,
+		      float_a *q, float_a *b);
+
 #endif
@@ -60,10 +60,44 @@ void agbnp3_vfree(void *x){
   if(x) free(x);
 #endif
 }
+
+/* returns the SIMD kernel set (AGBNP_SIMD_*) of a new instance: the
+   best one built into the library and supported by the CPU, and not 
+   above request unless request is AGBNP_SIMD_AUTO */
+int agbnp3_simd_detect(int request){
+  int simd = AGBNP_SIMD_NONE;
+
+#ifdef USE_SSE
+  simd = AGBNP_SIMD_SSE;
+#endif
+#if defined(USE_AVX2) || defined(USE_AVX512)
+  __builtin_cpu_init();
+#endif
+#ifdef USE_AVX2
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+    simd = AGBNP_SIMD_AVX2;
+  }
+#endif
+#ifdef USE_AVX512
+  if(__builtin_cpu_supports("avx512f")){
+    simd = AGBNP_SIMD_AVX512;
+  }
+#endif
+
+  if(request != AGBNP_SIMD_AUTO && request < simd){
+    simd = request;
+  }
+  return simd;
+}
+
  /* Memory allocator for arrays. */
 int agbnp3_vmemalloc(void **memptr, const size_t size){
 #ifdef INTEL_MIC
   size_t alignment = 64;
+#elif defined(USE_AVX512)
+  size_t alignment = 64;
+#elif defined(USE_AVX2)
+  size_t alignment = 32;
 #else
   size_t alignment = 16;
 #endif
@@ -490,18 +524,21 @@ int agbnp3_reset_buffers(AGBNPdata *agb, AGBworkdata *agbw_h){
   memset(agbw_h->br1,0,natoms*sizeof(float));
 #endif
 
+  /* local evaluations start from the reference self volumes and
+     surface areas, see agbnp3_self_volumes_rooti() */
 #pragma omp single nowait
   {
     memset(agbw->volumep,0,natoms*sizeof(float));
     for(iat=0;iat<nheavyat;iat++){
-      agbw->volumep[iat] = vols[iat];
+      agbw->volumep[iat] = agb->dlt_local ? agb->dlt_volref[iat] : vols[iat];
     }
   }
 #pragma omp single nowait
   {
     memset(agbw->surf_area,0,natoms*sizeof(float));
     for(iat=0;iat<nheavyat;iat++){
-      agbw->surf_area[iat] = 4.*pi*r[iat]*r[iat];
+      agbw->surf_area[iat] = agb->dlt_local ? agb->dlt_arearef[iat] :
+	4.*pi*r[iat]*r[iat];
     }
   }
 #pragma omp single nowait
@@ -512,7 +549,12 @@ int agbnp3_reset_buffers(AGBNPdata *agb, AGBworkdata *agbw_h){
   }
 #pragma omp single
   {
-    agb->ehb = 0.0;
+    /* trial moves also start from the reference water site energies,
+       see agbnp3_delta_wsatoms() */
+    agb->ehb = agb->dlt_local == AGBNP_LOCAL_TRIAL ?
+      agb->dlt_enerref[5] : 0.0;
+    agb->bnd_ehb_lig = agb->dlt_local == AGBNP_LOCAL_TRIAL ?
+      agb->dlt_ehbligref : 0.0;
   }
 
   return AGBNP_OK;
@@ -559,6 +601,11 @@ int agbnp3_reset_buffers(AGBNPdata *agb, AGBworkdata *agbw_h){
 
 #pragma omp single
   {
+    /* self volumes and surface areas for agbnp3_ener_delta() */
+    if(agb->dlt_br1){
+      memcpy(agb->dlt_vol, volumep, nheavyat*sizeof(float_a));
+      memcpy(agb->dlt_area, surf_area, nheavyat*sizeof(float_a));
+    }
     /* filters surface areas to avoid negative surface areas */
     memset(agb->surf_area,0,natoms*sizeof(float_i));
     memset(agb->agbw->surf_area_f,0,natoms*sizeof(float_a));
@@ -567,7 +614,8 @@ int agbnp3_reset_buffers(AGBNPdata *agb, AGBworkdata *agbw_h){
       f = agbnp3_swf_area(a, &fp);
       agb->surf_area[iat] = agbw->surf_area[iat]*f;
       surf_area_f[iat] = agb->surf_area[iat];
-      agbw->gammap[iat] = agbw->gamma[iat]*(f+a*fp);
+      agbw->gammap[iat] = (agb->terms & AGBNP_TERM_CAV) ? 
+	agbw->gamma[iat]*(f+a*fp) : 0.0;
     }
   }
 
@@ -641,6 +689,19 @@ int agbnp3_reset_buffers(AGBNPdata *agb, AGBworkdata *agbw_h){
 #pragma omp barrier
 #endif
 
+  /* unfiltered inverse Born radii for agbnp3_ener_delta() */
+  if(agb->dlt_br1){
+#pragma omp single nowait
+    {
+      memcpy(agb->dlt_br1, br1, natoms*sizeof(float));
+      agb->dlt_tail[0] = agbw_h->br_tailc[0];
+      agb->dlt_tail[1] = agbw_h->br_tailc[1];
+      agb->dlt_tail[2] = agbw_h->br_tailc[2];
+      agb->dlt_tail[3] = agbw_h->br_tailR;
+      agb->dlt_tail[4] = agbw_h->br_tailA;
+    }
+  }
+
   // now all threads compute born radii etc from master copy
   for(iat = 0; iat < natoms ; iat++){
     /* filters out very large or, worse, negative born radii */
@@ -860,6 +921,19 @@ int agbnp3_create_ctablef42d_list(AGBNPdata *agb, int na, float_a amax,
 
   tbl2d->table = (C1Table **)malloc(size*sizeof(C1Table *));
 
+  /* the node values of all the tables are stored contiguously so that 
+     they can be fetched by hardware gathers indexed by table and node */
+  tbl2d->size = size;
+  tbl2d->n = na;
+  tbl2d->y = tbl2d->y2 = NULL;
+  agbnp3_vmemalloc((void **)&(tbl2d->y), size*na*sizeof(float_a));
+  agbnp3_vmemalloc((void **)&(tbl2d->y2), size*na*sizeof(float_a));
+  if(!(tbl2d->table && tbl2d->y && tbl2d->y2)){
+    agbnp3_errprint( "agbnp3_create_ctablef42d_list(): unable to allocate tables (%d floats)\n", 2*size*na);
+    free(radii);
+    return AGBNP_ERR;
+  }
+
   /* now loop over all possible combinations of radii and constructs look up table for each */
   for(i=0;i<ntypes;i++){
     for(j=0;j<ntypes;j++){
@@ -873,9 +947,16 @@ int agbnp3_create_ctablef42d_list(AGBNPdata *agb, int na, float_a amax,
 	free(radii);
 	return AGBNP_ERR;
       }
-
+      memcpy(&(tbl2d->y[slot*na]), tbl2d->table[slot]->y, na*sizeof(float_a));
+      memcpy(&(tbl2d->y2[slot*na]), tbl2d->table[slot]->y2, na*sizeof(float_a));
+      agbnp3_vfree(tbl2d->table[slot]->y);
+      agbnp3_vfree(tbl2d->table[slot]->y2);
+      tbl2d->table[slot]->y = &(tbl2d->y[slot*na]);
+      tbl2d->table[slot]->y2 = &(tbl2d->y2[slot*na]);
     }
   }
+  tbl2d->dx = tbl2d->table[0]->dx;
+  tbl2d->dxinv = tbl2d->table[0]->dxinv;
 
   free(radii);
   *table2d = tbl2d;
@@ -1070,6 +1151,31 @@ int agbnp3_reallocate_wbuffers(AGBworkdata *agbw, int size){
   return AGBNP_OK;
 }
 
+int agbnp3_reallocate_pbuffers(AGBworkdata *agbw, int size){
+  int old_size = agbw->pbuffer_size;
+  size_t n = old_size*sizeof(float);
+  size_t m = size*sizeof(float);
+
+  agbnp3_vrealloc((void **)&(agbw->pbx), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pby), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbz), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbq), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbbr), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbdera), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbgx), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbgy), n, m);
+  agbnp3_vrealloc((void **)&(agbw->pbgz), n, m);
+
+  if(!(agbw->pbx && agbw->pby && agbw->pbz && agbw->pbq && agbw->pbbr &&
+       agbw->pbdera && agbw->pbgx && agbw->pbgy && agbw->pbgz)){
+    agbnp3_errprint( "agbnp3_reallocate_pbuffers(): error allocating memory for GB pair buffers.\n");
+      return AGBNP_ERR;
+  }
+
+  agbw->pbuffer_size = size;
+
+  return AGBNP_OK;
+}
 
 int agbnp3_reallocate_overlap_lists(AGBworkdata *agbw, int size){
   int i;
@@ -1095,3 +1201,377 @@ int agbnp3_reallocate_overlap_lists(AGBworkdata *agbw, int size){
 
   return AGBNP_OK;
 }
+
+/*                                                          *
+ *    Uniform grid (cell list) for spatial searches         *
+ *                                                          */
+
+void agbnp3_grid_reset(AGBGrid *grid){
+  memset(grid,0,sizeof(AGBGrid));
+}
+
+void agbnp3_grid_delete(AGBGrid *grid){
+  if(grid->cell_start){agbnp3_vfree(grid->cell_start); grid->cell_start = NULL;}
+  if(grid->cell_atoms){agbnp3_vfree(grid->cell_atoms); grid->cell_atoms = NULL;}
+  if(grid->atom_cell){agbnp3_vfree(grid->atom_cell); grid->atom_cell = NULL;}
+  agbnp3_grid_reset(grid);
+}
+
+/* returns the indexes of the cell containing point (x,y,z). Points
+   outside the grid are assigned to the nearest boundary cell. */
+void agbnp3_grid_cell(AGBGrid *grid, float_a x, float_a y, float_a z,
+		      int *ix, int *iy, int *iz){
+  int i, j, k;
+  i = (x - grid->xmin)*grid->spacing1;
+  j = (y - grid->ymin)*grid->spacing1;
+  k = (z - grid->zmin)*grid->spacing1;
+  if(i < 0) i = 0;
+  if(j < 0) j = 0;
+  if(k < 0) k = 0;
+  if(i >= grid->nx) i = grid->nx - 1;
+  if(j >= grid->ny) j = grid->ny - 1;
+  if(k >= grid->nz) k = grid->nz - 1;
+  *ix = i;
+  *iy = j;
+  *iz = k;
+}
+
+/* bins atoms 0 to n-1 into a grid of cubic cells of side at least
+   'spacing'. Atoms are stored by cell (counting sort) so that within
+   a cell they are in ascending index order. */
+int agbnp3_grid_build(AGBGrid *grid, int n, 
+		      float_a *x, float_a *y, float_a *z, float_a spacing){
+  int i, ic, ix, iy, iz;
+  float_a xmin, ymin, zmin, xmax, ymax, zmax;
+  int *cell_start, *cell_atoms, *atom_cell;
+  double ncells;
+
+  if(n <= 0){
+    grid->nx = grid->ny = grid->nz = 0;
+    grid->ncells = 0;
+    return AGBNP_OK;
+  }
+
+  xmin = xmax = x[0];
+  ymin = ymax = y[0];
+  zmin = zmax = z[0];
+  for(i=1;i<n;i++){
+    if(x[i] < xmin) xmin = x[i];
+    if(x[i] > xmax) xmax = x[i];
+    if(y[i] < ymin) ymin = y[i];
+    if(y[i] > ymax) ymax = y[i];
+    if(z[i] < zmin) zmin = z[i];
+    if(z[i] > zmax) zmax = z[i];
+  }
+
+  /* enlarge cells of sparse systems to limit the number of cells */
+  do {
+    grid->nx = (xmax - xmin)/spacing + 1;
+    grid->ny = (ymax - ymin)/spacing + 1;
+    grid->nz = (zmax - zmin)/spacing + 1;
+    ncells = (double)grid->nx*(double)grid->ny*(double)grid->nz;
+    if(ncells > (double)AGBNP_GRID_MAXCELLS*n + 27) spacing *= 1.26;
+  } while(ncells > (double)AGBNP_GRID_MAXCELLS*n + 27);
+
+  grid->ncells = grid->nx*grid->ny*grid->nz;
+  grid->xmin = xmin;
+  grid->ymin = ymin;
+  grid->zmin = zmin;
+  grid->spacing = spacing;
+  grid->spacing1 = 1./spacing;
+
+  if(grid->ncells + 1 > grid->cells_size){
+    agbnp3_vrealloc((void **)&(grid->cell_start), 
+		    grid->cells_size*sizeof(int), (grid->ncells+1)*sizeof(int));
+    if(!grid->cell_start){
+      agbnp3_errprint( "agbnp3_grid_build(): error allocating memory for grid cells (%d ints).\n", grid->ncells+1);
+      return AGBNP_ERR;
+    }
+    grid->cells_size = grid->ncells + 1;
+  }
+  if(n > grid->atoms_size){
+    agbnp3_vrealloc((void **)&(grid->cell_atoms), 
+		    grid->atoms_size*sizeof(int), n*sizeof(int));
+    agbnp3_vrealloc((void **)&(grid->atom_cell), 
+		    grid->atoms_size*sizeof(int), n*sizeof(int));
+    if(!(grid->cell_atoms && grid->atom_cell)){
+      agbnp3_errprint( "agbnp3_grid_build(): error allocating memory for grid atoms (%d ints).\n", 2*n);
+      return AGBNP_ERR;
+    }
+    grid->atoms_size = n;
+  }
+
+  cell_start = grid->cell_start;
+  cell_atoms = grid->cell_atoms;
+  atom_cell = grid->atom_cell;
+
+  /* count atoms in each cell */
+  memset(cell_start,0,(grid->ncells+1)*sizeof(int));
+  for(i=0;i<n;i++){
+    agbnp3_grid_cell(grid, x[i], y[i], z[i], &ix, &iy, &iz);
+    ic = (iz*grid->ny + iy)*grid->nx + ix;
+    atom_cell[i] = ic;
+    cell_start[ic+1] += 1;
+  }
+  for(ic=0;ic<grid->ncells;ic++){
+    cell_start[ic+1] += cell_start[ic];
+  }
+  /* fill cells, cell_start[ic] is used as insertion point and 
+     restored afterwards */
+  for(i=0;i<n;i++){
+    cell_atoms[cell_start[atom_cell[i]]++] = i;
+  }
+  for(ic=grid->ncells;ic>0;ic--){
+    cell_start[ic] = cell_start[ic-1];
+  }
+  cell_start[0] = 0;
+
+  return AGBNP_OK;
+}
+
+/*                                                          *
+ *    Octree for the GB treecode                            *
+ *                                                          */
+
+void agbnp3_tree_reset(AGBTree *tree){
+  memset(tree,0,sizeof(AGBTree));
+}
+
+void agbnp3_tree_delete(AGBTree *tree){
+  if(tree->node){free(tree->node); tree->node = NULL;}
+  if(tree->atoms){agbnp3_vfree(tree->atoms); tree->atoms = NULL;}
+  if(tree->x){agbnp3_vfree(tree->x); tree->x = NULL;}
+  if(tree->y){agbnp3_vfree(tree->y); tree->y = NULL;}
+  if(tree->z){agbnp3_vfree(tree->z); tree->z = NULL;}
+  if(tree->q){agbnp3_vfree(tree->q); tree->q = NULL;}
+  if(tree->b){agbnp3_vfree(tree->b); tree->b = NULL;}
+  agbnp3_tree_reset(tree);
+}
+
+/* reorders atoms[first] ... atoms[last-1] so that those with 
+   coordinate u <= mid come first. Returns the index of the first 
+   atom with u > mid. */
+int agbnp3_tree_partition(int *atoms, int first, int last,
+			  float_a *u, float_a mid){
+  int i = first, j = last - 1, t;
+  while(i <= j){
+    if(u[atoms[i]] <= mid){
+      i += 1;
+    }else{
+      t = atoms[i]; atoms[i] = atoms[j]; atoms[j] = t;
+      j -= 1;
+    }
+  }
+  return i;
+}
+
+/* Builds the octree of atoms 0 to n-1 and the moments of its nodes. A
+   node is split at the center of the bounding box of its atoms until
+   it holds at most AGBNP_TREE_LEAFSIZE atoms. Nodes are stored in 
+   breadth-first order so that children follow their parents. */
+int agbnp3_tree_build(AGBTree *tree, int n, 
+		      float_a *x, float_a *y, float_a *z,
+		      float_a *q, float_a *b){
+  int i, k, l, m, iat, nc;
+  int split[9];
+  float_a xmin, ymin, zmin, xmax, ymax, zmax;
+  AGBTreeNode *nd, *ch;
+  double nq, nd3[3], nm[6], nb, np, c[3], nat, r2, r2max, u, t[3];
+  float_a bmax;
+  int *atoms;
+
+  tree->nnodes = 0;
+  tree->error = 0;
+  if(n <= 0) return AGBNP_OK;
+
+  if(n > tree->atoms_size){
+    agbnp3_vrealloc((void **)&(tree->atoms), 
+		    tree->atoms_size*sizeof(int), n*sizeof(int));
+    agbnp3_vrealloc((void **)&(tree->x), 
+		    tree->atoms_size*sizeof(float_a), n*sizeof(float_a));
+    agbnp3_vrealloc((void **)&(tree->y), 
+		    tree->atoms_size*sizeof(float_a), n*sizeof(float_a));
+    agbnp3_vrealloc((void **)&(tree->z), 
+		    tree->atoms_size*sizeof(float_a), n*sizeof(float_a));
+    agbnp3_vrealloc((void **)&(tree->q), 
+		    tree->atoms_size*sizeof(float_a), n*sizeof(float_a));
+    agbnp3_vrealloc((void **)&(tree->b), 
+		    tree->atoms_size*sizeof(float_a), n*sizeof(float_a));
+    if(!(tree->atoms && tree->x && tree->y && tree->z && tree->q && tree->b)){
+      agbnp3_errprint( "agbnp3_tree_build(): error allocating memory for tree atoms (%d atoms).\n", n);
+      tree->error = 1;
+      return AGBNP_ERR;
+    }
+    tree->atoms_size = n;
+  }
+  atoms = tree->atoms;
+  for(i=0;i<n;i++) atoms[i] = i;
+
+  if(tree->nodes_size < 1){
+    m = n/AGBNP_TREE_LEAFSIZE + 8;
+    tree->node = (AGBTreeNode *)realloc(tree->node, m*sizeof(AGBTreeNode));
+    if(!tree->node){
+      agbnp3_errprint( "agbnp3_tree_build(): error allocating memory for tree nodes (%d nodes).\n", m);
+      tree->error = 1;
+      return AGBNP_ERR;
+    }
+    tree->nodes_size = m;
+  }
+  nd = &(tree->node[0]);
+  nd->first = 0;
+  nd->last = n;
+  nd->child = nd->nchild = 0;
+  tree->nnodes = 1;
+
+  /* topology */
+  for(k=0;k<tree->nnodes;k++){
+    nd = &(tree->node[k]);
+    if(nd->last - nd->first <= AGBNP_TREE_LEAFSIZE) continue;
+
+    iat = atoms[nd->first];
+    xmin = xmax = x[iat];
+    ymin = ymax = y[iat];
+    zmin = zmax = z[iat];
+    for(i=nd->first+1;i<nd->last;i++){
+      iat = atoms[i];
+      if(x[iat] < xmin) xmin = x[iat];
+      if(x[iat] > xmax) xmax = x[iat];
+      if(y[iat] < ymin) ymin = y[iat];
+      if(y[iat] > ymax) ymax = y[iat];
+      if(z[iat] < zmin) zmin = z[iat];
+      if(z[iat] > zmax) zmax = z[iat];
+    }
+    /* do not split (nearly) coincident atoms */
+    if(xmax - xmin < 1.e-3 && ymax - ymin < 1.e-3 && zmax - zmin < 1.e-3) 
+      continue;
+
+    /* octants, ordered by the x, then y, then z bit */
+    split[0] = nd->first;
+    split[8] = nd->last;
+    split[4] = agbnp3_tree_partition(atoms, split[0], split[8], x, 0.5*(xmin+xmax));
+    for(l=0;l<8;l+=4){
+      split[l+2] = agbnp3_tree_partition(atoms, split[l], split[l+4], y, 0.5*(ymin+ymax));
+    }
+    for(l=0;l<8;l+=2){
+      split[l+1] = agbnp3_tree_partition(atoms, split[l], split[l+2], z, 0.5*(zmin+zmax));
+    }
+
+    if(tree->nnodes + 8 > tree->nodes_size){
+      m = 2*tree->nodes_size + 8;
+      tree->node = (AGBTreeNode *)realloc(tree->node, m*sizeof(AGBTreeNode));
+      if(!tree->node){
+	agbnp3_errprint( "agbnp3_tree_build(): error allocating memory for tree nodes (%d nodes).\n", m);
+	tree->nodes_size = tree->nnodes = 0;
+	tree->error = 1;
+	return AGBNP_ERR;
+      }
+      tree->nodes_size = m;
+      nd = &(tree->node[k]);
+    }
+
+    nd->child = tree->nnodes;
+    for(l=0;l<8;l++){
+      if(split[l+1] > split[l]){
+	ch = &(tree->node[tree->nnodes++]);
+	ch->first = split[l];
+	ch->last = split[l+1];
+	ch->child = ch->nchild = 0;
+	nd->nchild += 1;
+      }
+    }
+  }
+
+  /* atomic data in tree order */
+  for(i=0;i<n;i++){
+    iat = atoms[i];
+    tree->x[i] = x[iat];
+    tree->y[i] = y[iat];
+    tree->z[i] = z[iat];
+    tree->q[i] = q[iat];
+    tree->b[i] = b[iat];
+  }
+
+  /* moments, from the leaves up */
+  for(k=tree->nnodes-1;k>=0;k--){
+    nd = &(tree->node[k]);
+    nat = nd->last - nd->first;
+    nq = nb = np = 0.0;
+    nd3[0] = nd3[1] = nd3[2] = 0.0;
+    nm[0] = nm[1] = nm[2] = nm[3] = nm[4] = nm[5] = 0.0;
+    c[0] = c[1] = c[2] = 0.0;
+    r2max = 0.0;
+    bmax = 0.0;
+    if(nd->nchild == 0){
+      for(i=nd->first;i<nd->last;i++){
+	c[0] += tree->x[i];
+	c[1] += tree->y[i];
+	c[2] += tree->z[i];
+	nb += tree->b[i];
+	if(tree->b[i] > bmax) bmax = tree->b[i];
+      }
+      c[0] /= nat; c[1] /= nat; c[2] /= nat;
+      nb /= nat;
+      for(i=nd->first;i<nd->last;i++){
+	t[0] = tree->x[i]-c[0];
+	t[1] = tree->y[i]-c[1];
+	t[2] = tree->z[i]-c[2];
+	nq += tree->q[i];
+	nd3[0] += tree->q[i]*t[0];
+	nd3[1] += tree->q[i]*t[1];
+	nd3[2] += tree->q[i]*t[2];
+	nm[0] += tree->q[i]*t[0]*t[0];
+	nm[1] += tree->q[i]*t[0]*t[1];
+	nm[2] += tree->q[i]*t[0]*t[2];
+	nm[3] += tree->q[i]*t[1]*t[1];
+	nm[4] += tree->q[i]*t[1]*t[2];
+	nm[5] += tree->q[i]*t[2]*t[2];
+	np += tree->q[i]*(tree->b[i]-nb);
+	r2 = t[0]*t[0] + t[1]*t[1] + t[2]*t[2];
+	if(r2 > r2max) r2max = r2;
+      }
+      nd->radius = sqrt(r2max);
+    }else{
+      for(l=nd->child;l<nd->child+nd->nchild;l++){
+	ch = &(tree->node[l]);
+	nc = ch->last - ch->first;
+	c[0] += nc*ch->c[0];
+	c[1] += nc*ch->c[1];
+	c[2] += nc*ch->c[2];
+	nb += nc*ch->b;
+	if(ch->bmax > bmax) bmax = ch->bmax;
+      }
+      c[0] /= nat; c[1] /= nat; c[2] /= nat;
+      nb /= nat;
+      nd->radius = 0.0;
+      /* moments of the children shifted to the center of the node */
+      for(l=nd->child;l<nd->child+nd->nchild;l++){
+	ch = &(tree->node[l]);
+	t[0] = ch->c[0]-c[0];
+	t[1] = ch->c[1]-c[1];
+	t[2] = ch->c[2]-c[2];
+	nq += ch->q;
+	nd3[0] += ch->d[0] + ch->q*t[0];
+	nd3[1] += ch->d[1] + ch->q*t[1];
+	nd3[2] += ch->d[2] + ch->q*t[2];
+	nm[0] += ch->m[0] + 2.*ch->d[0]*t[0] + ch->q*t[0]*t[0];
+	nm[1] += ch->m[1] + ch->d[0]*t[1] + ch->d[1]*t[0] + ch->q*t[0]*t[1];
+	nm[2] += ch->m[2] + ch->d[0]*t[2] + ch->d[2]*t[0] + ch->q*t[0]*t[2];
+	nm[3] += ch->m[3] + 2.*ch->d[1]*t[1] + ch->q*t[1]*t[1];
+	nm[4] += ch->m[4] + ch->d[1]*t[2] + ch->d[2]*t[1] + ch->q*t[1]*t[2];
+	nm[5] += ch->m[5] + 2.*ch->d[2]*t[2] + ch->q*t[2]*t[2];
+	np += ch->p + ch->q*(ch->b-nb);
+	u = sqrt(t[0]*t[0] + t[1]*t[1] + t[2]*t[2]) + ch->radius;
+	if(u > nd->radius) nd->radius = u;
+      }
+    }
+    nd->c[0] = c[0]; nd->c[1] = c[1]; nd->c[2] = c[2];
+    nd->q = nq;
+    nd->d[0] = nd3[0]; nd->d[1] = nd3[1]; nd->d[2] = nd3[2];
+    for(l=0;l<6;l++) nd->m[l] = nm[l];
+    nd->b = nb;
+    nd->bmax = bmax;
+    nd->p = np;
+  }
+
+  return AGBNP_OK;
+}
@@ -0,0 +1,147 @@
+#ifndef AVX_MATHFUN_H
+#define AVX_MATHFUN_H
+/* 8-wide AVX2/FMA and 16-wide AVX-512 versions of the exp and rsqrt 
+   functions of sse_mathfun.h, based on the same cephes algorithms
+
+   Derived from sse_mathfun.h, Copyright (C) 2007  Julien Pommier,
+   and distributed under the same zlib license (see sse_mathfun.h)
+*/
+
+#include <immintrin.h>
+
+/* the functions are compiled for their instruction set through target
+   attributes, so that they can be called from code which selects them 
+   at run time without the corresponding -m compiler flags */
+#ifndef AVX2_TARGET
+#define AVX2_TARGET   __attribute__((target("avx2,fma")))
+#endif
+#ifndef AVX512_TARGET
+#define AVX512_TARGET __attribute__((target("avx512f")))
+#endif
+
+#ifdef _MSC_VER /* visual c++ */
+# define ALIGN32_BEG __declspec(align(32))
+# define ALIGN32_END
+#else /* gcc or icc */
+# define ALIGN32_BEG
+# define ALIGN32_END __attribute__((aligned(32)))
+#endif
+
+typedef __m256  v8sf; // vector of 8 float (avx)
+typedef __m256i v8si; // vector of 8 int   (avx2)
+
+#define _PS256_CONST(Name, Val)                                         \
+  static const ALIGN32_BEG float _ps256_##Name[8] ALIGN32_END = { Val, Val, Val, Val, Val, Val, Val, Val }
+#define _PI32_CONST256(Name, Val)                                       \
+  static const ALIGN32_BEG int _pi32_256_##Name[8] ALIGN32_END = { Val, Val, Val, Val, Val, Val, Val, Val }
+
+_PS256_CONST(1  , 1.0f);
+_PS256_CONST(0p5, 0.5f);
+_PS256_CONST(3, 3.0f);
+_PS256_CONST(PI, 3.141592654f);
+
+_PI32_CONST256(0x7f, 0x7f);
+
+_PS256_CONST(exp_hi,	88.3762626647949f);
+_PS256_CONST(exp_lo,	-88.3762626647949f);
+
+_PS256_CONST(cephes_LOG2EF, 1.44269504088896341);
+_PS256_CONST(cephes_exp_C1, 0.693359375);
+_PS256_CONST(cephes_exp_C2, -2.12194440e-4);
+
+_PS256_CONST(cephes_exp_p0, 1.9875691500E-4);
+_PS256_CONST(cephes_exp_p1, 1.3981999507E-3);
+_PS256_CONST(cephes_exp_p2, 8.3334519073E-3);
+_PS256_CONST(cephes_exp_p3, 4.1665795894E-2);
+_PS256_CONST(cephes_exp_p4, 1.6666665459E-1);
+_PS256_CONST(cephes_exp_p5, 5.0000001201E-1);
+
+/* exp() of 8 floats, same range reduction and polynomial as exp_ps() */
+static inline AVX2_TARGET v8sf exp256_ps(v8sf x) {
+  v8sf fx, y, z;
+  v8si emm0;
+  v8sf one = *(v8sf*)_ps256_1;
+
+  x = _mm256_min_ps(x, *(v8sf*)_ps256_exp_hi);
+  x = _mm256_max_ps(x, *(v8sf*)_ps256_exp_lo);
+
+  /* express exp(x) as exp(g + n*log(2)), n = floor(x*log2(e) + 1/2) */
+  fx = _mm256_fmadd_ps(x, *(v8sf*)_ps256_cephes_LOG2EF, *(v8sf*)_ps256_0p5);
+  fx = _mm256_floor_ps(fx);
+
+  x = _mm256_fnmadd_ps(fx, *(v8sf*)_ps256_cephes_exp_C1, x);
+  x = _mm256_fnmadd_ps(fx, *(v8sf*)_ps256_cephes_exp_C2, x);
+
+  z = _mm256_mul_ps(x,x);
+
+  y = *(v8sf*)_ps256_cephes_exp_p0;
+  y = _mm256_fmadd_ps(y, x, *(v8sf*)_ps256_cephes_exp_p1);
+  y = _mm256_fmadd_ps(y, x, *(v8sf*)_ps256_cephes_exp_p2);
+  y = _mm256_fmadd_ps(y, x, *(v8sf*)_ps256_cephes_exp_p3);
+  y = _mm256_fmadd_ps(y, x, *(v8sf*)_ps256_cephes_exp_p4);
+  y = _mm256_fmadd_ps(y, x, *(v8sf*)_ps256_cephes_exp_p5);
+  y = _mm256_fmadd_ps(y, z, x);
+  y = _mm256_add_ps(y, one);
+
+  /* build 2^n */
+  emm0 = _mm256_cvttps_epi32(fx);
+  emm0 = _mm256_add_epi32(emm0, *(v8si*)_pi32_256_0x7f);
+  emm0 = _mm256_slli_epi32(emm0, 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(emm0));
+}
+
+/* inverse square root, one Newton-Raphson step as rsqrt_ps() */
+static inline AVX2_TARGET v8sf rsqrt256_ps(v8sf x) {
+  v8sf v = _mm256_rsqrt_ps(x);
+  v8sf vh = _mm256_mul_ps(*(v8sf*)_ps256_0p5, v);
+  /* v = pt5*v*(three-v*v*x) */
+  return _mm256_mul_ps(vh, _mm256_fnmadd_ps(_mm256_mul_ps(v, v), x,
+					    *(v8sf*)_ps256_3));
+}
+
+typedef __m512  v16sf; // vector of 16 float (avx512)
+
+/* exp() of 16 floats, same as exp256_ps() */
+static inline AVX512_TARGET v16sf exp512_ps(v16sf x) {
+  v16sf fx, y, z;
+  __m512i emm0;
+
+  x = _mm512_min_ps(x, _mm512_set1_ps(88.3762626647949f));
+  x = _mm512_max_ps(x, _mm512_set1_ps(-88.3762626647949f));
+
+  /* express exp(x) as exp(g + n*log(2)), n = floor(x*log2(e) + 1/2) */
+  fx = _mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504088896341f), 
+		       _mm512_set1_ps(0.5f));
+  fx = _mm512_roundscale_ps(fx, _MM_FROUND_TO_NEG_INF|_MM_FROUND_NO_EXC);
+
+  x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+  x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
+
+  z = _mm512_mul_ps(x,x);
+
+  y = _mm512_set1_ps(1.9875691500E-4f);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507E-3f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073E-3f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894E-2f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459E-1f));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201E-1f));
+  y = _mm512_fmadd_ps(y, z, x);
+  y = _mm512_add_ps(y, _mm512_set1_ps(1.0f));
+
+  /* build 2^n */
+  emm0 = _mm512_cvttps_epi32(fx);
+  emm0 = _mm512_add_epi32(emm0, _mm512_set1_epi32(0x7f));
+  emm0 = _mm512_slli_epi32(emm0, 23);
+  return _mm512_mul_ps(y, _mm512_castsi512_ps(emm0));
+}
+
+/* inverse square root, 14-bit guess plus one Newton-Raphson step */
+static inline AVX512_TARGET v16sf rsqrt512_ps(v16sf x) {
+  v16sf v = _mm512_rsqrt14_ps(x);
+  v16sf vh = _mm512_mul_ps(_mm512_set1_ps(0.5f), v);
+  return _mm512_mul_ps(vh, _mm512_fnmadd_ps(_mm512_mul_ps(v, v), x,
+					    _mm512_set1_ps(3.0f)));
+}
+
+/* AVX_MATHFUN_H */
+#endif